@@ -25,7 +25,10 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <pthread.h>
+#include <sched.h>
 #include <semaphore.h>
+#include <string.h>
+#include <sys/time.h>
 
 #include <alsa/asoundlib.h>
 
@@ -35,7 +38,12 @@
 #include "llist.h"
 #include "read-sound-file.h"
 #include "sound-theme-spec.h"
+#include "sample-cache.h"
+#include "sequence.h"
+#include "thread-pool.h"
+#include "mix.h"
 #include "malloc.h"
+#include "trace.h"
 
 struct private;
 
@@ -46,9 +54,36 @@ struct outstanding {
     ca_finish_callback_t callback;
     void *userdata;
     ca_sound_file *file;
+    ca_sample *sample;
+    ca_sequence *sequence;
+    size_t offset;
+    unsigned volume;
     snd_pcm_t *pcm;
+    snd_pcm_format_t format;
+    unsigned rate;
+    unsigned nchannels;
+    unsigned device_generation;
+    ca_bool_t mixed;
+    ca_bool_t finished;
+    ca_bool_t notify;
+    int error;
     int pipe_fd[2];
     ca_context *context;
+    ca_usec_t started;
+    ca_bool_t written;
+    ca_bool_t low_latency;
+    ca_bool_t realtime;
+};
+
+/* An already configured PCM device that is kept open for reuse by
+ * the next sound event of the same format */
+struct idle_pcm {
+    CA_LLIST_FIELDS(struct idle_pcm);
+    snd_pcm_t *pcm;
+    snd_pcm_format_t format;
+    unsigned rate;
+    unsigned nchannels;
+    struct timespec expiry;
 };
 
 struct private {
@@ -57,11 +92,64 @@ struct private {
     ca_bool_t signal_semaphore;
     sem_t semaphore;
     ca_bool_t semaphore_allocated;
+    ca_thread_pool *pool;
+
+    /* Everything below protected by the outstanding_mutex too */
+    unsigned pcm_idle_timeout;
+    unsigned device_generation;
+    sem_t reaper_semaphore;
+    ca_bool_t reaper_semaphore_allocated;
+    ca_bool_t reaper_running;
+    CA_LLIST_HEAD(struct idle_pcm, idle_pcms);
+    unsigned n_idle_pcms;
+
+    /* Target latency in usec for the devices the players open, 0
+     * for whatever ALSA picks */
+    unsigned latency;
+    ca_bool_t realtime;
+
+    /* What cached sounds are converted to, see get_native_format().
+     * Found out once per device, native.rate is 0 if we couldn't. */
+    ca_bool_t convert;
+    ca_bool_t native_known;
+    ca_sample_format native;
+    unsigned native_generation;
+
+    /* The software mixer, see mixer_func() */
+    ca_bool_t software_mixer;
+    ca_bool_t mixer_running;
+    snd_pcm_t *mixer_pcm;
+    unsigned mixer_rate;
+    unsigned n_mixer_sources;
+
     CA_LLIST_HEAD(struct outstanding, outstanding);
 };
 
 #define PRIVATE(c) ((struct private *) ((c)->private))
 
+#define PLAYER_THREADS_DEFAULT 2U
+#define IDLE_PCMS_MAX 4U
+
+/* The mixer keeps the device buffer short, so that sound events
+ * joining a running mix are not delayed much */
+#define MIXER_BUFFER_TIME_USEC 100000U
+#define MIXER_FRAMES 1024U
+#define MIXER_NCHANNELS 2U
+#define MIXER_SOURCES_MAX 32U
+
+/* The players stay below anything sound servers and the like
+ * usually run at */
+#define REALTIME_PRIORITY 5
+
+/* What we ask for when finding out the native format of a device.
+ * Most hardware runs at 48 kHz, if it doesn't ALSA tells us what's
+ * closest. */
+#define NATIVE_RATE 48000U
+#define NATIVE_NCHANNELS 2U
+
+static void thread_func(void *userdata, void *pool_userdata);
+static const ca_sample_format* get_native_format(ca_context *c, ca_sample_format *f);
+
 static void outstanding_free(struct outstanding *o) {
     ca_assert(o);
 
@@ -71,17 +159,275 @@ static void outstanding_free(struct outstanding *o) {
     if (o->pipe_fd[0] >= 0)
         close(o->pipe_fd[0]);
 
+    /* The file is one of those of the sequence then */
+    if (o->sequence) {
+        ca_sequence_free(o->sequence);
+        o->file = NULL;
+    }
+
     if (o->file)
         ca_sound_file_close(o->file);
 
+    if (o->sample)
+        ca_sample_unref(o->sample);
+
     if (o->pcm)
         snd_pcm_close(o->pcm);
 
     ca_free(o);
 }
 
+static unsigned get_player_threads(ca_proplist *l) {
+    unsigned n;
+
+    if (ca_proplist_get_unsigned(l, CA_PROP_CANBERRA_PLAYER_THREADS, &n) < 0)
+        return PLAYER_THREADS_DEFAULT;
+
+    return n;
+}
+
+static unsigned get_pcm_idle_timeout(ca_proplist *l) {
+    unsigned n;
+
+    /* Keeping the device open is opt-in, since it blocks other
+     * applications from using plain hw: devices */
+    if (ca_proplist_get_unsigned(l, CA_PROP_CANBERRA_DEVICE_IDLE_TIMEOUT, &n) < 0)
+        return 0;
+
+    return n;
+}
+
+static ca_bool_t get_software_mixer(ca_proplist *l) {
+    unsigned n;
+
+    if (ca_proplist_get_unsigned(l, CA_PROP_CANBERRA_SOFTWARE_MIXER, &n) < 0)
+        return FALSE;
+
+    return n > 0;
+}
+
+static unsigned get_latency(ca_proplist *l) {
+    unsigned n;
+
+    if (ca_proplist_get_unsigned(l, CA_PROP_CANBERRA_LATENCY, &n) < 0)
+        return 0;
+
+    return n;
+}
+
+static ca_bool_t get_convert(ca_proplist *l) {
+    unsigned n;
+
+    if (ca_proplist_get_unsigned(l, CA_PROP_CANBERRA_NATIVE_FORMAT, &n) < 0)
+        return FALSE;
+
+    return n > 0;
+}
+
+static ca_bool_t get_realtime(ca_proplist *l) {
+    unsigned n;
+
+    if (ca_proplist_get_unsigned(l, CA_PROP_CANBERRA_REALTIME, &n) < 0)
+        return FALSE;
+
+    return n > 0;
+}
+
+/* Player threads are pooled, hence this is undone when a sound event
+ * is finished. Failing is fine, we just play at normal priority
+ * then. */
+static ca_bool_t make_realtime(void) {
+    struct sched_param param;
+    int max;
+
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = REALTIME_PRIORITY;
+
+    if ((max = sched_get_priority_max(SCHED_RR)) >= 0 && param.sched_priority > max)
+        param.sched_priority = max;
+
+    return pthread_setschedparam(pthread_self(), SCHED_RR, &param) == 0;
+}
+
+static void make_normal(void) {
+    struct sched_param param;
+
+    memset(&param, 0, sizeof(param));
+    pthread_setschedparam(pthread_self(), SCHED_OTHER, &param);
+}
+
+static void timespec_from_now(struct timespec *ts, unsigned msec) {
+    struct timeval tv;
+
+    ca_assert_se(gettimeofday(&tv, NULL) == 0);
+
+    ts->tv_sec = tv.tv_sec + (time_t) (msec / 1000U);
+    ts->tv_nsec = (long) tv.tv_usec * 1000L + (long) (msec % 1000U) * 1000000L;
+
+    if (ts->tv_nsec >= 1000000000L) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000L;
+    }
+}
+
+static ca_bool_t timespec_passed(const struct timespec *ts, const struct timespec *now) {
+    return ts->tv_sec < now->tv_sec || (ts->tv_sec == now->tv_sec && ts->tv_nsec <= now->tv_nsec);
+}
+
+static void idle_pcms_free(struct idle_pcm *i) {
+
+    /* Closing a device might take a moment, hence this is called
+     * without holding the outstanding_mutex */
+
+    while (i) {
+        struct idle_pcm *n = i->next;
+
+        snd_pcm_close(i->pcm);
+        ca_free(i);
+        i = n;
+    }
+}
+
+static struct idle_pcm *steal_idle_pcms_unlocked(struct private *p, const struct timespec *now) {
+    struct idle_pcm *i, *n, *l = NULL;
+
+    /* Detaches all expired idle devices, or all of them if now is NULL */
+
+    for (i = p->idle_pcms; i; i = n) {
+        n = i->next;
+
+        if (now && !timespec_passed(&i->expiry, now))
+            continue;
+
+        CA_LLIST_REMOVE(struct idle_pcm, p->idle_pcms, i);
+        CA_LLIST_PREPEND(struct idle_pcm, l, i);
+        p->n_idle_pcms--;
+    }
+
+    if (!now && p->reaper_running)
+        sem_post(&p->reaper_semaphore);
+
+    return l;
+}
+
+static void* reaper_func(void *userdata) {
+    struct private *p = userdata;
+    struct idle_pcm *i, *l;
+    struct timespec ts, now;
+
+    pthread_detach(pthread_self());
+
+    ca_mutex_lock(p->outstanding_mutex);
+
+    while (p->idle_pcms) {
+
+        /* Sleep until the first device expires, or until somebody
+         * flushes the list */
+        ts = p->idle_pcms->expiry;
+        for (i = p->idle_pcms->next; i; i = i->next)
+            if (timespec_passed(&i->expiry, &ts))
+                ts = i->expiry;
+
+        ca_mutex_unlock(p->outstanding_mutex);
+
+        while (sem_timedwait(&p->reaper_semaphore, &ts) < 0 && errno == EINTR)
+            ;
+
+        ca_mutex_lock(p->outstanding_mutex);
+
+        timespec_from_now(&now, 0);
+        l = steal_idle_pcms_unlocked(p, &now);
+
+        ca_mutex_unlock(p->outstanding_mutex);
+        idle_pcms_free(l);
+        ca_mutex_lock(p->outstanding_mutex);
+    }
+
+    p->reaper_running = FALSE;
+
+    if (p->signal_semaphore)
+        sem_post(&p->semaphore);
+
+    ca_mutex_unlock(p->outstanding_mutex);
+
+    return NULL;
+}
+
+static snd_pcm_t* acquire_idle_pcm(struct private *p, snd_pcm_format_t format, unsigned rate, unsigned nchannels) {
+    struct idle_pcm *i;
+    snd_pcm_t *pcm = NULL;
+
+    ca_mutex_lock(p->outstanding_mutex);
+
+    for (i = p->idle_pcms; i; i = i->next)
+        if (i->format == format && i->rate == rate && i->nchannels == nchannels) {
+            CA_LLIST_REMOVE(struct idle_pcm, p->idle_pcms, i);
+            p->n_idle_pcms--;
+            pcm = i->pcm;
+            ca_free(i);
+            break;
+        }
+
+    ca_mutex_unlock(p->outstanding_mutex);
+
+    if (pcm && snd_pcm_prepare(pcm) < 0) {
+        snd_pcm_close(pcm);
+        pcm = NULL;
+    }
+
+    return pcm;
+}
+
+static struct idle_pcm *release_pcm_unlocked(struct private *p, struct outstanding *out) {
+    struct idle_pcm *i, *l = NULL;
+    pthread_t thread;
+
+    /* Park the device of a finished player for reuse. Returns what
+     * needs to be closed by the caller after dropping the lock. */
+
+    if (!out->pcm ||
+        p->pcm_idle_timeout <= 0 ||
+        p->signal_semaphore ||
+        !p->reaper_semaphore_allocated ||
+        out->device_generation != p->device_generation)
+        return NULL;
+
+    if (!(i = ca_new0(struct idle_pcm, 1)))
+        return NULL;
+
+    if (!p->reaper_running) {
+        if (pthread_create(&thread, NULL, reaper_func, p) != 0) {
+            ca_free(i);
+            return NULL;
+        }
+
+        p->reaper_running = TRUE;
+    }
+
+    i->pcm = out->pcm;
+    i->format = out->format;
+    i->rate = out->rate;
+    i->nchannels = out->nchannels;
+    timespec_from_now(&i->expiry, p->pcm_idle_timeout);
+    out->pcm = NULL;
+
+    CA_LLIST_PREPEND(struct idle_pcm, p->idle_pcms, i);
+
+    /* Don't hoard devices, drop the least recently used one */
+    if (++p->n_idle_pcms > IDLE_PCMS_MAX) {
+        for (l = p->idle_pcms; l->next; l = l->next)
+            ;
+
+        CA_LLIST_REMOVE(struct idle_pcm, p->idle_pcms, l);
+        p->n_idle_pcms--;
+    }
+
+    return l;
+}
+
 int driver_open(ca_context *c) {
     struct private *p;
+    int ret;
 
     ca_return_val_if_fail(c, CA_ERROR_INVALID);
     ca_return_val_if_fail(!c->driver || ca_streq(c->driver, "alsa"), CA_ERROR_NODRIVER);
@@ -102,12 +448,30 @@ int driver_open(ca_context *c) {
 
     p->semaphore_allocated = TRUE;
 
+    if (sem_init(&p->reaper_semaphore, 0, 0) < 0) {
+        driver_destroy(c);
+        return CA_ERROR_OOM;
+    }
+
+    p->reaper_semaphore_allocated = TRUE;
+    p->pcm_idle_timeout = get_pcm_idle_timeout(c->props);
+    p->software_mixer = get_software_mixer(c->props);
+    p->latency = get_latency(c->props);
+    p->realtime = get_realtime(c->props);
+    p->convert = get_convert(c->props);
+
+    if ((ret = ca_thread_pool_new(&p->pool, get_player_threads(c->props), thread_func, NULL)) < 0) {
+        driver_destroy(c);
+        return ret;
+    }
+
     return CA_SUCCESS;
 }
 
 int driver_destroy(ca_context *c) {
     struct private *p;
     struct outstanding *out;
+    struct idle_pcm *l = NULL;
 
     ca_return_val_if_fail(c, CA_ERROR_INVALID);
     ca_return_val_if_fail(c->private, CA_ERROR_STATE);
@@ -136,9 +500,12 @@ int driver_destroy(ca_context *c) {
         }
 
         if (p->semaphore_allocated) {
-            /* Now wait until all players are destroyed */
+            /* Now wait until all players, the mixer and the reaper
+             * are gone */
             p->signal_semaphore = TRUE;
-            while (p->outstanding) {
+            l = steal_idle_pcms_unlocked(p, NULL);
+
+            while (p->outstanding || p->reaper_running || p->mixer_running) {
                 ca_mutex_unlock(p->outstanding_mutex);
                 sem_wait(&p->semaphore);
                 ca_mutex_lock(p->outstanding_mutex);
@@ -149,12 +516,22 @@ int driver_destroy(ca_context *c) {
         ca_mutex_free(p->outstanding_mutex);
     }
 
+    idle_pcms_free(l);
+
+    /* All players are gone now, so this only waits for the idle
+     * workers to exit */
+    if (p->pool)
+        ca_thread_pool_free(p->pool);
+
     if (p->theme)
-        ca_theme_data_free(p->theme);
+        ca_theme_data_unref(p->theme);
 
     if (p->semaphore_allocated)
         sem_destroy(&p->semaphore);
 
+    if (p->reaper_semaphore_allocated)
+        sem_destroy(&p->reaper_semaphore);
+
     ca_free(p);
 
     c->private = NULL;
@@ -165,25 +542,102 @@ int driver_destroy(ca_context *c) {
 }
 
 int driver_change_device(ca_context *c, const char *device) {
+    struct private *p;
+    struct idle_pcm *l;
+
     ca_return_val_if_fail(c, CA_ERROR_INVALID);
     ca_return_val_if_fail(c->private, CA_ERROR_STATE);
 
+    p = PRIVATE(c);
+
+    /* Devices kept open belong to the old device, so let's get rid
+     * of them, and make sure players still running don't park theirs */
+    ca_mutex_lock(p->outstanding_mutex);
+    p->device_generation++;
+    l = steal_idle_pcms_unlocked(p, NULL);
+    ca_mutex_unlock(p->outstanding_mutex);
+
+    idle_pcms_free(l);
+
     return CA_SUCCESS;
 }
 
 int driver_change_props(ca_context *c, ca_proplist *changed, ca_proplist *merged) {
+    struct private *p;
+    struct idle_pcm *l = NULL;
+
     ca_return_val_if_fail(c, CA_ERROR_INVALID);
     ca_return_val_if_fail(changed, CA_ERROR_INVALID);
     ca_return_val_if_fail(merged, CA_ERROR_INVALID);
+    ca_return_val_if_fail(c->private, CA_ERROR_STATE);
+
+    p = PRIVATE(c);
+
+    if (ca_proplist_contains_key(changed, CA_PROP_KEY_CANBERRA_PLAYER_THREADS))
+        ca_thread_pool_set_idle_max(p->pool, get_player_threads(merged));
+
+    if (ca_proplist_contains_key(changed, CA_PROP_KEY_CANBERRA_DEVICE_IDLE_TIMEOUT)) {
+        ca_mutex_lock(p->outstanding_mutex);
+
+        if ((p->pcm_idle_timeout = get_pcm_idle_timeout(merged)) <= 0)
+            l = steal_idle_pcms_unlocked(p, NULL);
+
+        ca_mutex_unlock(p->outstanding_mutex);
+    }
+
+    if (ca_proplist_contains_key(changed, CA_PROP_KEY_CANBERRA_SOFTWARE_MIXER)) {
+        ca_mutex_lock(p->outstanding_mutex);
+        p->software_mixer = get_software_mixer(merged);
+        ca_mutex_unlock(p->outstanding_mutex);
+    }
+
+    if (ca_proplist_contains_key(changed, CA_PROP_KEY_CANBERRA_LATENCY)) {
+        struct idle_pcm *k;
+
+        /* Devices kept open are configured for the old latency */
+        ca_mutex_lock(p->outstanding_mutex);
+        p->latency = get_latency(merged);
+        p->device_generation++;
+        k = steal_idle_pcms_unlocked(p, NULL);
+        ca_mutex_unlock(p->outstanding_mutex);
+
+        idle_pcms_free(k);
+    }
+
+    if (ca_proplist_contains_key(changed, CA_PROP_KEY_CANBERRA_REALTIME)) {
+        ca_mutex_lock(p->outstanding_mutex);
+        p->realtime = get_realtime(merged);
+        ca_mutex_unlock(p->outstanding_mutex);
+    }
+
+    if (ca_proplist_contains_key(changed, CA_PROP_KEY_CANBERRA_NATIVE_FORMAT)) {
+        ca_mutex_lock(p->outstanding_mutex);
+        p->convert = get_convert(merged);
+        ca_mutex_unlock(p->outstanding_mutex);
+    }
+
+    idle_pcms_free(l);
 
     return CA_SUCCESS;
 }
 
 int driver_cache(ca_context *c, ca_proplist *proplist) {
+    ca_sample_format native;
+
     ca_return_val_if_fail(c, CA_ERROR_INVALID);
     ca_return_val_if_fail(proplist, CA_ERROR_INVALID);
+    ca_return_val_if_fail(c->private, CA_ERROR_STATE);
+
+    return ca_sample_cache_store_sound(&PRIVATE(c)->theme, c->props, proplist, get_native_format(c, &native));
+}
+
+int driver_cache_many(ca_context *c, ca_proplist **proplists, unsigned n, int *results) {
+    ca_return_val_if_fail(c, CA_ERROR_INVALID);
+    ca_return_val_if_fail(proplists || n <= 0, CA_ERROR_INVALID);
+    ca_return_val_if_fail(results || n <= 0, CA_ERROR_INVALID);
+    ca_return_val_if_fail(c->private, CA_ERROR_STATE);
 
-    return CA_ERROR_NOTSUPPORTED;
+    return ca_cache_many_sequentially(c, proplists, n, results, driver_cache);
 }
 
 static int translate_error(int error) {
@@ -221,81 +675,312 @@ static const snd_pcm_format_t sample_type_table[] = {
     [CA_SAMPLE_U8] = SND_PCM_FORMAT_U8
 };
 
-static int open_alsa(ca_context *c, struct outstanding *out) {
-    struct private *p;
-    int ret;
+/* With a period time set the device is started as soon as the first
+ * period has been written, instead of when the buffer is full */
+static int open_pcm(ca_context *c, snd_pcm_t **_pcm, snd_pcm_format_t format, unsigned rate, unsigned nchannels, unsigned buffer_time, unsigned period_time, unsigned *_rate) {
+    snd_pcm_t *pcm = NULL;
     snd_pcm_hw_params_t *hwparams;
-    unsigned rate;
+    snd_pcm_sw_params_t *swparams;
+    snd_pcm_uframes_t buffer_size, period_size;
+    int ret;
 
     snd_pcm_hw_params_alloca(&hwparams);
+    snd_pcm_sw_params_alloca(&swparams);
 
-    ca_return_val_if_fail(c, CA_ERROR_INVALID);
-    ca_return_val_if_fail(c->private, CA_ERROR_STATE);
-    ca_return_val_if_fail(out, CA_ERROR_INVALID);
+    if ((ret = snd_pcm_open(&pcm, c->device ? c->device : "default", SND_PCM_STREAM_PLAYBACK, 0)) < 0)
+        goto finish;
 
-    /* In ALSA we need to open different devices for doing
-     * multichannel audio. This cnnot be done in a backend-independant
-     * wa, hence we limit ourselves to mono/stereo only. */
-    ca_return_val_if_fail(ca_sound_file_get_nchannels(out->file) <= 2, CA_ERROR_NOTSUPPORTED);
+    if ((ret = snd_pcm_hw_params_any(pcm, hwparams)) < 0)
+        goto finish;
 
-    p = PRIVATE(c);
+    if ((ret = snd_pcm_hw_params_set_access(pcm, hwparams, SND_PCM_ACCESS_RW_INTERLEAVED)) < 0)
+        goto finish;
+
+    if ((ret = snd_pcm_hw_params_set_format(pcm, hwparams, format)) < 0)
+        goto finish;
+
+    if ((ret = snd_pcm_hw_params_set_rate_near(pcm, hwparams, &rate, 0)) < 0)
+        goto finish;
+
+    if ((ret = snd_pcm_hw_params_set_channels(pcm, hwparams, nchannels)) < 0)
+        goto finish;
+
+    if (buffer_time > 0)
+        if ((ret = snd_pcm_hw_params_set_buffer_time_near(pcm, hwparams, &buffer_time, 0)) < 0)
+            goto finish;
+
+    if (period_time > 0)
+        if ((ret = snd_pcm_hw_params_set_period_time_near(pcm, hwparams, &period_time, 0)) < 0)
+            goto finish;
+
+    if ((ret = snd_pcm_hw_params(pcm, hwparams)) < 0)
+        goto finish;
+
+    if ((ret = snd_pcm_hw_params_get_buffer_size(hwparams, &buffer_size)) < 0 ||
+        (ret = snd_pcm_hw_params_get_period_size(hwparams, &period_size, NULL)) < 0)
+        goto finish;
+
+    /* What we actually got, which might differ quite a bit from what
+     * we asked for */
+    if ((ret = snd_pcm_hw_params_get_rate(hwparams, &rate, NULL)) < 0)
+        goto finish;
+
+    ca_trace_device_latency((ca_usec_t) buffer_size * 1000000ULL / rate);
+
+    if (period_time > 0) {
+
+        if ((ret = snd_pcm_sw_params_current(pcm, swparams)) < 0)
+            goto finish;
+
+        if ((ret = snd_pcm_sw_params_set_start_threshold(pcm, swparams, period_size)) < 0)
+            goto finish;
+
+        if ((ret = snd_pcm_sw_params_set_avail_min(pcm, swparams, period_size)) < 0)
+            goto finish;
+
+        if ((ret = snd_pcm_sw_params(pcm, swparams)) < 0)
+            goto finish;
+    }
 
-    if ((ret = snd_pcm_open(&out->pcm, c->device ? c->device : "default", SND_PCM_STREAM_PLAYBACK, 0)) < 0)
+    if ((ret = snd_pcm_prepare(pcm)) < 0)
         goto finish;
 
-    if ((ret = snd_pcm_hw_params_any(out->pcm, hwparams)) < 0)
+    if (_rate)
+        *_rate = rate;
+
+    *_pcm = pcm;
+
+    return CA_SUCCESS;
+
+finish:
+
+    if (pcm)
+        snd_pcm_close(pcm);
+
+    return translate_error(ret);
+}
+
+static int probe_native_format(ca_context *c, ca_sample_format *f) {
+    snd_pcm_t *pcm = NULL;
+    snd_pcm_hw_params_t *hwparams;
+    unsigned rate = NATIVE_RATE, nchannels = NATIVE_NCHANNELS;
+    int ret;
+
+    snd_pcm_hw_params_alloca(&hwparams);
+
+    /* We don't wait for a device somebody else is using, we'll just
+     * try again with the next sound */
+    if ((ret = snd_pcm_open(&pcm, c->device ? c->device : "default", SND_PCM_STREAM_PLAYBACK, SND_PCM_NONBLOCK)) < 0)
         goto finish;
 
-    if ((ret = snd_pcm_hw_params_set_access(out->pcm, hwparams, SND_PCM_ACCESS_RW_INTERLEAVED)) < 0)
+    if ((ret = snd_pcm_hw_params_any(pcm, hwparams)) < 0)
         goto finish;
 
-    if ((ret = snd_pcm_hw_params_set_format(out->pcm, hwparams, sample_type_table[ca_sound_file_get_sample_type(out->file)])) < 0)
+    if ((ret = snd_pcm_hw_params_set_access(pcm, hwparams, SND_PCM_ACCESS_RW_INTERLEAVED)) < 0)
         goto finish;
 
-    rate = ca_sound_file_get_rate(out->file);
-    if ((ret = snd_pcm_hw_params_set_rate_near(out->pcm, hwparams, &rate, 0)) < 0)
+    if ((ret = snd_pcm_hw_params_set_format(pcm, hwparams, sample_type_table[CA_SAMPLE_S16NE])) < 0)
         goto finish;
 
-    if ((ret = snd_pcm_hw_params_set_channels(out->pcm, hwparams, ca_sound_file_get_nchannels(out->file))) < 0)
+    if ((ret = snd_pcm_hw_params_set_channels_near(pcm, hwparams, &nchannels)) < 0)
         goto finish;
 
-    if ((ret = snd_pcm_hw_params(out->pcm, hwparams)) < 0)
+    if ((ret = snd_pcm_hw_params_set_rate_near(pcm, hwparams, &rate, 0)) < 0)
         goto finish;
 
-    if ((ret = snd_pcm_prepare(out->pcm)) < 0)
+    /* See open_alsa() */
+    if (nchannels > 2) {
+        ret = -EINVAL;
         goto finish;
+    }
+
+    snd_pcm_close(pcm);
+
+    f->rate = rate;
+    f->nchannels = nchannels;
 
     return CA_SUCCESS;
 
 finish:
 
+    if (pcm)
+        snd_pcm_close(pcm);
+
     return translate_error(ret);
 }
 
+/* Returns NULL if sounds are to be played as they are */
+/* If we have the device open ourselves, probing it would fail for
+ * hw: devices, but then we know one format it is happy with anyway */
+static ca_bool_t get_open_format_unlocked(struct private *p, ca_sample_format *f) {
+    struct idle_pcm *i;
+
+    if (p->mixer_running) {
+        f->rate = p->mixer_rate;
+        f->nchannels = MIXER_NCHANNELS;
+        return TRUE;
+    }
+
+    for (i = p->idle_pcms; i; i = i->next)
+        if (i->format == sample_type_table[CA_SAMPLE_S16NE] && i->nchannels <= 2) {
+            f->rate = i->rate;
+            f->nchannels = i->nchannels;
+            return TRUE;
+        }
+
+    return FALSE;
+}
+
+static const ca_sample_format* get_native_format(ca_context *c, ca_sample_format *f) {
+    struct private *p;
+    unsigned generation;
+    ca_bool_t known;
+    int ret;
+
+    p = PRIVATE(c);
+
+    ca_mutex_lock(p->outstanding_mutex);
+
+    if (!p->convert) {
+        ca_mutex_unlock(p->outstanding_mutex);
+        return NULL;
+    }
+
+    generation = p->device_generation;
+
+    if ((known = p->native_known && p->native_generation == generation))
+        *f = p->native;
+    else if ((known = get_open_format_unlocked(p, f))) {
+        p->native = *f;
+        p->native_known = TRUE;
+        p->native_generation = generation;
+    }
+
+    ca_mutex_unlock(p->outstanding_mutex);
+
+    if (known)
+        return f->rate > 0 ? f : NULL;
+
+    /* A failure is remembered as well, so that we don't probe again
+     * and again on every play */
+    if ((ret = probe_native_format(c, f)) < 0)
+        f->rate = f->nchannels = 0;
+
+    ca_mutex_lock(p->outstanding_mutex);
+
+    /* Unless the device changed in the meantime */
+    if (p->device_generation == generation) {
+        p->native = *f;
+        p->native_known = TRUE;
+        p->native_generation = generation;
+    }
+
+    ca_mutex_unlock(p->outstanding_mutex);
+
+    return ret < 0 ? NULL : f;
+}
+
+static void get_format(struct outstanding *out, ca_sample_type_t *type, unsigned *rate, unsigned *nchannels) {
+
+    if (out->sample) {
+        *nchannels = out->sample->nchannels;
+        *rate = out->sample->rate;
+        *type = out->sample->type;
+    } else {
+        *nchannels = ca_sound_file_get_nchannels(out->file);
+        *rate = ca_sound_file_get_rate(out->file);
+        *type = ca_sound_file_get_sample_type(out->file);
+    }
+}
+
+static int open_alsa(ca_context *c, struct outstanding *out) {
+    struct private *p;
+    unsigned rate, nchannels, latency;
+    ca_sample_type_t type;
+
+    ca_return_val_if_fail(c, CA_ERROR_INVALID);
+    ca_return_val_if_fail(c->private, CA_ERROR_STATE);
+    ca_return_val_if_fail(out, CA_ERROR_INVALID);
+    ca_return_val_if_fail(out->file || out->sample, CA_ERROR_INVALID);
+
+    get_format(out, &type, &rate, &nchannels);
+
+    /* In ALSA we need to open different devices for doing
+     * multichannel audio. This cnnot be done in a backend-independant
+     * wa, hence we limit ourselves to mono/stereo only. */
+    ca_return_val_if_fail(nchannels <= 2, CA_ERROR_NOTSUPPORTED);
+
+    p = PRIVATE(c);
+
+    out->format = sample_type_table[type];
+    out->rate = rate;
+    out->nchannels = nchannels;
+
+    ca_mutex_lock(p->outstanding_mutex);
+    out->device_generation = p->device_generation;
+    latency = p->latency;
+    out->realtime = p->realtime;
+    ca_mutex_unlock(p->outstanding_mutex);
+
+    out->low_latency = latency > 0;
+
+    /* Maybe we still have a device open in the right configuration */
+    if ((out->pcm = acquire_idle_pcm(p, out->format, out->rate, out->nchannels)))
+        return CA_SUCCESS;
+
+    /* Two periods, so that we can refill one while the other one is
+     * played */
+    return open_pcm(c, &out->pcm, out->format, out->rate, out->nchannels, latency, latency/2, NULL);
+}
+
 #define BUFSIZE (16*1024)
 
-static void* thread_func(void *userdata) {
+/* How far the decoder may get ahead of the player, for compressed
+ * files that are streamed */
+#define READ_AHEAD_SIZE (4*BUFSIZE)
+
+static void thread_func(void *userdata, void *pool_userdata) {
     struct outstanding *out = userdata;
     int ret;
-    void *data, *d = NULL;
+    void *data = NULL;
+    const void *d = NULL;
+    ca_bool_t mapped;
     size_t fs, data_size;
     size_t nbytes = 0;
     struct pollfd *pfd = NULL;
     nfds_t n_pfd;
     struct private *p;
+    struct idle_pcm *l = NULL;
+    ca_bool_t realtime = FALSE;
 
     p = PRIVATE(out->context);
 
-    pthread_detach(pthread_self());
+    if (out->realtime)
+        realtime = make_realtime();
 
-    fs = ca_sound_file_frame_size(out->file);
+    fs = out->sample ? ca_sample_frame_size(out->sample) : ca_sound_file_frame_size(out->file);
     data_size = (BUFSIZE/fs)*fs;
 
-    if (!(data = ca_malloc(data_size))) {
-        ret = CA_ERROR_OOM;
-        goto finish;
+    /* With a short buffer we write a period at a time, so that we
+     * don't sit in snd_pcm_writei() for long */
+    if (out->low_latency) {
+        snd_pcm_uframes_t buffer_size, period_size;
+
+        if (snd_pcm_get_params(out->pcm, &buffer_size, &period_size) >= 0 && period_size > 0)
+            data_size = CA_MIN(data_size, (size_t) period_size*fs);
     }
 
+    /* Cached samples are written straight from the decoded buffer,
+     * mapped files straight from the map */
+    mapped = !out->sample && ca_sound_file_is_mapped(out->file);
+
+    /* Later files of a sequence might not be mapped */
+    if (!out->sample && (!mapped || out->sequence))
+        if (!(data = ca_malloc(data_size))) {
+            ret = CA_ERROR_OOM;
+            goto finish;
+        }
+
     if ((ret = snd_pcm_poll_descriptors_count(out->pcm)) < 0) {
         ret = translate_error(ret);
         goto finish;
@@ -371,14 +1056,39 @@ static void* thread_func(void *userdata) {
             continue;
         }
 
-        if (nbytes <= 0) {
+        while (nbytes <= 0) {
 
-            nbytes = data_size;
+            if (out->sample) {
+                nbytes = CA_MIN(data_size, out->sample->nbytes - out->offset);
+                d = (const uint8_t*) out->sample->data + out->offset;
+                out->offset += nbytes;
+            } else if (mapped) {
+                nbytes = data_size;
 
-            if ((ret = ca_sound_file_read_arbitrary(out->file, data, &nbytes)) < 0)
-                goto finish;
+                if ((ret = ca_sound_file_read_mapped(out->file, &d, &nbytes)) < 0)
+                    goto finish;
+            } else {
+                nbytes = data_size;
+
+                if ((ret = ca_sound_file_read_arbitrary(out->file, data, &nbytes)) < 0)
+                    goto finish;
 
-            d = data;
+                d = data;
+            }
+
+            if (nbytes > 0)
+                break;
+
+            /* Continue with the next file of the sequence, if any */
+            if ((ret = ca_sequence_next(out->sequence, &out->file)) < 0) {
+
+                if (ret != CA_ERROR_NOTFOUND)
+                    goto finish;
+
+                break;
+            }
+
+            mapped = ca_sound_file_is_mapped(out->file);
         }
 
         if (nbytes <= 0) {
@@ -396,8 +1106,13 @@ static void* thread_func(void *userdata) {
             continue;
         }
 
+        if (!out->written) {
+            out->written = TRUE;
+            ca_trace_stage(CA_TRACE_FIRST_WRITE, out->started);
+        }
+
         nbytes -= (size_t) sframes*fs;
-        d = (uint8_t*) d + (size_t) sframes*fs;
+        d = (const uint8_t*) d + (size_t) sframes*fs;
     }
 
     ret = CA_SUCCESS;
@@ -407,14 +1122,26 @@ finish:
     ca_free(data);
     ca_free(pfd);
 
-    if (!out->dead)
+    if (!out->dead) {
+        ca_trace_stage(CA_TRACE_FINISH, out->started);
+
         if (out->callback)
             out->callback(out->context, out->id, ret, out->userdata);
+    }
+
+    ca_trace_stream_end();
+
+    /* Only devices in a sane state may be reused */
+    if (out->pcm && out->dead)
+        snd_pcm_drop(out->pcm);
 
     ca_mutex_lock(p->outstanding_mutex);
 
     CA_LLIST_REMOVE(struct outstanding, p->outstanding, out);
 
+    if (ret == CA_SUCCESS)
+        l = release_pcm_unlocked(p, out);
+
     if (!p->outstanding && p->signal_semaphore)
         sem_post(&p->semaphore);
 
@@ -422,17 +1149,346 @@ finish:
 
     ca_mutex_unlock(p->outstanding_mutex);
 
+    idle_pcms_free(l);
+
+    if (realtime)
+        make_normal();
+}
+
+static int mixer_iterate(snd_pcm_t *pcm, struct pollfd *pfd, unsigned n_pfd, int16_t *mix, struct outstanding **sources, unsigned n_sources) {
+    unsigned short revents;
+    snd_pcm_sframes_t sframes;
+    size_t frames, n_mixed = 0;
+    unsigned i;
+    int ret;
+
+    /* Wait until the device wants more data */
+    if (poll(pfd, n_pfd, -1) < 0)
+        return CA_ERROR_SYSTEM;
+
+    if ((ret = snd_pcm_poll_descriptors_revents(pcm, pfd, n_pfd, &revents)) < 0)
+        return translate_error(ret);
+
+    if (revents != POLLOUT) {
+
+        switch (snd_pcm_state(pcm)) {
+
+            case SND_PCM_STATE_XRUN:
+                ret = snd_pcm_recover(pcm, -EPIPE, 1);
+                break;
+
+            case SND_PCM_STATE_SUSPENDED:
+                ret = snd_pcm_recover(pcm, -ESTRPIPE, 1);
+                break;
+
+            default:
+                snd_pcm_drop(pcm);
+                ret = snd_pcm_prepare(pcm);
+                break;
+        }
+
+        return ret < 0 ? translate_error(ret) : CA_SUCCESS;
+    }
+
+    if ((sframes = snd_pcm_avail_update(pcm)) < 0) {
+
+        if ((ret = snd_pcm_recover(pcm, (int) sframes, 1)) < 0)
+            return translate_error(ret);
+
+        return CA_SUCCESS;
+    }
+
+    if ((frames = CA_MIN((size_t) sframes, (size_t) MIXER_FRAMES)) <= 0)
+        return CA_SUCCESS;
+
+    memset(mix, 0, frames * MIXER_NCHANNELS * sizeof(int16_t));
+
+    for (i = 0; i < n_sources; i++) {
+        struct outstanding *out = sources[i];
+        size_t n = frames;
+
+        if (out->dead || out->finished)
+            continue;
+
+        if ((ret = ca_mix_source(mix, MIXER_NCHANNELS, &n, out->sample, &out->offset, out->file, out->volume)) < 0) {
+            out->finished = TRUE;
+            out->error = ret;
+            continue;
+        }
+
+        /* Note that we consider a source played as soon as the last
+         * bit of it has been written to the device */
+        if (n < frames) {
+            out->finished = TRUE;
+            out->error = CA_SUCCESS;
+        }
+
+        if (n > 0 && !out->written) {
+            out->written = TRUE;
+            ca_trace_stage(CA_TRACE_FIRST_WRITE, out->started);
+        }
+
+        n_mixed = CA_MAX(n_mixed, n);
+    }
+
+    for (i = 0; n_mixed > 0;) {
+
+        if ((sframes = snd_pcm_writei(pcm, mix + i * MIXER_NCHANNELS, n_mixed)) < 0) {
+
+            if ((ret = snd_pcm_recover(pcm, (int) sframes, 1)) < 0)
+                return translate_error(ret);
+
+            continue;
+        }
+
+        i += (unsigned) sframes;
+        n_mixed -= (size_t) sframes;
+    }
+
+    return CA_SUCCESS;
+}
+
+static void* mixer_func(void *userdata) {
+    struct private *p = userdata;
+    struct outstanding *sources[MIXER_SOURCES_MAX], *out, *done = NULL;
+    unsigned n_sources, i;
+    int16_t *mix = NULL;
+    struct pollfd *pfd = NULL;
+    unsigned n_pfd = 0;
+    ca_bool_t drained = FALSE;
+    snd_pcm_t *pcm;
+    int ret;
+
+    pthread_detach(pthread_self());
+
+    /* The device is ours until we reset mixer_running */
+    pcm = p->mixer_pcm;
+
+    if (!(mix = ca_new(int16_t, MIXER_FRAMES * MIXER_NCHANNELS))) {
+        ret = CA_ERROR_OOM;
+        goto loop;
+    }
+
+    if ((ret = snd_pcm_poll_descriptors_count(pcm)) < 0) {
+        ret = translate_error(ret);
+        goto loop;
+    }
+
+    n_pfd = (unsigned) ret;
+    if (!(pfd = ca_new(struct pollfd, n_pfd))) {
+        ret = CA_ERROR_OOM;
+        goto loop;
+    }
+
+    if ((ret = snd_pcm_poll_descriptors(pcm, pfd, n_pfd)) < 0) {
+        ret = translate_error(ret);
+        goto loop;
+    }
+
+    ret = CA_SUCCESS;
+
+loop:
+
+    for (;;) {
+
+        ca_mutex_lock(p->outstanding_mutex);
+
+        /* Only we remove mixed sources from the list, so the
+         * pointers stay valid after dropping the lock again */
+        n_sources = 0;
+        for (out = p->outstanding; out; out = out->next)
+            if (out->mixed)
+                sources[n_sources++] = out;
+
+        if (n_sources <= 0) {
+
+            /* Let the device play what is left, and check again
+             * afterwards, maybe something new came in meanwhile */
+            if (ret == CA_SUCCESS && !drained && !p->signal_semaphore) {
+                ca_mutex_unlock(p->outstanding_mutex);
+
+                snd_pcm_drain(pcm);
+
+                if ((ret = snd_pcm_prepare(pcm)) < 0)
+                    ret = translate_error(ret);
+
+                drained = TRUE;
+                continue;
+            }
+
+            /* We close the device with the lock held, so that nobody
+             * tries to open a new mixer before we let go of it */
+            p->mixer_running = FALSE;
+            p->mixer_pcm = NULL;
+            snd_pcm_close(pcm);
+
+            if (p->signal_semaphore)
+                sem_post(&p->semaphore);
+
+            ca_mutex_unlock(p->outstanding_mutex);
+            break;
+        }
+
+        ca_mutex_unlock(p->outstanding_mutex);
+
+        drained = FALSE;
+
+        if (ret == CA_SUCCESS)
+            ret = mixer_iterate(pcm, pfd, n_pfd, mix, sources, n_sources);
+
+        ca_mutex_lock(p->outstanding_mutex);
+
+        /* If the device failed on us, all sources fail with it */
+        for (i = 0; i < n_sources; i++) {
+            out = sources[i];
+
+            if (ret < 0 && !out->finished) {
+                out->finished = TRUE;
+                out->error = ret;
+            }
+
+            if (!out->dead && !out->finished)
+                continue;
+
+            /* Cancelled sources have already been notified */
+            out->notify = !out->dead;
+            out->dead = TRUE;
+
+            CA_LLIST_REMOVE(struct outstanding, p->outstanding, out);
+            CA_LLIST_PREPEND(struct outstanding, done, out);
+            p->n_mixer_sources--;
+        }
+
+        if (!p->outstanding && p->signal_semaphore)
+            sem_post(&p->semaphore);
+
+        ca_mutex_unlock(p->outstanding_mutex);
+
+        while ((out = done)) {
+            CA_LLIST_REMOVE(struct outstanding, done, out);
+
+            if (out->notify) {
+                ca_trace_stage(CA_TRACE_FINISH, out->started);
+
+                if (out->callback)
+                    out->callback(out->context, out->id, out->error, out->userdata);
+            }
+
+            ca_trace_stream_end();
+            outstanding_free(out);
+        }
+    }
+
+    ca_free(mix);
+    ca_free(pfd);
+
     return NULL;
 }
 
-int driver_play(ca_context *c, uint32_t id, ca_proplist *proplist, ca_finish_callback_t cb, void *userdata) {
+static ca_bool_t mixer_can_take_unlocked(struct private *p, unsigned rate, unsigned nchannels) {
+    return
+        nchannels <= 2 &&
+        p->n_mixer_sources < MIXER_SOURCES_MAX &&
+        (!p->mixer_running || p->mixer_rate == rate);
+}
+
+static void mixer_take_unlocked(struct private *p, struct outstanding *out) {
+    out->mixed = TRUE;
+    p->n_mixer_sources++;
+    ca_trace_stream_begin();
+
+    CA_LLIST_PREPEND(struct outstanding, p->outstanding, out);
+}
+
+static int mixer_add(ca_context *c, struct outstanding *out, ca_bool_t *added) {
+    struct private *p;
+    pthread_t thread;
+    unsigned rate, nchannels, device_rate;
+    ca_sample_type_t type;
+    snd_pcm_t *pcm = NULL;
+    ca_usec_t start;
+    int ret;
+
+    /* Adds a sound event to the software mixer, starting it if
+     * needed. Sound events which cannot be mixed into the stream
+     * currently playing are left to the caller. */
+
+    p = PRIVATE(c);
+    *added = FALSE;
+
+    get_format(out, &type, &rate, &nchannels);
+
+    ca_mutex_lock(p->outstanding_mutex);
+
+    /* Either we join the mixer that is playing already, or we leave
+     * the sound to the caller */
+    if (p->mixer_running || !mixer_can_take_unlocked(p, rate, nchannels)) {
+
+        if ((*added = mixer_can_take_unlocked(p, rate, nchannels)))
+            mixer_take_unlocked(p, out);
+
+        ca_mutex_unlock(p->outstanding_mutex);
+        return CA_SUCCESS;
+    }
+
+    ca_mutex_unlock(p->outstanding_mutex);
+
+    /* Opening the device may take a while, and we don't want to hold
+     * up the mixer or other players meanwhile */
+    start = ca_trace_now();
+    device_rate = rate;
+
+    /* If the device cannot do our mix format, play unmixed */
+    if ((ret = open_pcm(c, &pcm, sample_type_table[CA_SAMPLE_S16NE], rate, MIXER_NCHANNELS, MIXER_BUFFER_TIME_USEC, 0, &device_rate)) < 0)
+        return ret == CA_ERROR_NOTSUPPORTED ? CA_SUCCESS : ret;
+
+    ca_trace_stage(CA_TRACE_DEVICE_OPEN, start);
+
+    ca_mutex_lock(p->outstanding_mutex);
+
+    /* We don't resample, so if the device runs at another rate than
+     * we asked for, this sound cannot be mixed. And somebody else
+     * might have started the mixer in the meantime. */
+    if (device_rate == rate && !p->mixer_running) {
+
+        p->mixer_pcm = pcm;
+
+        if (pthread_create(&thread, NULL, mixer_func, p) != 0) {
+            p->mixer_pcm = NULL;
+            ca_mutex_unlock(p->outstanding_mutex);
+
+            snd_pcm_close(pcm);
+            return CA_ERROR_OOM;
+        }
+
+        pcm = NULL;
+        p->mixer_running = TRUE;
+        p->mixer_rate = device_rate;
+    }
+
+    /* If we didn't get a mixer going, the caller plays it unmixed */
+    if ((*added = p->mixer_running && mixer_can_take_unlocked(p, rate, nchannels)))
+        mixer_take_unlocked(p, out);
+
+    ca_mutex_unlock(p->outstanding_mutex);
+
+    if (pcm)
+        snd_pcm_close(pcm);
+
+    return CA_SUCCESS;
+}
+
+int driver_play(ca_context *c, uint32_t id, ca_proplist *proplist, ca_proplist *cp, ca_finish_callback_t cb, void *userdata) {
     struct private *p;
     struct outstanding *out = NULL;
+    ca_sample_format format;
+    const ca_sample_format *native;
+    ca_usec_t start;
     int ret;
-    pthread_t thread;
 
     ca_return_val_if_fail(c, CA_ERROR_INVALID);
     ca_return_val_if_fail(proplist, CA_ERROR_INVALID);
+    ca_return_val_if_fail(cp, CA_ERROR_INVALID);
     ca_return_val_if_fail(!userdata || cb, CA_ERROR_INVALID);
     ca_return_val_if_fail(c->private, CA_ERROR_STATE);
 
@@ -443,35 +1499,68 @@ int driver_play(ca_context *c, uint32_t id, ca_proplist *proplist, ca_finish_cal
         goto finish;
     }
 
+    out->started = ca_trace_now();
+
     out->context = c;
     out->id = id;
     out->callback = cb;
     out->userdata = userdata;
     out->pipe_fd[0] = out->pipe_fd[1] = -1;
 
+    /* Only the software mixer scales the sound */
+    if ((ret = ca_mix_get_volume(proplist, &out->volume)) < 0)
+        goto finish;
+
+    native = get_native_format(c, &format);
+
+    if ((ret = ca_sample_cache_lookup_sound(&out->sample, &out->file, &p->theme, cp, proplist, native)) < 0)
+        goto finish;
+
+    /* Get the decoder going before we even open the device, so that
+     * the first write doesn't wait for it */
+    if (out->file && !ca_sound_file_is_mapped(out->file))
+        if ((ret = ca_sound_file_read_ahead(out->file, READ_AHEAD_SIZE, BUFSIZE)) < 0)
+            goto finish;
+
+    if ((ret = ca_sequence_new(&out->sequence, &out->sample, &out->file, &p->theme, cp, proplist, native)) < 0)
+        goto finish;
+
+    /* The mixer only plays single sounds */
+    if (p->software_mixer && !out->sequence) {
+        ca_bool_t added;
+
+        if ((ret = mixer_add(c, out, &added)) < 0)
+            goto finish;
+
+        if (added)
+            return CA_SUCCESS;
+    }
+
     if (pipe(out->pipe_fd) < 0) {
         ret = CA_ERROR_SYSTEM;
         goto finish;
     }
 
-    if ((ret = ca_lookup_sound(&out->file, NULL, &p->theme, c->props, proplist)) < 0)
-        goto finish;
+    start = ca_trace_now();
 
     if ((ret = open_alsa(c, out)) < 0)
         goto finish;
 
+    ca_trace_stage(CA_TRACE_DEVICE_OPEN, start);
+
     /* OK, we're ready to go, so let's add this to our list */
     ca_mutex_lock(p->outstanding_mutex);
     CA_LLIST_PREPEND(struct outstanding, p->outstanding, out);
     ca_mutex_unlock(p->outstanding_mutex);
 
-    if (pthread_create(&thread, NULL, thread_func, out) < 0) {
-        ret = CA_ERROR_OOM;
+    ca_trace_stream_begin();
 
+    if ((ret = ca_thread_pool_push(p->pool, out)) < 0) {
         ca_mutex_lock(p->outstanding_mutex);
         CA_LLIST_REMOVE(struct outstanding, p->outstanding, out);
         ca_mutex_unlock(p->outstanding_mutex);
 
+        ca_trace_stream_end();
         goto finish;
     }
 
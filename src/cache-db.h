@@ -0,0 +1,40 @@
+#ifndef foocanberracachedbhfoo
+#define foocanberracachedbhfoo
+
+/***
+  This file is part of libcanberra.
+
+  Copyright 2008 Lennart Poettering
+
+  libcanberra is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 2.1 of the
+  License, or (at your option) any later version.
+
+  libcanberra is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with libcanberra. If not, see
+  <http://www.gnu.org/licenses/>.
+***/
+
+#include <sys/types.h>
+
+/* The key/value store the lookup cache in cache.c is built on. There
+ * is one implementation based on tdb (cache-tdb.c) and one based on
+ * immutable memory mapped files (cache-mmap.c), the one to use is
+ * picked at configure time. */
+
+/* Returns the path of the database file, which is machine and
+ * compiler target specific and ends in the suffix passed */
+int ca_cache_db_path(char **pn, const char *suffix);
+
+/* On success *data is to be freed with ca_free() */
+int ca_cache_db_lookup(const void *key, size_t klen, void **data, size_t *dlen);
+int ca_cache_db_store(const void *key, size_t klen, const void *data, size_t dlen);
+int ca_cache_db_remove(const void *key, size_t klen);
+
+#endif
@@ -0,0 +1,795 @@
+/***
+  This file is part of libcanberra.
+
+  Copyright 2008 Lennart Poettering
+
+  libcanberra is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 2.1 of the
+  License, or (at your option) any later version.
+
+  libcanberra is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with libcanberra. If not, see
+  <http://www.gnu.org/licenses/>.
+***/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "malloc.h"
+#include "macro.h"
+#include "mutex.h"
+#include "canberra.h"
+#include "cache-db.h"
+
+/* An immutable hash table in a file that is mapped into memory and
+ * probed without taking any locks. Updates are collected in memory
+ * and then written out in one go as a complete new file which is
+ * atomically renamed over the old one. Afterwards the old file is
+ * flagged as superseded, which is all readers need to check to
+ * notice that they should map the new one. */
+
+#define MAGIC "CACACHE1"
+#define BUCKETS_MIN 16U
+#define BATCH_MAX 16U
+#define BATCH_INTERVAL 5
+#define RECHECK_INTERVAL 10
+
+struct header {
+    char magic[8];
+    uint32_t superseded;
+    uint32_t n_buckets; /* power of two */
+    uint32_t n_entries;
+    uint32_t size;
+    /* Followed by n_buckets 32bit offsets of entries, 0 for empty
+     * buckets, followed by the entries themselves */
+};
+
+struct entry {
+    uint32_t hash;
+    uint32_t klen;
+    uint32_t dlen;
+    /* Followed by the key and the data, padded to 4 bytes */
+};
+
+#define ENTRY_SIZE(klen, dlen) (((sizeof(struct entry) + (klen) + (dlen)) + 3) & ~((size_t) 3))
+
+struct db_map {
+    struct db_map *next;
+    void *data;
+    size_t size;
+    time_t checked; /* if there was no usable file: when we looked */
+};
+
+struct pending {
+    struct pending *next;
+    void *key;
+    size_t klen;
+    void *data;
+    size_t dlen;
+    unsigned hash;
+    ca_bool_t removed;
+};
+
+/* This part is not portable due to pthread_once usage, should be abstracted
+ * when we port this to platforms that do not have POSIX threading */
+
+static ca_mutex *mutex = NULL;
+
+/* Everything below is protected by the mutex, except for the current
+ * map pointer which lookups use without locking. Maps replaced
+ * are only freed once no lookup is using any map anymore. We don't
+ * have atomic loads and stores, hence the volatiles and barriers. */
+static char *path = NULL;
+static struct db_map * volatile current = NULL;
+static struct db_map *retired = NULL;
+static volatile unsigned readers = 0;
+
+static struct pending *pending = NULL;
+static volatile unsigned n_pending = 0;
+static time_t first_pending = 0;
+
+static void allocate_mutex_once(void) {
+    mutex = ca_mutex_new();
+}
+
+static int allocate_mutex(void) {
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+    if (pthread_once(&once, allocate_mutex_once) != 0)
+        return CA_ERROR_OOM;
+
+    if (!mutex)
+        return CA_ERROR_OOM;
+
+    return 0;
+}
+
+static unsigned calc_hash(const void *key, size_t klen) {
+    const char *k = key;
+    unsigned hash = 0;
+
+    for (; klen > 0; klen--, k++)
+        hash = 31 * hash + (unsigned) *k;
+
+    return hash;
+}
+
+static void* dup_data(const void *d, size_t l) {
+    void *r;
+
+    if (!(r = ca_malloc(l > 0 ? l : 1)))
+        return NULL;
+
+    if (l > 0)
+        memcpy(r, d, l);
+
+    return r;
+}
+
+static void map_free(struct db_map *m) {
+    ca_assert(m);
+
+    if (m->data)
+        munmap(m->data, m->size);
+
+    ca_free(m);
+}
+
+static ca_bool_t map_valid(const void *data, size_t size) {
+    const struct header *h = data;
+
+    if (size < sizeof(struct header) ||
+        memcmp(h->magic, MAGIC, sizeof(h->magic)) != 0 ||
+        h->size != size ||
+        h->n_buckets <= 0 ||
+        (h->n_buckets & (h->n_buckets - 1)) != 0 ||
+        h->n_buckets > (size - sizeof(struct header)) / sizeof(uint32_t))
+        return FALSE;
+
+    return TRUE;
+}
+
+static int map_open(struct db_map **_m) {
+    struct db_map *m;
+    struct stat st;
+    int fd;
+
+    if (!(m = ca_new0(struct db_map, 1)))
+        return CA_ERROR_OOM;
+
+    if ((fd = open(path, O_RDONLY|O_NOCTTY
+#ifdef O_CLOEXEC
+                   | O_CLOEXEC
+#endif
+             )) < 0) {
+
+        if (errno != ENOENT) {
+            ca_free(m);
+            return CA_ERROR_SYSTEM;
+        }
+
+        /* No cache yet, that's fine */
+        goto empty;
+    }
+
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        ca_free(m);
+        return CA_ERROR_SYSTEM;
+    }
+
+    if (st.st_size <= 0 || (uint64_t) st.st_size > UINT32_MAX) {
+        close(fd);
+        goto empty;
+    }
+
+    m->size = (size_t) st.st_size;
+    m->data = mmap(NULL, m->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (m->data == MAP_FAILED) {
+        m->data = NULL;
+        goto empty;
+    }
+
+    /* A broken file is simply replaced by the next update */
+    if (!map_valid(m->data, m->size)) {
+        munmap(m->data, m->size);
+        m->data = NULL;
+        goto empty;
+    }
+
+    *_m = m;
+    return CA_SUCCESS;
+
+empty:
+    m->size = 0;
+    ca_assert_se(time(&m->checked) != (time_t) -1);
+
+    *_m = m;
+    return CA_SUCCESS;
+}
+
+static ca_bool_t map_superseded(struct db_map *m) {
+    time_t now;
+
+    ca_assert(m);
+
+    if (m->data)
+        return !!((volatile struct header*) m->data)->superseded;
+
+    /* Somebody else might have written the first cache file since */
+    ca_assert_se(time(&now) != (time_t) -1);
+    return now < m->checked || now >= m->checked + RECHECK_INTERVAL;
+}
+
+/* Returns NULL for empty buckets and broken entries, since we don't
+ * trust anything we read from the file */
+static const struct entry* map_entry(struct db_map *m, uint32_t i) {
+    const struct header *h = m->data;
+    const struct entry *e;
+    size_t avail;
+    uint32_t o;
+
+    if ((o = ((const uint32_t*) (h + 1))[i]) == 0)
+        return NULL;
+
+    if (o % 4 != 0 || o > m->size - sizeof(struct entry))
+        return NULL;
+
+    e = (const struct entry*) ((const uint8_t*) m->data + o);
+    avail = m->size - o - sizeof(struct entry);
+
+    if (e->klen > avail || e->dlen > avail - e->klen)
+        return NULL;
+
+    return e;
+}
+
+static const struct entry* map_lookup(struct db_map *m, const void *key, size_t klen, unsigned hash) {
+    const struct header *h;
+    uint32_t i, n, mask;
+
+    ca_assert(m);
+
+    if (!m->data)
+        return NULL;
+
+    h = m->data;
+    mask = h->n_buckets - 1;
+
+    for (i = hash & mask, n = 0; n < h->n_buckets; i = (i + 1) & mask, n++) {
+        const struct entry *e;
+
+        if (!(e = map_entry(m, i)))
+            break;
+
+        if (e->hash == (uint32_t) hash &&
+            e->klen == klen &&
+            memcmp(e + 1, key, klen) == 0)
+            return e;
+    }
+
+    return NULL;
+}
+
+static void free_retired_unlocked(void) {
+
+    __sync_synchronize();
+
+    if (readers > 0)
+        return;
+
+    while (retired) {
+        struct db_map *m = retired;
+
+        retired = m->next;
+        map_free(m);
+    }
+}
+
+static int refresh_unlocked(void) {
+    struct db_map *m, *old;
+    int ret;
+
+    if ((ret = map_open(&m)) < 0)
+        return ret;
+
+    old = current;
+    current = m;
+
+    if (old) {
+        old->next = retired;
+        retired = old;
+    }
+
+    free_retired_unlocked();
+
+    return CA_SUCCESS;
+}
+
+static int db_open(void) {
+    int ret;
+
+    if (current) {
+        __sync_synchronize();
+        return CA_SUCCESS;
+    }
+
+    if ((ret = allocate_mutex()) < 0)
+        return ret;
+
+    ca_mutex_lock(mutex);
+
+    if (!path)
+        if ((ret = ca_cache_db_path(&path, ".map")) < 0)
+            goto finish;
+
+    if (!current)
+        ret = refresh_unlocked();
+    else
+        ret = CA_SUCCESS;
+
+finish:
+    ca_mutex_unlock(mutex);
+
+    return ret;
+}
+
+static struct pending *find_pending_unlocked(const void *key, size_t klen, unsigned hash) {
+    struct pending *p;
+
+    for (p = pending; p; p = p->next)
+        if (p->hash == hash && p->klen == klen && memcmp(p->key, key, klen) == 0)
+            return p;
+
+    return NULL;
+}
+
+static void free_pending_unlocked(void) {
+
+    while (pending) {
+        struct pending *p = pending;
+
+        pending = p->next;
+        ca_free(p);
+    }
+
+    n_pending = 0;
+}
+
+static int write_all(int fd, const void *d, size_t l) {
+    const uint8_t *p = d;
+
+    while (l > 0) {
+        ssize_t r;
+
+        if ((r = write(fd, p, l)) < 0) {
+            if (errno == EINTR)
+                continue;
+
+            return CA_ERROR_SYSTEM;
+        }
+
+        p += r;
+        l -= (size_t) r;
+    }
+
+    return CA_SUCCESS;
+}
+
+static void put_entry(uint8_t *b, uint32_t n_buckets, size_t *offset, unsigned hash, const void *key, size_t klen, const void *data, size_t dlen) {
+    uint32_t *buckets = (uint32_t*) (b + sizeof(struct header));
+    struct entry *e;
+    uint32_t i;
+
+    for (i = hash & (n_buckets - 1); buckets[i]; i = (i + 1) & (n_buckets - 1))
+        ;
+
+    buckets[i] = (uint32_t) *offset;
+
+    e = (struct entry*) (b + *offset);
+    e->hash = (uint32_t) hash;
+    e->klen = (uint32_t) klen;
+    e->dlen = (uint32_t) dlen;
+    memcpy(e + 1, key, klen);
+    memcpy((uint8_t*) (e + 1) + klen, data, dlen);
+
+    *offset += ENTRY_SIZE(klen, dlen);
+}
+
+/* Merges the pending updates into the current generation and writes
+ * the result out as a new one */
+static int flush_unlocked(void) {
+    struct db_map *m;
+    struct header *h;
+    struct pending *p;
+    uint32_t n_buckets, i;
+    uint64_t size;
+    size_t n, offset;
+    uint8_t *b = NULL;
+    char *tmp = NULL, *lock = NULL;
+    int fd = -1, old_fd = -1, lock_fd = -1;
+    int ret;
+
+    ca_assert(path);
+
+    /* Only one writer at a time, also across processes */
+    if (!(lock = ca_sprintf_malloc("%s.lock", path)))
+        return CA_ERROR_OOM;
+
+    if ((lock_fd = open(lock, O_RDWR|O_CREAT|O_NOCTTY
+#ifdef O_CLOEXEC
+                        | O_CLOEXEC
+#endif
+                        , 0644)) < 0) {
+        ret = CA_ERROR_SYSTEM;
+        goto finish;
+    }
+
+    while (flock(lock_fd, LOCK_EX) < 0)
+        if (errno != EINTR) {
+            ret = CA_ERROR_SYSTEM;
+            goto finish;
+        }
+
+    /* Somebody else might have written a newer generation while we
+     * weren't holding the lock */
+    if (map_superseded(current))
+        if ((ret = refresh_unlocked()) < 0)
+            goto finish;
+
+    m = current;
+    h = m->data;
+
+    n = 0;
+    size = sizeof(struct header);
+
+    if (h)
+        for (i = 0; i < h->n_buckets; i++) {
+            const struct entry *e;
+
+            if ((e = map_entry(m, i))) {
+                size += ENTRY_SIZE(e->klen, e->dlen);
+                n++;
+            }
+        }
+
+    for (p = pending; p; p = p->next)
+        if (!p->removed) {
+            size += ENTRY_SIZE(p->klen, p->dlen);
+            n++;
+        }
+
+    for (n_buckets = BUCKETS_MIN; n_buckets < n * 2; n_buckets *= 2)
+        if (n_buckets >= UINT32_MAX / 4) {
+            ret = CA_ERROR_TOOBIG;
+            goto finish;
+        }
+
+    size += (uint64_t) n_buckets * sizeof(uint32_t);
+
+    if (size > UINT32_MAX) {
+        ret = CA_ERROR_TOOBIG;
+        goto finish;
+    }
+
+    if (!(b = ca_malloc0((size_t) size))) {
+        ret = CA_ERROR_OOM;
+        goto finish;
+    }
+
+    offset = sizeof(struct header) + n_buckets * sizeof(uint32_t);
+    n = 0;
+
+    for (p = pending; p; p = p->next)
+        if (!p->removed) {
+            put_entry(b, n_buckets, &offset, p->hash, p->key, p->klen, p->data, p->dlen);
+            n++;
+        }
+
+    /* Everything that hasn't been updated or removed is taken over
+     * from the old generation */
+    if (h)
+        for (i = 0; i < h->n_buckets; i++) {
+            const struct entry *e;
+
+            if (!(e = map_entry(m, i)))
+                continue;
+
+            if (find_pending_unlocked(e + 1, e->klen, e->hash))
+                continue;
+
+            put_entry(b, n_buckets, &offset, e->hash, e + 1, e->klen, (const uint8_t*) (e + 1) + e->klen, e->dlen);
+            n++;
+        }
+
+    h = (struct header*) b;
+    memcpy(h->magic, MAGIC, sizeof(h->magic));
+    h->n_buckets = n_buckets;
+    h->n_entries = (uint32_t) n;
+    h->size = (uint32_t) offset;
+
+    if (!(tmp = ca_sprintf_malloc("%s.XXXXXX", path))) {
+        ret = CA_ERROR_OOM;
+        goto finish;
+    }
+
+    if ((fd = mkstemp(tmp)) < 0) {
+        ret = CA_ERROR_SYSTEM;
+        goto finish;
+    }
+
+    if ((ret = write_all(fd, b, offset)) < 0 ||
+        fchmod(fd, 0644) < 0 ||
+        close(fd) < 0) {
+
+        if (ret >= 0)
+            ret = CA_ERROR_SYSTEM;
+
+        fd = -1;
+        unlink(tmp);
+        goto finish;
+    }
+
+    fd = -1;
+
+    /* We need to flag the old file, not whatever is there after the
+     * rename */
+    old_fd = open(path, O_WRONLY|O_NOCTTY
+#ifdef O_CLOEXEC
+                  | O_CLOEXEC
+#endif
+        );
+
+    if (rename(tmp, path) < 0) {
+        ret = CA_ERROR_SYSTEM;
+        unlink(tmp);
+        goto finish;
+    }
+
+    if (old_fd >= 0) {
+        uint32_t one = 1;
+
+        if (pwrite(old_fd, &one, sizeof(one), offsetof(struct header, superseded)) != sizeof(one)) {
+            /* The new generation is in place already, so there's
+             * not much we could do about this. Other processes will
+             * keep using the old one until they are restarted. */
+        }
+    }
+
+    if ((ret = refresh_unlocked()) < 0)
+        goto finish;
+
+    ret = CA_SUCCESS;
+
+finish:
+
+    /* This is only a cache, so if we cannot write the updates out
+     * we rather forget them than let them pile up */
+    free_pending_unlocked();
+
+    if (fd >= 0)
+        close(fd);
+
+    if (old_fd >= 0)
+        close(old_fd);
+
+    if (lock_fd >= 0)
+        close(lock_fd);
+
+    ca_free(lock);
+    ca_free(tmp);
+    ca_free(b);
+
+    return ret;
+}
+
+static int add_pending(const void *key, size_t klen, const void *data, size_t dlen, ca_bool_t removed) {
+    struct pending *p;
+    unsigned hash;
+    time_t now;
+    int ret;
+
+    if ((ret = db_open()) < 0)
+        return ret;
+
+    hash = calc_hash(key, klen);
+
+    if (!(p = ca_malloc(CA_ALIGN(sizeof(struct pending)) + klen + dlen)))
+        return CA_ERROR_OOM;
+
+    p->key = (uint8_t*) p + CA_ALIGN(sizeof(struct pending));
+    p->klen = klen;
+    p->data = (uint8_t*) p->key + klen;
+    p->dlen = dlen;
+    p->hash = hash;
+    p->removed = removed;
+
+    memcpy(p->key, key, klen);
+
+    if (dlen > 0)
+        memcpy(p->data, data, dlen);
+
+    ca_assert_se(time(&now) != (time_t) -1);
+
+    ca_mutex_lock(mutex);
+
+    /* An older update of the same key is superseded by this one */
+    if (find_pending_unlocked(key, klen, hash)) {
+        struct pending *i, **j;
+
+        for (j = &pending; (i = *j); )
+            if (i->hash == hash && i->klen == klen && memcmp(i->key, key, klen) == 0) {
+                *j = i->next;
+                ca_free(i);
+                n_pending--;
+            } else
+                j = &i->next;
+    }
+
+    if (!pending)
+        first_pending = now;
+
+    p->next = pending;
+    pending = p;
+    n_pending++;
+
+    /* Rewriting the whole file is not exactly cheap, hence we wait
+     * until we have a couple of updates, or they have been waiting a
+     * while */
+    if (n_pending >= BATCH_MAX || now < first_pending || now >= first_pending + BATCH_INTERVAL)
+        ret = flush_unlocked();
+    else
+        ret = CA_SUCCESS;
+
+    ca_mutex_unlock(mutex);
+
+    return ret;
+}
+
+#ifdef CA_GCC_DESTRUCTOR
+
+static void db_close(void) CA_GCC_DESTRUCTOR;
+
+static void db_close(void) {
+
+    if (!mutex)
+        return;
+
+    /* Don't lose the updates that haven't been written out yet */
+    ca_mutex_lock(mutex);
+
+    if (pending && path)
+        flush_unlocked();
+
+    free_pending_unlocked();
+
+    ca_mutex_unlock(mutex);
+
+    /* Only here to make this valgrind clean */
+    if (current) {
+        map_free(current);
+        current = NULL;
+    }
+
+    while (retired) {
+        struct db_map *m = retired;
+
+        retired = m->next;
+        map_free(m);
+    }
+
+    ca_free(path);
+    path = NULL;
+
+    ca_mutex_free(mutex);
+    mutex = NULL;
+}
+
+#endif
+
+int ca_cache_db_lookup(const void *key, size_t klen, void **data, size_t *dlen) {
+    const struct entry *e;
+    struct db_map *m;
+    unsigned hash;
+    int ret;
+
+    ca_return_val_if_fail(key, CA_ERROR_INVALID);
+    ca_return_val_if_fail(klen > 0, CA_ERROR_INVALID);
+    ca_return_val_if_fail(data, CA_ERROR_INVALID);
+    ca_return_val_if_fail(dlen, CA_ERROR_INVALID);
+
+    if ((ret = db_open()) < 0)
+        return ret;
+
+    hash = calc_hash(key, klen);
+
+    /* Updates that haven't been written out yet take precedence */
+    if (n_pending > 0) {
+        struct pending *p;
+
+        ca_mutex_lock(mutex);
+
+        if ((p = find_pending_unlocked(key, klen, hash))) {
+
+            if (p->removed)
+                ret = CA_ERROR_NOTFOUND;
+            else if (!(*data = dup_data(p->data, p->dlen)))
+                ret = CA_ERROR_OOM;
+            else {
+                *dlen = p->dlen;
+                ret = CA_SUCCESS;
+            }
+
+            ca_mutex_unlock(mutex);
+            return ret;
+        }
+
+        ca_mutex_unlock(mutex);
+    }
+
+    __sync_add_and_fetch(&readers, 1);
+
+    if (map_superseded(m = current)) {
+        __sync_sub_and_fetch(&readers, 1);
+
+        ca_mutex_lock(mutex);
+        if (map_superseded(current))
+            refresh_unlocked();
+        ca_mutex_unlock(mutex);
+
+        __sync_add_and_fetch(&readers, 1);
+        m = current;
+    }
+
+    if (!(e = map_lookup(m, key, klen, hash)))
+        ret = CA_ERROR_NOTFOUND;
+    else if (!(*data = dup_data((const uint8_t*) (e + 1) + e->klen, e->dlen)))
+        ret = CA_ERROR_OOM;
+    else {
+        *dlen = e->dlen;
+        ret = CA_SUCCESS;
+    }
+
+    __sync_sub_and_fetch(&readers, 1);
+
+    return ret;
+}
+
+int ca_cache_db_store(const void *key, size_t klen, const void *data, size_t dlen) {
+
+    ca_return_val_if_fail(key, CA_ERROR_INVALID);
+    ca_return_val_if_fail(klen > 0, CA_ERROR_INVALID);
+    ca_return_val_if_fail(data || dlen == 0, CA_ERROR_INVALID);
+
+    return add_pending(key, klen, data, dlen, FALSE);
+}
+
+int ca_cache_db_remove(const void *key, size_t klen) {
+
+    ca_return_val_if_fail(key, CA_ERROR_INVALID);
+    ca_return_val_if_fail(klen > 0, CA_ERROR_INVALID);
+
+    return add_pending(key, klen, NULL, 0, TRUE);
+}
@@ -0,0 +1,209 @@
+/***
+  This file is part of libcanberra.
+
+  Copyright 2008 Lennart Poettering
+
+  libcanberra is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 2.1 of the
+  License, or (at your option) any later version.
+
+  libcanberra is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with libcanberra. If not, see
+  <http://www.gnu.org/licenses/>.
+***/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <fcntl.h>
+#include <pthread.h>
+
+#include <tdb.h>
+
+#include "malloc.h"
+#include "macro.h"
+#include "mutex.h"
+#include "canberra.h"
+#include "cache-db.h"
+
+/* This part is not portable due to pthread_once usage, should be abstracted
+ * when we port this to platforms that do not have POSIX threading */
+
+static ca_mutex *mutex = NULL;
+static struct tdb_context *database = NULL;
+
+static void allocate_mutex_once(void) {
+    mutex = ca_mutex_new();
+}
+
+static int allocate_mutex(void) {
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+    if (pthread_once(&once, allocate_mutex_once) != 0)
+        return CA_ERROR_OOM;
+
+    if (!mutex)
+        return CA_ERROR_OOM;
+
+    return 0;
+}
+
+static int db_open(void) {
+    int ret;
+    char *pn;
+
+    if ((ret = allocate_mutex()) < 0)
+        return ret;
+
+    ca_mutex_lock(mutex);
+
+    if (database) {
+        ret = CA_SUCCESS;
+        goto finish;
+    }
+
+    if ((ret = ca_cache_db_path(&pn, ".tdb")) < 0)
+        goto finish;
+
+    /* We pass TDB_NOMMAP here as long as rhbz 460851 is not fixed in
+     * tdb. */
+    database = tdb_open(pn, 0, TDB_NOMMAP, O_RDWR|O_CREAT|O_NOCTTY
+#ifdef O_CLOEXEC
+                        | O_CLOEXEC
+#endif
+                        , 0644);
+    ca_free(pn);
+
+    if (!database) {
+        ret = CA_ERROR_CORRUPT;
+        goto finish;
+    }
+
+    ret = CA_SUCCESS;
+
+finish:
+    ca_mutex_unlock(mutex);
+
+    return ret;
+}
+
+#ifdef CA_GCC_DESTRUCTOR
+
+static void db_close(void) CA_GCC_DESTRUCTOR;
+
+static void db_close(void) {
+    /* Only here to make this valgrind clean */
+    if (mutex) {
+        ca_mutex_free(mutex);
+        mutex = NULL;
+    }
+
+    if (database) {
+        tdb_close(database);
+        database = NULL;
+    }
+}
+
+#endif
+
+int ca_cache_db_lookup(const void *key, size_t klen, void **data, size_t *dlen) {
+    int ret;
+    TDB_DATA k, d;
+
+    ca_return_val_if_fail(key, CA_ERROR_INVALID);
+    ca_return_val_if_fail(klen > 0, CA_ERROR_INVALID);
+    ca_return_val_if_fail(data, CA_ERROR_INVALID);
+    ca_return_val_if_fail(dlen, CA_ERROR_INVALID);
+
+    if ((ret = db_open()) < 0)
+        return ret;
+
+    k.dptr = (void*) key;
+    k.dsize = klen;
+
+    ca_mutex_lock(mutex);
+
+    ca_assert(database);
+    d = tdb_fetch(database, k);
+    if (!d.dptr) {
+        ret = CA_ERROR_NOTFOUND;
+        goto finish;
+    }
+
+    *data = d.dptr;
+    *dlen = d.dsize;
+
+finish:
+    ca_mutex_unlock(mutex);
+
+    return ret;
+}
+
+int ca_cache_db_store(const void *key, size_t klen, const void *data, size_t dlen) {
+    int ret;
+    TDB_DATA k, d;
+
+    ca_return_val_if_fail(key, CA_ERROR_INVALID);
+    ca_return_val_if_fail(klen > 0, CA_ERROR_INVALID);
+    ca_return_val_if_fail(data || dlen == 0, CA_ERROR_INVALID);
+
+    if ((ret = db_open()) < 0)
+        return ret;
+
+    k.dptr = (void*) key;
+    k.dsize = klen;
+
+    d.dptr = (void*) data;
+    d.dsize = dlen;
+
+    ca_mutex_lock(mutex);
+
+    ca_assert(database);
+    if (tdb_store(database, k, d, TDB_REPLACE) < 0) {
+        ret = CA_ERROR_CORRUPT;
+        goto finish;
+    }
+
+    ret = CA_SUCCESS;
+
+finish:
+    ca_mutex_unlock(mutex);
+
+    return ret;
+}
+
+int ca_cache_db_remove(const void *key, size_t klen) {
+    int ret;
+    TDB_DATA k;
+
+    ca_return_val_if_fail(key, CA_ERROR_INVALID);
+    ca_return_val_if_fail(klen > 0, CA_ERROR_INVALID);
+
+    if ((ret = db_open()) < 0)
+        return ret;
+
+    k.dptr = (void*) key;
+    k.dsize = klen;
+
+    ca_mutex_lock(mutex);
+
+    ca_assert(database);
+    if (tdb_delete(database, k) < 0) {
+        ret = CA_ERROR_CORRUPT;
+        goto finish;
+    }
+
+    ret = CA_SUCCESS;
+
+finish:
+    ca_mutex_unlock(mutex);
+
+    return ret;
+}
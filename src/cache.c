@@ -27,42 +27,16 @@
 #include <signal.h>
 #include <fcntl.h>
 #include <unistd.h>
-#include <pthread.h>
 #include <errno.h>
 
-#include <tdb.h>
-
 #include "malloc.h"
 #include "macro.h"
-#include "mutex.h"
 #include "canberra.h"
 #include "sound-theme-spec.h"
 #include "cache.h"
+#include "cache-db.h"
 
-#define FILENAME "event-sound-cache.tdb"
-#define UPDATE_INTERVAL 10
-
-/* This part is not portable due to pthread_once usage, should be abstracted
- * when we port this to platforms that do not have POSIX threading */
-
-static ca_mutex *mutex = NULL;
-static struct tdb_context *database = NULL;
-
-static void allocate_mutex_once(void) {
-    mutex = ca_mutex_new();
-}
-
-static int allocate_mutex(void) {
-    static pthread_once_t once = PTHREAD_ONCE_INIT;
-
-    if (pthread_once(&once, allocate_mutex_once) != 0)
-        return CA_ERROR_OOM;
-
-    if (!mutex)
-        return CA_ERROR_OOM;
-
-    return 0;
-}
+#define FILENAME "event-sound-cache"
 
 static int get_cache_home(char **e) {
     const char *env, *subdir;
@@ -157,22 +131,19 @@ static int get_machine_id(char **id) {
     return CA_SUCCESS;
 }
 
-static int db_open(void) {
+int ca_cache_db_path(char **pn, const char *suffix) {
+    char *c, *id;
     int ret;
-    char *c, *id, *pn;
 
-    if ((ret = allocate_mutex()) < 0)
-        return ret;
-
-    ca_mutex_lock(mutex);
-
-    if (database) {
-        ret = CA_SUCCESS;
-        goto finish;
-    }
+    ca_return_val_if_fail(pn, CA_ERROR_INVALID);
+    ca_return_val_if_fail(suffix, CA_ERROR_INVALID);
 
     if ((ret = get_cache_home(&c)) < 0)
-        goto finish;
+        return ret;
+
+    /* Hmm, no home dir? Then we cannot cache anything */
+    if (!c)
+        return CA_ERROR_NOTFOUND;
 
     /* Try to create, just in case it doesn't exist yet. We don't do
      * this recursively however. */
@@ -180,7 +151,7 @@ static int db_open(void) {
 
     if ((ret = get_machine_id(&id)) < 0) {
         ca_free(c);
-        goto finish;
+        return ret;
     }
 
     /* This data is machine specific, hence we include some kind of
@@ -188,149 +159,14 @@ static int db_open(void) {
      * abouth endianess/packing issues, hence we include the compiler
      * target in the name, too. */
 
-    pn = ca_sprintf_malloc("%s/" FILENAME ".%s." CANONICAL_HOST, c, id);
+    *pn = ca_sprintf_malloc("%s/" FILENAME "%s.%s." CANONICAL_HOST, c, suffix, id);
     ca_free(c);
     ca_free(id);
 
-    if (!pn) {
-        ret = CA_ERROR_OOM;
-        goto finish;
-    }
-
-    /* We pass TDB_NOMMAP here as long as rhbz 460851 is not fixed in
-     * tdb. */
-    database = tdb_open(pn, 0, TDB_NOMMAP, O_RDWR|O_CREAT|O_NOCTTY
-#ifdef O_CLOEXEC
-                        | O_CLOEXEC
-#endif
-                        , 0644);
-    ca_free(pn);
-
-    if (!database) {
-        ret = CA_ERROR_CORRUPT;
-        goto finish;
-    }
-
-    ret = CA_SUCCESS;
-
-finish:
-    ca_mutex_unlock(mutex);
-
-    return ret;
-}
-
-#ifdef CA_GCC_DESTRUCTOR
-
-static void db_close(void) CA_GCC_DESTRUCTOR;
-
-static void db_close(void) {
-    /* Only here to make this valgrind clean */
-    if (mutex) {
-        ca_mutex_free(mutex);
-        mutex = NULL;
-    }
-
-    if (database) {
-        tdb_close(database);
-        database = NULL;
-    }
-}
-
-#endif
-
-static int db_lookup(const void *key, size_t klen, void **data, size_t *dlen) {
-    int ret;
-    TDB_DATA k, d;
-
-    ca_return_val_if_fail(key, CA_ERROR_INVALID);
-    ca_return_val_if_fail(klen > 0, CA_ERROR_INVALID);
-    ca_return_val_if_fail(data, CA_ERROR_INVALID);
-    ca_return_val_if_fail(dlen, CA_ERROR_INVALID);
-
-    if ((ret = db_open()) < 0)
-        return ret;
-
-    k.dptr = (void*) key;
-    k.dsize = klen;
-
-    ca_mutex_lock(mutex);
-
-    ca_assert(database);
-    d = tdb_fetch(database, k);
-    if (!d.dptr) {
-        ret = CA_ERROR_NOTFOUND;
-        goto finish;
-    }
-
-    *data = d.dptr;
-    *dlen = d.dsize;
-
-finish:
-    ca_mutex_unlock(mutex);
-
-    return ret;
-}
-
-static int db_store(const void *key, size_t klen, const void *data, size_t dlen) {
-    int ret;
-    TDB_DATA k, d;
-
-    ca_return_val_if_fail(key, CA_ERROR_INVALID);
-    ca_return_val_if_fail(klen > 0, CA_ERROR_INVALID);
-    ca_return_val_if_fail(data || dlen == 0, CA_ERROR_INVALID);
-
-    if ((ret = db_open()) < 0)
-        return ret;
-
-    k.dptr = (void*) key;
-    k.dsize = klen;
-
-    d.dptr = (void*) data;
-    d.dsize = dlen;
-
-    ca_mutex_lock(mutex);
-
-    ca_assert(database);
-    if (tdb_store(database, k, d, TDB_REPLACE) < 0) {
-        ret = CA_ERROR_CORRUPT;
-        goto finish;
-    }
-
-    ret = CA_SUCCESS;
-
-finish:
-    ca_mutex_unlock(mutex);
-
-    return ret;
-}
-
-static int db_remove(const void *key, size_t klen) {
-    int ret;
-    TDB_DATA k;
-
-    ca_return_val_if_fail(key, CA_ERROR_INVALID);
-    ca_return_val_if_fail(klen > 0, CA_ERROR_INVALID);
-
-    if ((ret = db_open()) < 0)
-        return ret;
-
-    k.dptr = (void*) key;
-    k.dsize = klen;
-
-    ca_mutex_lock(mutex);
-
-    ca_assert(database);
-    if (tdb_delete(database, k) < 0) {
-        ret = CA_ERROR_CORRUPT;
-        goto finish;
-    }
-
-    ret = CA_SUCCESS;
-
-finish:
-    ca_mutex_unlock(mutex);
+    if (!*pn)
+        return CA_ERROR_OOM;
 
-    return ret;
+    return CA_SUCCESS;
 }
 
 static char *build_key(
@@ -364,88 +200,6 @@ static char *build_key(
     return key;
 }
 
-static int get_last_change(time_t *t) {
-    int ret;
-    char *e, *k;
-    struct stat st;
-    static time_t last_check = 0, last_change = 0;
-    time_t now;
-    const char *g;
-
-    ca_return_val_if_fail(t, CA_ERROR_INVALID);
-
-    if ((ret = allocate_mutex()) < 0)
-        return ret;
-
-    ca_mutex_lock(mutex);
-
-    ca_assert_se(time(&now) != (time_t) -1);
-
-    if (now < last_check + UPDATE_INTERVAL) {
-        *t = last_change;
-        ret = CA_SUCCESS;
-        goto finish;
-    }
-
-    if ((ret = ca_get_data_home(&e)) < 0)
-        goto finish;
-
-    if (!(k = ca_new(char, strlen(e) + sizeof("/sounds")))) {
-        ca_free(e);
-        ret = CA_ERROR_OOM;
-        goto finish;
-    }
-
-    sprintf(k, "%s/sounds", e);
-    ca_free(e);
-
-    if (stat(k, &st) >= 0)
-        *t = st.st_mtime;
-    else
-        *t = 0;
-
-    ca_free(k);
-
-    g = ca_get_data_dirs();
-
-    for (;;) {
-        size_t j = strcspn(g, ":");
-
-        if (g[0] == '/' && j > 0) {
-
-            if (!(k = ca_new(char, j + sizeof("/sounds")))) {
-                ret = CA_ERROR_OOM;
-                goto finish;
-            }
-
-            memcpy(k, g, j);
-            strcpy(k+j, "/sounds");
-
-            if (stat(k, &st) >= 0)
-                if (st.st_mtime >= *t)
-                    *t = st.st_mtime;
-
-            ca_free(k);
-        }
-
-        if (g[j] == 0)
-            break;
-
-        g += j+1;
-    }
-
-    last_change = *t;
-    last_check = now;
-
-    ret = 0;
-
-finish:
-
-    ca_mutex_unlock(mutex);
-
-    return ret;
-}
-
 int ca_cache_lookup_sound(
         ca_sound_file **f,
         ca_sound_file_open_callback_t sfopen,
@@ -476,7 +230,7 @@ int ca_cache_lookup_sound(
     if (!(key = build_key(theme, name, locale, profile, &klen)))
         return CA_ERROR_OOM;
 
-    ret = db_lookup(key, klen, &data, &dlen);
+    ret = ca_cache_db_lookup(key, klen, &data, &dlen);
 
     if (ret < 0)
         goto finish;
@@ -494,7 +248,7 @@ int ca_cache_lookup_sound(
 
     memcpy(&timestamp, data, sizeof(timestamp));
 
-    if ((ret = get_last_change(&last_change)) < 0)
+    if ((ret = ca_get_last_change(&last_change)) < 0)
         goto finish;
 
     ca_assert_se(time(&now) != (time_t) -1);
@@ -527,7 +281,7 @@ int ca_cache_lookup_sound(
 finish:
 
     if (remove_entry)
-        db_remove(key, klen);
+        ca_cache_db_remove(key, klen);
 
     if (sound_path && ret < 0)
         ca_free(*sound_path);
@@ -572,7 +326,7 @@ int ca_cache_store_sound(
     if (fname)
         strcpy((char*) data + sizeof(uint32_t), fname);
 
-    ret = db_store(key, klen, data, dlen);
+    ret = ca_cache_db_store(key, klen, data, dlen);
 
     ca_free(key);
     ca_free(data);
@@ -0,0 +1,772 @@
+/***
+  This file is part of libcanberra.
+
+  Copyright 2008 Lennart Poettering
+
+  libcanberra is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 2.1 of the
+  License, or (at your option) any later version.
+
+  libcanberra is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with libcanberra. If not, see
+  <http://www.gnu.org/licenses/>.
+***/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <errno.h>
+#include <ftw.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "canberra.h"
+#include "proplist.h"
+#include "read-sound-file.h"
+#include "sound-theme-spec.h"
+#include "macro.h"
+#include "malloc.h"
+
+/* Measures the costs of playing event sounds, from building the
+ * property list to the sound finishing, for each driver passed on
+ * the command line. The sounds are played from a throw-away sound
+ * theme in a temporary $XDG_DATA_HOME, so that the results don't
+ * depend on the themes installed. Prints one line per measurement:
+ *
+ *     driver benchmark iterations unit mean max
+ *
+ * Benchmarks that don't depend on the driver use "-" as driver name,
+ * benchmarks a driver cannot run are left out. */
+
+#define DRIVERS_DEFAULT "null", "alsa", "oss", "pulse", "gstreamer", "multi,pulse,alsa"
+
+/* The length of the inheritance chain of the themes we create. The
+ * deep sound is only found in the last one. */
+#define THEME_DEPTH 8
+
+#define N_ITERATIONS_DEFAULT 100U
+#define N_CONCURRENT_MAX 16U
+#define N_THREADS_MAX 8U
+#define THREAD_ROUNDS 3U
+
+#define SHORT_MSEC 20U
+#define LONG_MSEC 2000U
+#define RATE 44100U
+
+struct result {
+    unsigned n;
+    double sum, max;
+};
+
+struct completion {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    unsigned pending;
+    int error;
+};
+
+/* Plays sounds on a context shared with the other players */
+struct player {
+    pthread_t thread;
+    ca_context *context;
+    ca_proplist *props;
+    struct completion comp;
+    uint32_t id;
+    int error;
+    volatile ca_bool_t done;
+};
+
+static unsigned n_iterations = N_ITERATIONS_DEFAULT;
+static char *tmp_dir = NULL;
+
+static double now_usec(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+
+    return (double) tv.tv_sec * 1000000.0 + (double) tv.tv_usec;
+}
+
+static void result_add(struct result *r, double v) {
+    r->n++;
+    r->sum += v;
+
+    if (v > r->max)
+        r->max = v;
+}
+
+static void result_print(const char *driver, const char *benchmark, const char *unit, const struct result *r) {
+
+    if (r->n <= 0)
+        return;
+
+    printf("%s %s %u %s %.1f %.1f\n", driver, benchmark, r->n, unit, r->sum / r->n, r->max);
+    fflush(stdout);
+}
+
+static int write_wav(const char *fn, unsigned msec) {
+    FILE *f;
+    uint32_t n, i;
+    int ret = -1;
+
+    /* A mono 16 bit sine wave, little endian, like everything in a
+     * RIFF file */
+    n = RATE * msec / 1000U;
+
+    if (!(f = fopen(fn, "w")))
+        return -1;
+
+#define LE16(x) fputc((x) & 0xFF, f), fputc(((x) >> 8) & 0xFF, f)
+#define LE32(x) LE16((x) & 0xFFFF), LE16(((x) >> 16) & 0xFFFF)
+
+    fputs("RIFF", f); LE32(36 + n * 2);
+    fputs("WAVEfmt ", f); LE32(16);
+    LE16(1); LE16(1); LE32(RATE); LE32(RATE * 2); LE16(2); LE16(16);
+    fputs("data", f); LE32(n * 2);
+
+    for (i = 0; i < n; i++) {
+        int16_t s = (int16_t) (sin(2.0 * M_PI * 440.0 * i / RATE) * 8000.0);
+        LE16((uint16_t) s);
+    }
+
+#undef LE32
+#undef LE16
+
+    if (!ferror(f))
+        ret = 0;
+
+    if (fclose(f) != 0)
+        ret = -1;
+
+    return ret;
+}
+
+static int write_theme(unsigned i) {
+    char *d, *fn;
+    FILE *f;
+    int ret = -1;
+
+    if (!(d = ca_sprintf_malloc("%s/data/sounds/bench-%u", tmp_dir, i)))
+        return -1;
+
+    if (!(fn = ca_sprintf_malloc("%s/index.theme", d)))
+        goto finish;
+
+    if (mkdir(d, 0755) < 0)
+        goto finish;
+
+    if (!(f = fopen(fn, "w")))
+        goto finish;
+
+    fprintf(f,
+            "[Sound Theme]\n"
+            "Name=Benchmark %u\n", i);
+
+    if (i + 1 < THEME_DEPTH)
+        fprintf(f, "Inherits=bench-%u\n", i + 1);
+
+    fprintf(f,
+            "Directories=stereo\n"
+            "\n"
+            "[stereo]\n"
+            "OutputProfile=stereo\n");
+
+    if (fclose(f) != 0)
+        goto finish;
+
+    ca_free(fn);
+    if (!(fn = ca_sprintf_malloc("%s/stereo", d)))
+        goto finish;
+
+    if (mkdir(fn, 0755) < 0)
+        goto finish;
+
+    ca_free(fn);
+    fn = NULL;
+
+    /* The first theme has the sound we play and the one we decode,
+     * the last one the sound at the end of the inheritance chain */
+    if (i == 0) {
+        if (!(fn = ca_sprintf_malloc("%s/stereo/bench-shallow.wav", d)) || write_wav(fn, SHORT_MSEC) < 0)
+            goto finish;
+
+        ca_free(fn);
+        if (!(fn = ca_sprintf_malloc("%s/stereo/bench-long.wav", d)) || write_wav(fn, LONG_MSEC) < 0)
+            goto finish;
+
+    } else if (i == THEME_DEPTH - 1)
+        if (!(fn = ca_sprintf_malloc("%s/stereo/bench-deep.wav", d)) || write_wav(fn, SHORT_MSEC) < 0)
+            goto finish;
+
+    ret = 0;
+
+finish:
+    ca_free(fn);
+    ca_free(d);
+
+    return ret;
+}
+
+static int setup(void) {
+    char t[] = "/tmp/canberra-bench-XXXXXX";
+    char *p;
+    unsigned i;
+
+    if (!mkdtemp(t))
+        return -1;
+
+    if (!(tmp_dir = ca_strdup(t)))
+        return -1;
+
+    /* Don't touch the lookup and sample caches of the user */
+    if (!(p = ca_sprintf_malloc("%s/cache", tmp_dir)))
+        return -1;
+    mkdir(p, 0755);
+    setenv("XDG_CACHE_HOME", p, 1);
+    ca_free(p);
+
+    if (!(p = ca_sprintf_malloc("%s/data", tmp_dir)))
+        return -1;
+    mkdir(p, 0755);
+    setenv("XDG_DATA_HOME", p, 1);
+    ca_free(p);
+
+    if (!(p = ca_sprintf_malloc("%s/data/sounds", tmp_dir)))
+        return -1;
+    mkdir(p, 0755);
+    ca_free(p);
+
+    for (i = 0; i < THEME_DEPTH; i++)
+        if (write_theme(i) < 0)
+            return -1;
+
+    return 0;
+}
+
+static int remove_cb(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+    remove(path);
+    return 0;
+}
+
+static void cleanup(void) {
+
+    if (!tmp_dir)
+        return;
+
+    nftw(tmp_dir, remove_cb, 16, FTW_DEPTH|FTW_PHYS);
+    ca_free(tmp_dir);
+    tmp_dir = NULL;
+}
+
+static ca_proplist* build_event(const char *event_id) {
+    ca_proplist *p;
+
+    ca_assert_se(ca_proplist_create(&p) == CA_SUCCESS);
+
+    ca_assert_se(ca_proplist_sets(p, CA_PROP_EVENT_ID, event_id) == CA_SUCCESS);
+    ca_assert_se(ca_proplist_sets(p, CA_PROP_EVENT_DESCRIPTION, "Benchmark") == CA_SUCCESS);
+    ca_assert_se(ca_proplist_sets(p, CA_PROP_CANBERRA_XDG_THEME_NAME, "bench-0") == CA_SUCCESS);
+    ca_assert_se(ca_proplist_sets(p, CA_PROP_CANBERRA_XDG_THEME_OUTPUT_PROFILE, "stereo") == CA_SUCCESS);
+    ca_assert_se(ca_proplist_sets(p, CA_PROP_WINDOW_NAME, "Untitled Document 1 - gedit") == CA_SUCCESS);
+    ca_assert_se(ca_proplist_sets(p, CA_PROP_WINDOW_ID, "gedit") == CA_SUCCESS);
+    ca_assert_se(ca_proplist_sets(p, CA_PROP_WINDOW_X11_DISPLAY, ":0.0") == CA_SUCCESS);
+    ca_assert_se(ca_proplist_setf(p, CA_PROP_WINDOW_X11_XID, "%lu", 0x2e00003UL) == CA_SUCCESS);
+    ca_assert_se(ca_proplist_setf(p, CA_PROP_EVENT_MOUSE_X, "%i", 300) == CA_SUCCESS);
+    ca_assert_se(ca_proplist_setf(p, CA_PROP_EVENT_MOUSE_Y, "%i", 200) == CA_SUCCESS);
+
+    return p;
+}
+
+static ca_proplist* build_context(void) {
+    ca_proplist *p;
+
+    ca_assert_se(ca_proplist_create(&p) == CA_SUCCESS);
+
+    ca_assert_se(ca_proplist_sets(p, CA_PROP_APPLICATION_NAME, "canberra-bench") == CA_SUCCESS);
+    ca_assert_se(ca_proplist_sets(p, CA_PROP_APPLICATION_ID, "org.freedesktop.libcanberra.Bench") == CA_SUCCESS);
+    ca_assert_se(ca_proplist_sets(p, CA_PROP_APPLICATION_LANGUAGE, "C") == CA_SUCCESS);
+    ca_assert_se(ca_proplist_setf(p, CA_PROP_APPLICATION_PROCESS_ID, "%lu", (unsigned long) getpid()) == CA_SUCCESS);
+
+    return p;
+}
+
+static void bench_proplist(void) {
+    struct result build = { 0, 0, 0 }, merge = { 0, 0, 0 };
+    ca_proplist *cp, *sp, *m;
+    unsigned i;
+
+    cp = build_context();
+
+    for (i = 0; i < n_iterations * 10; i++) {
+        double t;
+
+        t = now_usec();
+        sp = build_event("bench-shallow");
+        result_add(&build, now_usec() - t);
+
+        t = now_usec();
+        ca_assert_se(ca_proplist_merge(&m, cp, sp) == CA_SUCCESS);
+        result_add(&merge, now_usec() - t);
+
+        ca_proplist_destroy(m);
+        ca_proplist_destroy(sp);
+    }
+
+    ca_proplist_destroy(cp);
+
+    result_print("-", "proplist-build", "usec", &build);
+    result_print("-", "proplist-merge", "usec", &merge);
+}
+
+static void bench_lookup_one(const char *benchmark, const char *event_id, int expected) {
+    struct result r = { 0, 0, 0 };
+    ca_theme_data *theme = NULL;
+    ca_proplist *cp, *sp;
+    unsigned i;
+
+    cp = build_context();
+    sp = build_event(event_id);
+
+    /* The first lookup reads the theme, the others are served from
+     * the caches. We report both. */
+    for (i = 0; i <= n_iterations; i++) {
+        ca_sound_file *f = NULL;
+        double t;
+        int ret;
+
+        t = now_usec();
+        ret = ca_lookup_sound(&f, NULL, &theme, cp, sp);
+        t = now_usec() - t;
+
+        if (f)
+            ca_sound_file_close(f);
+
+        if (ret != expected) {
+            fprintf(stderr, "%s: lookup failed: %s\n", benchmark, ca_strerror(ret));
+            break;
+        }
+
+        if (i == 0) {
+            struct result cold = { 0, 0, 0 };
+            char *b;
+
+            result_add(&cold, t);
+
+            if ((b = ca_sprintf_malloc("%s-cold", benchmark))) {
+                result_print("-", b, "usec", &cold);
+                ca_free(b);
+            }
+        } else
+            result_add(&r, t);
+    }
+
+    if (theme)
+        ca_theme_data_unref(theme);
+
+    ca_proplist_destroy(cp);
+    ca_proplist_destroy(sp);
+
+    result_print("-", benchmark, "usec", &r);
+}
+
+static void bench_lookup(void) {
+    bench_lookup_one("lookup-hit", "bench-shallow", CA_SUCCESS);
+    bench_lookup_one("lookup-hit-deep", "bench-deep", CA_SUCCESS);
+    bench_lookup_one("lookup-miss", "bench-does-not-exist", CA_ERROR_NOTFOUND);
+}
+
+static void bench_decode_one(const char *benchmark, const char *fn) {
+    struct result r = { 0, 0, 0 };
+    void *buf;
+    unsigned i;
+
+    if (!(buf = ca_malloc(16*1024)))
+        return;
+
+    for (i = 0; i < (n_iterations + 9) / 10; i++) {
+        ca_sound_file *f;
+        size_t total = 0;
+        double t;
+
+        t = now_usec();
+
+        if (ca_sound_file_open(&f, fn) < 0) {
+            fprintf(stderr, "%s: failed to open %s\n", benchmark, fn);
+            break;
+        }
+
+        for (;;) {
+            size_t n = 16*1024;
+
+            if (ca_sound_file_read_arbitrary(f, buf, &n) < 0 || n <= 0)
+                break;
+
+            total += n;
+        }
+
+        ca_sound_file_close(f);
+
+        t = now_usec() - t;
+
+        /* Bytes per usec are MB/s */
+        if (t > 0)
+            result_add(&r, (double) total / t);
+    }
+
+    ca_free(buf);
+
+    result_print("-", benchmark, "MB/s", &r);
+}
+
+static void bench_decode(const char *vorbis) {
+    char *fn;
+
+    if ((fn = ca_sprintf_malloc("%s/data/sounds/bench-0/stereo/bench-long.wav", tmp_dir))) {
+        bench_decode_one("decode-wav", fn);
+        ca_free(fn);
+    }
+
+    /* We have no way to create Vorbis files ourselves */
+    if (vorbis)
+        bench_decode_one("decode-vorbis", vorbis);
+}
+
+static void completion_init(struct completion *c) {
+    pthread_mutex_init(&c->mutex, NULL);
+    pthread_cond_init(&c->cond, NULL);
+    c->pending = 0;
+    c->error = CA_SUCCESS;
+}
+
+static void completion_done(struct completion *c) {
+    pthread_cond_destroy(&c->cond);
+    pthread_mutex_destroy(&c->mutex);
+}
+
+static void finish_cb(ca_context *c, uint32_t id, int error_code, void *userdata) {
+    struct completion *comp = userdata;
+
+    pthread_mutex_lock(&comp->mutex);
+
+    if (error_code < 0 && comp->error == CA_SUCCESS)
+        comp->error = error_code;
+
+    ca_assert(comp->pending > 0);
+    comp->pending--;
+    pthread_cond_signal(&comp->cond);
+
+    pthread_mutex_unlock(&comp->mutex);
+}
+
+static int completion_wait(struct completion *c) {
+    int ret;
+
+    pthread_mutex_lock(&c->mutex);
+
+    while (c->pending > 0)
+        pthread_cond_wait(&c->cond, &c->mutex);
+
+    ret = c->error;
+    c->error = CA_SUCCESS;
+
+    pthread_mutex_unlock(&c->mutex);
+
+    return ret;
+}
+
+static int play(ca_context *c, ca_proplist *p, struct completion *comp, uint32_t id) {
+    int ret;
+
+    pthread_mutex_lock(&comp->mutex);
+    comp->pending++;
+    pthread_mutex_unlock(&comp->mutex);
+
+    if ((ret = ca_context_play_full(c, id, p, finish_cb, comp)) < 0) {
+        pthread_mutex_lock(&comp->mutex);
+        comp->pending--;
+        pthread_mutex_unlock(&comp->mutex);
+    }
+
+    return ret;
+}
+
+static ca_bool_t get_stage(ca_context *c, const char *stage, double *count, double *usec) {
+    ca_proplist *s;
+    const char *v;
+    char k[64];
+    ca_bool_t ok = FALSE;
+
+    if (ca_context_get_stats(c, &s) < 0)
+        return FALSE;
+
+    ca_proplist_lock(s);
+
+    snprintf(k, sizeof(k), "canberra.stats.%s.count", stage);
+    if ((v = ca_proplist_gets_unlocked(s, k))) {
+        *count = strtod(v, NULL);
+
+        snprintf(k, sizeof(k), "canberra.stats.%s.usec", stage);
+        if ((v = ca_proplist_gets_unlocked(s, k))) {
+            *usec = strtod(v, NULL);
+            ok = TRUE;
+        }
+    }
+
+    ca_proplist_unlock(s);
+    ca_proplist_destroy(s);
+
+    return ok;
+}
+
+static void* player_func(void *userdata) {
+    struct player *pl = userdata;
+    unsigned i;
+
+    for (i = 0; i < n_iterations; i++)
+        if ((pl->error = play(pl->context, pl->props, &pl->comp, pl->id++)) < 0 ||
+            (pl->error = completion_wait(&pl->comp)) < 0)
+            break;
+
+    __sync_synchronize();
+    pl->done = TRUE;
+
+    return NULL;
+}
+
+static ca_bool_t players_done(struct player *players, unsigned n) {
+    unsigned j;
+
+    for (j = 0; j < n; j++)
+        if (!players[j].done)
+            return FALSE;
+
+    return TRUE;
+}
+
+/* How many sounds per second all threads together get played when
+ * they share one context, optionally while the context properties
+ * keep changing under their feet. Ideally this grows with the number
+ * of threads. */
+static void bench_threads(const char *driver, ca_context *c, ca_bool_t change) {
+    unsigned k;
+
+    for (k = 1; k <= N_THREADS_MAX; k *= 2) {
+        struct player players[N_THREADS_MAX];
+        struct result r = { 0, 0, 0 };
+        unsigned round, n_changes = 0;
+        int ret = CA_SUCCESS;
+        char b[32];
+
+        for (round = 0; round < THREAD_ROUNDS && ret == CA_SUCCESS; round++) {
+            unsigned j, n;
+            double t;
+
+            t = now_usec();
+
+            for (n = 0; n < k; n++) {
+                struct player *pl = players + n;
+
+                /* Each with properties of its own, like different
+                 * parts of an application would */
+                pl->context = c;
+                pl->props = build_event("bench-shallow");
+                pl->id = (n + 1) * 1000000U;
+                pl->error = CA_SUCCESS;
+                pl->done = FALSE;
+                completion_init(&pl->comp);
+
+                if (pthread_create(&pl->thread, NULL, player_func, pl) != 0) {
+                    completion_done(&pl->comp);
+                    ca_proplist_destroy(pl->props);
+                    ret = CA_ERROR_OOM;
+                    break;
+                }
+            }
+
+            if (change)
+                while (!players_done(players, n))
+                    ca_context_change_props(c, CA_PROP_APPLICATION_VERSION, (n_changes++ & 1) ? "1" : "2", NULL);
+
+            for (j = 0; j < n; j++) {
+                pthread_join(players[j].thread, NULL);
+                completion_done(&players[j].comp);
+                ca_proplist_destroy(players[j].props);
+
+                if (players[j].error < 0 && ret == CA_SUCCESS)
+                    ret = players[j].error;
+            }
+
+            t = now_usec() - t;
+
+            if (ret == CA_SUCCESS && t > 0)
+                result_add(&r, (double) (k * n_iterations) * 1000000.0 / t);
+        }
+
+        if (ret < 0) {
+            fprintf(stderr, "%s: threads skipped: %s\n", driver, ca_strerror(ret));
+            return;
+        }
+
+        snprintf(b, sizeof(b), change ? "threads-%u-changing" : "threads-%u", k);
+        result_print(driver, b, "plays/s", &r);
+    }
+}
+
+static void bench_driver(const char *driver) {
+    struct result open = { 0, 0, 0 }, call = { 0, 0, 0 }, first = { 0, 0, 0 }, done = { 0, 0, 0 };
+    struct completion comp;
+    ca_context *c = NULL;
+    ca_proplist *cp, *sp;
+    unsigned i, k;
+    uint32_t id = 1;
+    double t;
+    int ret;
+
+    completion_init(&comp);
+
+    cp = build_context();
+    sp = build_event("bench-shallow");
+
+    ca_assert_se(ca_context_create(&c) == CA_SUCCESS);
+
+    if ((ret = ca_context_set_driver(c, driver)) < 0 ||
+        (ret = ca_context_change_props_full(c, cp)) < 0)
+        goto fail;
+
+    t = now_usec();
+    if ((ret = ca_context_open(c)) < 0)
+        goto fail;
+    result_add(&open, now_usec() - t);
+
+    /* Warm up the caches and make sure this works at all */
+    if ((ret = play(c, sp, &comp, id++)) < 0 ||
+        (ret = completion_wait(&comp)) < 0)
+        goto fail;
+
+    for (i = 0; i < n_iterations; i++) {
+        double count0 = 0, usec0 = 0, count1, usec1;
+        ca_bool_t stats;
+
+        stats = get_stage(c, "first-write", &count0, &usec0);
+
+        t = now_usec();
+
+        if ((ret = play(c, sp, &comp, id++)) < 0)
+            goto fail;
+
+        result_add(&call, now_usec() - t);
+
+        if ((ret = completion_wait(&comp)) < 0)
+            goto fail;
+
+        result_add(&done, now_usec() - t);
+
+        /* Only drivers that write the data themselves know when
+         * they did that */
+        if (stats &&
+            get_stage(c, "first-write", &count1, &usec1) &&
+            count1 > count0)
+            result_add(&first, (usec1 - usec0) / (count1 - count0));
+    }
+
+    result_print(driver, "open", "usec", &open);
+    result_print(driver, "play-call", "usec", &call);
+    result_print(driver, "first-sample", "usec", &first);
+    result_print(driver, "play-finish", "usec", &done);
+
+    /* How the time until all sounds are done grows when more of them
+     * are played at the same time */
+    for (k = 1; k <= N_CONCURRENT_MAX; k *= 2) {
+        struct result r = { 0, 0, 0 };
+        char b[32];
+
+        for (i = 0; i < (n_iterations + k - 1) / k; i++) {
+            unsigned j;
+
+            t = now_usec();
+
+            for (j = 0; j < k; j++)
+                if ((ret = play(c, sp, &comp, id++)) < 0)
+                    break;
+
+            if (completion_wait(&comp) < 0 || ret < 0)
+                break;
+
+            result_add(&r, now_usec() - t);
+        }
+
+        snprintf(b, sizeof(b), "concurrent-%u", k);
+        result_print(driver, b, "usec", &r);
+    }
+
+    bench_threads(driver, c, FALSE);
+    bench_threads(driver, c, TRUE);
+
+    goto finish;
+
+fail:
+    completion_wait(&comp);
+    fprintf(stderr, "%s: skipped: %s\n", driver, ca_strerror(ret));
+
+finish:
+    ca_context_destroy(c);
+
+    ca_proplist_destroy(cp);
+    ca_proplist_destroy(sp);
+
+    completion_done(&comp);
+}
+
+int main(int argc, char *argv[]) {
+    static const char * const drivers_default[] = { DRIVERS_DEFAULT, NULL };
+    const char * const *drivers = drivers_default;
+    const char *vorbis = NULL;
+    int i;
+
+    for (i = 1; i < argc; i++) {
+
+        if (ca_streq(argv[i], "--vorbis") && i + 1 < argc)
+            vorbis = argv[++i];
+        else if (ca_streq(argv[i], "--iterations") && i + 1 < argc)
+            n_iterations = (unsigned) CA_MAX(atoi(argv[++i]), 1);
+        else if (ca_streq(argv[i], "--help")) {
+            printf("%s [--iterations N] [--vorbis FILE] [DRIVER ...]\n", argv[0]);
+            return 0;
+        } else {
+            drivers = (const char * const *) argv + i;
+            break;
+        }
+    }
+
+    if (setup() < 0) {
+        fprintf(stderr, "Failed to set up the benchmark theme: %s\n", strerror(errno));
+        cleanup();
+        return 1;
+    }
+
+    printf("# driver benchmark iterations unit mean max\n");
+
+    bench_proplist();
+    bench_lookup();
+    bench_decode(vorbis);
+
+    for (; *drivers; drivers++)
+        bench_driver(*drivers);
+
+    cleanup();
+
+    return 0;
+}
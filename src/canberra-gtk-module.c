@@ -25,6 +25,7 @@
 #include <gtk/gtk.h>
 #include <gdk/gdkx.h>
 #include <X11/Xatom.h>
+#include <stdlib.h>
 
 #include "canberra-gtk.h"
 
@@ -83,6 +84,14 @@ static gboolean disabled = FALSE;
 
 static GQueue sound_event_queue = G_QUEUE_INIT;
 
+/* Events of the kind that come in floods when keys are held or the
+ * user scrolls quickly are played at most once per this interval, in
+ * usec. Can be overridden in msec with $CANBERRA_GTK_EVENT_INTERVAL,
+ * 0 disables it. */
+#define DEFAULT_EVENT_INTERVAL (100*G_USEC_PER_SEC/1000)
+
+static gint64 event_interval = DEFAULT_EVENT_INTERVAL;
+
 static guint idle_id = 0;
 
 static guint
@@ -103,6 +112,18 @@ static GQuark
     disable_sound_quark,
     was_hidden_quark;
 
+/* The signals that are coalesced and rate limited. Since each of them
+ * maps to exactly one event id we can do that before we do any work
+ * for them. */
+static struct {
+    guint *signal_id;
+    gint64 last_dispatched;
+} rate_limited[] = {
+    { &signal_id_tree_view_cursor_changed, 0 },     /* item-selected */
+    { &signal_id_icon_view_selection_changed, 0 },  /* item-selected */
+    { &signal_id_notebook_switch_page, 0 }          /* notebook-tab-changed */
+};
+
 /* Make sure GCC doesn't warn us about a missing prototype for this
  * exported function */
 void gtk_module_init(gint *argc, gchar ***argv[]);
@@ -292,6 +313,61 @@ static SoundEventData* filter_sound_event(SoundEventData *d) {
     return d;
 }
 
+static gint64 now_usec(void) {
+    GTimeVal tv;
+
+    g_get_current_time(&tv);
+
+    return (gint64) tv.tv_sec * G_USEC_PER_SEC + tv.tv_usec;
+}
+
+static int find_rate_limited(guint signal_id) {
+    unsigned i;
+
+    for (i = 0; i < G_N_ELEMENTS(rate_limited); i++)
+        if (*rate_limited[i].signal_id == signal_id)
+            return (int) i;
+
+    return -1;
+}
+
+static gboolean is_duplicate_event(guint signal_id, GObject *object) {
+    GList *i;
+    int k;
+
+    if ((k = find_rate_limited(signal_id)) < 0)
+        return FALSE;
+
+    /* The same signal on the same object is still waiting to be
+     * dispatched, filter_sound_event() would drop this one anyway */
+    for (i = sound_event_queue.head; i; i = i->next) {
+        SoundEventData *j = i->data;
+
+        if (j->signal_id == signal_id && j->object == object)
+            return TRUE;
+    }
+
+    if (event_interval > 0 && rate_limited[k].last_dispatched > 0) {
+        gint64 now = now_usec();
+
+        /* The clock might have been set back */
+        if (now >= rate_limited[k].last_dispatched &&
+            now < rate_limited[k].last_dispatched + event_interval)
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+static void note_dispatched(guint signal_id) {
+    int k;
+
+    if ((k = find_rate_limited(signal_id)) < 0)
+        return;
+
+    rate_limited[k].last_dispatched = now_usec();
+}
+
 static gboolean is_hidden(GdkDisplay *d, GdkWindow *w) {
     Atom type_return;
     gint format_return;
@@ -640,6 +716,7 @@ static gboolean idle_cb(void *userdata) {
 
 /*         g_message("Dispatching signal %s on %s", g_signal_name(d->signal_id), g_type_name(G_OBJECT_TYPE(d->object))); */
 
+        note_dispatched(d->signal_id);
         dispatch_sound_event(d);
         free_sound_event(d);
     }
@@ -673,6 +750,9 @@ static gboolean emission_hook_cb(GSignalInvocationHint *hint, guint n_param_valu
         !GTK_WIDGET_DRAWABLE(object))
         return TRUE;
 
+    if (is_duplicate_event(hint->signal_id, object))
+        return TRUE;
+
 /*     g_message("signal %s on %s", g_signal_name(hint->signal_id), g_type_name(G_OBJECT_TYPE(object))); */
 
     d = g_slice_new0(SoundEventData);
@@ -743,11 +823,22 @@ static void connect_settings(void) {
 }
 
 G_MODULE_EXPORT void gtk_module_init(gint *argc, gchar ***argv[]) {
+    const char *e;
 
     /* This is the same quark libgnomeui uses! */
     disable_sound_quark = g_quark_from_string("gnome_disable_sound_events");
     was_hidden_quark = g_quark_from_string("canberra_was_hidden");
 
+    if ((e = g_getenv("CANBERRA_GTK_EVENT_INTERVAL"))) {
+        char *end = NULL;
+        long msec;
+
+        msec = strtol(e, &end, 10);
+
+        if (end && end != e && *end == 0 && msec >= 0)
+            event_interval = (gint64) msec * G_USEC_PER_SEC / 1000;
+    }
+
     /* Hook up the gtk setting */
     connect_settings();
 
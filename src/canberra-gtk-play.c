@@ -22,110 +22,635 @@
 #include <config.h>
 #endif
 
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <string.h>
 #include <locale.h>
+#include <unistd.h>
 
 #include <gtk/gtk.h>
 #include <canberra-gtk.h>
 
+/* Besides playing a single sound, this can play many of them over
+ * the same context, so that scripts don't pay for setting up GTK+,
+ * connecting to the sound system and loading the sound theme again
+ * and again:
+ *
+ *   --batch reads play requests from stdin, one per line, and quits
+ *   once all of them finished playing.
+ *
+ *   --daemon listens on a socket for clients to send play requests
+ *   to, and runs until it is killed.
+ *
+ *   --send hands the play request on its command line to the daemon,
+ *   and plays it itself only if there is no daemon.
+ *
+ * A request uses the same options as the command line, quoted like
+ * in the shell, e.g. "-i bell -V -6.0 --delay 500". Requests are
+ * fire and forget, failures are only reported on the stderr of
+ * whoever plays them. */
+
+#define SOCKET_NAME "canberra-gtk-play"
+
+/* Requests are short, anything longer than this is garbage */
+#define LINE_LENGTH_MAX 4096
+
+/* Where we collect a request until its newline came in */
+struct input {
+    GString *buffer;
+    gboolean is_stdin;
+};
+
+/* The options of a single play request */
+struct options {
+    gchar *event_id, *filename, *event_description, *cache_control, *volume;
+    int n_loops;
+    int delay;
+    GPtrArray *properties;
+};
+
+struct request {
+    ca_proplist *proplist;
+    uint32_t id;
+    int n_loops;
+    int delay;
+    int error;
+};
+
 static int ret = 0;
-static ca_proplist *proplist = NULL;
-static int n_loops = 1;
+static uint32_t next_id = 1;
+
+/* We quit once nothing is playing anymore and nothing more can come
+ * in */
+static unsigned n_active = 0;
+static gboolean reading = FALSE, listening = FALSE;
 
 static void callback(ca_context *c, uint32_t id, int error, void *userdata);
 
-static gboolean idle_quit(gpointer userdata) {
-    gtk_main_quit();
-    return FALSE;
+static GQuark error_domain(void) {
+    return g_quark_from_static_string("canberra-error-quark");
 }
 
-static gboolean idle_play(gpointer userdata) {
-    int r;
+static void options_init(struct options *o) {
+    memset(o, 0, sizeof(*o));
+    o->n_loops = 1;
+    o->properties = g_ptr_array_new();
+}
 
-    g_assert(n_loops > 1);
+static void options_clear(struct options *o) {
+    guint i;
 
-    n_loops--;
+    g_free(o->event_id);
+    g_free(o->filename);
+    g_free(o->event_description);
+    g_free(o->cache_control);
+    g_free(o->volume);
 
-    r = ca_context_play_full(ca_gtk_context_get(), 1, proplist, callback, NULL);
+    for (i = 0; i < o->properties->len; i++)
+        g_free(g_ptr_array_index(o->properties, i));
 
-    if (r < 0) {
-        g_printerr("Failed to play sound: %s\n", ca_strerror(r));
-        ret = 1;
+    g_ptr_array_free(o->properties, TRUE);
+}
+
+static gboolean property_callback(
+        const gchar *option_name,
+        const gchar *value,
+        gpointer data,
+        GError **error) {
+
+    struct options *o = data;
+
+    if (!strchr(value, '=')) {
+        g_set_error(error, error_domain(), 0, "Property lacks '='.");
+        return FALSE;
+    }
+
+    g_ptr_array_add(o->properties, g_strdup(value));
+    return TRUE;
+}
+
+/* The options that make up a play request, both on the command line
+ * and in batch or daemon mode */
+static GOptionGroup* request_group(struct options *o) {
+    GOptionGroup *g;
+
+    const GOptionEntry options[] = {
+        { "id",            'i', 0, G_OPTION_ARG_STRING,   &o->event_id,              "Event sound identifier",  "STRING" },
+        { "file",          'f', 0, G_OPTION_ARG_STRING,   &o->filename,              "Play file",  "PATH" },
+        { "description",   'd', 0, G_OPTION_ARG_STRING,   &o->event_description,     "Event sound description", "STRING" },
+        { "cache-control", 'c', 0, G_OPTION_ARG_STRING,   &o->cache_control,         "Cache control (permanent, volatile, never)", "STRING" },
+        { "loop",          'l', 0, G_OPTION_ARG_INT,      &o->n_loops,               "Loop how many times (detault: 1)", "INTEGER" },
+        { "volume",        'V', 0, G_OPTION_ARG_STRING,   &o->volume,                "A floating point dB value for the sample volume (ex: 0.0)", "STRING" },
+        { "delay",         0,   0, G_OPTION_ARG_INT,      &o->delay,                 "Wait this long before playing (default: 0)", "MSEC" },
+        { "property",      0,   0, G_OPTION_ARG_CALLBACK, (void*) property_callback, "An arbitrary property", "STRING" },
+        { NULL, 0, 0, 0, NULL, NULL, NULL }
+    };
+
+    /* The entries are copied, the callback gets o as its data */
+    g = g_option_group_new("request", "Play request options", "Show play request options", o, NULL);
+    g_option_group_add_entries(g, options);
+
+    return g;
+}
+
+static void request_free(struct request *r) {
+
+    if (r->proplist)
+        ca_proplist_destroy(r->proplist);
+
+    g_free(r);
+}
+
+static struct request* request_new(const struct options *o, GError **error) {
+    struct request *r;
+    guint i;
+
+    if (!o->event_id && !o->filename) {
+        g_set_error(error, error_domain(), 0, "No event id or file specified.");
+        return NULL;
+    }
+
+    r = g_new0(struct request, 1);
+    r->id = next_id++;
+    r->n_loops = MAX(o->n_loops, 1);
+    r->delay = MAX(o->delay, 0);
+
+    if (ca_proplist_create(&r->proplist) < 0) {
+        g_set_error(error, error_domain(), 0, "Out of memory.");
+        g_free(r);
+        return NULL;
+    }
+
+    if (o->event_id)
+        ca_proplist_sets(r->proplist, CA_PROP_EVENT_ID, o->event_id);
+
+    if (o->filename)
+        ca_proplist_sets(r->proplist, CA_PROP_MEDIA_FILENAME, o->filename);
+
+    if (o->cache_control)
+        ca_proplist_sets(r->proplist, CA_PROP_CANBERRA_CACHE_CONTROL, o->cache_control);
+
+    if (o->event_description)
+        ca_proplist_sets(r->proplist, CA_PROP_EVENT_DESCRIPTION, o->event_description);
+
+    if (o->volume)
+        ca_proplist_sets(r->proplist, CA_PROP_CANBERRA_VOLUME, o->volume);
+
+    for (i = 0; i < o->properties->len; i++) {
+        const char *p = g_ptr_array_index(o->properties, i);
+        const char *equal = strchr(p, '=');
+        char *t;
+        int k;
+
+        t = g_strndup(p, equal - p);
+        k = ca_proplist_sets(r->proplist, t, equal + 1);
+        g_free(t);
+
+        if (k < 0) {
+            g_set_error(error, error_domain(), 0, "Invalid property.");
+            request_free(r);
+            return NULL;
+        }
+    }
+
+    return r;
+}
+
+/* Parses one line of batch or daemon input */
+static struct request* request_parse(const char *line, GError **error) {
+    GOptionContext *oc;
+    struct options o;
+    struct request *r = NULL;
+    gchar **argv = NULL, **args;
+    gint argc, n;
+
+    if (!g_shell_parse_argv(line, &argc, &argv, error))
+        return NULL;
+
+    /* The option parser wants a program name first */
+    args = g_new0(gchar*, argc + 2);
+    args[0] = (gchar*) "canberra-gtk-play";
+    memcpy(args + 1, argv, sizeof(gchar*) * argc);
+    n = argc + 1;
+
+    options_init(&o);
+
+    oc = g_option_context_new(NULL);
+    g_option_context_set_main_group(oc, request_group(&o));
+    g_option_context_set_help_enabled(oc, FALSE);
+
+    if (g_option_context_parse(oc, &n, &args, error)) {
+
+        if (n > 1)
+            g_set_error(error, error_domain(), 0, "Unexpected argument '%s'.", args[1]);
+        else
+            r = request_new(&o, error);
+    }
+
+    g_option_context_free(oc);
+    options_clear(&o);
+
+    /* The parser only shuffled the pointers around */
+    g_free(args);
+    g_strfreev(argv);
+
+    return r;
+}
+
+static void maybe_quit(void) {
+
+    if (n_active <= 0 && !reading && !listening)
         gtk_main_quit();
+}
+
+static void request_done(struct request *r, gboolean failed) {
+
+    if (failed)
+        ret = 1;
+
+    request_free(r);
+
+    g_assert(n_active > 0);
+    n_active--;
+
+    maybe_quit();
+}
+
+static int request_play(struct request *r) {
+    return ca_context_play_full(ca_gtk_context_get(), r->id, r->proplist, callback, r);
+}
+
+static gboolean timeout_play(gpointer userdata) {
+    struct request *r = userdata;
+    int k;
+
+    if ((k = request_play(r)) < 0) {
+        g_printerr("Failed to play sound: %s\n", ca_strerror(k));
+        request_done(r, TRUE);
     }
 
     return FALSE;
 }
 
+static gboolean idle_finished(gpointer userdata) {
+    struct request *r = userdata;
+
+    if (r->error < 0) {
+        g_printerr("Failed to play sound (callback): %s\n", ca_strerror(r->error));
+        request_done(r, TRUE);
+
+    } else if (--r->n_loops > 0)
+        timeout_play(r);
+    else
+        request_done(r, FALSE);
+
+    return FALSE;
+}
+
 static void callback(ca_context *c, uint32_t id, int error, void *userdata) {
+    struct request *r = userdata;
 
-    if (error < 0) {
-        g_printerr("Failed to play sound (callback): %s\n", ca_strerror(error));
-        ret = 1;
+    /* So, why don't we call ca_context_play_full() or gtk_main_quit()
+     * here directly? -- Because the context this callback is called
+     * from is explicitly documented as undefined and no libcanberra
+     * function may be called from it. Also, this callback might get
+     * called before the main loop actually started running. Hence
+     * everything else happens from the main loop. */
 
-    } else if (n_loops > 1) {
-        /* So, why don't we call ca_context_play_full() here directly?
-        -- Because the context this callback is called from is
-        explicitly documented as undefined and no libcanberra function
-        may be called from it. */
+    r->error = error;
+    g_idle_add(idle_finished, r);
+}
+
+static void request_start(struct request *r) {
+    n_active++;
+
+    if (r->delay > 0)
+        g_timeout_add((guint) r->delay, timeout_play, r);
+    else
+        timeout_play(r);
+}
+
+static void handle_line(gchar *line) {
+    struct request *r;
+    GError *error = NULL;
+
+    g_strstrip(line);
+
+    if (!*line || *line == '#')
+        return;
+
+    if (!(r = request_parse(line, &error))) {
+        g_printerr("Invalid request '%s': %s\n", line, error ? error->message : "unknown error");
+
+        if (error)
+            g_error_free(error);
+
+        /* A daemon shouldn't fail because of a broken client */
+        if (!listening)
+            ret = 1;
 
-        g_idle_add(idle_play, NULL);
         return;
     }
 
-    /* So, why don't we call gtk_main_quit() here directly? -- Because
-     * otherwise we might end up with a small race condition: this
-     * callback might get called before the main loop actually started
-     * running */
-    g_idle_add(idle_quit, NULL);
+    request_start(r);
 }
 
-static GQuark error_domain(void) {
-    return g_quark_from_static_string("canberra-error-quark");
+static gboolean input_cb(GIOChannel *channel, GIOCondition condition, gpointer userdata) {
+    struct input *i = userdata;
+    gchar data[1024], *nl;
+    ssize_t l;
+
+    /* Only a single read each time, which doesn't block since we were
+     * told there is something to read. Everything that keeps going
+     * meanwhile, like delayed and looped sounds, runs from the same
+     * main loop. */
+    if ((l = read(g_io_channel_unix_get_fd(channel), data, sizeof(data))) < 0 &&
+        (errno == EINTR || errno == EAGAIN))
+        return TRUE;
+
+    if (l > 0) {
+        g_string_append_len(i->buffer, data, l);
+
+        while ((nl = memchr(i->buffer->str, '\n', i->buffer->len))) {
+            gssize n = nl - i->buffer->str + 1;
+
+            *nl = 0;
+            handle_line(i->buffer->str);
+            g_string_erase(i->buffer, 0, n);
+        }
+
+        if (i->buffer->len <= LINE_LENGTH_MAX)
+            return TRUE;
+
+        g_printerr("Request too long, ignoring the rest of the input.\n");
+
+        if (!listening)
+            ret = 1;
+
+    } else if (l == 0 && i->buffer->len > 0)
+        /* A last line without a newline */
+        handle_line(i->buffer->str);
+
+    /* EOF or error */
+    if (i->is_stdin) {
+        reading = FALSE;
+        maybe_quit();
+    }
+
+    /* Dropping the watch drops the last reference to the channel,
+     * which closes the connection */
+    return FALSE;
 }
 
-static gboolean property_callback(
-        const gchar *option_name,
-        const gchar *value,
-        gpointer data,
-        GError **error) {
+static void input_free(gpointer userdata) {
+    struct input *i = userdata;
 
-    const char *equal;
-    char *t;
+    g_string_free(i->buffer, TRUE);
+    g_free(i);
+}
 
-    if (!(equal = strchr(value, '='))) {
-        g_set_error(error, error_domain(), 0, "Property lacks '='.");
-        return FALSE;
+static void watch_fd(int fd, gboolean is_stdin) {
+    GIOChannel *channel;
+    struct input *i;
+
+    i = g_new(struct input, 1);
+    i->buffer = g_string_new(NULL);
+    i->is_stdin = is_stdin;
+
+    channel = g_io_channel_unix_new(fd);
+    g_io_channel_set_close_on_unref(channel, !is_stdin);
+
+    /* A client that sends half a line mustn't block the daemon. We
+     * don't do that for stdin, which we share with our parent. */
+    if (!is_stdin)
+        g_io_channel_set_flags(channel, G_IO_FLAG_NONBLOCK, NULL);
+
+    g_io_add_watch_full(channel, G_PRIORITY_DEFAULT, G_IO_IN|G_IO_HUP|G_IO_ERR, input_cb, i, input_free);
+    g_io_channel_unref(channel);
+}
+
+static gboolean accept_cb(GIOChannel *channel, GIOCondition condition, gpointer userdata) {
+    int fd;
+
+    if ((fd = accept(g_io_channel_unix_get_fd(channel), NULL, NULL)) < 0)
+        return TRUE;
+
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    watch_fd(fd, FALSE);
+
+    return TRUE;
+}
+
+static gchar* get_socket_path(const gchar *path) {
+    const char *e;
+
+    if (path)
+        return g_strdup(path);
+
+    /* The runtime dir belongs to the user alone, hence nobody else
+     * can play sounds through our daemon */
+    if (!(e = g_getenv("XDG_RUNTIME_DIR")) || *e != '/') {
+        g_printerr("XDG_RUNTIME_DIR is not set, please pass --socket.\n");
+        return NULL;
     }
 
-    t = g_strndup(value, equal - value);
+    return g_build_filename(e, SOCKET_NAME, NULL);
+}
 
-    if (ca_proplist_sets(proplist, t, equal + 1) < 0) {
-        g_set_error(error, error_domain(), 0, "Invalid property.");
-        g_free(t);
-        return FALSE;
+static int socket_address(struct sockaddr_un *sa, const gchar *path) {
+
+    memset(sa, 0, sizeof(*sa));
+    sa->sun_family = AF_UNIX;
+
+    if (strlen(path) >= sizeof(sa->sun_path)) {
+        g_printerr("Socket path %s is too long.\n", path);
+        return -1;
     }
 
-    g_free(t);
-    return TRUE;
+    strcpy(sa->sun_path, path);
+    return 0;
+}
+
+static int socket_connect(const gchar *path) {
+    struct sockaddr_un sa;
+    int fd;
+
+    if (socket_address(&sa, path) < 0)
+        return -1;
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        return -1;
+
+    if (connect(fd, (struct sockaddr*) &sa, sizeof(sa)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static int socket_bind(int fd, const struct sockaddr_un *sa) {
+    mode_t u;
+    int r;
+
+    /* The socket is created with only us allowed to connect, so that
+     * there's no moment at which anybody else could */
+    u = umask(0077);
+    r = bind(fd, (const struct sockaddr*) sa, sizeof(*sa));
+    umask(u);
+
+    return r;
+}
+
+static int socket_listen(const gchar *path) {
+    struct sockaddr_un sa;
+    GIOChannel *channel;
+    int fd;
+
+    if (socket_address(&sa, path) < 0)
+        return -1;
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        g_printerr("Failed to create socket: %s\n", g_strerror(errno));
+        return -1;
+    }
+
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    if (socket_bind(fd, &sa) < 0) {
+        int other;
+
+        if (errno != EADDRINUSE) {
+            g_printerr("Failed to bind socket %s: %s\n", path, g_strerror(errno));
+            close(fd);
+            return -1;
+        }
+
+        /* Either another daemon is running, or one died without
+         * cleaning up after itself */
+        if ((other = socket_connect(path)) >= 0) {
+            g_printerr("Another daemon is already listening on %s.\n", path);
+            close(other);
+            close(fd);
+            return -1;
+        }
+
+        unlink(path);
+
+        if (socket_bind(fd, &sa) < 0) {
+            g_printerr("Failed to bind socket %s: %s\n", path, g_strerror(errno));
+            close(fd);
+            return -1;
+        }
+    }
+
+    if (listen(fd, SOMAXCONN) < 0) {
+        g_printerr("Failed to listen on socket %s: %s\n", path, g_strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    channel = g_io_channel_unix_new(fd);
+    g_io_channel_set_close_on_unref(channel, TRUE);
+    g_io_add_watch(channel, G_IO_IN, accept_cb, NULL);
+    g_io_channel_unref(channel);
+
+    return 0;
+}
+
+static void append_option(GString *s, const char *name, const char *value) {
+    gchar *q;
+
+    q = g_shell_quote(value);
+    g_string_append_printf(s, " --%s=%s", name, q);
+    g_free(q);
+}
+
+/* Turns the options back into a line for the daemon to parse */
+static gchar* options_to_line(const struct options *o) {
+    GString *s;
+    guint i;
+
+    s = g_string_new("");
+
+    if (o->event_id)
+        append_option(s, "id", o->event_id);
+    if (o->filename)
+        append_option(s, "file", o->filename);
+    if (o->event_description)
+        append_option(s, "description", o->event_description);
+    if (o->cache_control)
+        append_option(s, "cache-control", o->cache_control);
+    if (o->volume)
+        append_option(s, "volume", o->volume);
+
+    if (o->n_loops != 1)
+        g_string_append_printf(s, " --loop=%i", o->n_loops);
+    if (o->delay != 0)
+        g_string_append_printf(s, " --delay=%i", o->delay);
+
+    for (i = 0; i < o->properties->len; i++)
+        append_option(s, "property", g_ptr_array_index(o->properties, i));
+
+    g_string_append_c(s, '\n');
+
+    return g_string_free(s, FALSE);
+}
+
+static int send_request(const struct options *o, const gchar *path) {
+    gchar *line;
+    size_t n, done = 0;
+    int fd, r = 0;
+
+    if ((fd = socket_connect(path)) < 0)
+        return -1;
+
+    line = options_to_line(o);
+    n = strlen(line);
+
+    while (done < n) {
+        ssize_t k;
+
+        /* A daemon going away shouldn't kill us */
+        if ((k = send(fd, line + done, n - done, MSG_NOSIGNAL)) < 0) {
+
+            if (errno == EINTR)
+                continue;
+
+            r = -1;
+            break;
+        }
+
+        done += (size_t) k;
+    }
+
+    g_free(line);
+    close(fd);
+
+    return r;
 }
 
 int main (int argc, char *argv[]) {
     GOptionContext *oc;
-    static gchar *event_id = NULL, *filename = NULL, *event_description = NULL, *cache_control = NULL, *volume = NULL;
-    int r;
-    static gboolean version = FALSE;
+    struct options o;
+    struct request *r;
+    static gboolean version = FALSE, batch_mode = FALSE, daemon_mode = FALSE, send_mode = FALSE;
+    static gchar *socket_path = NULL;
+    gchar *path = NULL;
+    gboolean thin = FALSE;
     GError *error = NULL;
+    int i, k;
 
     static const GOptionEntry options[] = {
         { "version",       'v', 0, G_OPTION_ARG_NONE,     &version,                  "Display version number and quit", NULL },
-        { "id",            'i', 0, G_OPTION_ARG_STRING,   &event_id,                 "Event sound identifier",  "STRING" },
-        { "file",          'f', 0, G_OPTION_ARG_STRING,   &filename,                 "Play file",  "PATH" },
-        { "description",   'd', 0, G_OPTION_ARG_STRING,   &event_description,        "Event sound description", "STRING" },
-        { "cache-control", 'c', 0, G_OPTION_ARG_STRING,   &cache_control,            "Cache control (permanent, volatile, never)", "STRING" },
-        { "loop",          'l', 0, G_OPTION_ARG_INT,      &n_loops,                  "Loop how many times (detault: 1)", "INTEGER" },
-        { "volume",        'V', 0, G_OPTION_ARG_STRING,   &volume,                   "A floating point dB value for the sample volume (ex: 0.0)", "STRING" },
-        { "property",      0,   0, G_OPTION_ARG_CALLBACK, (void*) property_callback, "An arbitrary property", "STRING" },
+        { "batch",         0,   0, G_OPTION_ARG_NONE,     &batch_mode,               "Play the requests read from stdin, one per line", NULL },
+        { "daemon",        0,   0, G_OPTION_ARG_NONE,     &daemon_mode,              "Play the requests sent to the socket", NULL },
+        { "send",          0,   0, G_OPTION_ARG_NONE,     &send_mode,                "Send the request to the daemon instead of playing it", NULL },
+        { "socket",        0,   0, G_OPTION_ARG_STRING,   &socket_path,              "The socket of the daemon (default: $XDG_RUNTIME_DIR/" SOCKET_NAME ")", "PATH" },
         { NULL, 0, 0, 0, NULL, NULL, NULL }
     };
 
@@ -134,11 +659,19 @@ int main (int argc, char *argv[]) {
     g_type_init();
     g_thread_init(NULL);
 
-    ca_proplist_create(&proplist);
+    /* Thin clients shouldn't pay for setting up GTK+, unless there
+     * turns out to be no daemon to send the request to */
+    for (i = 1; i < argc; i++)
+        if (strcmp(argv[i], "--send") == 0)
+            thin = TRUE;
+
+    options_init(&o);
 
     oc = g_option_context_new("- canberra-gtk-play");
+    g_option_context_set_main_group(oc, request_group(&o));
     g_option_context_add_main_entries(oc, options, NULL);
-    g_option_context_add_group(oc, gtk_get_option_group(TRUE));
+    if (!thin)
+        g_option_context_add_group(oc, gtk_get_option_group(TRUE));
     g_option_context_set_help_enabled(oc, TRUE);
 
     if (!(g_option_context_parse(oc, &argc, &argv, &error))) {
@@ -152,44 +685,93 @@ int main (int argc, char *argv[]) {
         return 0;
     }
 
-    if (!event_id && !filename) {
+    if ((batch_mode ? 1 : 0) + (daemon_mode ? 1 : 0) + (send_mode ? 1 : 0) > 1) {
+        g_printerr("Only one of --batch, --daemon and --send may be specified.\n");
+        return 1;
+    }
+
+    if (batch_mode || daemon_mode) {
+        if (o.event_id || o.filename) {
+            g_printerr("Event ids and files are passed as requests in batch and daemon mode.\n");
+            return 1;
+        }
+    } else if (!o.event_id && !o.filename) {
         g_printerr("No event id or file specified.\n");
         return 1;
     }
 
+    if (send_mode || daemon_mode)
+        if (!(path = get_socket_path(socket_path)))
+            return 1;
+
+    if (send_mode) {
+        if (send_request(&o, path) == 0)
+            goto finish;
+
+        /* Without a daemon, play it ourselves */
+        if (!gtk_init_check(&argc, &argv)) {
+            g_printerr("Failed to reach the daemon on %s, and cannot play the sound without it.\n", path);
+            ret = 1;
+            goto finish;
+        }
+    }
+
     ca_context_change_props(ca_gtk_context_get(),
                             CA_PROP_APPLICATION_NAME, "canberra-gtk-play",
                             CA_PROP_APPLICATION_ID, "org.freedesktop.libcanberra.GtkPlay",
                             NULL);
 
-    if (event_id)
-        ca_proplist_sets(proplist, CA_PROP_EVENT_ID, event_id);
-
-    if (filename)
-        ca_proplist_sets(proplist, CA_PROP_MEDIA_FILENAME, filename);
-
-    if (cache_control)
-        ca_proplist_sets(proplist, CA_PROP_CANBERRA_CACHE_CONTROL, cache_control);
-
-    if (event_description)
-        ca_proplist_sets(proplist, CA_PROP_EVENT_DESCRIPTION, event_description);
-
-    if (volume)
-        ca_proplist_sets(proplist, CA_PROP_CANBERRA_VOLUME, volume);
-
-    r = ca_context_play_full(ca_gtk_context_get(), 1, proplist, callback, NULL);
-
-    if (r < 0) {
-        g_printerr("Failed to play sound: %s\n", ca_strerror(r));
-        ret = 1;
-        goto finish;
+    if (batch_mode || daemon_mode) {
+
+        /* Connect right away, so that the first request doesn't have
+         * to wait for it */
+        if ((k = ca_context_open(ca_gtk_context_get())) < 0) {
+            g_printerr("Failed to open the context: %s\n", ca_strerror(k));
+            ret = 1;
+            goto finish;
+        }
+
+        if (daemon_mode) {
+            if (socket_listen(path) < 0) {
+                ret = 1;
+                goto finish;
+            }
+
+            listening = TRUE;
+        } else {
+            watch_fd(STDIN_FILENO, TRUE);
+            reading = TRUE;
+        }
+
+    } else {
+        if (!(r = request_new(&o, &error))) {
+            g_printerr("%s\n", error->message);
+            g_error_free(error);
+            ret = 1;
+            goto finish;
+        }
+
+        /* Failures to play right away mean we don't need to enter
+         * the main loop at all */
+        if (r->delay <= 0 && (k = request_play(r)) < 0) {
+            g_printerr("Failed to play sound: %s\n", ca_strerror(k));
+            request_free(r);
+            ret = 1;
+            goto finish;
+        }
+
+        n_active++;
+
+        if (r->delay > 0)
+            g_timeout_add((guint) r->delay, timeout_play, r);
     }
 
     gtk_main();
 
 finish:
 
-    ca_proplist_destroy(proplist);
+    options_clear(&o);
+    g_free(path);
 
     return ret;
 }
@@ -170,32 +170,18 @@ static GtkWindow* get_toplevel(GtkWidget *w) {
     return GTK_WINDOW(w);
 }
 
-/**
- * ca_gtk_proplist_set_for_widget:
- * @p: The proplist to store these sound event properties in
- * @w: The Gtk widget to base these sound event properties on
- *
- * Fill in a ca_proplist object for a sound event that shall originate
- * from the specified Gtk Widget. This will fill in properties like
- * %CA_PROP_WINDOW_NAME or %CA_PROP_WINDOW_X11_DISPLAY for you.
- *
- * Returns: 0 on success, negative error code on error.
- */
+/* The window properties are the same for every sound event of a
+ * window, hence we build them once and keep them around as a frozen
+ * property list on the toplevel until any of them changes */
+#define WINDOW_PROPS_KEY "canberra::gtk::window-props"
+#define WINDOW_WATCHED_KEY "canberra::gtk::window-watched"
 
-int ca_gtk_proplist_set_for_widget(ca_proplist *p, GtkWidget *widget) {
-    GtkWindow *w;
+static int fill_window_props(ca_proplist *p, GtkWindow *w) {
     int ret;
     const char *t, *role;
     GdkWindow *dw;
     GdkScreen *screen;
 
-    ca_return_val_if_fail(p, CA_ERROR_INVALID);
-    ca_return_val_if_fail(widget, CA_ERROR_INVALID);
-    ca_return_val_if_fail(!ca_detect_fork(), CA_ERROR_FORKED);
-
-    if (!(w = get_toplevel(widget)))
-        return CA_ERROR_INVALID;
-
     if ((t = gtk_window_get_title(w)))
         if ((ret = ca_proplist_sets(p, CA_PROP_WINDOW_NAME, t)) < 0)
             return ret;
@@ -223,7 +209,7 @@ int ca_gtk_proplist_set_for_widget(ca_proplist *p, GtkWidget *widget) {
         if ((ret = ca_proplist_setf(p, CA_PROP_WINDOW_X11_XID, "%lu", (unsigned long) GDK_WINDOW_XID(dw))) < 0)
             return ret;
 
-    if ((screen = gtk_widget_get_screen(widget))) {
+    if ((screen = gtk_widget_get_screen(GTK_WIDGET(w)))) {
 
         if ((t = gdk_display_get_name(gdk_screen_get_display(screen))))
             if ((ret = ca_proplist_sets(p, CA_PROP_WINDOW_X11_DISPLAY, t)) < 0)
@@ -240,6 +226,111 @@ int ca_gtk_proplist_set_for_widget(ca_proplist *p, GtkWidget *widget) {
     return CA_SUCCESS;
 }
 
+static void window_props_invalidate(GtkWindow *w) {
+    g_object_set_data(G_OBJECT(w), WINDOW_PROPS_KEY, NULL);
+}
+
+static void window_notify_cb(GtkWindow *w, GParamSpec *arg1, gpointer userdata) {
+    window_props_invalidate(w);
+}
+
+static void window_changed_cb(GtkWindow *w, gpointer userdata) {
+    window_props_invalidate(w);
+}
+
+static void window_screen_changed_cb(GtkWindow *w, GdkScreen *previous, gpointer userdata) {
+    window_props_invalidate(w);
+}
+
+static gboolean window_configure_cb(GtkWindow *w, GdkEventConfigure *e, gpointer userdata) {
+    /* The window might have been moved to another monitor */
+    window_props_invalidate(w);
+    return FALSE;
+}
+
+static void window_watch(GtkWindow *w) {
+
+    if (g_object_get_data(G_OBJECT(w), WINDOW_WATCHED_KEY))
+        return;
+
+    g_signal_connect(G_OBJECT(w), "notify::title", G_CALLBACK(window_notify_cb), NULL);
+    g_signal_connect(G_OBJECT(w), "notify::role", G_CALLBACK(window_notify_cb), NULL);
+    g_signal_connect(G_OBJECT(w), "notify::icon-name", G_CALLBACK(window_notify_cb), NULL);
+
+    /* The XID and the monitor */
+    g_signal_connect(G_OBJECT(w), "realize", G_CALLBACK(window_changed_cb), NULL);
+    g_signal_connect(G_OBJECT(w), "unrealize", G_CALLBACK(window_changed_cb), NULL);
+    g_signal_connect(G_OBJECT(w), "map", G_CALLBACK(window_changed_cb), NULL);
+    g_signal_connect(G_OBJECT(w), "configure-event", G_CALLBACK(window_configure_cb), NULL);
+
+    /* The display and the screen */
+    g_signal_connect(G_OBJECT(w), "screen-changed", G_CALLBACK(window_screen_changed_cb), NULL);
+
+    g_object_set_data(G_OBJECT(w), WINDOW_WATCHED_KEY, GINT_TO_POINTER(1));
+}
+
+/* Returns a new reference to the frozen property list */
+static int get_window_props(ca_proplist **_p, GtkWindow *w) {
+    ca_proplist *p, *frozen;
+    int ret;
+
+    if ((p = g_object_get_data(G_OBJECT(w), WINDOW_PROPS_KEY))) {
+        *_p = ca_proplist_ref(p);
+        return CA_SUCCESS;
+    }
+
+    window_watch(w);
+
+    if ((ret = ca_proplist_create(&p)) < 0)
+        return ret;
+
+    if ((ret = fill_window_props(p, w)) < 0 ||
+        (ret = ca_proplist_freeze(&frozen, p)) < 0) {
+        ca_proplist_destroy(p);
+        return ret;
+    }
+
+    ca_proplist_destroy(p);
+
+    g_object_set_data_full(G_OBJECT(w), WINDOW_PROPS_KEY, ca_proplist_ref(frozen), (GDestroyNotify) ca_proplist_destroy);
+
+    *_p = frozen;
+    return CA_SUCCESS;
+}
+
+/**
+ * ca_gtk_proplist_set_for_widget:
+ * @p: The proplist to store these sound event properties in
+ * @w: The Gtk widget to base these sound event properties on
+ *
+ * Fill in a ca_proplist object for a sound event that shall originate
+ * from the specified Gtk Widget. This will fill in properties like
+ * %CA_PROP_WINDOW_NAME or %CA_PROP_WINDOW_X11_DISPLAY for you.
+ *
+ * Returns: 0 on success, negative error code on error.
+ */
+
+int ca_gtk_proplist_set_for_widget(ca_proplist *p, GtkWidget *widget) {
+    GtkWindow *w;
+    ca_proplist *wp;
+    int ret;
+
+    ca_return_val_if_fail(p, CA_ERROR_INVALID);
+    ca_return_val_if_fail(widget, CA_ERROR_INVALID);
+    ca_return_val_if_fail(!ca_detect_fork(), CA_ERROR_FORKED);
+
+    if (!(w = get_toplevel(widget)))
+        return CA_ERROR_INVALID;
+
+    if ((ret = get_window_props(&wp, w)) < 0)
+        return ret;
+
+    ret = ca_proplist_merge_into(p, wp);
+    ca_proplist_destroy(wp);
+
+    return ret;
+}
+
 /**
  * ca_gtk_proplist_set_for_event:
  * @p: The proplist to store these sound event properties in
@@ -333,27 +424,38 @@ int ca_gtk_proplist_set_for_event(ca_proplist *p, GdkEvent *e) {
 int ca_gtk_play_for_widget(GtkWidget *w, uint32_t id, ...) {
     va_list ap;
     int ret;
-    ca_proplist *p;
+    ca_proplist *p, *wp, *merged;
+    GtkWindow *tl;
     GdkScreen *s;
 
     ca_return_val_if_fail(w, CA_ERROR_INVALID);
     ca_return_val_if_fail(!ca_detect_fork(), CA_ERROR_FORKED);
 
-    if ((ret = ca_proplist_create(&p)) < 0)
+    if (!(tl = get_toplevel(w)))
+        return CA_ERROR_INVALID;
+
+    va_start(ap, id);
+    ret = ca_proplist_from_ap(&p, ap);
+    va_end(ap);
+
+    if (ret < 0)
         return ret;
 
-    if ((ret = ca_gtk_proplist_set_for_widget(p, w)) < 0)
+    /* Instead of copying the window properties into p one by one we
+     * put the two together in one go */
+    if ((ret = get_window_props(&wp, tl)) < 0)
         goto fail;
 
-    va_start(ap, id);
-    ret = ca_proplist_merge_ap(p, ap);
-    va_end(ap);
+    ret = ca_proplist_merge_frozen(&merged, wp, p);
+    ca_proplist_destroy(wp);
 
     if (ret < 0)
         goto fail;
 
     s = gtk_widget_get_screen(w);
-    ret = ca_context_play_full(ca_gtk_context_get_for_screen(s), id, p, NULL, NULL);
+    ret = ca_context_play_full(ca_gtk_context_get_for_screen(s), id, merged, NULL, NULL);
+
+    ca_assert_se(ca_proplist_destroy(merged) == 0);
 
 fail:
 
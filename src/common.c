@@ -23,6 +23,7 @@
 #endif
 
 #include <stdarg.h>
+#include <sched.h>
 
 #include "canberra.h"
 #include "common.h"
@@ -31,6 +32,10 @@
 #include "proplist.h"
 #include "macro.h"
 #include "fork-detect.h"
+#include "trace.h"
+#include "sample-cache.h"
+#include "sound-theme-spec.h"
+#include "theme-watch.h"
 
 /**
  * SECTION:canberra
@@ -125,6 +130,7 @@
 
 int ca_context_create(ca_context **_c) {
     ca_context *c;
+    ca_proplist *p;
     int ret;
     const char *d;
 
@@ -139,7 +145,23 @@ int ca_context_create(ca_context **_c) {
         return CA_ERROR_OOM;
     }
 
-    if ((ret = ca_proplist_create(&c->props)) < 0) {
+    if (!(c->voice_mutex = ca_mutex_new())) {
+        ca_context_destroy(c);
+        return CA_ERROR_OOM;
+    }
+
+    if ((ret = ca_proplist_create(&p)) < 0) {
+        ca_context_destroy(c);
+        return ret;
+    }
+
+    /* The context properties are only ever replaced as a whole,
+     * hence we keep them frozen so that the drivers can read them
+     * without locking */
+    ret = ca_proplist_freeze(&c->props, p);
+    ca_assert_se(ca_proplist_destroy(p) == CA_SUCCESS);
+
+    if (ret < 0) {
         ca_context_destroy(c);
         return ret;
     }
@@ -180,9 +202,26 @@ int ca_context_destroy(ca_context *c) {
      * broken anyway if it destructs this object in one thread and
      * still is calling a method of it in another. */
 
+    if (c->preopen_started)
+        pthread_join(c->preopen_thread, NULL);
+
     if (c->opened)
         ret = driver_destroy(c);
 
+    /* The driver should have called back for all of them by now */
+    while (c->voices) {
+        struct ca_voice *v = c->voices;
+
+        CA_LLIST_REMOVE(struct ca_voice, c->voices, v);
+        ca_free(v);
+    }
+
+    if (c->voice_mutex)
+        ca_mutex_free(c->voice_mutex);
+
+    if (c->check_theme)
+        ca_theme_data_unref(c->check_theme);
+
     if (c->props)
         ca_assert_se(ca_proplist_destroy(c->props) == CA_SUCCESS);
 
@@ -288,8 +327,29 @@ static int context_open_unlocked(ca_context *c) {
     if (c->opened)
         return CA_SUCCESS;
 
-    if ((ret = driver_open(c)) == CA_SUCCESS)
+    /* Plays look at this without taking the lock, so they need to
+     * see the driver fully set up once they see it TRUE */
+    if ((ret = driver_open(c)) == CA_SUCCESS) {
+        __sync_synchronize();
         c->opened = TRUE;
+    }
+
+    return ret;
+}
+
+/* Once the context is open it stays open, hence plays only need the
+ * lock the first time */
+static int context_open(ca_context *c) {
+    int ret;
+
+    if (c->opened) {
+        __sync_synchronize();
+        return CA_SUCCESS;
+    }
+
+    ca_mutex_lock(c->mutex);
+    ret = context_open_unlocked(c);
+    ca_mutex_unlock(c->mutex);
 
     return ret;
 }
@@ -320,6 +380,98 @@ int ca_context_open(ca_context *c) {
     return ret;
 }
 
+/* This part is not portable due to pthread usage, should be abstracted
+ * when we port this to platforms that do not have POSIX threading */
+
+static void* preopen_func(void *userdata) {
+    ca_context *c = userdata;
+
+    /* Failures are reported by whatever opens the context next */
+    ca_mutex_lock(c->mutex);
+    context_open_unlocked(c);
+    ca_mutex_unlock(c->mutex);
+
+    return NULL;
+}
+
+/**
+ * ca_context_preopen:
+ * @c: the context to connect.
+ *
+ * Like ca_context_open(), but connects the context from a background
+ * thread and returns right away, so that neither this nor the first
+ * ca_context_play() have to wait for the backend to be found, loaded
+ * and connected. Calls that need the context to be open wait for the
+ * background thread. Set the driver, the device and the application
+ * properties before calling this.
+ *
+ * Returns: 0 on success, negative error code on error.
+ */
+int ca_context_preopen(ca_context *c) {
+    int ret = CA_SUCCESS;
+
+    ca_return_val_if_fail(!ca_detect_fork(), CA_ERROR_FORKED);
+    ca_return_val_if_fail(c, CA_ERROR_INVALID);
+
+    ca_mutex_lock(c->mutex);
+
+    if (!c->opened && !c->preopen_started) {
+        if (pthread_create(&c->preopen_thread, NULL, preopen_func, c) == 0)
+            c->preopen_started = TRUE;
+        else
+            ret = CA_ERROR_OOM;
+    }
+
+    ca_mutex_unlock(c->mutex);
+
+    return ret;
+}
+
+/* Readers announce themselves in the counter of the epoch they saw
+ * before loading the pointer, and retry if the epoch changed in
+ * between. The writer flips the epoch after storing the new list, and
+ * drops the old one once the readers of the old epoch are gone. That
+ * way neither side takes a lock, and the readers never wait. */
+ca_proplist *ca_context_ref_props(ca_context *c) {
+    ca_proplist *p;
+    unsigned e;
+
+    ca_assert(c);
+
+    for (;;) {
+        e = c->props_epoch;
+        __sync_add_and_fetch(&c->props_readers[e & 1], 1);
+
+        if (e == c->props_epoch)
+            break;
+
+        __sync_sub_and_fetch(&c->props_readers[e & 1], 1);
+    }
+
+    p = ca_proplist_ref(c->props);
+
+    __sync_sub_and_fetch(&c->props_readers[e & 1], 1);
+
+    return p;
+}
+
+static void props_replace_unlocked(ca_context *c, ca_proplist *p) {
+    ca_proplist *old;
+    unsigned e;
+
+    old = c->props;
+    c->props = p;
+
+    __sync_synchronize();
+    e = __sync_fetch_and_add(&c->props_epoch, 1);
+
+    /* This is just a handful of instructions on the reader side */
+    while (c->props_readers[e & 1] > 0)
+        sched_yield();
+
+    ca_assert_se(ca_proplist_destroy(old) == CA_SUCCESS);
+}
+
 /**
  * ca_context_change_props:
  * @c: the context to set the properties on.
@@ -382,15 +534,14 @@ int ca_context_change_props_full(ca_context *c, ca_proplist *p) {
 
     ca_mutex_lock(c->mutex);
 
-    if ((ret = ca_proplist_merge(&merged, c->props, p)) < 0)
+    if ((ret = ca_proplist_merge_frozen(&merged, c->props, p)) < 0)
         goto finish;
 
     ret = c->opened ? driver_change_props(c, p, merged) : CA_SUCCESS;
 
-    if (ret == CA_SUCCESS) {
-        ca_assert_se(ca_proplist_destroy(c->props) == CA_SUCCESS);
-        c->props = merged;
-    } else
+    if (ret == CA_SUCCESS)
+        props_replace_unlocked(c, merged);
+    else
         ca_assert_se(ca_proplist_destroy(merged) == CA_SUCCESS);
 
 finish:
@@ -464,6 +615,157 @@ int ca_context_play(ca_context *c, uint32_t id, ...) {
     return ret;
 }
 
+static void voice_add_unlocked(ca_context *c, struct ca_voice *v) {
+    CA_LLIST_PREPEND(struct ca_voice, c->voices, v);
+    c->n_voices++;
+
+    __sync_add_and_fetch(&c->n_playing, 1);
+    __sync_add_and_fetch(&c->playing_slots[v->id % CA_PLAYING_SLOTS], 1);
+}
+
+static void voice_remove_unlocked(ca_context *c, struct ca_voice *v) {
+    CA_LLIST_REMOVE(struct ca_voice, c->voices, v);
+
+    if (!v->canceled)
+        c->n_voices--;
+
+    __sync_sub_and_fetch(&c->playing_slots[v->id % CA_PLAYING_SLOTS], 1);
+    __sync_sub_and_fetch(&c->n_playing, 1);
+}
+
+static void voice_finish_cb(ca_context *c, uint32_t driver_id, int error_code, void *userdata) {
+    struct ca_voice *v = userdata;
+
+    /* The sound is not playing anymore by the time the callback is
+     * called */
+    ca_mutex_lock(c->voice_mutex);
+    voice_remove_unlocked(c, v);
+    ca_mutex_unlock(c->voice_mutex);
+
+    if (v->callback)
+        v->callback(c, v->id, error_code, v->userdata);
+
+    ca_free(v);
+}
+
+/* Returns the voice to cancel to make room for a new one, or NULL if
+ * the new one shall not be played */
+static struct ca_voice* find_victim_unlocked(ca_context *c, const char *policy, unsigned priority) {
+    struct ca_voice *v, *victim = NULL;
+
+    if (policy && ca_streq(policy, "drop-new"))
+        return NULL;
+
+    if (policy && ca_streq(policy, "steal-oldest")) {
+
+        for (v = c->voices; v; v = v->next)
+            if (!v->canceled)
+                victim = v;
+
+        return victim;
+    }
+
+    /* Anything else means "steal-lowest". The list is most recent
+     * first, hence the <= picks the oldest among equals. */
+    for (v = c->voices; v; v = v->next)
+        if (!v->canceled && (!victim || v->priority <= victim->priority))
+            victim = v;
+
+    if (victim && victim->priority > priority)
+        return NULL;
+
+    return victim;
+}
+
+/* Returns CA_ERROR_DISABLED if either the event or the context turned
+ * the sounds off, the former wins */
+static int check_enabled(ca_proplist *p, ca_proplist *cp) {
+    const char *t;
+    ca_bool_t enabled = TRUE;
+
+    if ((t = ca_proplist_gets_key_unlocked(cp, CA_PROP_KEY_CANBERRA_ENABLE)))
+        enabled = !ca_streq(t, "0");
+
+    ca_proplist_lock(p);
+    if ((t = ca_proplist_gets_key_unlocked(p, CA_PROP_KEY_CANBERRA_ENABLE)))
+        enabled = !ca_streq(t, "0");
+    ca_proplist_unlock(p);
+
+    ca_return_val_if_fail(enabled, CA_ERROR_DISABLED);
+
+    return CA_SUCCESS;
+}
+
+/* Called without any lock held, cp is the snapshot of the context
+ * properties this sound event is played with */
+static int play_voice(ca_context *c, uint32_t id, ca_proplist *p, ca_proplist *cp, ca_finish_callback_t cb, void *userdata) {
+    struct ca_voice *v, *victim = NULL;
+    uint32_t victim_id = 0;
+    unsigned limit = 0, priority = 0;
+    int ret;
+
+    ca_proplist_get_unsigned(cp, CA_PROP_CANBERRA_VOICE_LIMIT, &limit);
+
+    if (ca_proplist_get_unsigned(p, CA_PROP_CANBERRA_PRIORITY, &priority) < 0)
+        ca_proplist_get_unsigned(cp, CA_PROP_CANBERRA_PRIORITY, &priority);
+
+    if (!(v = ca_new0(struct ca_voice, 1)))
+        return CA_ERROR_OOM;
+
+    v->context = c;
+    v->id = id;
+    v->priority = priority;
+    v->callback = cb;
+    v->userdata = userdata;
+
+    ca_mutex_lock(c->voice_mutex);
+
+    if (limit > 0 && c->n_voices >= limit) {
+
+        if (!(victim = find_victim_unlocked(c, ca_proplist_gets_key_unlocked(cp, CA_PROP_KEY_CANBERRA_VOICE_POLICY), priority))) {
+            ca_mutex_unlock(c->voice_mutex);
+            ca_free(v);
+            return CA_ERROR_CANCELED;
+        }
+
+        victim->canceled = TRUE;
+        victim_id = victim->driver_id;
+        c->n_voices--;
+    }
+
+    v->driver_id = c->next_driver_id++;
+    voice_add_unlocked(c, v);
+
+    ca_mutex_unlock(c->voice_mutex);
+
+    /* The driver calls back for the victim with CA_ERROR_CANCELED,
+     * which also frees it */
+    if (victim)
+        driver_cancel(c, victim_id);
+
+    /* If this succeeds the callback might already have been called
+     * and the voice be gone by the time this returns */
+    if ((ret = driver_play(c, v->driver_id, p, cp, voice_finish_cb, v)) < 0) {
+        ca_mutex_lock(c->voice_mutex);
+        voice_remove_unlocked(c, v);
+        ca_mutex_unlock(c->voice_mutex);
+
+        ca_free(v);
+    }
+
+    return ret;
+}
+
+static int check_play(ca_proplist *p, ca_proplist *cp) {
+
+    ca_return_val_if_fail(ca_proplist_contains_key(p, CA_PROP_KEY_EVENT_ID) ||
+                          ca_proplist_contains_key(cp, CA_PROP_KEY_EVENT_ID) ||
+                          ca_proplist_contains_key(p, CA_PROP_KEY_MEDIA_FILENAME) ||
+                          ca_proplist_contains_key(cp, CA_PROP_KEY_MEDIA_FILENAME), CA_ERROR_INVALID);
+
+    return check_enabled(p, cp);
+}
+
 /**
  * ca_context_play_full:
  * @c: the context to play the event sound on
@@ -480,48 +782,41 @@ int ca_context_play(ca_context *c, uint32_t id, ...) {
  * allocated memory to the callback and assume that it is freed
  * properly.
  *
+ * Sound events may be played on the same context from several
+ * threads at the same time. They don't wait for each other, nor for
+ * ca_context_change_props(), and are played with the context
+ * properties as they were when the call was made.
+ *
  * Returns: 0 on success, negative error code on error.
  */
 
 int ca_context_play_full(ca_context *c, uint32_t id, ca_proplist *p, ca_finish_callback_t cb, void *userdata) {
     int ret;
-    const char *t;
-    ca_bool_t enabled = TRUE;
+    ca_proplist *cp;
 
     ca_return_val_if_fail(!ca_detect_fork(), CA_ERROR_FORKED);
     ca_return_val_if_fail(c, CA_ERROR_INVALID);
     ca_return_val_if_fail(p, CA_ERROR_INVALID);
     ca_return_val_if_fail(!userdata || cb, CA_ERROR_INVALID);
 
-    ca_mutex_lock(c->mutex);
-
-    ca_return_val_if_fail_unlock(ca_proplist_contains(p, CA_PROP_EVENT_ID) ||
-                                 ca_proplist_contains(c->props, CA_PROP_EVENT_ID) ||
-                                 ca_proplist_contains(p, CA_PROP_MEDIA_FILENAME) ||
-                                 ca_proplist_contains(c->props, CA_PROP_MEDIA_FILENAME), CA_ERROR_INVALID, c->mutex);
-
-    ca_mutex_lock(c->props->mutex);
-    if ((t = ca_proplist_gets_unlocked(c->props, CA_PROP_CANBERRA_ENABLE)))
-        enabled = !ca_streq(t, "0");
-    ca_mutex_unlock(c->props->mutex);
+    /* Sound events played from several threads at the same time
+     * don't serialize on the context lock, all they need is a
+     * consistent view of the context properties */
+    cp = ca_context_ref_props(c);
 
-    ca_mutex_lock(p->mutex);
-    if ((t = ca_proplist_gets_unlocked(p, CA_PROP_CANBERRA_ENABLE)))
-        enabled = !ca_streq(t, "0");
-    ca_mutex_unlock(p->mutex);
-
-    ca_return_val_if_fail_unlock(enabled, CA_ERROR_DISABLED, c->mutex);
+    if ((ret = check_play(p, cp)) < 0)
+        goto finish;
 
-    if ((ret = context_open_unlocked(c)) < 0)
+    if ((ret = context_open(c)) < 0)
         goto finish;
 
     ca_assert(c->opened);
 
-    ret = driver_play(c, id, p, cb, userdata);
+    ret = play_voice(c, id, p, cp, cb, userdata);
 
 finish:
 
-    ca_mutex_unlock(c->mutex);
+    ca_assert_se(ca_proplist_destroy(cp) == CA_SUCCESS);
 
     return ret;
 }
@@ -541,20 +836,111 @@ finish:
  * Returns: 0 on success, negative error code on error.
  */
 int ca_context_cancel(ca_context *c, uint32_t id)  {
-    int ret;
+    int ret = CA_SUCCESS;
 
     ca_return_val_if_fail(!ca_detect_fork(), CA_ERROR_FORKED);
     ca_return_val_if_fail(c, CA_ERROR_INVALID);
     ca_mutex_lock(c->mutex);
     ca_return_val_if_fail_unlock(c->opened, CA_ERROR_STATE, c->mutex);
 
-    ret = driver_cancel(c, id);
+    /* The voice might be gone as soon as we drop the lock, since the
+     * driver calls back from driver_cancel(), hence one at a time */
+    for (;;) {
+        struct ca_voice *v;
+        uint32_t driver_id = 0;
+        int r;
+
+        ca_mutex_lock(c->voice_mutex);
+
+        for (v = c->voices; v; v = v->next)
+            if (v->id == id && !v->canceled)
+                break;
+
+        if (v) {
+            v->canceled = TRUE;
+            driver_id = v->driver_id;
+            c->n_voices--;
+        }
+
+        ca_mutex_unlock(c->voice_mutex);
+
+        if (!v)
+            break;
+
+        /* We only return the first failure */
+        if ((r = driver_cancel(c, driver_id)) < 0 && ret == CA_SUCCESS)
+            ret = r;
+    }
 
     ca_mutex_unlock(c->mutex);
 
     return ret;
 }
 
+/**
+ * ca_context_playing:
+ * @c: the context to query
+ * @id: the id that identifies the sounds to check
+ * @playing: A pointer where to store TRUE or FALSE
+ *
+ * Check whether at least one event sound started with the specified
+ * id via ca_context_play() is still playing. A sound stops playing
+ * right before its callback is called. This is cheap enough to be
+ * called often, it usually doesn't take any lock.
+ *
+ * Returns: 0 on success, negative error code on error.
+ */
+int ca_context_playing(ca_context *c, uint32_t id, int *playing) {
+    struct ca_voice *v;
+
+    ca_return_val_if_fail(!ca_detect_fork(), CA_ERROR_FORKED);
+    ca_return_val_if_fail(c, CA_ERROR_INVALID);
+    ca_return_val_if_fail(playing, CA_ERROR_INVALID);
+
+    /* Nothing with an id in this slot is playing, which is by far
+     * the most common case */
+    __sync_synchronize();
+
+    if (c->playing_slots[id % CA_PLAYING_SLOTS] <= 0) {
+        *playing = FALSE;
+        return CA_SUCCESS;
+    }
+
+    ca_mutex_lock(c->voice_mutex);
+
+    for (v = c->voices; v; v = v->next)
+        if (v->id == id)
+            break;
+
+    *playing = !!v;
+
+    ca_mutex_unlock(c->voice_mutex);
+
+    return CA_SUCCESS;
+}
+
+/**
+ * ca_context_left_to_play:
+ * @c: the context to query
+ * @n: A pointer where to store the number of event sounds
+ *
+ * Query how many event sounds started via ca_context_play() on this
+ * context are still playing, regardless of their ids. This doesn't
+ * take any lock.
+ *
+ * Returns: 0 on success, negative error code on error.
+ */
+int ca_context_left_to_play(ca_context *c, unsigned *n) {
+    ca_return_val_if_fail(!ca_detect_fork(), CA_ERROR_FORKED);
+    ca_return_val_if_fail(c, CA_ERROR_INVALID);
+    ca_return_val_if_fail(n, CA_ERROR_INVALID);
+
+    __sync_synchronize();
+    *n = c->n_playing;
+
+    return CA_SUCCESS;
+}
+
 /**
  * ca_context_cache:
  * @c: The context to use for uploading.
@@ -618,8 +1004,8 @@ int ca_context_cache_full(ca_context *c, ca_proplist *p) {
 
     ca_mutex_lock(c->mutex);
 
-    ca_return_val_if_fail_unlock(ca_proplist_contains(p, CA_PROP_EVENT_ID) ||
-                                 ca_proplist_contains(c->props, CA_PROP_EVENT_ID), CA_ERROR_INVALID, c->mutex);
+    ca_return_val_if_fail_unlock(ca_proplist_contains_key(p, CA_PROP_KEY_EVENT_ID) ||
+                                 ca_proplist_contains_key(c->props, CA_PROP_KEY_EVENT_ID), CA_ERROR_INVALID, c->mutex);
 
     if ((ret = context_open_unlocked(c)) < 0)
         goto finish;
@@ -635,6 +1021,605 @@ finish:
     return ret;
 }
 
+/**
+ * ca_context_cache_many:
+ * @c: The context to use for uploading.
+ * @p: An array of property lists, one for each event sound.
+ * @n: The number of entries in @p.
+ * @results: An array of @n integers that is filled with the result for each event sound, or %NULL.
+ *
+ * Upload a number of samples into the server in one go. This is
+ * equivalent to calling ca_context_cache_full() for every entry of
+ * @p, but allows backends to do the uploads in parallel, which is
+ * a lot faster when pre-caching a complete sound theme. This
+ * function will only return after all uploads have finished.
+ *
+ * Returns: 0 if all samples have been uploaded, otherwise the first negative error code of any of them.
+ */
+int ca_context_cache_many(ca_context *c, ca_proplist **p, unsigned n, int *results) {
+    int ret = CA_SUCCESS, *r = NULL;
+    unsigned i;
+
+    ca_return_val_if_fail(!ca_detect_fork(), CA_ERROR_FORKED);
+    ca_return_val_if_fail(c, CA_ERROR_INVALID);
+    ca_return_val_if_fail(p || n <= 0, CA_ERROR_INVALID);
+
+    for (i = 0; i < n; i++)
+        ca_return_val_if_fail(p[i], CA_ERROR_INVALID);
+
+    if (n <= 0)
+        return CA_SUCCESS;
+
+    if (!results) {
+        if (!(r = ca_new(int, n)))
+            return CA_ERROR_OOM;
+
+        results = r;
+    }
+
+    ca_mutex_lock(c->mutex);
+
+    for (i = 0; i < n; i++)
+        results[i] =
+            ca_proplist_contains_key(p[i], CA_PROP_KEY_EVENT_ID) ||
+            ca_proplist_contains_key(c->props, CA_PROP_KEY_EVENT_ID) ? CA_SUCCESS : CA_ERROR_INVALID;
+
+    if ((ret = context_open_unlocked(c)) < 0) {
+
+        for (i = 0; i < n; i++)
+            if (results[i] == CA_SUCCESS)
+                results[i] = ret;
+
+        goto finish;
+    }
+
+    ca_assert(c->opened);
+
+    driver_cache_many(c, p, n, results);
+
+    for (i = 0; i < n; i++)
+        if (results[i] < 0) {
+            ret = results[i];
+            break;
+        }
+
+finish:
+
+    ca_mutex_unlock(c->mutex);
+
+    ca_free(r);
+
+    return ret;
+}
+
+static void prepared_unload(ca_prepared *p) {
+
+    if (p->sample) {
+        ca_sample_unref(p->sample);
+        p->sample = NULL;
+    }
+
+    if (p->context_props) {
+        ca_proplist_destroy(p->context_props);
+        p->context_props = NULL;
+    }
+}
+
+static int prepared_load_unlocked(ca_prepared *p) {
+    ca_context *c = p->context;
+    ca_proplist *old;
+    ca_bool_t watched;
+    unsigned generation;
+    int ret;
+
+    if (p->sample) {
+        ca_sample_unref(p->sample);
+        p->sample = NULL;
+    }
+
+    /* The handle stays stale until the lookup succeeded, so that the
+     * next play tries again if it fails. Players only compare the
+     * pointer, hence we may drop our reference right away. */
+    if ((old = p->context_props)) {
+        p->context_props = NULL;
+        __sync_synchronize();
+        ca_proplist_destroy(old);
+    }
+
+    /* Learn about the generation before the lookup, so that a change
+     * during the lookup makes us look again next time */
+    watched = ca_theme_watch_get(&generation, NULL);
+
+    /* This keeps the decoded sound in the sample cache, where the
+     * drivers find it without looking it up in the theme again, for
+     * as long as the handle exists */
+    if ((ret = ca_sample_cache_share_sound(&p->sample, &p->theme, c->props, p->props)) < 0 &&
+        ret != CA_ERROR_TOOBIG)
+        return ret;
+
+    p->watched = watched;
+    p->generation = generation;
+
+    /* Published last, see prepared_is_stale() */
+    __sync_synchronize();
+    p->context_props = ca_proplist_ref(c->props);
+
+    return CA_SUCCESS;
+}
+
+/* Called without the context mutex, while somebody else might be
+ * reloading the handle. That's fine since the loader writes the
+ * context properties last, and we read them first. */
+static ca_bool_t prepared_is_stale(ca_prepared *p, ca_proplist *cp) {
+    unsigned g;
+
+    /* The context properties decide on the theme, locale and output
+     * profile, too */
+    if (p->context_props != cp)
+        return TRUE;
+
+    __sync_synchronize();
+
+    return p->watched && ca_theme_watch_get(&g, NULL) && g != p->generation;
+}
+
+/**
+ * ca_context_prepare:
+ * @c: the context to prepare the event sound for
+ * @p: A pointer where the prepared event sound is stored.
+ * @...: additional properties for this event sound, like in ca_context_play().
+ *
+ * Look up and load an event sound so that it can be played
+ * repeatedly with ca_context_play_prepared(), without parsing its
+ * properties and looking it up in the sound theme every time. This
+ * is useful for the few event sounds an application plays over and
+ * over again. The prepared sound keeps the decoded sound loaded until
+ * it is freed with ca_prepared_destroy().
+ *
+ * Returns: 0 on success, negative error code on error.
+ */
+int ca_context_prepare(ca_context *c, ca_prepared **p, ...) {
+    int ret;
+    va_list ap;
+    ca_proplist *pl = NULL;
+
+    ca_return_val_if_fail(!ca_detect_fork(), CA_ERROR_FORKED);
+    ca_return_val_if_fail(c, CA_ERROR_INVALID);
+    ca_return_val_if_fail(p, CA_ERROR_INVALID);
+
+    va_start(ap, p);
+    ret = ca_proplist_from_ap(&pl, ap);
+    va_end(ap);
+
+    if (ret < 0)
+        return ret;
+
+    ret = ca_context_prepare_full(c, p, pl);
+
+    ca_assert_se(ca_proplist_destroy(pl) == 0);
+
+    return ret;
+}
+
+/**
+ * ca_context_prepare_full:
+ * @c: the context to prepare the event sound for
+ * @p: A pointer where the prepared event sound is stored.
+ * @pl: A property list of properties for this event sound
+ *
+ * Prepare an event sound for ca_context_play_prepared(). See
+ * ca_context_prepare(). The property list may be modified or freed
+ * afterwards.
+ *
+ * Returns: 0 on success, negative error code on error.
+ */
+int ca_context_prepare_full(ca_context *c, ca_prepared **_p, ca_proplist *pl) {
+    ca_prepared *p;
+    int ret;
+
+    ca_return_val_if_fail(!ca_detect_fork(), CA_ERROR_FORKED);
+    ca_return_val_if_fail(c, CA_ERROR_INVALID);
+    ca_return_val_if_fail(_p, CA_ERROR_INVALID);
+    ca_return_val_if_fail(pl, CA_ERROR_INVALID);
+
+    if (!(p = ca_new0(ca_prepared, 1)))
+        return CA_ERROR_OOM;
+
+    p->context = c;
+
+    if ((ret = ca_proplist_freeze(&p->props, pl)) < 0)
+        goto fail;
+
+    ca_mutex_lock(c->mutex);
+
+    if (!ca_proplist_contains_key(p->props, CA_PROP_KEY_EVENT_ID) &&
+        !ca_proplist_contains_key(c->props, CA_PROP_KEY_EVENT_ID) &&
+        !ca_proplist_contains_key(p->props, CA_PROP_KEY_MEDIA_FILENAME) &&
+        !ca_proplist_contains_key(c->props, CA_PROP_KEY_MEDIA_FILENAME))
+        ret = CA_ERROR_INVALID;
+    else
+        ret = prepared_load_unlocked(p);
+
+    ca_mutex_unlock(c->mutex);
+
+    if (ret < 0)
+        goto fail;
+
+    *_p = p;
+
+    return CA_SUCCESS;
+
+fail:
+    ca_prepared_destroy(p);
+
+    return ret;
+}
+
+/**
+ * ca_context_play_prepared:
+ * @c: the context to play the event sound on
+ * @p: the event sound prepared with ca_context_prepare() on the same context
+ * @id: an integer id this sound can be later be identified with when calling ca_context_cancel() or when the callback is called.
+ * @cb: A callback to call when this sound event sucessfully finished playing or when an error occured during playback, or %NULL.
+ * @userdata: Some arbitrary user data to pass to the callback.
+ *
+ * Play a prepared event sound. This behaves exactly like
+ * ca_context_play_full() with the properties the sound was prepared
+ * with. If the context properties or the sound theme changed since
+ * the sound was prepared it is looked up again first.
+ *
+ * Returns: 0 on success, negative error code on error.
+ */
+int ca_context_play_prepared(ca_context *c, ca_prepared *p, uint32_t id, ca_finish_callback_t cb, void *userdata) {
+    int ret = CA_SUCCESS;
+    ca_proplist *cp;
+
+    ca_return_val_if_fail(!ca_detect_fork(), CA_ERROR_FORKED);
+    ca_return_val_if_fail(c, CA_ERROR_INVALID);
+    ca_return_val_if_fail(p, CA_ERROR_INVALID);
+    ca_return_val_if_fail(p->context == c, CA_ERROR_INVALID);
+    ca_return_val_if_fail(!userdata || cb, CA_ERROR_INVALID);
+
+    cp = ca_context_ref_props(c);
+
+    if ((ret = check_enabled(p->props, cp)) < 0)
+        goto finish;
+
+    /* Only reloading needs the lock, which is rare */
+    if (prepared_is_stale(p, cp)) {
+        ca_mutex_lock(c->mutex);
+
+        if (prepared_is_stale(p, c->props))
+            ret = prepared_load_unlocked(p);
+
+        ca_mutex_unlock(c->mutex);
+
+        if (ret < 0)
+            goto finish;
+    }
+
+    if ((ret = context_open(c)) < 0)
+        goto finish;
+
+    ca_assert(c->opened);
+
+    ret = play_voice(c, id, p->props, cp, cb, userdata);
+
+finish:
+
+    ca_assert_se(ca_proplist_destroy(cp) == CA_SUCCESS);
+
+    return ret;
+}
+
+/**
+ * ca_prepared_destroy:
+ * @p: the prepared event sound to free
+ *
+ * Free an event sound prepared with ca_context_prepare(). Sounds
+ * that are still playing are not affected. This may also be called
+ * after the context has been destroyed.
+ *
+ * Returns: 0 on success, negative error code on error.
+ */
+int ca_prepared_destroy(ca_prepared *p) {
+    ca_return_val_if_fail(p, CA_ERROR_INVALID);
+
+    prepared_unload(p);
+
+    if (p->theme)
+        ca_theme_data_unref(p->theme);
+
+    if (p->props)
+        ca_proplist_destroy(p->props);
+
+    ca_free(p);
+
+    return CA_SUCCESS;
+}
+
+/**
+ * ca_context_get_stats:
+ * @c: the context to query
+ * @p: A pointer where the property list with the statistics is stored.
+ *
+ * Query the counters libcanberra keeps about the sound events it
+ * played. The counters are kept for the whole process, since the
+ * caches they cover are shared between all contexts. All values are
+ * unsigned integers formatted as strings:
+ *
+ * canberra.stats.bytes-decoded: bytes read from sound files;
+ * canberra.stats.streams: sound events playing right now;
+ * canberra.stats.streams-max: the most that ever played at the same time;
+ * canberra.stats.device-latency.usec: the buffer latency of the device most recently opened;
+ * canberra.stats.device-latency.usec-min and canberra.stats.device-latency.usec-max: the lowest and highest one so far.
+ *
+ * The device latency is only reported by the ALSA backend.
+ *
+ * For each of the stages lookup (finding the sound in the theme),
+ * cache-hit and cache-miss (querying the lookup cache), file-open,
+ * decode (decoding into the sample cache), device-open, first-write
+ * and finish (the latter two measured from the moment the backend got
+ * the event) there is canberra.stats.<stage>.count, and the total and
+ * maximum time spent in it in canberra.stats.<stage>.usec and
+ * canberra.stats.<stage>.usec-max.
+ *
+ * If $CANBERRA_TRACE is set every stage is logged to stderr as well.
+ *
+ * Returns: 0 on success, negative error code on error. On success the property list should be freed with ca_proplist_destroy().
+ */
+int ca_context_get_stats(ca_context *c, ca_proplist **p) {
+    ca_return_val_if_fail(!ca_detect_fork(), CA_ERROR_FORKED);
+    ca_return_val_if_fail(c, CA_ERROR_INVALID);
+    ca_return_val_if_fail(p, CA_ERROR_INVALID);
+
+    return ca_trace_get_stats(p);
+}
+
+/* Big enough to not make the decoder spend its time in function
+ * calls */
+#define CHECK_BUFSIZE (16*1024)
+
+static int check_decode(ca_sound_file *f, size_t *nbytes) {
+    void *data;
+    size_t fs, k;
+    int ret;
+
+    fs = ca_sound_file_frame_size(f);
+    k = (CHECK_BUFSIZE/fs)*fs;
+
+    if (!(data = ca_malloc(k)))
+        return CA_ERROR_OOM;
+
+    *nbytes = 0;
+
+    for (;;) {
+        size_t n = k;
+
+        if ((ret = ca_sound_file_read_arbitrary(f, data, &n)) < 0)
+            break;
+
+        if (n <= 0)
+            break;
+
+        *nbytes += n;
+    }
+
+    ca_free(data);
+
+    return ret;
+}
+
+static int check_sound(ca_theme_data **t, ca_proplist *cp, ca_proplist *sp, ca_proplist *r) {
+    ca_cache_control_t control = CA_CACHE_CONTROL_NEVER;
+    ca_sound_file *f = NULL;
+    ca_sample *s = NULL;
+    char *path = NULL;
+    const char *ct;
+    ca_usec_t start;
+    size_t nbytes = 0;
+    int ret;
+
+    ca_proplist_lock(sp);
+
+    if ((ct = ca_proplist_gets_key_unlocked(sp, CA_PROP_KEY_CANBERRA_CACHE_CONTROL)))
+        ret = ca_parse_cache_control(&control, ct);
+    else
+        ret = CA_SUCCESS;
+
+    ca_proplist_unlock(sp);
+
+    if (ret < 0)
+        return CA_ERROR_INVALID;
+
+    /* This is what warms the theme index and the lookup cache */
+    start = ca_trace_now();
+
+    if ((ret = ca_lookup_sound_with_callback(&f, ca_sound_file_open, &path, t, cp, sp)) < 0)
+        goto finish;
+
+    ca_proplist_setf(r, "canberra.check.lookup.usec", "%llu", (unsigned long long) (ca_trace_now() - start));
+
+    if (path)
+        ca_proplist_sets(r, "canberra.check.filename", path);
+
+    ca_proplist_setf(r, "canberra.check.rate", "%u", ca_sound_file_get_rate(f));
+    ca_proplist_setf(r, "canberra.check.channels", "%u", ca_sound_file_get_nchannels(f));
+
+    start = ca_trace_now();
+
+    /* If the sound is to be cached we decode it into the sample
+     * cache, for the drivers to find. The second lookup is cheap
+     * now. Otherwise we just make sure it decodes. */
+    if (control != CA_CACHE_CONTROL_NEVER) {
+        ca_sound_file_close(f);
+        f = NULL;
+
+        if ((ret = ca_sample_cache_lookup_sound(&s, &f, t, cp, sp, NULL)) < 0)
+            goto finish;
+    }
+
+    if (s)
+        nbytes = s->nbytes;
+    else if ((ret = check_decode(f, &nbytes)) < 0)
+        goto finish;
+
+    ca_proplist_setf(r, "canberra.check.decode.usec", "%llu", (unsigned long long) (ca_trace_now() - start));
+    ca_proplist_setf(r, "canberra.check.bytes", "%llu", (unsigned long long) nbytes);
+    ca_proplist_sets(r, "canberra.check.cached", s ? "1" : "0");
+
+finish:
+
+    if (f)
+        ca_sound_file_close(f);
+
+    if (s)
+        ca_sample_unref(s);
+
+    ca_free(path);
+
+    return ret;
+}
+
+/**
+ * ca_context_check:
+ * @c: the context to check the event sound for
+ * @r: A pointer where the property list with the results is stored, or %NULL.
+ * @...: The properties for this event sound. Terminated with NULL.
+ *
+ * Look up and decode an event sound exactly like ca_context_play()
+ * would, but don't play it. This neither opens the context nor talks
+ * to the sound system, so that applications may validate their event
+ * sounds at startup in a background thread. As a side effect the
+ * theme is parsed, the lookup cache is filled and the sound is
+ * decoded into the sample cache if %CA_PROP_CANBERRA_CACHE_CONTROL
+ * asks for that, which makes playing it later fast.
+ *
+ * Unless NULL is passed, on success *r is set to a property list with
+ * the results. All values are strings:
+ *
+ * canberra.check.filename: the file the event sound was found in;
+ * canberra.check.rate, canberra.check.channels: its format;
+ * canberra.check.bytes: the size of the decoded sound;
+ * canberra.check.cached: "1" if it is in the sample cache now;
+ * canberra.check.lookup.usec, canberra.check.decode.usec: the time
+ * spent looking the sound up and decoding it.
+ *
+ * Returns: 0 on success, negative error code on error, %CA_ERROR_NOTFOUND if the event sound doesn't exist.
+ */
+int ca_context_check(ca_context *c, ca_proplist **r, ...) {
+    int ret;
+    va_list ap;
+    ca_proplist *p = NULL;
+
+    ca_return_val_if_fail(!ca_detect_fork(), CA_ERROR_FORKED);
+    ca_return_val_if_fail(c, CA_ERROR_INVALID);
+
+    va_start(ap, r);
+    ret = ca_proplist_from_ap(&p, ap);
+    va_end(ap);
+
+    if (ret < 0)
+        return ret;
+
+    ret = ca_context_check_full(c, r, p);
+
+    ca_assert_se(ca_proplist_destroy(p) == 0);
+
+    return ret;
+}
+
+/**
+ * ca_context_check_full:
+ * @c: the context to check the event sound for
+ * @r: A pointer where the property list with the results is stored, or %NULL.
+ * @p: A property list of properties for this event sound
+ *
+ * Check an event sound without playing it. See ca_context_check().
+ *
+ * Returns: 0 on success, negative error code on error. On success the property list should be freed with ca_proplist_destroy().
+ */
+int ca_context_check_full(ca_context *c, ca_proplist **_r, ca_proplist *p) {
+    ca_proplist *cp, *r = NULL;
+    ca_theme_data *t;
+    int ret;
+
+    ca_return_val_if_fail(!ca_detect_fork(), CA_ERROR_FORKED);
+    ca_return_val_if_fail(c, CA_ERROR_INVALID);
+    ca_return_val_if_fail(p, CA_ERROR_INVALID);
+
+    /* We don't hold the context lock while we decode, so that
+     * checking doesn't hold up playing */
+    ca_mutex_lock(c->mutex);
+
+    ca_return_val_if_fail_unlock(ca_proplist_contains_key(p, CA_PROP_KEY_EVENT_ID) ||
+                                 ca_proplist_contains_key(c->props, CA_PROP_KEY_EVENT_ID) ||
+                                 ca_proplist_contains_key(p, CA_PROP_KEY_MEDIA_FILENAME) ||
+                                 ca_proplist_contains_key(c->props, CA_PROP_KEY_MEDIA_FILENAME), CA_ERROR_INVALID, c->mutex);
+
+    cp = ca_proplist_ref(c->props);
+    t = c->check_theme;
+    c->check_theme = NULL;
+
+    ca_mutex_unlock(c->mutex);
+
+    if ((ret = ca_proplist_create(&r)) < 0)
+        goto finish;
+
+    if ((ret = check_sound(&t, cp, p, r)) < 0)
+        goto finish;
+
+    if (_r) {
+        *_r = r;
+        r = NULL;
+    }
+
+finish:
+
+    /* Keep the theme, unless somebody else was quicker */
+    if (t) {
+        ca_mutex_lock(c->mutex);
+
+        if (!c->check_theme) {
+            c->check_theme = t;
+            t = NULL;
+        }
+
+        ca_mutex_unlock(c->mutex);
+
+        if (t)
+            ca_theme_data_unref(t);
+    }
+
+    if (r)
+        ca_proplist_destroy(r);
+
+    ca_proplist_destroy(cp);
+
+    return ret;
+}
+
+int ca_cache_many_sequentially(ca_context *c, ca_proplist **p, unsigned n, int *results, int (*cache)(ca_context *c, ca_proplist *p)) {
+    int ret = CA_SUCCESS;
+    unsigned i;
+
+    ca_return_val_if_fail(c, CA_ERROR_INVALID);
+    ca_return_val_if_fail(p || n <= 0, CA_ERROR_INVALID);
+    ca_return_val_if_fail(results || n <= 0, CA_ERROR_INVALID);
+    ca_return_val_if_fail(cache, CA_ERROR_INVALID);
+
+    for (i = 0; i < n; i++) {
+
+        if (results[i] >= 0)
+            results[i] = cache(c, p[i]);
+
+        if (results[i] < 0 && ret == CA_SUCCESS)
+            ret = results[i];
+    }
+
+    return ret;
+}
+
 /**
  * ca_strerror:
  * @code: Numerical error code as returned by a libcanberra API function
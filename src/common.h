@@ -21,25 +21,102 @@
   <http://www.gnu.org/licenses/>.
 ***/
 
+#include <pthread.h>
+
 #include "canberra.h"
+#include "llist.h"
 #include "macro.h"
 #include "mutex.h"
 
+/* An event sound that is playing on a context. The drivers see our
+ * own ids instead of the ones of the application, so that we can
+ * stop a single one of several event sounds sharing an id. */
+#define CA_PLAYING_SLOTS 64U
+
+struct ca_voice {
+    CA_LLIST_FIELDS(struct ca_voice);
+    ca_context *context;
+
+    uint32_t id;
+    uint32_t driver_id;
+    unsigned priority;
+
+    /* TRUE once we asked the driver to stop it */
+    ca_bool_t canceled;
+
+    ca_finish_callback_t callback;
+    void *userdata;
+};
+
 struct ca_context {
-    ca_bool_t opened;
+    /* Only taken to open the context and to change its state, sound
+     * events are played without it. Once set, opened stays TRUE. */
+    volatile ca_bool_t opened;
     ca_mutex *mutex;
 
+    /* Frozen, and only replaced as a whole under the mutex. Whoever
+     * doesn't hold the mutex takes a reference with
+     * ca_context_ref_props(). The epoch is bumped on each swap, and
+     * the old list isn't dropped until all readers that might have
+     * seen it under the old epoch have taken their reference. */
     ca_proplist *props;
+    volatile unsigned props_epoch;
+    volatile unsigned props_readers[2];
 
     char *driver;
     char *device;
 
+    /* The voices are also touched from the drivers' callbacks, hence
+     * they have a lock of their own. Most recent first. */
+    ca_mutex *voice_mutex;
+    CA_LLIST_HEAD(struct ca_voice, voices);
+    unsigned n_voices; /* Not counting the canceled ones */
+    uint32_t next_driver_id;
+
+    /* How many voices there are, in total and by id modulo
+     * CA_PLAYING_SLOTS, so that ca_context_playing() and
+     * ca_context_left_to_play() usually don't need to take any lock.
+     * Only changed with atomic operations. */
+    volatile unsigned n_playing;
+    volatile unsigned playing_slots[CA_PLAYING_SLOTS];
+
+    /* Keeps the theme ca_context_check() parsed around for the
+     * drivers to find */
+    struct ca_theme_data *check_theme;
+
+    /* See ca_context_preopen() */
+    pthread_t preopen_thread;
+    ca_bool_t preopen_started;
+
     void *private;
 #ifdef HAVE_DSO
     void *private_dso;
 #endif
 };
 
+/* An event sound as returned by ca_context_prepare() */
+struct ca_prepared {
+    ca_context *context;
+
+    /* The event properties, and the context properties at the time
+     * we looked the sound up. The latter and the generation below
+     * are written under the context mutex, but read without it. */
+    ca_proplist *props;
+    ca_proplist * volatile context_props;
+
+    /* The decoded sound, kept in the sample cache for the drivers to
+     * find. NULL if it is too big for the cache. */
+    struct ca_sample *sample;
+    struct ca_theme_data *theme;
+
+    volatile ca_bool_t watched;
+    volatile unsigned generation;
+};
+
+/* Returns a reference to the current context properties, without
+ * taking the context lock. To be dropped with ca_proplist_destroy(). */
+ca_proplist *ca_context_ref_props(ca_context *c);
+
 typedef enum ca_cache_control {
     CA_CACHE_CONTROL_NEVER,
     CA_CACHE_CONTROL_PERMANENT,
@@ -48,4 +125,8 @@ typedef enum ca_cache_control {
 
 int ca_parse_cache_control(ca_cache_control_t *control, const char *c);
 
+/* For drivers which cannot batch uploads: caches one item after the
+ * other with the driver's own driver_cache() */
+int ca_cache_many_sequentially(ca_context *c, ca_proplist **p, unsigned n, int *results, int (*cache)(ca_context *c, ca_proplist *p));
+
 #endif
@@ -29,8 +29,15 @@ int driver_destroy(ca_context *c);
 int driver_change_device(ca_context *c, const char *device);
 int driver_change_props(ca_context *c, ca_proplist *changed, ca_proplist *merged);
 
-int driver_play(ca_context *c, uint32_t id, ca_proplist *p, ca_finish_callback_t cb, void *userdata);
+/* Called without the context lock and possibly from several threads
+ * at once. cp is the snapshot of the context properties to play the
+ * sound with, c->props might change under our feet. */
+int driver_play(ca_context *c, uint32_t id, ca_proplist *p, ca_proplist *cp, ca_finish_callback_t cb, void *userdata);
 int driver_cancel(ca_context *c, uint32_t id);
 int driver_cache(ca_context *c, ca_proplist *p);
 
+/* Items whose entry in results is already negative on entry are
+ * skipped. Returns the first error of any item. */
+int driver_cache_many(ca_context *c, ca_proplist **p, unsigned n, int *results);
+
 #endif
@@ -23,8 +23,12 @@
 #endif
 
 #include <ltdl.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "driver.h"
 #include "common.h"
@@ -39,9 +43,10 @@ struct private_dso {
     int (*driver_destroy)(ca_context *c);
     int (*driver_change_device)(ca_context *c, const char *device);
     int (*driver_change_props)(ca_context *c, ca_proplist *changed, ca_proplist *merged);
-    int (*driver_play)(ca_context *c, uint32_t id, ca_proplist *p, ca_finish_callback_t cb, void *userdata);
+    int (*driver_play)(ca_context *c, uint32_t id, ca_proplist *p, ca_proplist *cp, ca_finish_callback_t cb, void *userdata);
     int (*driver_cancel)(ca_context *c, uint32_t id);
     int (*driver_cache)(ca_context *c, ca_proplist *p);
+    int (*driver_cache_many)(ca_context *c, ca_proplist **p, unsigned n, int *results);
 };
 
 #define PRIVATE_DSO(c) ((struct private_dso *) ((c)->private_dso))
@@ -173,10 +178,198 @@ static void* real_dlsym(lt_module m, const char *name, const char *symbol) {
 #define MAKE_FUNC_PTR(ret, args, x) ((ret (*) args ) (size_t) (x))
 #define GET_FUNC_PTR(module, name, symbol, ret, args) MAKE_FUNC_PTR(ret, args, real_dlsym((module), (name), (symbol)))
 
+static void close_module(struct private_dso *p) {
+
+    if (p->module) {
+        lt_dlclose(p->module);
+        p->module = NULL;
+    }
+
+    p->driver_open = NULL;
+    p->driver_destroy = NULL;
+    p->driver_change_device = NULL;
+    p->driver_change_props = NULL;
+    p->driver_play = NULL;
+    p->driver_cancel = NULL;
+    p->driver_cache = NULL;
+    p->driver_cache_many = NULL;
+}
+
+/* Loads the backend and opens it. On failure nothing of the backend
+ * is left behind, so that the next one may be tried. */
+static int try_driver(ca_context *c, const char *driver) {
+    struct private_dso *p;
+    int ret;
+
+    p = PRIVATE_DSO(c);
+
+    if ((ret = try_open(c, driver)) < 0)
+        return ret;
+
+    ca_assert(p->module);
+
+    if (!(p->driver_open = GET_FUNC_PTR(p->module, driver, "driver_open", int, (ca_context*))) ||
+        !(p->driver_destroy = GET_FUNC_PTR(p->module, driver, "driver_destroy", int, (ca_context*))) ||
+        !(p->driver_change_device = GET_FUNC_PTR(p->module, driver, "driver_change_device", int, (ca_context*, const char *))) ||
+        !(p->driver_change_props = GET_FUNC_PTR(p->module, driver, "driver_change_props", int, (ca_context *, ca_proplist *, ca_proplist *))) ||
+        !(p->driver_play = GET_FUNC_PTR(p->module, driver, "driver_play", int, (ca_context*, uint32_t, ca_proplist *, ca_proplist *, ca_finish_callback_t, void *))) ||
+        !(p->driver_cancel = GET_FUNC_PTR(p->module, driver, "driver_cancel", int, (ca_context*, uint32_t))) ||
+        !(p->driver_cache = GET_FUNC_PTR(p->module, driver, "driver_cache", int, (ca_context*, ca_proplist *)))) {
+
+        close_module(p);
+        return CA_ERROR_CORRUPT;
+    }
+
+    /* Optional, we fall back to caching one by one */
+    p->driver_cache_many = GET_FUNC_PTR(p->module, driver, "driver_cache_many", int, (ca_context*, ca_proplist **, unsigned, int *));
+
+    /* The backend cleans up after itself if this fails */
+    if ((ret = p->driver_open(c)) < 0) {
+        p->driver_destroy = NULL;
+        close_module(p);
+        return ret;
+    }
+
+    return CA_SUCCESS;
+}
+
+/* Which backend won recently, and when. The ones before it in
+ * ca_driver_order failed to load then, hence we don't try them again
+ * until DRIVER_CACHE_SEC have passed, so that the order is back to
+ * normal soon after the better backend recovered. In this process it
+ * is simply remembered, other processes of the same user on the same
+ * machine read it from a file in the cache dir. Either way it points
+ * into ca_driver_order, so nothing else is ever loaded from it. */
+#define DRIVER_CACHE_SEC 60
+
+static const char * volatile cached_driver = NULL;
+static volatile time_t cached_time = 0;
+
+static ca_bool_t cache_is_recent(time_t t, time_t now) {
+    return now >= t && now < t + DRIVER_CACHE_SEC;
+}
+
+static const char *find_driver(const char *name) {
+    const char *const * e;
+
+    for (e = ca_driver_order; *e; e++)
+        if (ca_streq(*e, name))
+            return *e;
+
+    return NULL;
+}
+
+static char *get_cache_path(void) {
+    const char *env, *subdir;
+    char host[256];
+
+    if ((env = getenv("XDG_CACHE_HOME")) && *env == '/')
+        subdir = "";
+    else if ((env = getenv("HOME")) && *env == '/')
+        subdir = "/.cache";
+    else
+        return NULL;
+
+    /* Home directories might be shared between machines with
+     * different sound systems */
+    if (gethostname(host, sizeof(host)) < 0)
+        return NULL;
+
+    host[sizeof(host)-1] = 0;
+
+    return ca_sprintf_malloc("%s%s/libcanberra-driver.%s", env, subdir, host);
+}
+
+static const char *load_cached_driver(void) {
+    const char *d = NULL;
+    char *fn, ln[64];
+    unsigned long t;
+    time_t now;
+    FILE *f;
+
+    now = time(NULL);
+
+    if ((d = cached_driver) && cache_is_recent(cached_time, now))
+        return d;
+
+    if (!(fn = get_cache_path()))
+        return NULL;
+
+    f = fopen(fn, "r");
+    ca_free(fn);
+
+    if (!f)
+        return NULL;
+
+    d = NULL;
+
+    if (fgets(ln, sizeof(ln), f)) {
+        size_t k = strcspn(ln, " \n\r\t");
+
+        /* Files without a time are too old to go by */
+        if (ln[k] == ' ' && sscanf(ln + k + 1, "%lu", &t) == 1 && cache_is_recent((time_t) t, now)) {
+            ln[k] = 0;
+
+            if ((d = find_driver(ln))) {
+                cached_time = (time_t) t;
+                cached_driver = d;
+            }
+        }
+    }
+
+    fclose(f);
+
+    return d;
+}
+
+static void save_cached_driver(const char *driver) {
+    char *fn, *tmp;
+    time_t now;
+    FILE *f;
+
+    now = time(NULL);
+
+    if (cached_driver == driver && cache_is_recent(cached_time, now))
+        return;
+
+    cached_time = now;
+    cached_driver = driver;
+
+    if (!(fn = get_cache_path()))
+        return;
+
+    /* Written to a temporary file first, so that nobody ever reads a
+     * half written one */
+    if (!(tmp = ca_sprintf_malloc("%s.%lu", fn, (unsigned long) getpid()))) {
+        ca_free(fn);
+        return;
+    }
+
+    if ((f = fopen(tmp, "w"))) {
+        ca_bool_t good;
+
+        good = fprintf(f, "%s %lu\n", driver, (unsigned long) now) >= 0;
+
+        if (fclose(f) == 0 && good)
+            rename(tmp, fn);
+        else
+            unlink(tmp);
+    }
+
+    ca_free(tmp);
+    ca_free(fn);
+}
+
+static ca_bool_t is_fallback_error(int ret) {
+    return
+        ret == CA_ERROR_NODRIVER ||
+        ret == CA_ERROR_NOTAVAILABLE ||
+        ret == CA_ERROR_NOTFOUND;
+}
+
 int driver_open(ca_context *c) {
     int ret;
     struct private_dso *p;
-    char *driver;
 
     ca_return_val_if_fail(c, CA_ERROR_INVALID);
     ca_return_val_if_fail(!PRIVATE_DSO(c), CA_ERROR_STATE);
@@ -210,63 +403,55 @@ int driver_open(ca_context *c) {
             return CA_ERROR_INVALID;
         }
 
-        if ((ret = try_open(c, e)) < 0) {
+        ret = try_driver(c, e);
+        ca_free(e);
+
+        if (ret < 0) {
             driver_destroy(c);
-            ca_free(e);
             return ret;
         }
 
-        driver = e;
-
     } else {
         const char *const * e;
+        const char *cached;
+        unsigned pass;
 
-        for (e = ca_driver_order; *e; e++) {
+        /* The first pass skips those that failed just recently, the
+         * second one tries them after all, in case the one that won
+         * back then is gone now */
+        cached = load_cached_driver();
 
-            if ((ret = try_open(c, *e)) == CA_SUCCESS)
-                break;
+        for (pass = 0; pass < 2; pass++) {
+            ca_bool_t skip = pass == 0 && cached;
 
-            if (ret != CA_ERROR_NODRIVER &&
-                ret != CA_ERROR_NOTAVAILABLE &&
-                ret != CA_ERROR_NOTFOUND) {
+            for (e = ca_driver_order; *e; e++) {
 
-                driver_destroy(c);
-                return ret;
-            }
-        }
+                if (skip) {
+                    if (*e != cached)
+                        continue;
 
-        if (!*e) {
-            driver_destroy(c);
-            return CA_ERROR_NODRIVER;
-        }
-
-        if (!(driver = ca_strdup(*e))) {
-            driver_destroy(c);
-            return CA_ERROR_OOM;
-        }
-    }
+                    skip = FALSE;
 
-    ca_assert(p->module);
+                } else if (pass == 1 && *e == cached)
+                    break;
 
-    if (!(p->driver_open = GET_FUNC_PTR(p->module, driver, "driver_open", int, (ca_context*))) ||
-        !(p->driver_destroy = GET_FUNC_PTR(p->module, driver, "driver_destroy", int, (ca_context*))) ||
-        !(p->driver_change_device = GET_FUNC_PTR(p->module, driver, "driver_change_device", int, (ca_context*, const char *))) ||
-        !(p->driver_change_props = GET_FUNC_PTR(p->module, driver, "driver_change_props", int, (ca_context *, ca_proplist *, ca_proplist *))) ||
-        !(p->driver_play = GET_FUNC_PTR(p->module, driver, "driver_play", int, (ca_context*, uint32_t, ca_proplist *, ca_finish_callback_t, void *))) ||
-        !(p->driver_cancel = GET_FUNC_PTR(p->module, driver, "driver_cancel", int, (ca_context*, uint32_t))) ||
-        !(p->driver_cache = GET_FUNC_PTR(p->module, driver, "driver_cache", int, (ca_context*, ca_proplist *)))) {
+                if ((ret = try_driver(c, *e)) == CA_SUCCESS) {
+                    save_cached_driver(*e);
+                    return CA_SUCCESS;
+                }
 
-        ca_free(driver);
-        driver_destroy(c);
-        return CA_ERROR_CORRUPT;
-    }
+                if (!is_fallback_error(ret)) {
+                    driver_destroy(c);
+                    return ret;
+                }
+            }
 
-    ca_free(driver);
+            if (!cached)
+                break;
+        }
 
-    if ((ret = p->driver_open(c)) < 0) {
-        p->driver_destroy = NULL;
         driver_destroy(c);
-        return ret;
+        return CA_ERROR_NODRIVER;
     }
 
     return CA_SUCCESS;
@@ -284,8 +469,7 @@ int driver_destroy(ca_context *c) {
     if (p->driver_destroy)
         ret = p->driver_destroy(c);
 
-    if (p->module)
-        lt_dlclose(p->module);
+    close_module(p);
 
     if (p->ltdl_initialized) {
         lt_dlexit();
@@ -323,7 +507,7 @@ int driver_change_props(ca_context *c, ca_proplist *changed, ca_proplist *merged
     return p->driver_change_props(c, changed, merged);
 }
 
-int driver_play(ca_context *c, uint32_t id, ca_proplist *pl, ca_finish_callback_t cb, void *userdata) {
+int driver_play(ca_context *c, uint32_t id, ca_proplist *pl, ca_proplist *cp, ca_finish_callback_t cb, void *userdata) {
     struct private_dso *p;
 
     ca_return_val_if_fail(c, CA_ERROR_INVALID);
@@ -332,7 +516,7 @@ int driver_play(ca_context *c, uint32_t id, ca_proplist *pl, ca_finish_callback_
     p = PRIVATE_DSO(c);
     ca_return_val_if_fail(p->driver_play, CA_ERROR_STATE);
 
-    return p->driver_play(c, id, pl, cb, userdata);
+    return p->driver_play(c, id, pl, cp, cb, userdata);
 }
 
 int driver_cancel(ca_context *c, uint32_t id) {
@@ -358,3 +542,18 @@ int driver_cache(ca_context *c, ca_proplist *pl) {
 
     return p->driver_cache(c, pl);
 }
+
+int driver_cache_many(ca_context *c, ca_proplist **pl, unsigned n, int *results) {
+    struct private_dso *p;
+
+    ca_return_val_if_fail(c, CA_ERROR_INVALID);
+    ca_return_val_if_fail(c->private_dso, CA_ERROR_STATE);
+
+    p = PRIVATE_DSO(c);
+    ca_return_val_if_fail(p->driver_cache, CA_ERROR_STATE);
+
+    if (!p->driver_cache_many)
+        return ca_cache_many_sequentially(c, pl, n, results, p->driver_cache);
+
+    return p->driver_cache_many(c, pl, n, results);
+}
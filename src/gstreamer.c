@@ -50,9 +50,19 @@ struct outstanding {
     ca_finish_callback_t callback;
     void *userdata;
     GstElement *pipeline;
+    GstElement *abin;
     struct ca_context *context;
 };
 
+/* A converter and sink bin that is kept in READY state after a sound
+ * event finished, so that the next one doesn't need to set up and
+ * probe for the audio sink again */
+struct idle_bin {
+    CA_LLIST_FIELDS(struct idle_bin);
+    GstElement *bin;
+    GstClockTime expiry;
+};
+
 struct private {
     ca_theme_data *theme;
     ca_bool_t signal_semaphore;
@@ -65,10 +75,16 @@ struct private {
     ca_bool_t mgr_thread_running;
     ca_bool_t semaphore_allocated;
     CA_LLIST_HEAD(struct outstanding, outstanding);
+
+    unsigned bin_idle_timeout;
+    CA_LLIST_HEAD(struct idle_bin, idle_bins);
+    unsigned n_idle_bins;
 };
 
 #define PRIVATE(c) ((struct private *) ((c)->private))
 
+#define IDLE_BINS_MAX 4U
+
 static void* thread_func(void *userdata);
 static void send_eos_msg(struct outstanding *out, int err);
 static void send_mgr_exit_msg (struct private *p);
@@ -91,6 +107,49 @@ static void outstanding_free(struct outstanding *o) {
     ca_free(o);
 }
 
+static void idle_bins_free(struct idle_bin *l) {
+
+    while (l) {
+        struct idle_bin *i = l;
+
+        l = l->next;
+
+        gst_element_set_state(i->bin, GST_STATE_NULL);
+        gst_object_unref(GST_OBJECT(i->bin));
+        ca_free(i);
+    }
+}
+
+/* Removes all bins that expire before now, or all of them if now is
+ * GST_CLOCK_TIME_NONE. The caller frees them after dropping the lock. */
+static struct idle_bin *steal_idle_bins_unlocked(struct private *p, GstClockTime now) {
+    struct idle_bin *i, *n, *l = NULL;
+
+    for (i = p->idle_bins; i; i = n) {
+        n = i->next;
+
+        if (now != GST_CLOCK_TIME_NONE && i->expiry > now)
+            continue;
+
+        CA_LLIST_REMOVE(struct idle_bin, p->idle_bins, i);
+        CA_LLIST_PREPEND(struct idle_bin, l, i);
+        p->n_idle_bins--;
+    }
+
+    return l;
+}
+
+static unsigned get_bin_idle_timeout(ca_proplist *l) {
+    unsigned n;
+
+    /* Keeping the sink in READY keeps the device open, so this is
+     * opt-in, like in the ALSA backend */
+    if (ca_proplist_get_unsigned(l, CA_PROP_CANBERRA_DEVICE_IDLE_TIMEOUT, &n) < 0)
+        return 0;
+
+    return n;
+}
+
 int driver_open(ca_context *c) {
     GError *error = NULL;
     struct private *p;
@@ -111,6 +170,8 @@ int driver_open(ca_context *c) {
         return CA_ERROR_OOM;
     c->private = p;
 
+    p->bin_idle_timeout = get_bin_idle_timeout(c->props);
+
     if (!(p->outstanding_mutex = ca_mutex_new())) {
         driver_destroy(c);
         return CA_ERROR_OOM;
@@ -142,6 +203,7 @@ int driver_open(ca_context *c) {
 int driver_destroy(ca_context *c) {
     struct private *p;
     struct outstanding *out;
+    struct idle_bin *l = NULL;
 
     ca_return_val_if_fail(c, CA_ERROR_INVALID);
     ca_return_val_if_fail(PRIVATE(c), CA_ERROR_STATE);
@@ -172,15 +234,19 @@ int driver_destroy(ca_context *c) {
             }
         }
 
+        l = steal_idle_bins_unlocked(p, GST_CLOCK_TIME_NONE);
+
         ca_mutex_unlock(p->outstanding_mutex);
         ca_mutex_free(p->outstanding_mutex);
     }
 
+    idle_bins_free(l);
+
     if (p->mgr_bus)
         g_object_unref(p->mgr_bus);
 
     if (p->theme)
-        ca_theme_data_free(p->theme);
+        ca_theme_data_unref(p->theme);
 
     if (p->semaphore_allocated)
         sem_destroy(&p->semaphore);
@@ -200,11 +266,27 @@ int driver_change_device(ca_context *c, const char *device) {
 }
 
 int driver_change_props(ca_context *c, ca_proplist *changed, ca_proplist *merged) {
+    struct private *p;
+    struct idle_bin *l = NULL;
+
     ca_return_val_if_fail(c, CA_ERROR_INVALID);
     ca_return_val_if_fail(changed, CA_ERROR_INVALID);
     ca_return_val_if_fail(merged, CA_ERROR_INVALID);
     ca_return_val_if_fail(PRIVATE(c), CA_ERROR_STATE);
 
+    p = PRIVATE(c);
+
+    if (ca_proplist_contains_key(changed, CA_PROP_KEY_CANBERRA_DEVICE_IDLE_TIMEOUT)) {
+        ca_mutex_lock(p->outstanding_mutex);
+
+        if ((p->bin_idle_timeout = get_bin_idle_timeout(merged)) <= 0)
+            l = steal_idle_bins_unlocked(p, GST_CLOCK_TIME_NONE);
+
+        ca_mutex_unlock(p->outstanding_mutex);
+    }
+
+    idle_bins_free(l);
+
     return CA_SUCCESS;
 }
 
@@ -317,6 +399,138 @@ static void on_pad_added(GstElement *element, GstPad *pad, gboolean arg1, gpoint
     gst_caps_unref(caps);
 }
 
+static GstElement* make_audio_bin(void) {
+    GstElement *abin, *audioconvert = NULL, *audioresample = NULL, *sink = NULL;
+    GstPad *audiopad;
+
+    if (!(abin = gst_bin_new("audiobin"))
+        || !(audioconvert = gst_element_factory_make("audioconvert", NULL))
+        || !(audioresample = gst_element_factory_make("audioresample", NULL))
+        || !(sink = gst_element_factory_make("autoaudiosink", NULL))) {
+
+        if (abin != NULL)
+           g_object_unref(abin);
+        if (audioconvert != NULL)
+           g_object_unref(audioconvert);
+        if (audioresample != NULL)
+           g_object_unref(audioresample);
+        if (sink != NULL)
+           g_object_unref(sink);
+
+        return NULL;
+    }
+
+    gst_bin_add_many(GST_BIN (abin), audioconvert, audioresample, sink, NULL);
+    gst_element_link_many(audioconvert, audioresample, sink, NULL);
+
+    audiopad = gst_element_get_pad(audioconvert, "sink");
+    gst_element_add_pad(abin, gst_ghost_pad_new("sink", audiopad));
+    gst_object_unref(audiopad);
+
+    return abin;
+}
+
+static GstElement* acquire_audio_bin(struct private *p) {
+    struct idle_bin *i;
+    GstElement *abin;
+
+    ca_mutex_lock(p->outstanding_mutex);
+
+    if ((i = p->idle_bins)) {
+        CA_LLIST_REMOVE(struct idle_bin, p->idle_bins, i);
+        p->n_idle_bins--;
+    }
+
+    ca_mutex_unlock(p->outstanding_mutex);
+
+    if (!i)
+        return make_audio_bin();
+
+    abin = i->bin;
+    ca_free(i);
+
+    return abin;
+}
+
+/* Takes the pipeline of a finished sound event down, but keeps its
+ * audio bin around for the next one if it played fine. Returns FALSE
+ * if the pipeline refused to stop. */
+static ca_bool_t shutdown_pipeline(struct private *p, struct outstanding *out) {
+    struct idle_bin *i = NULL, *l = NULL;
+    GstElement *abin = NULL;
+    unsigned timeout;
+
+    ca_mutex_lock(p->outstanding_mutex);
+    timeout = p->bin_idle_timeout;
+    ca_mutex_unlock(p->outstanding_mutex);
+
+    if (out->abin &&
+        out->err == CA_SUCCESS &&
+        timeout > 0 &&
+        gst_element_set_state(out->pipeline, GST_STATE_READY) != GST_STATE_CHANGE_FAILURE &&
+        (i = ca_new0(struct idle_bin, 1))) {
+
+        GstPad *pad, *peer;
+
+        /* The pipeline is in READY now, so nothing flows anymore and
+         * we can take the bin out safely */
+        abin = gst_object_ref(out->abin);
+
+        if ((pad = gst_element_get_static_pad(abin, "sink"))) {
+            if ((peer = gst_pad_get_peer(pad))) {
+                gst_pad_unlink(peer, pad);
+                gst_object_unref(peer);
+            }
+
+            gst_object_unref(pad);
+        }
+
+        gst_bin_remove(GST_BIN(out->pipeline), abin);
+    }
+
+    out->abin = NULL;
+
+    if (gst_element_set_state(out->pipeline, GST_STATE_NULL) == GST_STATE_CHANGE_FAILURE) {
+        if (abin) {
+            gst_element_set_state(abin, GST_STATE_NULL);
+            gst_object_unref(abin);
+        }
+
+        ca_free(i);
+        return FALSE;
+    }
+
+    if (!abin)
+        return TRUE;
+
+    i->bin = abin;
+    i->expiry = gst_util_get_timestamp() + (GstClockTime) timeout * GST_MSECOND;
+
+    ca_mutex_lock(p->outstanding_mutex);
+
+    if (p->signal_semaphore)
+        /* We're shutting down */
+        l = i;
+    else {
+        CA_LLIST_PREPEND(struct idle_bin, p->idle_bins, i);
+
+        /* Don't hoard devices, drop the least recently used one */
+        if (++p->n_idle_bins > IDLE_BINS_MAX) {
+            for (l = p->idle_bins; l->next; l = l->next)
+                ;
+
+            CA_LLIST_REMOVE(struct idle_bin, p->idle_bins, l);
+            p->n_idle_bins--;
+        }
+    }
+
+    ca_mutex_unlock(p->outstanding_mutex);
+
+    idle_bins_free(l);
+
+    return TRUE;
+}
+
 static void
 send_mgr_exit_msg (struct private *p) {
     GstMessage *m;
@@ -337,13 +551,35 @@ static void* thread_func(void *userdata) {
 
     /* Pop messages from the manager bus until we see an exit command */
     do {
-        GstMessage *m = gst_bus_timed_pop(bus, GST_CLOCK_TIME_NONE);
+        GstMessage *m;
         const GstStructure *s;
         const GValue *v;
         struct outstanding *out;
+        struct idle_bin *i, *l;
+        GstClockTime now, timeout = GST_CLOCK_TIME_NONE;
+
+        /* Close the audio bins that have been idle for too long, and
+         * wake up again when the next one expires */
+        now = gst_util_get_timestamp();
+
+        ca_mutex_lock(p->outstanding_mutex);
+        l = steal_idle_bins_unlocked(p, now);
+
+        for (i = p->idle_bins; i; i = i->next)
+            if (timeout == GST_CLOCK_TIME_NONE || i->expiry - now < timeout)
+                timeout = i->expiry - now;
+
+        ca_mutex_unlock(p->outstanding_mutex);
+
+        idle_bins_free(l);
+
+        if (!(m = gst_bus_timed_pop(bus, timeout))) {
+
+            if (timeout != GST_CLOCK_TIME_NONE)
+                continue;
 
-        if (m == NULL)
             break;
+        }
         if (GST_MESSAGE_TYPE(m) != GST_MESSAGE_APPLICATION) {
             gst_message_unref (m);
             break;
@@ -364,8 +600,7 @@ static void* thread_func(void *userdata) {
 
         /* Set pipeline back to NULL to close things. By the time this
          * completes, we can be sure bus_cb won't be called */
-        if (gst_element_set_state(out->pipeline, GST_STATE_NULL) ==
-                GST_STATE_CHANGE_FAILURE) {
+        if (!shutdown_pipeline(p, out)) {
             gst_message_unref (m);
             break;
         }
@@ -393,29 +628,26 @@ static void* thread_func(void *userdata) {
 }
 
 
-int driver_play(ca_context *c, uint32_t id, ca_proplist *proplist, ca_finish_callback_t cb, void *userdata) {
+int driver_play(ca_context *c, uint32_t id, ca_proplist *proplist, ca_proplist *cp, ca_finish_callback_t cb, void *userdata) {
     struct private *p;
     struct outstanding *out;
     ca_sound_file *f;
-    GstElement *decodebin, *sink, *audioconvert, *audioresample, *abin;
+    GstElement *decodebin, *abin;
     GstBus *bus;
-    GstPad *audiopad;
     int ret;
 
     ca_return_val_if_fail(c, CA_ERROR_INVALID);
     ca_return_val_if_fail(proplist, CA_ERROR_INVALID);
+    ca_return_val_if_fail(cp, CA_ERROR_INVALID);
     ca_return_val_if_fail(!userdata || cb, CA_ERROR_INVALID);
 
     out = NULL;
     f = NULL;
-    sink = NULL;
     decodebin = NULL;
-    audioconvert = NULL;
-    audioresample = NULL;
     abin = NULL;
     p = PRIVATE(c);
 
-    if ((ret = ca_lookup_sound_with_callback(&f, ca_gst_sound_file_open, NULL, &p->theme, c->props, proplist)) < 0)
+    if ((ret = ca_lookup_sound_with_callback(&f, ca_gst_sound_file_open, NULL, &p->theme, cp, proplist)) < 0)
         goto fail;
 
     if (!(out = ca_new0(struct outstanding, 1)))
@@ -426,26 +658,17 @@ int driver_play(ca_context *c, uint32_t id, ca_proplist *proplist, ca_finish_cal
     out->userdata = userdata;
     out->context = c;
 
+    /* Only the source and the decoder are set up from scratch, the
+     * rest might be left over from an earlier sound event */
     if (!(out->pipeline = gst_pipeline_new(NULL))
         || !(decodebin = gst_element_factory_make("decodebin2", NULL))
-        || !(audioconvert = gst_element_factory_make("audioconvert", NULL))
-        || !(audioresample = gst_element_factory_make("audioresample", NULL))
-        || !(sink = gst_element_factory_make("autoaudiosink", NULL))
-        || !(abin = gst_bin_new ("audiobin"))) {
+        || !(abin = acquire_audio_bin(p))) {
 
         /* At this point, if there is a failure, free each plugin separately. */
         if (out->pipeline != NULL)
            g_object_unref (out->pipeline);
         if (decodebin != NULL)
            g_object_unref(decodebin);
-        if (audioconvert != NULL)
-           g_object_unref(audioconvert);
-        if (audioresample != NULL)
-           g_object_unref(audioresample);
-        if (sink != NULL)
-           g_object_unref(sink);
-        if (abin != NULL)
-           g_object_unref(abin);
 
         ca_free(out);
 
@@ -453,18 +676,14 @@ int driver_play(ca_context *c, uint32_t id, ca_proplist *proplist, ca_finish_cal
         goto fail;
     }
 
+    out->abin = abin;
+
     bus = gst_pipeline_get_bus(GST_PIPELINE (out->pipeline));
     gst_bus_set_sync_handler(bus, bus_cb, out);
     gst_object_unref(bus);
 
     g_signal_connect(decodebin, "new-decoded-pad",
                      G_CALLBACK (on_pad_added), abin);
-    gst_bin_add_many(GST_BIN (abin), audioconvert, audioresample, sink, NULL);
-    gst_element_link_many(audioconvert, audioresample, sink, NULL);
-
-    audiopad = gst_element_get_pad(audioconvert, "sink");
-    gst_element_add_pad(abin, gst_ghost_pad_new("sink", audiopad));
-    gst_object_unref(audiopad);
 
     gst_bin_add_many(GST_BIN (out->pipeline),
                      f->fdsrc, decodebin, abin, NULL);
@@ -552,3 +771,12 @@ int driver_cache(ca_context *c, ca_proplist *proplist) {
 
     return CA_ERROR_NOTSUPPORTED;
 }
+
+int driver_cache_many(ca_context *c, ca_proplist **proplists, unsigned n, int *results) {
+    ca_return_val_if_fail(c, CA_ERROR_INVALID);
+    ca_return_val_if_fail(proplists || n <= 0, CA_ERROR_INVALID);
+    ca_return_val_if_fail(results || n <= 0, CA_ERROR_INVALID);
+    ca_return_val_if_fail(PRIVATE(c), CA_ERROR_STATE);
+
+    return ca_cache_many_sequentially(c, proplists, n, results, driver_cache);
+}
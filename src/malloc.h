@@ -34,6 +34,7 @@
 #define ca_malloc malloc
 #define ca_free free
 #define ca_malloc0(size) calloc(1, (size))
+#define ca_realloc realloc
 #define ca_strdup strdup
 #ifdef HAVE_STRNDUP
 #define ca_strndup strndup
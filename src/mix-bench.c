@@ -0,0 +1,169 @@
+/***
+  This file is part of libcanberra.
+
+  Copyright 2008 Lennart Poettering
+
+  libcanberra is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 2.1 of the
+  License, or (at your option) any later version.
+
+  libcanberra is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with libcanberra. If not, see
+  <http://www.gnu.org/licenses/>.
+***/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "canberra.h"
+#include "common.h"
+#include "malloc.h"
+#include "mix.h"
+
+/* Compares the SIMD sample conversion and mixing kernels against the
+ * scalar loops. Prints one line per kernel and implementation:
+ *
+ *     kernel impl nsec-per-sample speedup-over-scalar
+ */
+
+#define N_SAMPLES (64*1024)
+#define N_ITERATIONS 2000
+
+enum {
+    KERNEL_U8_TO_S16NE,
+    KERNEL_S16_BYTESWAP,
+    KERNEL_S16_VOLUME,
+    KERNEL_S16_ADD,
+    _KERNEL_MAX
+};
+
+static const char * const kernel_names[_KERNEL_MAX] = {
+    [KERNEL_U8_TO_S16NE] = "u8-to-s16ne",
+    [KERNEL_S16_BYTESWAP] = "s16-byteswap",
+    [KERNEL_S16_VOLUME] = "s16-volume",
+    [KERNEL_S16_ADD] = "s16-add"
+};
+
+static uint8_t *input_u8;
+static int16_t *input_s16, *output, *reference;
+
+static void run(unsigned kernel, int16_t *d) {
+
+    switch (kernel) {
+        case KERNEL_U8_TO_S16NE:
+            ca_mix_u8_to_s16ne(d, input_u8, N_SAMPLES);
+            break;
+        case KERNEL_S16_BYTESWAP:
+            ca_mix_s16_byteswap(d, input_s16, N_SAMPLES);
+            break;
+        case KERNEL_S16_VOLUME:
+            ca_mix_s16_volume(d, input_s16, N_SAMPLES, CA_MIX_VOLUME_NORM * 3 / 2);
+            break;
+        case KERNEL_S16_ADD:
+            ca_mix_s16_add(d, input_s16, N_SAMPLES);
+            break;
+    }
+}
+
+static double now(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+
+    return (double) tv.tv_sec + (double) tv.tv_usec / 1000000.0;
+}
+
+static double bench(unsigned kernel) {
+    double t;
+    unsigned i;
+
+    /* Warm up the caches first */
+    run(kernel, output);
+
+    t = now();
+    for (i = 0; i < N_ITERATIONS; i++)
+        run(kernel, output);
+    t = now() - t;
+
+    return t * 1000000000.0 / ((double) N_SAMPLES * N_ITERATIONS);
+}
+
+static int check(unsigned kernel, ca_mix_impl_t impl) {
+
+    /* The add kernel accumulates, so start from the same data */
+    memcpy(reference, input_s16, N_SAMPLES * sizeof(int16_t));
+    memcpy(output, input_s16, N_SAMPLES * sizeof(int16_t));
+
+    ca_assert_se(ca_mix_set_impl(CA_MIX_IMPL_SCALAR) == CA_SUCCESS);
+    run(kernel, reference);
+
+    ca_assert_se(ca_mix_set_impl(impl) == CA_SUCCESS);
+    run(kernel, output);
+
+    return memcmp(reference, output, N_SAMPLES * sizeof(int16_t)) == 0;
+}
+
+int main(int argc, char *argv[]) {
+    double scalar[_KERNEL_MAX];
+    unsigned k, i;
+    int ret = 0;
+
+    input_u8 = ca_new(uint8_t, N_SAMPLES);
+    input_s16 = ca_new(int16_t, N_SAMPLES);
+    output = ca_new(int16_t, N_SAMPLES);
+    reference = ca_new(int16_t, N_SAMPLES);
+    ca_assert_se(input_u8 && input_s16 && output && reference);
+
+    /* Cover the full range, so that saturation is exercised too */
+    srand(4711);
+    for (i = 0; i < N_SAMPLES; i++) {
+        input_u8[i] = (uint8_t) rand();
+        input_s16[i] = (int16_t) (rand() - RAND_MAX/2);
+    }
+
+    printf("# default: %s\n", ca_mix_impl_to_string(ca_mix_get_impl()));
+
+    for (k = 0; k < _KERNEL_MAX; k++) {
+        ca_assert_se(ca_mix_set_impl(CA_MIX_IMPL_SCALAR) == CA_SUCCESS);
+        scalar[k] = bench(k);
+    }
+
+    for (i = 0; i < _CA_MIX_IMPL_MAX; i++) {
+
+        if (ca_mix_set_impl((ca_mix_impl_t) i) < 0)
+            continue;
+
+        for (k = 0; k < _KERNEL_MAX; k++) {
+            double t;
+
+            ca_assert_se(ca_mix_set_impl((ca_mix_impl_t) i) == CA_SUCCESS);
+            t = bench(k);
+
+            if (!check(k, (ca_mix_impl_t) i)) {
+                fprintf(stderr, "%s %s: result differs from scalar\n", kernel_names[k], ca_mix_impl_to_string((ca_mix_impl_t) i));
+                ret = 1;
+            }
+
+            printf("%s %s %.3f %.2f\n", kernel_names[k], ca_mix_impl_to_string((ca_mix_impl_t) i), t, scalar[k] / t);
+        }
+    }
+
+    ca_free(input_u8);
+    ca_free(input_s16);
+    ca_free(output);
+    ca_free(reference);
+
+    return ret;
+}
@@ -0,0 +1,772 @@
+/***
+  This file is part of libcanberra.
+
+  Copyright 2008 Lennart Poettering
+
+  libcanberra is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 2.1 of the
+  License, or (at your option) any later version.
+
+  libcanberra is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with libcanberra. If not, see
+  <http://www.gnu.org/licenses/>.
+***/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+#ifdef HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define HAVE_NEON 1
+#include <arm_neon.h>
+#endif
+
+#include "canberra.h"
+#include "common.h"
+#include "malloc.h"
+#include "mix.h"
+#include "proplist.h"
+
+/* How many frames to convert in one go on the stack */
+#define CHUNK_FRAMES 1024U
+
+/* The volume factor is applied as (s * v) >> VOLUME_SHIFT */
+#define VOLUME_SHIFT 12
+
+struct kernels {
+    void (*u8_to_s16ne)(int16_t *dst, const uint8_t *src, size_t n);
+    void (*s16_byteswap)(int16_t *dst, const int16_t *src, size_t n);
+    void (*s16_volume)(int16_t *dst, const int16_t *src, size_t n, int16_t volume);
+    void (*s16_add)(int16_t *dst, const int16_t *src, size_t n);
+};
+
+/* Scalar versions, these also handle the tails of the SIMD ones */
+
+static void u8_to_s16ne_scalar(int16_t *dst, const uint8_t *src, size_t n) {
+
+    for (; n > 0; n--, src++, dst++)
+        *dst = (int16_t) (((int) *src - 0x80) * 0x100);
+}
+
+static void s16_byteswap_scalar(int16_t *dst, const int16_t *src, size_t n) {
+
+    for (; n > 0; n--, src++, dst++)
+        *dst = CA_INT16_SWAP(*src);
+}
+
+static void s16_volume_scalar(int16_t *dst, const int16_t *src, size_t n, int16_t volume) {
+
+    for (; n > 0; n--, src++, dst++) {
+        int32_t t = ((int32_t) *src * (int32_t) volume) >> VOLUME_SHIFT;
+
+        *dst = (int16_t) CA_CLAMP(t, -0x8000, 0x7FFF);
+    }
+}
+
+static void s16_add_scalar(int16_t *dst, const int16_t *src, size_t n) {
+
+    for (; n > 0; n--, src++, dst++) {
+        int32_t sum = (int32_t) *dst + (int32_t) *src;
+
+        *dst = (int16_t) CA_CLAMP(sum, -0x8000, 0x7FFF);
+    }
+}
+
+#ifdef HAVE_X86_SIMD
+
+__attribute__((target("sse2")))
+static void u8_to_s16ne_sse2(int16_t *dst, const uint8_t *src, size_t n) {
+    const __m128i zero = _mm_setzero_si128(), bias = _mm_set1_epi8((char) 0x80);
+
+    /* Flipping the top bit makes it signed, unpacking into the high
+     * byte scales it */
+    for (; n >= 16; n -= 16, src += 16, dst += 16) {
+        __m128i x = _mm_xor_si128(_mm_loadu_si128((const __m128i*) src), bias);
+
+        _mm_storeu_si128((__m128i*) dst, _mm_unpacklo_epi8(zero, x));
+        _mm_storeu_si128((__m128i*) (dst + 8), _mm_unpackhi_epi8(zero, x));
+    }
+
+    u8_to_s16ne_scalar(dst, src, n);
+}
+
+__attribute__((target("sse2")))
+static void s16_byteswap_sse2(int16_t *dst, const int16_t *src, size_t n) {
+
+    for (; n >= 8; n -= 8, src += 8, dst += 8) {
+        __m128i x = _mm_loadu_si128((const __m128i*) src);
+
+        _mm_storeu_si128((__m128i*) dst, _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8)));
+    }
+
+    s16_byteswap_scalar(dst, src, n);
+}
+
+__attribute__((target("sse2")))
+static void s16_volume_sse2(int16_t *dst, const int16_t *src, size_t n, int16_t volume) {
+    const __m128i v = _mm_set1_epi16(volume);
+
+    for (; n >= 8; n -= 8, src += 8, dst += 8) {
+        __m128i x, lo, hi;
+
+        /* Build the full 32 bit products, shift and pack them back
+         * with saturation */
+        x = _mm_loadu_si128((const __m128i*) src);
+        lo = _mm_mullo_epi16(x, v);
+        hi = _mm_mulhi_epi16(x, v);
+
+        _mm_storeu_si128((__m128i*) dst,
+                         _mm_packs_epi32(_mm_srai_epi32(_mm_unpacklo_epi16(lo, hi), VOLUME_SHIFT),
+                                         _mm_srai_epi32(_mm_unpackhi_epi16(lo, hi), VOLUME_SHIFT)));
+    }
+
+    s16_volume_scalar(dst, src, n, volume);
+}
+
+__attribute__((target("sse2")))
+static void s16_add_sse2(int16_t *dst, const int16_t *src, size_t n) {
+
+    for (; n >= 8; n -= 8, src += 8, dst += 8)
+        _mm_storeu_si128((__m128i*) dst,
+                         _mm_adds_epi16(_mm_loadu_si128((const __m128i*) dst),
+                                        _mm_loadu_si128((const __m128i*) src)));
+
+    s16_add_scalar(dst, src, n);
+}
+
+__attribute__((target("avx2")))
+static void u8_to_s16ne_avx2(int16_t *dst, const uint8_t *src, size_t n) {
+    const __m256i bias = _mm256_set1_epi16(0x80);
+
+    for (; n >= 16; n -= 16, src += 16, dst += 16) {
+        __m256i x = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*) src));
+
+        _mm256_storeu_si256((__m256i*) dst, _mm256_slli_epi16(_mm256_sub_epi16(x, bias), 8));
+    }
+
+    u8_to_s16ne_scalar(dst, src, n);
+}
+
+__attribute__((target("avx2")))
+static void s16_byteswap_avx2(int16_t *dst, const int16_t *src, size_t n) {
+    const __m256i shuffle = _mm256_setr_epi8(
+            1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+            1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+
+    for (; n >= 16; n -= 16, src += 16, dst += 16)
+        _mm256_storeu_si256((__m256i*) dst,
+                            _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*) src), shuffle));
+
+    s16_byteswap_scalar(dst, src, n);
+}
+
+__attribute__((target("avx2")))
+static void s16_volume_avx2(int16_t *dst, const int16_t *src, size_t n, int16_t volume) {
+    const __m256i v = _mm256_set1_epi16(volume);
+
+    /* Unpacking and packing both work per 128 bit lane, so the order
+     * of the samples is preserved */
+    for (; n >= 16; n -= 16, src += 16, dst += 16) {
+        __m256i x, lo, hi;
+
+        x = _mm256_loadu_si256((const __m256i*) src);
+        lo = _mm256_mullo_epi16(x, v);
+        hi = _mm256_mulhi_epi16(x, v);
+
+        _mm256_storeu_si256((__m256i*) dst,
+                            _mm256_packs_epi32(_mm256_srai_epi32(_mm256_unpacklo_epi16(lo, hi), VOLUME_SHIFT),
+                                               _mm256_srai_epi32(_mm256_unpackhi_epi16(lo, hi), VOLUME_SHIFT)));
+    }
+
+    s16_volume_scalar(dst, src, n, volume);
+}
+
+__attribute__((target("avx2")))
+static void s16_add_avx2(int16_t *dst, const int16_t *src, size_t n) {
+
+    for (; n >= 16; n -= 16, src += 16, dst += 16)
+        _mm256_storeu_si256((__m256i*) dst,
+                            _mm256_adds_epi16(_mm256_loadu_si256((const __m256i*) dst),
+                                              _mm256_loadu_si256((const __m256i*) src)));
+
+    s16_add_scalar(dst, src, n);
+}
+
+#endif
+
+#ifdef HAVE_NEON
+
+static void u8_to_s16ne_neon(int16_t *dst, const uint8_t *src, size_t n) {
+    const uint16x8_t bias = vdupq_n_u16(0x8000);
+
+    for (; n >= 16; n -= 16, src += 16, dst += 16) {
+        uint8x16_t x = vld1q_u8(src);
+
+        vst1q_s16(dst, vreinterpretq_s16_u16(veorq_u16(vshll_n_u8(vget_low_u8(x), 8), bias)));
+        vst1q_s16(dst + 8, vreinterpretq_s16_u16(veorq_u16(vshll_n_u8(vget_high_u8(x), 8), bias)));
+    }
+
+    u8_to_s16ne_scalar(dst, src, n);
+}
+
+static void s16_byteswap_neon(int16_t *dst, const int16_t *src, size_t n) {
+
+    for (; n >= 8; n -= 8, src += 8, dst += 8)
+        vst1q_s16(dst, vreinterpretq_s16_u8(vrev16q_u8(vreinterpretq_u8_s16(vld1q_s16(src)))));
+
+    s16_byteswap_scalar(dst, src, n);
+}
+
+static void s16_volume_neon(int16_t *dst, const int16_t *src, size_t n, int16_t volume) {
+    const int16x4_t v = vdup_n_s16(volume);
+
+    for (; n >= 8; n -= 8, src += 8, dst += 8) {
+        int16x8_t x = vld1q_s16(src);
+
+        vst1q_s16(dst, vcombine_s16(vqshrn_n_s32(vmull_s16(vget_low_s16(x), v), VOLUME_SHIFT),
+                                    vqshrn_n_s32(vmull_s16(vget_high_s16(x), v), VOLUME_SHIFT)));
+    }
+
+    s16_volume_scalar(dst, src, n, volume);
+}
+
+static void s16_add_neon(int16_t *dst, const int16_t *src, size_t n) {
+
+    for (; n >= 8; n -= 8, src += 8, dst += 8)
+        vst1q_s16(dst, vqaddq_s16(vld1q_s16(dst), vld1q_s16(src)));
+
+    s16_add_scalar(dst, src, n);
+}
+
+#endif
+
+static const struct kernels kernel_table[_CA_MIX_IMPL_MAX] = {
+    [CA_MIX_IMPL_SCALAR] = {
+        u8_to_s16ne_scalar,
+        s16_byteswap_scalar,
+        s16_volume_scalar,
+        s16_add_scalar
+    },
+#ifdef HAVE_X86_SIMD
+    [CA_MIX_IMPL_SSE2] = {
+        u8_to_s16ne_sse2,
+        s16_byteswap_sse2,
+        s16_volume_sse2,
+        s16_add_sse2
+    },
+    [CA_MIX_IMPL_AVX2] = {
+        u8_to_s16ne_avx2,
+        s16_byteswap_avx2,
+        s16_volume_avx2,
+        s16_add_avx2
+    },
+#endif
+#ifdef HAVE_NEON
+    [CA_MIX_IMPL_NEON] = {
+        u8_to_s16ne_neon,
+        s16_byteswap_neon,
+        s16_volume_neon,
+        s16_add_neon
+    },
+#endif
+};
+
+static const char * const impl_names[_CA_MIX_IMPL_MAX] = {
+    [CA_MIX_IMPL_SCALAR] = "scalar",
+    [CA_MIX_IMPL_SSE2] = "sse2",
+    [CA_MIX_IMPL_AVX2] = "avx2",
+    [CA_MIX_IMPL_NEON] = "neon"
+};
+
+static ca_mix_impl_t impl = CA_MIX_IMPL_SCALAR;
+static const struct kernels *kernels = NULL;
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+
+static ca_bool_t impl_supported(ca_mix_impl_t i) {
+
+    switch (i) {
+        case CA_MIX_IMPL_SCALAR:
+            return TRUE;
+
+#ifdef HAVE_X86_SIMD
+        case CA_MIX_IMPL_SSE2:
+            __builtin_cpu_init();
+            return !!__builtin_cpu_supports("sse2");
+
+        case CA_MIX_IMPL_AVX2:
+            __builtin_cpu_init();
+            return !!__builtin_cpu_supports("avx2");
+#endif
+
+#ifdef HAVE_NEON
+        case CA_MIX_IMPL_NEON:
+            return TRUE;
+#endif
+
+        default:
+            return FALSE;
+    }
+}
+
+static void select_kernels(void) {
+    int i;
+
+    /* The table is ordered from slowest to fastest */
+    for (i = _CA_MIX_IMPL_MAX-1; i > CA_MIX_IMPL_SCALAR; i--)
+        if (impl_supported((ca_mix_impl_t) i))
+            break;
+
+    impl = (ca_mix_impl_t) i;
+    kernels = &kernel_table[impl];
+}
+
+static const struct kernels *get_kernels(void) {
+    ca_assert_se(pthread_once(&kernels_once, select_kernels) == 0);
+
+    return kernels;
+}
+
+ca_mix_impl_t ca_mix_get_impl(void) {
+    get_kernels();
+
+    return impl;
+}
+
+int ca_mix_set_impl(ca_mix_impl_t i) {
+    ca_return_val_if_fail(i < _CA_MIX_IMPL_MAX, CA_ERROR_INVALID);
+
+    get_kernels();
+
+    if (!impl_supported(i))
+        return CA_ERROR_NOTSUPPORTED;
+
+    impl = i;
+    kernels = &kernel_table[impl];
+
+    return CA_SUCCESS;
+}
+
+const char *ca_mix_impl_to_string(ca_mix_impl_t i) {
+    ca_return_val_if_fail(i < _CA_MIX_IMPL_MAX, NULL);
+
+    return impl_names[i];
+}
+
+void ca_mix_u8_to_s16ne(int16_t *dst, const uint8_t *src, size_t n) {
+    get_kernels()->u8_to_s16ne(dst, src, n);
+}
+
+void ca_mix_s16_byteswap(int16_t *dst, const int16_t *src, size_t n) {
+    get_kernels()->s16_byteswap(dst, src, n);
+}
+
+void ca_mix_s16_volume(int16_t *dst, const int16_t *src, size_t n, unsigned volume) {
+    get_kernels()->s16_volume(dst, src, n, (int16_t) CA_MIN(volume, CA_MIX_VOLUME_MAX));
+}
+
+void ca_mix_s16_add(int16_t *dst, const int16_t *src, size_t n) {
+    get_kernels()->s16_add(dst, src, n);
+}
+
+int ca_mix_get_volume(ca_proplist *p, unsigned *volume) {
+    const char *t;
+    char *e = NULL;
+    double db, v;
+    int ret;
+
+    ca_return_val_if_fail(p, CA_ERROR_INVALID);
+    ca_return_val_if_fail(volume, CA_ERROR_INVALID);
+
+    ca_proplist_lock(p);
+
+    if (!(t = ca_proplist_gets_unlocked(p, CA_PROP_CANBERRA_VOLUME))) {
+        *volume = CA_MIX_VOLUME_NORM;
+        ret = CA_SUCCESS;
+        goto finish;
+    }
+
+    errno = 0;
+    db = strtod(t, &e);
+
+    if (errno != 0 || !e || *e || e == t) {
+        ret = CA_ERROR_INVALID;
+        goto finish;
+    }
+
+    /* Clamped, since the fixed point factor cannot go any louder */
+    v = (double) CA_MIX_VOLUME_NORM * pow(10.0, db / 20.0);
+    *volume = v >= (double) CA_MIX_VOLUME_MAX ? CA_MIX_VOLUME_MAX : (unsigned) (v + 0.5);
+    ret = CA_SUCCESS;
+
+finish:
+    ca_proplist_unlock(p);
+
+    return ret;
+}
+
+int ca_mix_source(int16_t *mix, unsigned nchannels, size_t *_frames, ca_sample *s, size_t *offset, ca_sound_file *f, unsigned volume) {
+    int16_t buf[CHUNK_FRAMES*2], conv[CHUNK_FRAMES*2], chan[CHUNK_FRAMES*2];
+    unsigned src_nchannels;
+    ca_sample_type_t type;
+    size_t fs, frames, done = 0;
+    int ret;
+
+    ca_return_val_if_fail(mix, CA_ERROR_INVALID);
+    ca_return_val_if_fail(nchannels == 1 || nchannels == 2, CA_ERROR_INVALID);
+    ca_return_val_if_fail(_frames, CA_ERROR_INVALID);
+    ca_return_val_if_fail(!s || offset, CA_ERROR_INVALID);
+    ca_return_val_if_fail(s || f, CA_ERROR_INVALID);
+
+    if (s) {
+        src_nchannels = s->nchannels;
+        type = s->type;
+    } else {
+        src_nchannels = ca_sound_file_get_nchannels(f);
+        type = ca_sound_file_get_sample_type(f);
+    }
+
+    ca_return_val_if_fail(src_nchannels == 1 || src_nchannels == 2, CA_ERROR_NOTSUPPORTED);
+
+    fs = src_nchannels * (type == CA_SAMPLE_U8 ? sizeof(uint8_t) : sizeof(int16_t));
+    frames = *_frames;
+
+    while (done < frames) {
+        size_t n, nbytes, k;
+        const void *d;
+        const int16_t *src;
+
+        n = CA_MIN(frames - done, CHUNK_FRAMES);
+        nbytes = n * fs;
+
+        if (s) {
+            nbytes = CA_MIN(nbytes, s->nbytes - *offset);
+            d = (const uint8_t*) s->data + *offset;
+            *offset += nbytes;
+        } else if (ca_sound_file_is_mapped(f)) {
+
+            if ((ret = ca_sound_file_read_mapped(f, &d, &nbytes)) < 0)
+                return ret;
+
+        } else {
+            size_t l = 0;
+
+            /* Decoders may return less than asked for even if the
+             * file is not over yet */
+            while (l < nbytes) {
+                k = nbytes - l;
+
+                if ((ret = ca_sound_file_read_arbitrary(f, (uint8_t*) buf + l, &k)) < 0)
+                    return ret;
+
+                if (k <= 0)
+                    break;
+
+                l += k;
+            }
+
+            nbytes = l;
+            d = buf;
+        }
+
+        if ((k = nbytes / fs) <= 0)
+            break;
+
+        switch (type) {
+            case CA_SAMPLE_U8:
+                ca_mix_u8_to_s16ne(conv, d, k * src_nchannels);
+                src = conv;
+                break;
+
+            case CA_SAMPLE_S16RE:
+                ca_mix_s16_byteswap(conv, d, k * src_nchannels);
+                src = conv;
+                break;
+
+            case CA_SAMPLE_S16NE:
+                src = d;
+                break;
+
+            default:
+                ca_assert_not_reached();
+        }
+
+        if (src_nchannels < nchannels) {
+            size_t i;
+
+            for (i = 0; i < k; i++)
+                chan[2*i] = chan[2*i+1] = src[i];
+
+            src = chan;
+
+        } else if (src_nchannels > nchannels) {
+            size_t i;
+
+            for (i = 0; i < k; i++)
+                chan[i] = (int16_t) (((int32_t) src[2*i] + (int32_t) src[2*i+1]) / 2);
+
+            src = chan;
+        }
+
+        if (volume != CA_MIX_VOLUME_NORM) {
+            ca_mix_s16_volume(chan, src, k * nchannels, volume);
+            src = chan;
+        }
+
+        ca_mix_s16_add(mix + done * nchannels, src, k * nchannels);
+        done += k;
+
+        if (k < n)
+            break;
+    }
+
+    *_frames = done;
+
+    return CA_SUCCESS;
+}
+
+/* Where a channel ends up when a sound is folded down to stereo */
+typedef enum side {
+    SIDE_LEFT,
+    SIDE_RIGHT,
+    SIDE_CENTER,
+    SIDE_ALL,
+    SIDE_NONE
+} side_t;
+
+/* 1/sqrt(2), center channels are split across left and right */
+#define CENTER_VOLUME 0xB50U
+
+static side_t get_side(const ca_channel_position_t *channel_map, unsigned c, unsigned nchannels) {
+    ca_channel_position_t p;
+
+    /* Without a map the usual layouts are assumed, extra channels
+     * are treated like a center channel */
+    if (channel_map)
+        p = channel_map[c];
+    else if (nchannels == 1)
+        p = CA_CHANNEL_MONO;
+    else
+        p = c == 0 ? CA_CHANNEL_FRONT_LEFT : (c == 1 ? CA_CHANNEL_FRONT_RIGHT : CA_CHANNEL_FRONT_CENTER);
+
+    switch (p) {
+        case CA_CHANNEL_MONO:
+            return SIDE_ALL;
+
+        case CA_CHANNEL_FRONT_LEFT:
+        case CA_CHANNEL_REAR_LEFT:
+        case CA_CHANNEL_FRONT_LEFT_OF_CENTER:
+        case CA_CHANNEL_SIDE_LEFT:
+        case CA_CHANNEL_TOP_FRONT_LEFT:
+        case CA_CHANNEL_TOP_REAR_LEFT:
+            return SIDE_LEFT;
+
+        case CA_CHANNEL_FRONT_RIGHT:
+        case CA_CHANNEL_REAR_RIGHT:
+        case CA_CHANNEL_FRONT_RIGHT_OF_CENTER:
+        case CA_CHANNEL_SIDE_RIGHT:
+        case CA_CHANNEL_TOP_FRONT_RIGHT:
+        case CA_CHANNEL_TOP_REAR_RIGHT:
+            return SIDE_RIGHT;
+
+        case CA_CHANNEL_LFE:
+            return SIDE_NONE;
+
+        default:
+            return SIDE_CENTER;
+    }
+}
+
+/* Which share of each source channel goes to each destination
+ * channel, in units of CA_MIX_VOLUME_NORM */
+static void build_matrix(unsigned matrix[2][_CA_CHANNEL_POSITION_MAX], unsigned nchannels, const ca_channel_position_t *channel_map, unsigned src_nchannels) {
+    unsigned c, d;
+
+    memset(matrix, 0, sizeof(unsigned) * 2 * _CA_CHANNEL_POSITION_MAX);
+
+    for (c = 0; c < src_nchannels; c++) {
+        side_t side = get_side(channel_map, c, src_nchannels);
+
+        if (side == SIDE_NONE)
+            continue;
+
+        if (nchannels == 1) {
+            matrix[0][c] = CA_MIX_VOLUME_NORM;
+            continue;
+        }
+
+        if (side == SIDE_LEFT || side == SIDE_ALL)
+            matrix[0][c] = CA_MIX_VOLUME_NORM;
+
+        if (side == SIDE_RIGHT || side == SIDE_ALL)
+            matrix[1][c] = CA_MIX_VOLUME_NORM;
+
+        if (side == SIDE_CENTER)
+            matrix[0][c] = matrix[1][c] = CENTER_VOLUME;
+    }
+
+    /* Scale down so that each destination channel stays within
+     * range, which makes a fold down to mono an average. If nothing
+     * went into a channel at all we fall back to mixing everything
+     * into it. */
+    for (d = 0; d < nchannels; d++) {
+        unsigned sum = 0;
+
+        for (c = 0; c < src_nchannels; c++)
+            sum += matrix[d][c];
+
+        if (sum <= 0) {
+            for (c = 0; c < src_nchannels; c++)
+                matrix[d][c] = CA_MIX_VOLUME_NORM / src_nchannels;
+        } else if (sum > CA_MIX_VOLUME_NORM)
+            for (c = 0; c < src_nchannels; c++)
+                matrix[d][c] = matrix[d][c] * CA_MIX_VOLUME_NORM / sum;
+    }
+}
+
+static void remap(int16_t *dst, unsigned nchannels, const int16_t *src, unsigned src_nchannels, size_t n, unsigned matrix[2][_CA_CHANNEL_POSITION_MAX]) {
+    size_t i;
+
+    for (i = 0; i < n; i++, src += src_nchannels) {
+        unsigned c, d;
+
+        for (d = 0; d < nchannels; d++, dst++) {
+            int32_t sum = 0;
+
+            for (c = 0; c < src_nchannels; c++)
+                sum += ((int32_t) src[c] * (int32_t) matrix[d][c]) >> VOLUME_SHIFT;
+
+            *dst = (int16_t) CA_CLAMP(sum, -0x8000, 0x7FFF);
+        }
+    }
+}
+
+/* Linear interpolation, which is plenty for event sounds and cheap
+ * enough to not make caching them noticeably slower */
+static void resample(int16_t *dst, size_t dst_n, unsigned rate, const int16_t *src, size_t n, unsigned src_rate, unsigned nchannels) {
+    size_t j;
+
+    for (j = 0; j < dst_n; j++) {
+        uint64_t pos = (uint64_t) j * src_rate;
+        size_t i = (size_t) (pos / rate);
+        int64_t frac = (int64_t) (pos % rate);
+        const int16_t *a, *b;
+        unsigned c;
+
+        a = src + i * nchannels;
+        b = i + 1 < n ? a + nchannels : a;
+
+        for (c = 0; c < nchannels; c++)
+            *(dst++) = (int16_t) (a[c] + ((int64_t) (b[c] - a[c]) * frac) / (int64_t) rate);
+    }
+}
+
+int ca_mix_convert(
+        void **_dst,
+        size_t *_dst_nbytes,
+        unsigned rate,
+        unsigned nchannels,
+        const void *src,
+        size_t nbytes,
+        ca_sample_type_t type,
+        unsigned src_rate,
+        unsigned src_nchannels,
+        const ca_channel_position_t *channel_map) {
+
+    int16_t *conv = NULL, *chan = NULL, *dst = NULL;
+    const int16_t *s;
+    size_t n, dst_n;
+    int ret;
+
+    ca_return_val_if_fail(_dst, CA_ERROR_INVALID);
+    ca_return_val_if_fail(_dst_nbytes, CA_ERROR_INVALID);
+    ca_return_val_if_fail(rate > 0, CA_ERROR_INVALID);
+    ca_return_val_if_fail(nchannels == 1 || nchannels == 2, CA_ERROR_INVALID);
+    ca_return_val_if_fail(src, CA_ERROR_INVALID);
+    ca_return_val_if_fail(src_rate > 0, CA_ERROR_INVALID);
+    ca_return_val_if_fail(src_nchannels > 0, CA_ERROR_INVALID);
+    ca_return_val_if_fail(src_nchannels <= _CA_CHANNEL_POSITION_MAX, CA_ERROR_NOTSUPPORTED);
+
+    n = nbytes / (src_nchannels * (type == CA_SAMPLE_U8 ? sizeof(uint8_t) : sizeof(int16_t)));
+
+    if (n <= 0)
+        return CA_ERROR_INVALID;
+
+    switch (type) {
+        case CA_SAMPLE_U8:
+        case CA_SAMPLE_S16RE:
+
+            if (!(conv = ca_new(int16_t, n * src_nchannels))) {
+                ret = CA_ERROR_OOM;
+                goto finish;
+            }
+
+            if (type == CA_SAMPLE_U8)
+                ca_mix_u8_to_s16ne(conv, src, n * src_nchannels);
+            else
+                ca_mix_s16_byteswap(conv, src, n * src_nchannels);
+
+            s = conv;
+            break;
+
+        case CA_SAMPLE_S16NE:
+            s = src;
+            break;
+
+        default:
+            ca_assert_not_reached();
+    }
+
+    /* Folding down first means less to resample afterwards */
+    if (src_nchannels != nchannels || channel_map) {
+        unsigned matrix[2][_CA_CHANNEL_POSITION_MAX];
+
+        if (!(chan = ca_new(int16_t, n * nchannels))) {
+            ret = CA_ERROR_OOM;
+            goto finish;
+        }
+
+        build_matrix(matrix, nchannels, channel_map, src_nchannels);
+        remap(chan, nchannels, s, src_nchannels, n, matrix);
+        s = chan;
+    }
+
+    dst_n = src_rate == rate ? n : CA_MAX((size_t) ((uint64_t) n * rate / src_rate), (size_t) 1);
+
+    if (!(dst = ca_new(int16_t, dst_n * nchannels))) {
+        ret = CA_ERROR_OOM;
+        goto finish;
+    }
+
+    if (src_rate == rate)
+        memcpy(dst, s, n * nchannels * sizeof(int16_t));
+    else
+        resample(dst, dst_n, rate, s, n, src_rate, nchannels);
+
+    *_dst = dst;
+    *_dst_nbytes = dst_n * nchannels * sizeof(int16_t);
+    dst = NULL;
+    ret = CA_SUCCESS;
+
+finish:
+
+    ca_free(conv);
+    ca_free(chan);
+    ca_free(dst);
+
+    return ret;
+}
@@ -0,0 +1,87 @@
+#ifndef foocanberramixhfoo
+#define foocanberramixhfoo
+
+/***
+  This file is part of libcanberra.
+
+  Copyright 2008 Lennart Poettering
+
+  libcanberra is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 2.1 of the
+  License, or (at your option) any later version.
+
+  libcanberra is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with libcanberra. If not, see
+  <http://www.gnu.org/licenses/>.
+***/
+
+
+#include <inttypes.h>
+
+#include "sample-cache.h"
+
+/* Software mixing for those drivers which talk to the sound device
+ * directly. Everything is mixed as native endian signed 16 bit, mono
+ * or stereo. */
+
+/* Volume factors are fixed point, this is unity gain */
+#define CA_MIX_VOLUME_NORM 0x1000U
+#define CA_MIX_VOLUME_MAX 0x7FFFU
+
+/* These operate on n samples, not frames. dst and src may be the
+ * same buffer, but may not overlap otherwise. */
+void ca_mix_u8_to_s16ne(int16_t *dst, const uint8_t *src, size_t n);
+void ca_mix_s16_byteswap(int16_t *dst, const int16_t *src, size_t n);
+void ca_mix_s16_volume(int16_t *dst, const int16_t *src, size_t n, unsigned volume);
+void ca_mix_s16_add(int16_t *dst, const int16_t *src, size_t n);
+
+/* The functions above are implemented with the best SIMD instruction
+ * set the CPU supports, selected on first use. Overriding that is
+ * only useful for testing and is not thread-safe. */
+typedef enum ca_mix_impl {
+    CA_MIX_IMPL_SCALAR,
+    CA_MIX_IMPL_SSE2,
+    CA_MIX_IMPL_AVX2,
+    CA_MIX_IMPL_NEON,
+    _CA_MIX_IMPL_MAX
+} ca_mix_impl_t;
+
+ca_mix_impl_t ca_mix_get_impl(void);
+int ca_mix_set_impl(ca_mix_impl_t impl);
+const char *ca_mix_impl_to_string(ca_mix_impl_t impl);
+
+/* Converts up to *frames frames of a source to nchannels and adds
+ * them onto mix. The source is either a cached sample, read starting
+ * at *offset, or a file. *frames is set to the number of frames
+ * actually mixed, if that is less than requested the source is
+ * exhausted. The source is scaled by volume on the way. */
+int ca_mix_source(int16_t *mix, unsigned nchannels, size_t *frames, ca_sample *s, size_t *offset, ca_sound_file *f, unsigned volume);
+
+/* Reads canberra.volume, which is in dB, as a fixed point volume
+ * factor. Without that property this is CA_MIX_VOLUME_NORM. */
+int ca_mix_get_volume(ca_proplist *p, unsigned *volume);
+
+/* Converts a whole decoded sound to native endian signed 16 bit at
+ * the given rate, mono or stereo. Channels are mapped by their
+ * position, LFE channels are dropped. Without a channel map the
+ * usual mono or stereo layout is assumed. On success *dst is to be
+ * freed with ca_free(). */
+int ca_mix_convert(
+        void **dst,
+        size_t *dst_nbytes,
+        unsigned rate,
+        unsigned nchannels,
+        const void *src,
+        size_t nbytes,
+        ca_sample_type_t type,
+        unsigned src_rate,
+        unsigned src_nchannels,
+        const ca_channel_position_t *channel_map);
+
+#endif
@@ -27,6 +27,8 @@
 #include "malloc.h"
 #include "common.h"
 #include "driver-order.h"
+#include "sample-cache.h"
+#include "sound-theme-spec.h"
 
 struct backend {
     CA_LLIST_FIELDS(struct backend);
@@ -36,6 +38,7 @@ struct backend {
 struct private {
     ca_context *context;
     CA_LLIST_HEAD(struct backend, backends);
+    ca_theme_data *theme;
 };
 
 #define PRIVATE(c) ((struct private *) ((c)->private))
@@ -190,6 +193,9 @@ int driver_destroy(ca_context *c) {
             ret = r;
     }
 
+    if (p->theme)
+        ca_theme_data_unref(p->theme);
+
     ca_free(p);
 
     c->private = NULL;
@@ -242,14 +248,16 @@ static void call_closure(ca_context *c, uint32_t id, int error_code, void *userd
     ca_free(closure);
 }
 
-int driver_play(ca_context *c, uint32_t id, ca_proplist *proplist, ca_finish_callback_t cb, void *userdata) {
+int driver_play(ca_context *c, uint32_t id, ca_proplist *proplist, ca_proplist *cp, ca_finish_callback_t cb, void *userdata) {
     int ret = CA_SUCCESS;
     struct private *p;
     struct backend *b;
     struct closure *closure;
+    ca_sample *s = NULL;
 
     ca_return_val_if_fail(c, CA_ERROR_INVALID);
     ca_return_val_if_fail(proplist, CA_ERROR_INVALID);
+    ca_return_val_if_fail(cp, CA_ERROR_INVALID);
     ca_return_val_if_fail(!userdata || cb, CA_ERROR_INVALID);
     ca_return_val_if_fail(c->private, CA_ERROR_STATE);
 
@@ -265,18 +273,31 @@ int driver_play(ca_context *c, uint32_t id, ca_proplist *proplist, ca_finish_cal
     } else
         closure = NULL;
 
+    /* Look up and decode the sound only once, instead of once for
+     * each backend we try. The backends find it in the sample cache,
+     * which drops it again when the last of them is done with it. If
+     * this fails the backends simply do it themselves. */
+    if (p->backends && p->backends->next)
+        ca_sample_cache_share_sound(&s, &p->theme, cp, proplist);
+
     /* The first backend that can play this, takes it */
     for (b = p->backends; b; b = b->next) {
         int r;
 
-        if ((r = ca_context_play_full(b->context, id, proplist, closure ? call_closure : NULL, closure)) == CA_SUCCESS)
-            return r;
+        if ((r = ca_context_play_full(b->context, id, proplist, closure ? call_closure : NULL, closure)) == CA_SUCCESS) {
+            ret = r;
+            closure = NULL;
+            break;
+        }
 
         /* We only return the first failure */
         if (ret == CA_SUCCESS)
             ret = r;
     }
 
+    if (s)
+        ca_sample_unref(s);
+
     ca_free(closure);
 
     return ret;
@@ -330,3 +351,76 @@ int driver_cache(ca_context *c, ca_proplist *proplist) {
 
     return ret;
 }
+
+int driver_cache_many(ca_context *c, ca_proplist **proplists, unsigned n, int *results) {
+    struct private *p;
+    struct backend *b;
+    ca_proplist **pending = NULL;
+    unsigned *index = NULL, i, k;
+    int *r = NULL, ret = CA_SUCCESS;
+    ca_bool_t *done = NULL;
+
+    ca_return_val_if_fail(c, CA_ERROR_INVALID);
+    ca_return_val_if_fail(proplists || n <= 0, CA_ERROR_INVALID);
+    ca_return_val_if_fail(results || n <= 0, CA_ERROR_INVALID);
+    ca_return_val_if_fail(c->private, CA_ERROR_STATE);
+
+    p = PRIVATE(c);
+
+    if (!(pending = ca_new(ca_proplist*, n)) ||
+        !(index = ca_new(unsigned, n)) ||
+        !(r = ca_new(int, n)) ||
+        !(done = ca_new0(ca_bool_t, n))) {
+        ret = CA_ERROR_OOM;
+        goto finish;
+    }
+
+    for (i = 0; i < n; i++)
+        done[i] = results[i] < 0;
+
+    /* The first backend that can cache an item takes it, but each
+     * backend gets all of the items still left as one batch */
+    for (b = p->backends; b; b = b->next) {
+
+        for (i = 0, k = 0; i < n; i++)
+            if (!done[i]) {
+                pending[k] = proplists[i];
+                index[k] = i;
+                k++;
+            }
+
+        if (k <= 0)
+            break;
+
+        /* Not touched if the arguments are refused outright */
+        for (i = 0; i < k; i++)
+            r[i] = CA_ERROR_STATE;
+
+        ca_context_cache_many(b->context, pending, k, r);
+
+        for (i = 0; i < k; i++) {
+
+            if (r[i] == CA_SUCCESS)
+                done[index[i]] = TRUE;
+
+            /* We only return the first failure of each item */
+            if (b == p->backends || r[i] == CA_SUCCESS)
+                results[index[i]] = r[i];
+        }
+    }
+
+    for (i = 0; i < n; i++)
+        if (results[i] < 0) {
+            ret = results[i];
+            break;
+        }
+
+finish:
+
+    ca_free(pending);
+    ca_free(index);
+    ca_free(r);
+    ca_free(done);
+
+    return ret;
+}
@@ -32,6 +32,10 @@ struct ca_mutex {
     pthread_mutex_t mutex;
 };
 
+struct ca_cond {
+    pthread_cond_t cond;
+};
+
 ca_mutex* ca_mutex_new(void) {
     ca_mutex *m;
 
@@ -76,3 +80,40 @@ void ca_mutex_unlock(ca_mutex *m) {
 
     ca_assert_se(pthread_mutex_unlock(&m->mutex) == 0);
 }
+
+ca_cond *ca_cond_new(void) {
+    ca_cond *c;
+
+    if (!(c = ca_new(ca_cond, 1)))
+        return NULL;
+
+    if (pthread_cond_init(&c->cond, NULL) != 0) {
+        ca_free(c);
+        return NULL;
+    }
+
+    return c;
+}
+
+void ca_cond_free(ca_cond *c) {
+    ca_assert(c);
+
+    ca_assert_se(pthread_cond_destroy(&c->cond) == 0);
+    ca_free(c);
+}
+
+void ca_cond_signal(ca_cond *c, ca_bool_t broadcast) {
+    ca_assert(c);
+
+    if (broadcast)
+        ca_assert_se(pthread_cond_broadcast(&c->cond) == 0);
+    else
+        ca_assert_se(pthread_cond_signal(&c->cond) == 0);
+}
+
+void ca_cond_wait(ca_cond *c, ca_mutex *m) {
+    ca_assert(c);
+    ca_assert(m);
+
+    ca_assert_se(pthread_cond_wait(&c->cond, &m->mutex) == 0);
+}
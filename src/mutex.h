@@ -32,4 +32,12 @@ void ca_mutex_lock(ca_mutex *m);
 ca_bool_t ca_mutex_try_lock(ca_mutex *m);
 void ca_mutex_unlock(ca_mutex *m);
 
+typedef struct ca_cond ca_cond;
+
+ca_cond *ca_cond_new(void);
+void ca_cond_free(ca_cond *c);
+
+void ca_cond_signal(ca_cond *c, ca_bool_t broadcast);
+void ca_cond_wait(ca_cond *c, ca_mutex *m);
+
 #endif
@@ -55,9 +55,10 @@ int driver_change_props(ca_context *c, ca_proplist *changed, ca_proplist *merged
     return CA_SUCCESS;
 }
 
-int driver_play(ca_context *c, uint32_t id, ca_proplist *proplist, ca_finish_callback_t cb, void *userdata) {
+int driver_play(ca_context *c, uint32_t id, ca_proplist *proplist, ca_proplist *cp, ca_finish_callback_t cb, void *userdata) {
     ca_return_val_if_fail(c, CA_ERROR_INVALID);
     ca_return_val_if_fail(proplist, CA_ERROR_INVALID);
+    ca_return_val_if_fail(cp, CA_ERROR_INVALID);
     ca_return_val_if_fail(!userdata || cb, CA_ERROR_INVALID);
 
     if (cb)
@@ -78,3 +79,11 @@ int driver_cache(ca_context *c, ca_proplist *proplist) {
 
     return CA_ERROR_NOTSUPPORTED;
 }
+
+int driver_cache_many(ca_context *c, ca_proplist **proplists, unsigned n, int *results) {
+    ca_return_val_if_fail(c, CA_ERROR_INVALID);
+    ca_return_val_if_fail(proplists || n <= 0, CA_ERROR_INVALID);
+    ca_return_val_if_fail(results || n <= 0, CA_ERROR_INVALID);
+
+    return ca_cache_many_sequentially(c, proplists, n, results, driver_cache);
+}
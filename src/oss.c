@@ -27,6 +27,7 @@
 #include <sys/ioctl.h>
 #include <sys/param.h>
 #include <sys/uio.h>
+#include <sys/mman.h>
 #include <math.h>
 #include <unistd.h>
 #include <errno.h>
@@ -35,6 +36,7 @@
 #include <poll.h>
 #include <pthread.h>
 #include <semaphore.h>
+#include <string.h>
 
 #ifdef HAVE_MACHINE_SOUNDCARD_H
 #  include <machine/soundcard.h>
@@ -52,7 +54,12 @@
 #include "llist.h"
 #include "read-sound-file.h"
 #include "sound-theme-spec.h"
+#include "sample-cache.h"
+#include "sequence.h"
+#include "thread-pool.h"
+#include "mix.h"
 #include "malloc.h"
+#include "trace.h"
 
 struct private;
 
@@ -63,9 +70,24 @@ struct outstanding {
     ca_finish_callback_t callback;
     void *userdata;
     ca_sound_file *file;
+    ca_sample *sample;
+    ca_sequence *sequence;
+    size_t offset;
+    unsigned volume;
     int pcm;
+    ca_bool_t mixed;
+    ca_bool_t finished;
+    ca_bool_t notify;
+    int error;
     int pipe_fd[2];
     ca_context *context;
+    ca_usec_t started;
+    ca_bool_t written;
+
+    /* The DMA buffer of the device, if we write to it directly */
+    void *mmap_buffer;
+    size_t mmap_size;
+    unsigned fragment_usec;
 };
 
 struct private {
@@ -74,11 +96,51 @@ struct private {
     ca_bool_t signal_semaphore;
     sem_t semaphore;
     ca_bool_t semaphore_allocated;
+    ca_thread_pool *pool;
+
+    /* Everything below protected by the outstanding_mutex too */
+
+    /* Target latency in usec, 0 for whatever the driver picks */
+    unsigned latency;
+    ca_bool_t use_mmap;
+
+    /* What cached sounds are converted to, see get_native_format().
+     * Found out once per device, native.rate is 0 if we couldn't. */
+    ca_bool_t convert;
+    ca_bool_t native_known;
+    ca_sample_format native;
+
+    /* The software mixer, see mixer_func() */
+    ca_bool_t software_mixer;
+    ca_bool_t mixer_running;
+    int mixer_fd;
+    unsigned mixer_rate;
+    unsigned n_mixer_sources;
+
     CA_LLIST_HEAD(struct outstanding, outstanding);
 };
 
 #define PRIVATE(c) ((struct private *) ((c)->private))
 
+#define PLAYER_THREADS_DEFAULT 2U
+
+#define MIXER_FRAMES 1024U
+#define MIXER_NCHANNELS 2U
+#define MIXER_SOURCES_MAX 32U
+
+/* What we ask for when finding out the native format of a device,
+ * the driver tells us what's closest */
+#define NATIVE_RATE 48000U
+#define NATIVE_NCHANNELS 2U
+
+/* The smallest fragment OSS allows is 2^4 bytes, and we don't need
+ * more than 2^16 */
+#define FRAGMENT_SHIFT_MIN 4
+#define FRAGMENT_SHIFT_MAX 16
+
+static void thread_func(void *userdata, void *pool_userdata);
+static const ca_sample_format* get_native_format(ca_context *c, ca_sample_format *f);
+
 static void outstanding_free(struct outstanding *o) {
     ca_assert(o);
 
@@ -88,9 +150,21 @@ static void outstanding_free(struct outstanding *o) {
     if (o->pipe_fd[0] >= 0)
         close(o->pipe_fd[0]);
 
+    /* The file is one of those of the sequence then */
+    if (o->sequence) {
+        ca_sequence_free(o->sequence);
+        o->file = NULL;
+    }
+
     if (o->file)
         ca_sound_file_close(o->file);
 
+    if (o->sample)
+        ca_sample_unref(o->sample);
+
+    if (o->mmap_buffer)
+        munmap(o->mmap_buffer, o->mmap_size);
+
     if (o->pcm >= 0) {
         close(o->pcm);
         o->pcm = -1;
@@ -99,8 +173,54 @@ static void outstanding_free(struct outstanding *o) {
     ca_free(o);
 }
 
+static unsigned get_player_threads(ca_proplist *l) {
+    unsigned n;
+
+    if (ca_proplist_get_unsigned(l, CA_PROP_CANBERRA_PLAYER_THREADS, &n) < 0)
+        return PLAYER_THREADS_DEFAULT;
+
+    return n;
+}
+
+static unsigned get_latency(ca_proplist *l) {
+    unsigned n;
+
+    if (ca_proplist_get_unsigned(l, CA_PROP_CANBERRA_LATENCY, &n) < 0)
+        return 0;
+
+    return n;
+}
+
+static ca_bool_t get_mmap(ca_proplist *l) {
+    unsigned n;
+
+    if (ca_proplist_get_unsigned(l, CA_PROP_CANBERRA_MMAP, &n) < 0)
+        return FALSE;
+
+    return n > 0;
+}
+
+static ca_bool_t get_convert(ca_proplist *l) {
+    unsigned n;
+
+    if (ca_proplist_get_unsigned(l, CA_PROP_CANBERRA_NATIVE_FORMAT, &n) < 0)
+        return FALSE;
+
+    return n > 0;
+}
+
+static ca_bool_t get_software_mixer(ca_proplist *l) {
+    unsigned n;
+
+    if (ca_proplist_get_unsigned(l, CA_PROP_CANBERRA_SOFTWARE_MIXER, &n) < 0)
+        return FALSE;
+
+    return n > 0;
+}
+
 int driver_open(ca_context *c) {
     struct private *p;
+    int ret;
 
     ca_return_val_if_fail(c, CA_ERROR_INVALID);
     ca_return_val_if_fail(!c->driver || ca_streq(c->driver, "oss"), CA_ERROR_NODRIVER);
@@ -109,6 +229,8 @@ int driver_open(ca_context *c) {
     if (!(c->private = p = ca_new0(struct private, 1)))
         return CA_ERROR_OOM;
 
+    p->mixer_fd = -1;
+
     if (!(p->outstanding_mutex = ca_mutex_new())) {
         driver_destroy(c);
         return CA_ERROR_OOM;
@@ -120,6 +242,15 @@ int driver_open(ca_context *c) {
     }
 
     p->semaphore_allocated = TRUE;
+    p->software_mixer = get_software_mixer(c->props);
+    p->latency = get_latency(c->props);
+    p->use_mmap = get_mmap(c->props);
+    p->convert = get_convert(c->props);
+
+    if ((ret = ca_thread_pool_new(&p->pool, get_player_threads(c->props), thread_func, NULL)) < 0) {
+        driver_destroy(c);
+        return ret;
+    }
 
     return CA_SUCCESS;
 }
@@ -155,9 +286,9 @@ int driver_destroy(ca_context *c) {
         }
 
         if (p->semaphore_allocated) {
-            /* Now wait until all players are destroyed */
+            /* Now wait until all players and the mixer are destroyed */
             p->signal_semaphore = TRUE;
-            while (p->outstanding) {
+            while (p->outstanding || p->mixer_running) {
                 ca_mutex_unlock(p->outstanding_mutex);
                 sem_wait(&p->semaphore);
                 ca_mutex_lock(p->outstanding_mutex);
@@ -168,8 +299,13 @@ int driver_destroy(ca_context *c) {
         ca_mutex_free(p->outstanding_mutex);
     }
 
+    /* All players are gone now, so this only waits for the idle
+     * workers to exit */
+    if (p->pool)
+        ca_thread_pool_free(p->pool);
+
     if (p->theme)
-        ca_theme_data_free(p->theme);
+        ca_theme_data_unref(p->theme);
 
     if (p->semaphore_allocated)
         sem_destroy(&p->semaphore);
@@ -182,25 +318,78 @@ int driver_destroy(ca_context *c) {
 }
 
 int driver_change_device(ca_context *c, const char *device) {
+    struct private *p;
+
     ca_return_val_if_fail(c, CA_ERROR_INVALID);
     ca_return_val_if_fail(c->private, CA_ERROR_STATE);
 
+    p = PRIVATE(c);
+
+    /* The new device might prefer something else */
+    ca_mutex_lock(p->outstanding_mutex);
+    p->native_known = FALSE;
+    ca_mutex_unlock(p->outstanding_mutex);
+
     return CA_SUCCESS;
 }
 
 int driver_change_props(ca_context *c, ca_proplist *changed, ca_proplist *merged) {
+    struct private *p;
+
     ca_return_val_if_fail(c, CA_ERROR_INVALID);
     ca_return_val_if_fail(changed, CA_ERROR_INVALID);
     ca_return_val_if_fail(merged, CA_ERROR_INVALID);
+    ca_return_val_if_fail(c->private, CA_ERROR_STATE);
+
+    p = PRIVATE(c);
+
+    if (ca_proplist_contains_key(changed, CA_PROP_KEY_CANBERRA_PLAYER_THREADS))
+        ca_thread_pool_set_idle_max(p->pool, get_player_threads(merged));
+
+    if (ca_proplist_contains_key(changed, CA_PROP_KEY_CANBERRA_SOFTWARE_MIXER)) {
+        ca_mutex_lock(p->outstanding_mutex);
+        p->software_mixer = get_software_mixer(merged);
+        ca_mutex_unlock(p->outstanding_mutex);
+    }
+
+    if (ca_proplist_contains_key(changed, CA_PROP_KEY_CANBERRA_LATENCY)) {
+        ca_mutex_lock(p->outstanding_mutex);
+        p->latency = get_latency(merged);
+        ca_mutex_unlock(p->outstanding_mutex);
+    }
+
+    if (ca_proplist_contains_key(changed, CA_PROP_KEY_CANBERRA_MMAP)) {
+        ca_mutex_lock(p->outstanding_mutex);
+        p->use_mmap = get_mmap(merged);
+        ca_mutex_unlock(p->outstanding_mutex);
+    }
+
+    if (ca_proplist_contains_key(changed, CA_PROP_KEY_CANBERRA_NATIVE_FORMAT)) {
+        ca_mutex_lock(p->outstanding_mutex);
+        p->convert = get_convert(merged);
+        ca_mutex_unlock(p->outstanding_mutex);
+    }
 
     return CA_SUCCESS;
 }
 
 int driver_cache(ca_context *c, ca_proplist *proplist) {
+    ca_sample_format native;
+
     ca_return_val_if_fail(c, CA_ERROR_INVALID);
     ca_return_val_if_fail(proplist, CA_ERROR_INVALID);
+    ca_return_val_if_fail(c->private, CA_ERROR_STATE);
 
-    return CA_ERROR_NOTSUPPORTED;
+    return ca_sample_cache_store_sound(&PRIVATE(c)->theme, c->props, proplist, get_native_format(c, &native));
+}
+
+int driver_cache_many(ca_context *c, ca_proplist **proplists, unsigned n, int *results) {
+    ca_return_val_if_fail(c, CA_ERROR_INVALID);
+    ca_return_val_if_fail(proplists || n <= 0, CA_ERROR_INVALID);
+    ca_return_val_if_fail(results || n <= 0, CA_ERROR_INVALID);
+    ca_return_val_if_fail(c->private, CA_ERROR_STATE);
+
+    return ca_cache_many_sequentially(c, proplists, n, results, driver_cache);
 }
 
 static int translate_error(int error) {
@@ -227,32 +416,44 @@ static int translate_error(int error) {
     }
 }
 
-static int open_oss(ca_context *c, struct outstanding *out) {
-    struct private *p;
-    int mode, val, test, ret;
+/* Two fragments of a power of two bytes each, so that one can be
+ * refilled while the other one is played */
+static int fragment_for_latency(unsigned latency, ca_sample_type_t type, unsigned rate, unsigned nchannels) {
+    uint64_t nbytes;
+    int shift;
 
-    ca_return_val_if_fail(c, CA_ERROR_INVALID);
-    ca_return_val_if_fail(c->private, CA_ERROR_STATE);
-    ca_return_val_if_fail(out, CA_ERROR_INVALID);
+    nbytes = (uint64_t) latency * rate * nchannels * (type == CA_SAMPLE_U8 ? 1 : 2) / 1000000ULL / 2;
 
-    /* In OSS we have no way to configure a channel mapping for
-     * multichannel streams. We cannot support those files hence */
-    ca_return_val_if_fail(ca_sound_file_get_nchannels(out->file) <= 2, CA_ERROR_NOTSUPPORTED);
+    for (shift = FRAGMENT_SHIFT_MIN; shift < FRAGMENT_SHIFT_MAX; shift++)
+        if ((1ULL << (shift + 1)) > nbytes)
+            break;
 
-    p = PRIVATE(c);
+    return (2 << 16) | shift;
+}
+
+static int open_dsp(ca_context *c, int *_fd, ca_sample_type_t type, unsigned rate, unsigned nchannels, unsigned latency, unsigned *_rate) {
+    int fd, mode, val, test, ret;
+    audio_buf_info info;
 
-    if ((out->pcm = open(c->device ? c->device : "/dev/dsp", O_WRONLY | O_NONBLOCK, 0)) < 0)
+    if ((fd = open(c->device ? c->device : "/dev/dsp", O_WRONLY | O_NONBLOCK, 0)) < 0)
         goto finish_errno;
 
-    if ((mode = fcntl(out->pcm, F_GETFL)) < 0)
+    if ((mode = fcntl(fd, F_GETFL)) < 0)
         goto finish_errno;
 
     mode &= ~O_NONBLOCK;
 
-    if (fcntl(out->pcm, F_SETFL, mode) < 0)
+    if (fcntl(fd, F_SETFL, mode) < 0)
         goto finish_errno;
 
-    switch (ca_sound_file_get_sample_type(out->file)) {
+    /* This needs to happen before the format is set. Not all drivers
+     * can do this, in which case we stay with their default. */
+    if (latency > 0) {
+        val = fragment_for_latency(latency, type, rate, nchannels);
+        ioctl(fd, SNDCTL_DSP_SETFRAGMENT, &val);
+    }
+
+    switch (type) {
         case CA_SAMPLE_U8:
             val = AFMT_U8;
             break;
@@ -269,7 +470,7 @@ static int open_oss(ca_context *c, struct outstanding *out) {
     }
 
     test = val;
-    if (ioctl(out->pcm, SNDCTL_DSP_SETFMT, &val) < 0)
+    if (ioctl(fd, SNDCTL_DSP_SETFMT, &val) < 0)
         goto finish_errno;
 
     if (val != test) {
@@ -277,8 +478,8 @@ static int open_oss(ca_context *c, struct outstanding *out) {
         goto finish_ret;
     }
 
-    test = val = (int) ca_sound_file_get_nchannels(out->file);
-    if (ioctl(out->pcm, SNDCTL_DSP_CHANNELS, &val) < 0)
+    test = val = (int) nchannels;
+    if (ioctl(fd, SNDCTL_DSP_CHANNELS, &val) < 0)
         goto finish_errno;
 
     if (val != test) {
@@ -286,8 +487,8 @@ static int open_oss(ca_context *c, struct outstanding *out) {
         goto finish_ret;
     }
 
-    test = val = (int) ca_sound_file_get_rate(out->file);
-    if (ioctl(out->pcm, SNDCTL_DSP_SPEED, &val) < 0)
+    test = val = (int) rate;
+    if (ioctl(fd, SNDCTL_DSP_SPEED, &val) < 0)
         goto finish_errno;
 
     /* Check to make sure the configured rate is close enough to the
@@ -297,21 +498,360 @@ static int open_oss(ca_context *c, struct outstanding *out) {
         goto finish_ret;
     }
 
+    if (ioctl(fd, SNDCTL_DSP_GETOSPACE, &info) >= 0 && val > 0)
+        ca_trace_device_latency((ca_usec_t) info.fragstotal * (ca_usec_t) info.fragsize * 1000000ULL /
+                                ((ca_usec_t) val * nchannels * (type == CA_SAMPLE_U8 ? 1 : 2)));
+
+    /* What we actually got, which may be off by a few percent */
+    if (_rate)
+        *_rate = (unsigned) val;
+
+    *_fd = fd;
+
     return CA_SUCCESS;
 
 finish_errno:
-    return translate_error(errno);
+    ret = translate_error(errno);
 
 finish_ret:
+
+    if (fd >= 0)
+        close(fd);
+
     return ret;
 }
 
+static int probe_native_format(ca_context *c, ca_sample_format *f) {
+    int fd, val, ret;
+    unsigned nchannels;
+
+    /* Some devices can only be opened once. If somebody else is using
+     * it we just try again with the next sound. */
+    if ((fd = open(c->device ? c->device : "/dev/dsp", O_WRONLY | O_NONBLOCK, 0)) < 0)
+        return translate_error(errno);
+
+    val = AFMT_S16_NE;
+    if (ioctl(fd, SNDCTL_DSP_SETFMT, &val) < 0)
+        goto finish_errno;
+
+    if (val != AFMT_S16_NE) {
+        ret = CA_ERROR_NOTSUPPORTED;
+        goto finish_ret;
+    }
+
+    val = (int) NATIVE_NCHANNELS;
+    if (ioctl(fd, SNDCTL_DSP_CHANNELS, &val) < 0)
+        goto finish_errno;
+
+    /* See open_oss() */
+    if (val < 1 || val > 2) {
+        ret = CA_ERROR_NOTSUPPORTED;
+        goto finish_ret;
+    }
+
+    nchannels = (unsigned) val;
+
+    val = (int) NATIVE_RATE;
+    if (ioctl(fd, SNDCTL_DSP_SPEED, &val) < 0)
+        goto finish_errno;
+
+    if (val <= 0) {
+        ret = CA_ERROR_NOTSUPPORTED;
+        goto finish_ret;
+    }
+
+    close(fd);
+
+    f->rate = (unsigned) val;
+    f->nchannels = nchannels;
+
+    return CA_SUCCESS;
+
+finish_errno:
+    ret = translate_error(errno);
+
+finish_ret:
+    close(fd);
+
+    return ret;
+}
+
+/* Returns NULL if sounds are to be played as they are */
+static const ca_sample_format* get_native_format(ca_context *c, ca_sample_format *f) {
+    struct private *p;
+    ca_bool_t known;
+    int ret;
+
+    p = PRIVATE(c);
+
+    ca_mutex_lock(p->outstanding_mutex);
+
+    if (!p->convert) {
+        ca_mutex_unlock(p->outstanding_mutex);
+        return NULL;
+    }
+
+    if ((known = p->native_known))
+        *f = p->native;
+
+    /* Probing the device fails while our own mixer has it open, but
+     * then we know one format it is happy with anyway */
+    else if ((known = p->mixer_running)) {
+        f->rate = p->mixer_rate;
+        f->nchannels = MIXER_NCHANNELS;
+        p->native = *f;
+        p->native_known = TRUE;
+    }
+
+    ca_mutex_unlock(p->outstanding_mutex);
+
+    if (known)
+        return f->rate > 0 ? f : NULL;
+
+    /* A failure is remembered as well, so that we don't probe again
+     * and again on every play */
+    if ((ret = probe_native_format(c, f)) < 0)
+        f->rate = f->nchannels = 0;
+
+    ca_mutex_lock(p->outstanding_mutex);
+    p->native = *f;
+    p->native_known = TRUE;
+    ca_mutex_unlock(p->outstanding_mutex);
+
+    return ret < 0 ? NULL : f;
+}
+
+static void get_format(struct outstanding *out, ca_sample_type_t *type, unsigned *rate, unsigned *nchannels) {
+
+    if (out->sample) {
+        *nchannels = out->sample->nchannels;
+        *rate = out->sample->rate;
+        *type = out->sample->type;
+    } else {
+        *nchannels = ca_sound_file_get_nchannels(out->file);
+        *rate = ca_sound_file_get_rate(out->file);
+        *type = ca_sound_file_get_sample_type(out->file);
+    }
+}
+
+/* Maps the DMA buffer of the device, for OSS drivers that allow
+ * that. If they don't we simply write() as usual. */
+static void setup_mmap(struct outstanding *out, unsigned rate, size_t fs) {
+    audio_buf_info info;
+    int caps, val;
+    void *b;
+
+    if (ioctl(out->pcm, SNDCTL_DSP_GETCAPS, &caps) < 0 ||
+        !(caps & DSP_CAP_MMAP) ||
+        !(caps & DSP_CAP_TRIGGER))
+        return;
+
+    if (ioctl(out->pcm, SNDCTL_DSP_GETOSPACE, &info) < 0 ||
+        info.fragstotal <= 0 ||
+        info.fragsize <= 0)
+        return;
+
+    /* Playback starts once we have filled the buffer */
+    val = 0;
+    if (ioctl(out->pcm, SNDCTL_DSP_SETTRIGGER, &val) < 0)
+        return;
+
+    if ((b = mmap(NULL, (size_t) info.fragstotal * (size_t) info.fragsize, PROT_WRITE, MAP_SHARED, out->pcm, 0)) == MAP_FAILED)
+        return;
+
+    out->mmap_buffer = b;
+    out->mmap_size = (size_t) info.fragstotal * (size_t) info.fragsize;
+    out->fragment_usec = (unsigned) ((uint64_t) info.fragsize * 1000000ULL / ((uint64_t) rate * fs));
+}
+
+static int open_oss(ca_context *c, struct outstanding *out) {
+    struct private *p;
+    unsigned rate, nchannels, latency;
+    ca_sample_type_t type;
+    ca_bool_t use_mmap;
+    int ret;
+
+    ca_return_val_if_fail(c, CA_ERROR_INVALID);
+    ca_return_val_if_fail(c->private, CA_ERROR_STATE);
+    ca_return_val_if_fail(out, CA_ERROR_INVALID);
+    ca_return_val_if_fail(out->file || out->sample, CA_ERROR_INVALID);
+
+    get_format(out, &type, &rate, &nchannels);
+
+    /* In OSS we have no way to configure a channel mapping for
+     * multichannel streams. We cannot support those files hence */
+    ca_return_val_if_fail(nchannels <= 2, CA_ERROR_NOTSUPPORTED);
+
+    p = PRIVATE(c);
+
+    ca_mutex_lock(p->outstanding_mutex);
+    latency = p->latency;
+    use_mmap = p->use_mmap;
+    ca_mutex_unlock(p->outstanding_mutex);
+
+    if ((ret = open_dsp(c, &out->pcm, type, rate, nchannels, latency, NULL)) < 0)
+        return ret;
+
+    if (use_mmap)
+        setup_mmap(out, rate, nchannels * (type == CA_SAMPLE_U8 ? 1 : 2));
+
+    return CA_SUCCESS;
+}
+
 #define BUFSIZE (4*1024)
 
-static void* thread_func(void *userdata) {
+/* How far the decoder may get ahead of the player, for compressed
+ * files that are streamed */
+#define READ_AHEAD_SIZE (4*BUFSIZE)
+
+/* Returns the next chunk to play, at the end *nbytes is 0 */
+static int read_data(struct outstanding *out, void *data, size_t data_size, ca_bool_t *mapped, const void **d, size_t *nbytes) {
+    int ret;
+
+    for (;;) {
+
+        if (out->sample) {
+            *nbytes = CA_MIN(data_size, out->sample->nbytes - out->offset);
+            *d = (const uint8_t*) out->sample->data + out->offset;
+            out->offset += *nbytes;
+        } else if (*mapped) {
+            *nbytes = data_size;
+
+            if ((ret = ca_sound_file_read_mapped(out->file, d, nbytes)) < 0)
+                return ret;
+        } else {
+            *nbytes = data_size;
+
+            if ((ret = ca_sound_file_read_arbitrary(out->file, data, nbytes)) < 0)
+                return ret;
+
+            *d = data;
+        }
+
+        if (*nbytes > 0)
+            return CA_SUCCESS;
+
+        /* Continue with the next file of the sequence, if any */
+        if ((ret = ca_sequence_next(out->sequence, &out->file)) < 0)
+            return ret == CA_ERROR_NOTFOUND ? CA_SUCCESS : ret;
+
+        *mapped = ca_sound_file_is_mapped(out->file);
+    }
+}
+
+/* Copies the sound into the DMA buffer as the device makes room for
+ * it, and fills up with silence at the end, since the device keeps
+ * going round the buffer until we close it */
+static int play_mmap(struct outstanding *out, struct pollfd *pfd, void *data, size_t data_size, ca_bool_t mapped, uint8_t silence) {
+    uint8_t *buffer = out->mmap_buffer;
+    uint64_t written = 0, played = 0, end = 0;
+    ca_bool_t eof = FALSE, triggered = FALSE;
+    const void *d = NULL;
+    size_t nbytes = 0;
+    unsigned last = 0;
+    int timeout, ret;
+
+    /* The device only tells us when a fragment is done if it feels
+     * like it, hence we check at least that often */
+    timeout = (int) (out->fragment_usec / 1000U) + 1;
+
+    for (;;) {
+        count_info ci;
+        size_t space;
+
+        if (out->dead)
+            break;
+
+        if (triggered) {
+
+            if (ioctl(out->pcm, SNDCTL_DSP_GETOPTR, &ci) < 0)
+                return translate_error(errno);
+
+            /* This wraps around, but the difference doesn't */
+            played += (unsigned) ci.bytes - last;
+            last = (unsigned) ci.bytes;
+        }
+
+        if (eof && played >= end)
+            break;
+
+        /* If we fell behind the device we continue where it is */
+        if (played > written)
+            written = played;
+
+        space = out->mmap_size - (size_t) (written - played);
+
+        while (space > 0) {
+            size_t pos, k;
+
+            pos = (size_t) (written % out->mmap_size);
+            k = CA_MIN(space, out->mmap_size - pos);
+
+            if (!eof) {
+
+                if (nbytes <= 0) {
+                    if ((ret = read_data(out, data, data_size, &mapped, &d, &nbytes)) < 0)
+                        return ret;
+
+                    if (nbytes <= 0) {
+                        eof = TRUE;
+                        end = written;
+                        continue;
+                    }
+                }
+
+                k = CA_MIN(k, nbytes);
+                memcpy(buffer + pos, d, k);
+
+                d = (const uint8_t*) d + k;
+                nbytes -= k;
+
+            } else {
+
+                /* Once the whole buffer behind the end is silent we
+                 * are done */
+                if (written >= end + out->mmap_size)
+                    break;
+
+                k = CA_MIN(k, (size_t) (end + out->mmap_size - written));
+                memset(buffer + pos, silence, k);
+            }
+
+            written += k;
+            space -= k;
+        }
+
+        if (!triggered) {
+            int val = PCM_ENABLE_OUTPUT;
+
+            if (ioctl(out->pcm, SNDCTL_DSP_SETTRIGGER, &val) < 0)
+                return translate_error(errno);
+
+            triggered = TRUE;
+        }
+
+        if (!out->written) {
+            out->written = TRUE;
+            ca_trace_stage(CA_TRACE_FIRST_WRITE, out->started);
+        }
+
+        if (poll(pfd, 2, timeout) < 0)
+            return CA_ERROR_SYSTEM;
+
+        /* We have been asked to shut down */
+        if (pfd[0].revents)
+            break;
+    }
+
+    return CA_SUCCESS;
+}
+
+static void thread_func(void *userdata, void *pool_userdata) {
     struct outstanding *out = userdata;
     int ret;
-    void *data, *d = NULL;
+    void *data = NULL;
+    const void *d = NULL;
+    ca_bool_t mapped;
     size_t fs, data_size;
     size_t nbytes = 0;
     struct pollfd pfd[2];
@@ -320,15 +860,19 @@ static void* thread_func(void *userdata) {
 
     p = PRIVATE(out->context);
 
-    pthread_detach(pthread_self());
-
-    fs = ca_sound_file_frame_size(out->file);
+    fs = out->sample ? ca_sample_frame_size(out->sample) : ca_sound_file_frame_size(out->file);
     data_size = (BUFSIZE/fs)*fs;
 
-    if (!(data = ca_malloc(data_size))) {
-        ret = CA_ERROR_OOM;
-        goto finish;
-    }
+    /* Cached samples are written straight from the decoded buffer,
+     * mapped files straight from the map */
+    mapped = !out->sample && ca_sound_file_is_mapped(out->file);
+
+    /* Later files of a sequence might not be mapped */
+    if (!out->sample && (!mapped || out->sequence))
+        if (!(data = ca_malloc(data_size))) {
+            ret = CA_ERROR_OOM;
+            goto finish;
+        }
 
     pfd[0].fd = out->pipe_fd[0];
     pfd[0].events = POLLIN;
@@ -337,6 +881,14 @@ static void* thread_func(void *userdata) {
     pfd[1].events = POLLOUT;
     pfd[1].revents = 0;
 
+    if (out->mmap_buffer) {
+        ca_sample_type_t type;
+
+        type = out->sample ? out->sample->type : ca_sound_file_get_sample_type(out->file);
+        ret = play_mmap(out, pfd, data, data_size, mapped, type == CA_SAMPLE_U8 ? 0x80 : 0);
+        goto finish;
+    }
+
     for (;;) {
         ssize_t bytes_written;
 
@@ -357,15 +909,10 @@ static void* thread_func(void *userdata) {
             goto finish;
         }
 
-        if (nbytes <= 0) {
-            nbytes = data_size;
-
-            if ((ret = ca_sound_file_read_arbitrary(out->file, data, &nbytes)) < 0)
+        if (nbytes <= 0)
+            if ((ret = read_data(out, data, data_size, &mapped, &d, &nbytes)) < 0)
                 goto finish;
 
-            d = data;
-        }
-
         if (nbytes <= 0)
             break;
 
@@ -374,8 +921,13 @@ static void* thread_func(void *userdata) {
             goto finish;
         }
 
+        if (!out->written) {
+            out->written = TRUE;
+            ca_trace_stage(CA_TRACE_FIRST_WRITE, out->started);
+        }
+
         nbytes -= (size_t) bytes_written;
-        d = (uint8_t*) d + (size_t) bytes_written;
+        d = (const uint8_t*) d + (size_t) bytes_written;
     }
 
     ret = CA_SUCCESS;
@@ -384,9 +936,14 @@ finish:
 
     ca_free(data);
 
-    if (!out->dead)
+    if (!out->dead) {
+        ca_trace_stage(CA_TRACE_FINISH, out->started);
+
         if (out->callback)
             out->callback(out->context, out->id, ret, out->userdata);
+    }
+
+    ca_trace_stream_end();
 
     ca_mutex_lock(p->outstanding_mutex);
 
@@ -398,18 +955,313 @@ finish:
     outstanding_free(out);
 
     ca_mutex_unlock(p->outstanding_mutex);
+}
+
+static int mixer_iterate(int fd, int16_t *mix, struct outstanding **sources, unsigned n_sources) {
+    struct pollfd pfd;
+    audio_buf_info info;
+    size_t frames, n_mixed = 0, nbytes;
+    uint8_t *d;
+    unsigned i;
+    int ret;
+
+    /* Wait until the device wants more data */
+    pfd.fd = fd;
+    pfd.events = POLLOUT;
+    pfd.revents = 0;
+
+    if (poll(&pfd, 1, -1) < 0)
+        return CA_ERROR_SYSTEM;
+
+    if (pfd.revents != POLLOUT)
+        return CA_ERROR_IO;
+
+    /* Don't queue more than the device has room for right now, so
+     * that sound events joining the mix are not delayed much */
+    frames = MIXER_FRAMES;
+    if (ioctl(fd, SNDCTL_DSP_GETOSPACE, &info) >= 0 && info.bytes > 0)
+        frames = CA_MIN(frames, (size_t) info.bytes / (MIXER_NCHANNELS * sizeof(int16_t)));
+
+    if (frames <= 0)
+        frames = 1;
+
+    memset(mix, 0, frames * MIXER_NCHANNELS * sizeof(int16_t));
+
+    for (i = 0; i < n_sources; i++) {
+        struct outstanding *out = sources[i];
+        size_t n = frames;
+
+        if (out->dead || out->finished)
+            continue;
+
+        if ((ret = ca_mix_source(mix, MIXER_NCHANNELS, &n, out->sample, &out->offset, out->file, out->volume)) < 0) {
+            out->finished = TRUE;
+            out->error = ret;
+            continue;
+        }
+
+        /* Note that we consider a source played as soon as the last
+         * bit of it has been written to the device */
+        if (n < frames) {
+            out->finished = TRUE;
+            out->error = CA_SUCCESS;
+        }
+
+        if (n > 0 && !out->written) {
+            out->written = TRUE;
+            ca_trace_stage(CA_TRACE_FIRST_WRITE, out->started);
+        }
+
+        n_mixed = CA_MAX(n_mixed, n);
+    }
+
+    d = (uint8_t*) mix;
+    nbytes = n_mixed * MIXER_NCHANNELS * sizeof(int16_t);
+
+    while (nbytes > 0) {
+        ssize_t bytes_written;
+
+        if ((bytes_written = write(fd, d, nbytes)) <= 0)
+            return translate_error(errno);
+
+        nbytes -= (size_t) bytes_written;
+        d += (size_t) bytes_written;
+    }
+
+    return CA_SUCCESS;
+}
+
+static void* mixer_func(void *userdata) {
+    struct private *p = userdata;
+    struct outstanding *sources[MIXER_SOURCES_MAX], *out, *done = NULL;
+    unsigned n_sources, i;
+    int16_t *mix;
+    ca_bool_t drained = FALSE;
+    int fd, ret = CA_SUCCESS;
+
+    pthread_detach(pthread_self());
+
+    /* The device is ours until we reset mixer_running */
+    fd = p->mixer_fd;
+
+    if (!(mix = ca_new(int16_t, MIXER_FRAMES * MIXER_NCHANNELS)))
+        ret = CA_ERROR_OOM;
+
+    for (;;) {
+
+        ca_mutex_lock(p->outstanding_mutex);
+
+        /* Only we remove mixed sources from the list, so the
+         * pointers stay valid after dropping the lock again */
+        n_sources = 0;
+        for (out = p->outstanding; out; out = out->next)
+            if (out->mixed)
+                sources[n_sources++] = out;
+
+        if (n_sources <= 0) {
+
+            /* Let the device play what is left, and check again
+             * afterwards, maybe something new came in meanwhile */
+            if (ret == CA_SUCCESS && !drained && !p->signal_semaphore) {
+                ca_mutex_unlock(p->outstanding_mutex);
+
+                if (ioctl(fd, SNDCTL_DSP_SYNC, NULL) < 0)
+                    ret = translate_error(errno);
+
+                drained = TRUE;
+                continue;
+            }
+
+            /* We close the device with the lock held, so that nobody
+             * tries to open a new mixer before we let go of it */
+            p->mixer_running = FALSE;
+            p->mixer_fd = -1;
+            close(fd);
+
+            if (p->signal_semaphore)
+                sem_post(&p->semaphore);
+
+            ca_mutex_unlock(p->outstanding_mutex);
+            break;
+        }
+
+        ca_mutex_unlock(p->outstanding_mutex);
+
+        drained = FALSE;
+
+        if (ret == CA_SUCCESS)
+            ret = mixer_iterate(fd, mix, sources, n_sources);
+
+        ca_mutex_lock(p->outstanding_mutex);
+
+        /* If the device failed on us, all sources fail with it */
+        for (i = 0; i < n_sources; i++) {
+            out = sources[i];
+
+            if (ret < 0 && !out->finished) {
+                out->finished = TRUE;
+                out->error = ret;
+            }
+
+            if (!out->dead && !out->finished)
+                continue;
+
+            /* Cancelled sources have already been notified */
+            out->notify = !out->dead;
+            out->dead = TRUE;
+
+            CA_LLIST_REMOVE(struct outstanding, p->outstanding, out);
+            CA_LLIST_PREPEND(struct outstanding, done, out);
+            p->n_mixer_sources--;
+        }
+
+        if (!p->outstanding && p->signal_semaphore)
+            sem_post(&p->semaphore);
+
+        ca_mutex_unlock(p->outstanding_mutex);
+
+        while ((out = done)) {
+            CA_LLIST_REMOVE(struct outstanding, done, out);
+
+            if (out->notify) {
+                ca_trace_stage(CA_TRACE_FINISH, out->started);
+
+                if (out->callback)
+                    out->callback(out->context, out->id, out->error, out->userdata);
+            }
+
+            ca_trace_stream_end();
+            outstanding_free(out);
+        }
+    }
+
+    ca_free(mix);
 
     return NULL;
 }
 
-int driver_play(ca_context *c, uint32_t id, ca_proplist *proplist, ca_finish_callback_t cb, void *userdata) {
+static ca_bool_t mixer_can_take_unlocked(struct private *p, unsigned rate, unsigned nchannels) {
+    return
+        nchannels <= 2 &&
+        p->n_mixer_sources < MIXER_SOURCES_MAX &&
+        (!p->mixer_running || p->mixer_rate == rate);
+}
+
+static void mixer_take_unlocked(struct private *p, struct outstanding *out) {
+    out->mixed = TRUE;
+    p->n_mixer_sources++;
+    ca_trace_stream_begin();
+
+    CA_LLIST_PREPEND(struct outstanding, p->outstanding, out);
+}
+
+static int mixer_add(ca_context *c, struct outstanding *out, ca_bool_t *added) {
+    struct private *p;
+    pthread_t thread;
+    unsigned rate, nchannels, device_rate, latency;
+    ca_sample_type_t type;
+    int fd = -1;
+    ca_usec_t start;
+    int ret;
+
+    /* Adds a sound event to the software mixer, starting it if
+     * needed. Sound events which cannot be mixed into the stream
+     * currently playing are left to the caller. */
+
+    p = PRIVATE(c);
+    *added = FALSE;
+
+    get_format(out, &type, &rate, &nchannels);
+
+    ca_mutex_lock(p->outstanding_mutex);
+
+    latency = p->latency;
+
+    /* Either we join the mixer that is playing already, or we leave
+     * the sound to the caller */
+    if (p->mixer_running || !mixer_can_take_unlocked(p, rate, nchannels)) {
+
+        if ((*added = mixer_can_take_unlocked(p, rate, nchannels)))
+            mixer_take_unlocked(p, out);
+
+        ca_mutex_unlock(p->outstanding_mutex);
+        return CA_SUCCESS;
+    }
+
+    ca_mutex_unlock(p->outstanding_mutex);
+
+    /* Opening the device may take a while, and we don't want to hold
+     * up the mixer or other players meanwhile */
+    start = ca_trace_now();
+    device_rate = rate;
+
+    if ((ret = open_dsp(c, &fd, CA_SAMPLE_S16NE, rate, MIXER_NCHANNELS, latency, &device_rate)) < 0) {
+
+        /* If the device cannot do our mix format, play unmixed */
+        if (ret == CA_ERROR_NOTSUPPORTED)
+            return CA_SUCCESS;
+
+        /* Some devices can only be opened once, so this might fail
+         * because somebody else just started the mixer */
+        ca_mutex_lock(p->outstanding_mutex);
+
+        if (p->mixer_running && (*added = mixer_can_take_unlocked(p, rate, nchannels))) {
+            mixer_take_unlocked(p, out);
+            ret = CA_SUCCESS;
+        }
+
+        ca_mutex_unlock(p->outstanding_mutex);
+
+        return ret;
+    }
+
+    ca_trace_stage(CA_TRACE_DEVICE_OPEN, start);
+
+    ca_mutex_lock(p->outstanding_mutex);
+
+    /* We don't resample, so if the device runs at another rate than
+     * we asked for, this sound cannot be mixed. And somebody else
+     * might have started the mixer in the meantime. */
+    if (device_rate == rate && !p->mixer_running) {
+
+        p->mixer_fd = fd;
+
+        if (pthread_create(&thread, NULL, mixer_func, p) != 0) {
+            p->mixer_fd = -1;
+            ca_mutex_unlock(p->outstanding_mutex);
+
+            close(fd);
+            return CA_ERROR_OOM;
+        }
+
+        fd = -1;
+        p->mixer_running = TRUE;
+        p->mixer_rate = device_rate;
+    }
+
+    /* If we didn't get a mixer going, the caller plays it unmixed */
+    if ((*added = p->mixer_running && mixer_can_take_unlocked(p, rate, nchannels)))
+        mixer_take_unlocked(p, out);
+
+    ca_mutex_unlock(p->outstanding_mutex);
+
+    if (fd >= 0)
+        close(fd);
+
+    return CA_SUCCESS;
+}
+
+int driver_play(ca_context *c, uint32_t id, ca_proplist *proplist, ca_proplist *cp, ca_finish_callback_t cb, void *userdata) {
     struct private *p;
     struct outstanding *out = NULL;
+    ca_sample_format format;
+    const ca_sample_format *native;
+    ca_usec_t start;
     int ret;
-    pthread_t thread;
 
     ca_return_val_if_fail(c, CA_ERROR_INVALID);
     ca_return_val_if_fail(proplist, CA_ERROR_INVALID);
+    ca_return_val_if_fail(cp, CA_ERROR_INVALID);
     ca_return_val_if_fail(!userdata || cb, CA_ERROR_INVALID);
     ca_return_val_if_fail(c->private, CA_ERROR_STATE);
 
@@ -420,6 +1272,8 @@ int driver_play(ca_context *c, uint32_t id, ca_proplist *proplist, ca_finish_cal
         goto finish;
     }
 
+    out->started = ca_trace_now();
+
     out->context = c;
     out->id = id;
     out->callback = cb;
@@ -427,29 +1281,60 @@ int driver_play(ca_context *c, uint32_t id, ca_proplist *proplist, ca_finish_cal
     out->pipe_fd[0] = out->pipe_fd[1] = -1;
     out->pcm = -1;
 
+    /* Only the software mixer scales the sound */
+    if ((ret = ca_mix_get_volume(proplist, &out->volume)) < 0)
+        goto finish;
+
+    native = get_native_format(c, &format);
+
+    if ((ret = ca_sample_cache_lookup_sound(&out->sample, &out->file, &p->theme, cp, proplist, native)) < 0)
+        goto finish;
+
+    /* Get the decoder going before we even open the device, so that
+     * the first write doesn't wait for it */
+    if (out->file && !ca_sound_file_is_mapped(out->file))
+        if ((ret = ca_sound_file_read_ahead(out->file, READ_AHEAD_SIZE, BUFSIZE)) < 0)
+            goto finish;
+
+    if ((ret = ca_sequence_new(&out->sequence, &out->sample, &out->file, &p->theme, cp, proplist, native)) < 0)
+        goto finish;
+
+    /* The mixer only plays single sounds */
+    if (p->software_mixer && !out->sequence) {
+        ca_bool_t added;
+
+        if ((ret = mixer_add(c, out, &added)) < 0)
+            goto finish;
+
+        if (added)
+            return CA_SUCCESS;
+    }
+
     if (pipe(out->pipe_fd) < 0) {
         ret = CA_ERROR_SYSTEM;
         goto finish;
     }
 
-    if ((ret = ca_lookup_sound(&out->file, NULL, &p->theme, c->props, proplist)) < 0)
-        goto finish;
+    start = ca_trace_now();
 
     if ((ret = open_oss(c, out)) < 0)
         goto finish;
 
+    ca_trace_stage(CA_TRACE_DEVICE_OPEN, start);
+
     /* OK, we're ready to go, so let's add this to our list */
     ca_mutex_lock(p->outstanding_mutex);
     CA_LLIST_PREPEND(struct outstanding, p->outstanding, out);
     ca_mutex_unlock(p->outstanding_mutex);
 
-    if (pthread_create(&thread, NULL, thread_func, out) < 0) {
-        ret = CA_ERROR_OOM;
+    ca_trace_stream_begin();
 
+    if ((ret = ca_thread_pool_push(p->pool, out)) < 0) {
         ca_mutex_lock(p->outstanding_mutex);
         CA_LLIST_REMOVE(struct outstanding, p->outstanding, out);
         ca_mutex_unlock(p->outstanding_mutex);
 
+        ca_trace_stream_end();
         goto finish;
     }
 
@@ -0,0 +1,151 @@
+/***
+  This file is part of libcanberra.
+
+  Copyright 2008 Lennart Poettering
+
+  libcanberra is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 2.1 of the
+  License, or (at your option) any later version.
+
+  libcanberra is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with libcanberra. If not, see
+  <http://www.gnu.org/licenses/>.
+***/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#include "canberra.h"
+#include "proplist.h"
+#include "macro.h"
+
+/* Builds and destroys a property list like the one
+ * ca_gtk_play_for_widget() builds for a click, and then looks up a
+ * couple of properties in it, by name and by interned key. Prints
+ * one line per operation:
+ *
+ *     operation allocations-per-list nsec-per-list
+ */
+
+#define N_ITERATIONS 100000
+
+static double now(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+
+    return (double) tv.tv_sec + (double) tv.tv_usec / 1000000.0;
+}
+
+static ca_proplist* build(void) {
+    ca_proplist *p;
+
+    ca_assert_se(ca_proplist_create(&p) == CA_SUCCESS);
+
+    ca_assert_se(ca_proplist_sets(p, CA_PROP_EVENT_ID, "button-pressed") == CA_SUCCESS);
+    ca_assert_se(ca_proplist_sets(p, CA_PROP_EVENT_DESCRIPTION, "Button pressed") == CA_SUCCESS);
+    ca_assert_se(ca_proplist_sets(p, CA_PROP_WINDOW_NAME, "Untitled Document 1 - gedit") == CA_SUCCESS);
+    ca_assert_se(ca_proplist_sets(p, CA_PROP_WINDOW_ID, "gedit") == CA_SUCCESS);
+    ca_assert_se(ca_proplist_sets(p, CA_PROP_WINDOW_ICON_NAME, "accessories-text-editor") == CA_SUCCESS);
+    ca_assert_se(ca_proplist_sets(p, CA_PROP_WINDOW_X11_DISPLAY, ":0.0") == CA_SUCCESS);
+    ca_assert_se(ca_proplist_setf(p, CA_PROP_WINDOW_X11_SCREEN, "%i", 0) == CA_SUCCESS);
+    ca_assert_se(ca_proplist_setf(p, CA_PROP_WINDOW_X11_MONITOR, "%i", 0) == CA_SUCCESS);
+    ca_assert_se(ca_proplist_setf(p, CA_PROP_WINDOW_X11_XID, "%lu", 0x2e00003UL) == CA_SUCCESS);
+    ca_assert_se(ca_proplist_sets(p, CA_PROP_APPLICATION_NAME, "gedit") == CA_SUCCESS);
+    ca_assert_se(ca_proplist_sets(p, CA_PROP_APPLICATION_ID, "org.gnome.gedit") == CA_SUCCESS);
+    ca_assert_se(ca_proplist_sets(p, CA_PROP_APPLICATION_ICON_NAME, "accessories-text-editor") == CA_SUCCESS);
+    ca_assert_se(ca_proplist_sets(p, CA_PROP_APPLICATION_LANGUAGE, "de_DE") == CA_SUCCESS);
+    ca_assert_se(ca_proplist_setf(p, CA_PROP_APPLICATION_PROCESS_ID, "%lu", 4711UL) == CA_SUCCESS);
+    ca_assert_se(ca_proplist_sets(p, CA_PROP_APPLICATION_PROCESS_BINARY, "gedit") == CA_SUCCESS);
+    ca_assert_se(ca_proplist_sets(p, CA_PROP_APPLICATION_PROCESS_USER, "lennart") == CA_SUCCESS);
+    ca_assert_se(ca_proplist_sets(p, CA_PROP_APPLICATION_PROCESS_HOST, "tango") == CA_SUCCESS);
+    ca_assert_se(ca_proplist_setf(p, CA_PROP_EVENT_MOUSE_X, "%i", 300) == CA_SUCCESS);
+    ca_assert_se(ca_proplist_setf(p, CA_PROP_EVENT_MOUSE_Y, "%i", 200) == CA_SUCCESS);
+    ca_assert_se(ca_proplist_setf(p, CA_PROP_EVENT_MOUSE_HPOS, "%0.2f", 0.37) == CA_SUCCESS);
+    ca_assert_se(ca_proplist_setf(p, CA_PROP_EVENT_MOUSE_VPOS, "%0.2f", 0.33) == CA_SUCCESS);
+    ca_assert_se(ca_proplist_setf(p, CA_PROP_EVENT_MOUSE_BUTTON, "%i", 1) == CA_SUCCESS);
+    ca_assert_se(ca_proplist_sets(p, CA_PROP_CANBERRA_CACHE_CONTROL, "permanent") == CA_SUCCESS);
+
+    return p;
+}
+
+static void lookup(ca_proplist *p) {
+    ca_assert_se(ca_proplist_gets_unlocked(p, CA_PROP_EVENT_ID));
+    ca_assert_se(ca_proplist_gets_unlocked(p, CA_PROP_WINDOW_X11_XID));
+    ca_assert_se(!ca_proplist_gets_unlocked(p, CA_PROP_MEDIA_FILENAME));
+    ca_assert_se(!ca_proplist_gets_unlocked(p, CA_PROP_CANBERRA_XDG_THEME_NAME));
+}
+
+static void lookup_key(ca_proplist *p) {
+    ca_assert_se(ca_proplist_gets_key_unlocked(p, CA_PROP_KEY_EVENT_ID));
+    ca_assert_se(ca_proplist_gets_key_unlocked(p, CA_PROP_KEY_WINDOW_X11_XID));
+    ca_assert_se(!ca_proplist_gets_key_unlocked(p, CA_PROP_KEY_MEDIA_FILENAME));
+    ca_assert_se(!ca_proplist_gets_key_unlocked(p, CA_PROP_KEY_CANBERRA_XDG_THEME_NAME));
+}
+
+int main(int argc, char *argv[]) {
+    ca_proplist *p, *f;
+    unsigned i, a;
+    double t;
+
+    a = ca_proplist_get_n_allocations();
+    t = now();
+    for (i = 0; i < N_ITERATIONS; i++)
+        ca_assert_se(ca_proplist_destroy(build()) == CA_SUCCESS);
+    t = now() - t;
+    a = ca_proplist_get_n_allocations() - a;
+
+    printf("build %.2f %.1f\n", (double) a / N_ITERATIONS, t * 1000000000.0 / N_ITERATIONS);
+
+    p = build();
+
+    t = now();
+    for (i = 0; i < N_ITERATIONS; i++)
+        lookup(p);
+    t = now() - t;
+
+    printf("lookup 0.00 %.1f\n", t * 1000000000.0 / N_ITERATIONS);
+
+    t = now();
+    for (i = 0; i < N_ITERATIONS; i++)
+        lookup_key(p);
+    t = now() - t;
+
+    printf("lookup-key 0.00 %.1f\n", t * 1000000000.0 / N_ITERATIONS);
+
+    a = ca_proplist_get_n_allocations();
+    t = now();
+    for (i = 0; i < N_ITERATIONS; i++) {
+        ca_assert_se(ca_proplist_freeze(&f, p) == CA_SUCCESS);
+        ca_assert_se(ca_proplist_destroy(f) == CA_SUCCESS);
+    }
+    t = now() - t;
+    a = ca_proplist_get_n_allocations() - a;
+
+    printf("freeze %.2f %.1f\n", (double) a / N_ITERATIONS, t * 1000000000.0 / N_ITERATIONS);
+
+    ca_assert_se(ca_proplist_freeze(&f, p) == CA_SUCCESS);
+
+    t = now();
+    for (i = 0; i < N_ITERATIONS; i++)
+        lookup(f);
+    t = now() - t;
+
+    printf("lookup-frozen 0.00 %.1f\n", t * 1000000000.0 / N_ITERATIONS);
+
+    ca_assert_se(ca_proplist_destroy(f) == CA_SUCCESS);
+    ca_assert_se(ca_proplist_destroy(p) == CA_SUCCESS);
+
+    return 0;
+}
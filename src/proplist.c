@@ -23,12 +23,45 @@
 #endif
 
 #include <stdarg.h>
+#include <errno.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <pthread.h>
 
 #include "canberra.h"
 #include "proplist.h"
 #include "macro.h"
 #include "malloc.h"
 
+/* Properties and their keys are allocated from chunks of memory that
+ * are only freed as a whole. Replaced properties are left behind in
+ * them, until they take up more than half of it, at which point the
+ * remaining ones are moved into a fresh chunk. The first chunk is
+ * allocated together with the list itself. */
+
+#define CHUNK_SIZE_MIN 1024U
+
+struct ca_proplist_chunk {
+    struct ca_proplist_chunk *next;
+    size_t size, used;
+};
+
+#define CHUNK_DATA(c) ((uint8_t*) (c) + CA_ALIGN(sizeof(struct ca_proplist_chunk)))
+#define FIRST_CHUNK(p) ((struct ca_proplist_chunk*) ((uint8_t*) (p) + CA_ALIGN(sizeof(ca_proplist))))
+
+/* Counts the allocations done by the property list code, for the
+ * benchmark to look at */
+static volatile unsigned n_allocations = 0;
+
+static void count_allocation(void) {
+    __sync_add_and_fetch(&n_allocations, 1);
+}
+
+unsigned ca_proplist_get_n_allocations(void) {
+    __sync_synchronize();
+    return n_allocations;
+}
+
 static unsigned calc_hash(const char *c) {
     unsigned hash = 0;
 
@@ -38,6 +71,139 @@ static unsigned calc_hash(const char *c) {
     return hash;
 }
 
+static const char * const well_known_keys[_CA_PROP_KEY_MAX] = {
+    [CA_PROP_KEY_VISUAL_EFFECT] = CA_PROP_VISUAL_EFFECT,
+    [CA_PROP_KEY_COLOR] = CA_PROP_COLOR,
+    [CA_PROP_KEY_MEDIA_IMAGE_PATH] = CA_PROP_MEDIA_IMAGE_PATH,
+    [CA_PROP_KEY_MEDIA_NAME] = CA_PROP_MEDIA_NAME,
+    [CA_PROP_KEY_MEDIA_TITLE] = CA_PROP_MEDIA_TITLE,
+    [CA_PROP_KEY_MEDIA_ARTIST] = CA_PROP_MEDIA_ARTIST,
+    [CA_PROP_KEY_MEDIA_LANGUAGE] = CA_PROP_MEDIA_LANGUAGE,
+    [CA_PROP_KEY_MEDIA_FILENAME] = CA_PROP_MEDIA_FILENAME,
+    [CA_PROP_KEY_MEDIA_ICON] = CA_PROP_MEDIA_ICON,
+    [CA_PROP_KEY_MEDIA_ICON_NAME] = CA_PROP_MEDIA_ICON_NAME,
+    [CA_PROP_KEY_MEDIA_ROLE] = CA_PROP_MEDIA_ROLE,
+    [CA_PROP_KEY_EVENT_ID] = CA_PROP_EVENT_ID,
+    [CA_PROP_KEY_EVENT_DESCRIPTION] = CA_PROP_EVENT_DESCRIPTION,
+    [CA_PROP_KEY_EVENT_MOUSE_X] = CA_PROP_EVENT_MOUSE_X,
+    [CA_PROP_KEY_EVENT_MOUSE_Y] = CA_PROP_EVENT_MOUSE_Y,
+    [CA_PROP_KEY_EVENT_MOUSE_HPOS] = CA_PROP_EVENT_MOUSE_HPOS,
+    [CA_PROP_KEY_EVENT_MOUSE_VPOS] = CA_PROP_EVENT_MOUSE_VPOS,
+    [CA_PROP_KEY_EVENT_MOUSE_BUTTON] = CA_PROP_EVENT_MOUSE_BUTTON,
+    [CA_PROP_KEY_WINDOW_NAME] = CA_PROP_WINDOW_NAME,
+    [CA_PROP_KEY_WINDOW_ID] = CA_PROP_WINDOW_ID,
+    [CA_PROP_KEY_WINDOW_ICON] = CA_PROP_WINDOW_ICON,
+    [CA_PROP_KEY_WINDOW_ICON_NAME] = CA_PROP_WINDOW_ICON_NAME,
+    [CA_PROP_KEY_WINDOW_X11_DISPLAY] = CA_PROP_WINDOW_X11_DISPLAY,
+    [CA_PROP_KEY_WINDOW_X11_SCREEN] = CA_PROP_WINDOW_X11_SCREEN,
+    [CA_PROP_KEY_WINDOW_X11_MONITOR] = CA_PROP_WINDOW_X11_MONITOR,
+    [CA_PROP_KEY_WINDOW_X11_XID] = CA_PROP_WINDOW_X11_XID,
+    [CA_PROP_KEY_APPLICATION_NAME] = CA_PROP_APPLICATION_NAME,
+    [CA_PROP_KEY_APPLICATION_ID] = CA_PROP_APPLICATION_ID,
+    [CA_PROP_KEY_APPLICATION_VERSION] = CA_PROP_APPLICATION_VERSION,
+    [CA_PROP_KEY_APPLICATION_ICON] = CA_PROP_APPLICATION_ICON,
+    [CA_PROP_KEY_APPLICATION_ICON_NAME] = CA_PROP_APPLICATION_ICON_NAME,
+    [CA_PROP_KEY_APPLICATION_LANGUAGE] = CA_PROP_APPLICATION_LANGUAGE,
+    [CA_PROP_KEY_APPLICATION_PROCESS_ID] = CA_PROP_APPLICATION_PROCESS_ID,
+    [CA_PROP_KEY_APPLICATION_PROCESS_BINARY] = CA_PROP_APPLICATION_PROCESS_BINARY,
+    [CA_PROP_KEY_APPLICATION_PROCESS_USER] = CA_PROP_APPLICATION_PROCESS_USER,
+    [CA_PROP_KEY_APPLICATION_PROCESS_HOST] = CA_PROP_APPLICATION_PROCESS_HOST,
+    [CA_PROP_KEY_CANBERRA_CACHE_CONTROL] = CA_PROP_CANBERRA_CACHE_CONTROL,
+    [CA_PROP_KEY_CANBERRA_VOLUME] = CA_PROP_CANBERRA_VOLUME,
+    [CA_PROP_KEY_CANBERRA_XDG_THEME_NAME] = CA_PROP_CANBERRA_XDG_THEME_NAME,
+    [CA_PROP_KEY_CANBERRA_XDG_THEME_OUTPUT_PROFILE] = CA_PROP_CANBERRA_XDG_THEME_OUTPUT_PROFILE,
+    [CA_PROP_KEY_CANBERRA_ENABLE] = CA_PROP_CANBERRA_ENABLE,
+    [CA_PROP_KEY_CANBERRA_FORCE_CHANNEL] = CA_PROP_CANBERRA_FORCE_CHANNEL,
+    [CA_PROP_KEY_CANBERRA_PLAYER_THREADS] = CA_PROP_CANBERRA_PLAYER_THREADS,
+    [CA_PROP_KEY_CANBERRA_DEVICE_IDLE_TIMEOUT] = CA_PROP_CANBERRA_DEVICE_IDLE_TIMEOUT,
+    [CA_PROP_KEY_CANBERRA_SOFTWARE_MIXER] = CA_PROP_CANBERRA_SOFTWARE_MIXER,
+    [CA_PROP_KEY_CANBERRA_ASYNC_PLAY] = CA_PROP_CANBERRA_ASYNC_PLAY,
+    [CA_PROP_KEY_CANBERRA_ASYNC_OPEN] = CA_PROP_CANBERRA_ASYNC_OPEN,
+    [CA_PROP_KEY_CANBERRA_VOICE_LIMIT] = CA_PROP_CANBERRA_VOICE_LIMIT,
+    [CA_PROP_KEY_CANBERRA_VOICE_POLICY] = CA_PROP_CANBERRA_VOICE_POLICY,
+    [CA_PROP_KEY_CANBERRA_PRIORITY] = CA_PROP_CANBERRA_PRIORITY,
+    [CA_PROP_KEY_CANBERRA_LOOP_COUNT] = CA_PROP_CANBERRA_LOOP_COUNT,
+    [CA_PROP_KEY_CANBERRA_SEQUENCE] = CA_PROP_CANBERRA_SEQUENCE,
+    [CA_PROP_KEY_CANBERRA_VISUAL_RATE] = CA_PROP_CANBERRA_VISUAL_RATE,
+    [CA_PROP_KEY_CANBERRA_LATENCY] = CA_PROP_CANBERRA_LATENCY,
+    [CA_PROP_KEY_CANBERRA_REALTIME] = CA_PROP_CANBERRA_REALTIME,
+    [CA_PROP_KEY_CANBERRA_MMAP] = CA_PROP_CANBERRA_MMAP,
+    [CA_PROP_KEY_CANBERRA_SHARED_CACHE] = CA_PROP_CANBERRA_SHARED_CACHE,
+    [CA_PROP_KEY_CANBERRA_NATIVE_FORMAT] = CA_PROP_CANBERRA_NATIVE_FORMAT,
+};
+
+/* Open addressing table mapping the hashes of the well-known keys to
+ * their ids plus one, zero for empty slots */
+#define N_KEY_SLOTS 128U
+
+static unsigned well_known_hashes[_CA_PROP_KEY_MAX];
+static uint8_t key_slots[N_KEY_SLOTS];
+
+static void init_keys_once(void) {
+    unsigned k;
+
+    for (k = 0; k < _CA_PROP_KEY_MAX; k++) {
+        unsigned i;
+
+        well_known_hashes[k] = calc_hash(well_known_keys[k]);
+
+        for (i = well_known_hashes[k] & (N_KEY_SLOTS - 1); key_slots[i]; i = (i + 1) & (N_KEY_SLOTS - 1))
+            ;
+
+        key_slots[i] = (uint8_t) (k + 1);
+    }
+}
+
+#ifdef CA_GCC_CONSTRUCTOR
+
+/* Lookups are too frequent to go through pthread_once() each time,
+ * hence we set up the table when we are loaded */
+
+static void init_keys(void) CA_GCC_CONSTRUCTOR;
+
+static void init_keys(void) {
+    init_keys_once();
+}
+
+#define ensure_keys() do { } while (0)
+
+#else
+
+/* This part is not portable due to pthread_once usage, should be abstracted
+ * when we port this to platforms that do not have POSIX threading */
+
+static void ensure_keys(void) {
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+    ca_assert_se(pthread_once(&once, init_keys_once) == 0);
+}
+
+#endif
+
+static ca_prop_key_t key_lookup(const char *key, unsigned hash) {
+    unsigned i, k;
+
+    ensure_keys();
+
+    for (i = hash & (N_KEY_SLOTS - 1); (k = key_slots[i]); i = (i + 1) & (N_KEY_SLOTS - 1)) {
+        k--;
+
+        /* Callers usually pass the very same string we have in the
+         * table, in which case we can skip the comparison */
+        if (well_known_hashes[k] == hash &&
+            (well_known_keys[k] == key || strcmp(well_known_keys[k], key) == 0))
+            return (ca_prop_key_t) k;
+    }
+
+    return CA_PROP_KEY_INVALID;
+}
+
+ca_prop_key_t ca_prop_key_from_string(const char *key) {
+    ca_return_val_if_fail(key, CA_PROP_KEY_INVALID);
+
+    return key_lookup(key, calc_hash(key));
+}
+
 /**
  * ca_proplist_create:
  * @p: A pointer where to fill in a pointer for the new property list.
@@ -48,40 +214,194 @@ static unsigned calc_hash(const char *c) {
  */
 int ca_proplist_create(ca_proplist **_p) {
     ca_proplist *p;
+    struct ca_proplist_chunk *c;
     ca_return_val_if_fail(_p, CA_ERROR_INVALID);
 
-    if (!(p = ca_new0(ca_proplist, 1)))
+    if (!(p = ca_malloc0(CA_ALIGN(sizeof(ca_proplist)) + CA_ALIGN(sizeof(struct ca_proplist_chunk)) + CHUNK_SIZE_MIN)))
         return CA_ERROR_OOM;
 
+    count_allocation();
+
     if (!(p->mutex = ca_mutex_new())) {
         ca_free(p);
         return CA_ERROR_OOM;
     }
 
+    count_allocation();
+
+    p->prop_hashtable = p->prop_hashtable_static;
+    p->n_hashtable = N_HASHTABLE_MIN;
+
+    c = FIRST_CHUNK(p);
+    c->size = CHUNK_SIZE_MIN;
+    p->chunks = c;
+
     *_p = p;
 
     return CA_SUCCESS;
 }
 
-static int _unset(ca_proplist *p, const char *key) {
+static void* arena_alloc(ca_proplist *p, size_t size) {
+    struct ca_proplist_chunk *c;
+    void *r;
+
+    size = CA_ALIGN(size);
+
+    if (!(c = p->chunks) || c->size - c->used < size) {
+        size_t s;
+
+        for (s = c ? c->size * 2 : CHUNK_SIZE_MIN; s < size; s *= 2)
+            ;
+
+        if (!(c = ca_malloc(CA_ALIGN(sizeof(struct ca_proplist_chunk)) + s)))
+            return NULL;
+
+        count_allocation();
+
+        c->size = s;
+        c->used = 0;
+        c->next = p->chunks;
+        p->chunks = c;
+    }
+
+    r = CHUNK_DATA(c) + c->used;
+    c->used += size;
+    p->allocated += size;
+
+    return r;
+}
+
+static size_t prop_size(const ca_prop *prop) {
+    return CA_ALIGN(CA_ALIGN(sizeof(ca_prop)) + CA_ALIGN(prop->nbytes) + strlen(prop->key) + 1);
+}
+
+static void compact(ca_proplist *p) {
+    struct ca_proplist_chunk *c, *n;
+    ca_prop *prop, *q, *last = NULL;
+    size_t s;
+
+    for (s = CHUNK_SIZE_MIN; s < p->allocated - p->wasted; s *= 2)
+        ;
+
+    /* If we cannot get the memory we keep on wasting it for now */
+    if (!(c = ca_malloc(CA_ALIGN(sizeof(struct ca_proplist_chunk)) + s)))
+        return;
+
+    count_allocation();
+
+    c->size = s;
+    c->used = 0;
+    c->next = NULL;
+
+    n = p->chunks;
+    p->chunks = c;
+    p->allocated = p->wasted = 0;
+
+    prop = p->first_item;
+    p->first_item = NULL;
+
+    memset(p->well_known, 0, sizeof(p->well_known));
+    memset(p->prop_hashtable, 0, sizeof(ca_prop*) * p->n_hashtable);
+
+    /* We keep the order of the items */
+    for (; prop; prop = prop->next_item) {
+        size_t l = prop_size(prop);
+
+        ca_assert_se(q = arena_alloc(p, l));
+        memcpy(q, prop, l);
+        q->key = (char*) CA_PROP_DATA(q) + CA_ALIGN(q->nbytes);
+
+        if (q->id != CA_PROP_KEY_INVALID) {
+            q->next_in_slot = NULL;
+            p->well_known[q->id] = q;
+        } else {
+            unsigned i = q->hash & (p->n_hashtable - 1);
+
+            q->next_in_slot = p->prop_hashtable[i];
+            p->prop_hashtable[i] = q;
+        }
+
+        q->next_item = NULL;
+        if ((q->prev_item = last))
+            last->next_item = q;
+        else
+            p->first_item = q;
+        last = q;
+    }
+
+    /* The first chunk stays unused from now on */
+    for (c = n; c; c = n) {
+        n = c->next;
+
+        if (c != FIRST_CHUNK(p))
+            ca_free(c);
+    }
+}
+
+static void grow_hashtable(ca_proplist *p) {
+    ca_prop **t, *prop;
+    unsigned n;
+
+    /* We keep the load factor at one at most. If we cannot get the
+     * memory we simply stay with longer chains. */
+    if (p->n_hashed <= p->n_hashtable)
+        return;
+
+    n = p->n_hashtable * 2;
+
+    if (!(t = ca_new0(ca_prop*, n)))
+        return;
+
+    count_allocation();
+
+    for (prop = p->first_item; prop; prop = prop->next_item) {
+        unsigned i;
+
+        if (prop->id != CA_PROP_KEY_INVALID)
+            continue;
+
+        i = prop->hash & (n - 1);
+        prop->next_in_slot = t[i];
+        t[i] = prop;
+    }
+
+    if (p->prop_hashtable != p->prop_hashtable_static)
+        ca_free(p->prop_hashtable);
+
+    p->prop_hashtable = t;
+    p->n_hashtable = n;
+}
+
+static int _unset(ca_proplist *p, const char *key, unsigned hash, ca_prop_key_t id) {
     ca_prop *prop, *nprop;
     unsigned i;
 
     ca_return_val_if_fail(p, CA_ERROR_INVALID);
     ca_return_val_if_fail(key, CA_ERROR_INVALID);
 
-    i = calc_hash(key) % N_HASHTABLE;
+    if (id != CA_PROP_KEY_INVALID) {
+        if ((prop = p->well_known[id]))
+            p->well_known[id] = NULL;
 
-    nprop = NULL;
-    for (prop = p->prop_hashtable[i]; prop; nprop = prop, prop = prop->next_in_slot)
-        if (strcmp(prop->key, key) == 0)
-            break;
+    } else {
+        i = hash & (p->n_hashtable - 1);
+
+        nprop = NULL;
+        for (prop = p->prop_hashtable[i]; prop; nprop = prop, prop = prop->next_in_slot)
+            if (prop->hash == hash && strcmp(prop->key, key) == 0)
+                break;
+
+        if (prop) {
+            if (nprop)
+                nprop->next_in_slot = prop->next_in_slot;
+            else
+                p->prop_hashtable[i] = prop->next_in_slot;
+
+            p->n_hashed--;
+        }
+    }
 
     if (prop) {
-        if (nprop)
-            nprop->next_in_slot = prop->next_in_slot;
-        else
-            p->prop_hashtable[i] = prop->next_in_slot;
 
         if (prop->prev_item)
             prop->prev_item->next_item = prop->next_item;
@@ -91,13 +411,63 @@ static int _unset(ca_proplist *p, const char *key) {
         if (prop->next_item)
             prop->next_item->prev_item = prop->prev_item;
 
-        ca_free(prop->key);
-        ca_free(prop);
+        p->wasted += prop_size(prop);
     }
 
     return CA_SUCCESS;
 }
 
+static int set_unlocked(ca_proplist *p, const char *key, const void *data, size_t nbytes) {
+    ca_prop *prop;
+    size_t l;
+    unsigned hash, i;
+    ca_prop_key_t id;
+    int ret;
+
+    hash = calc_hash(key);
+    id = key_lookup(key, hash);
+    l = strlen(key) + 1;
+
+    if (!(prop = arena_alloc(p, CA_ALIGN(sizeof(ca_prop)) + CA_ALIGN(nbytes) + l)))
+        return CA_ERROR_OOM;
+
+    prop->key = (char*) CA_PROP_DATA(prop) + CA_ALIGN(nbytes);
+    memcpy(prop->key, key, l);
+    prop->nbytes = nbytes;
+    prop->hash = hash;
+    prop->id = id;
+
+    if (nbytes > 0)
+        memcpy(CA_PROP_DATA(prop), data, nbytes);
+
+    if ((ret = _unset(p, key, hash, id)) < 0)
+        return ret;
+
+    if (id != CA_PROP_KEY_INVALID) {
+        prop->next_in_slot = NULL;
+        p->well_known[id] = prop;
+    } else {
+        p->n_hashed++;
+        grow_hashtable(p);
+
+        i = hash & (p->n_hashtable - 1);
+        prop->next_in_slot = p->prop_hashtable[i];
+        p->prop_hashtable[i] = prop;
+    }
+
+    prop->prev_item = NULL;
+    if ((prop->next_item = p->first_item))
+        prop->next_item->prev_item = prop;
+    p->first_item = prop;
+
+    /* Lists that are changed over and over again would grow without
+     * bounds otherwise */
+    if (p->wasted >= CHUNK_SIZE_MIN && p->wasted > p->allocated / 2)
+        compact(p);
+
+    return CA_SUCCESS;
+}
+
 /**
  * ca_proplist_sets:
  * @p: The property list to add this key/value pair to
@@ -133,36 +503,29 @@ int ca_proplist_sets(ca_proplist *p, const char *key, const char *value) {
 
 int ca_proplist_setf(ca_proplist *p, const char *key, const char *format, ...) {
     int ret;
-    char *k;
-    ca_prop *prop;
-    size_t size = 100;
-    unsigned h;
+    char buf[256], *data = buf, *allocated = NULL;
+    size_t size = sizeof(buf), nbytes;
 
     ca_return_val_if_fail(p, CA_ERROR_INVALID);
+    ca_return_val_if_fail(!p->frozen, CA_ERROR_STATE);
     ca_return_val_if_fail(key, CA_ERROR_INVALID);
     ca_return_val_if_fail(format, CA_ERROR_INVALID);
 
-    if (!(k = ca_strdup(key)))
-        return CA_ERROR_OOM;
+    /* Most values fit into the buffer on the stack, only go to the
+     * heap for the longer ones */
 
     for (;;) {
         va_list ap;
         int r;
 
-        if (!(prop = ca_malloc(CA_ALIGN(sizeof(ca_prop)) + size))) {
-            ca_free(k);
-            return CA_ERROR_OOM;
-        }
-
-
         va_start(ap, format);
-        r = vsnprintf(CA_PROP_DATA(prop), size, format, ap);
+        r = vsnprintf(data, size, format, ap);
         va_end(ap);
 
-        ((char*) CA_PROP_DATA(prop))[size-1] = 0;
+        data[size-1] = 0;
 
         if (r > -1 && (size_t) r < size) {
-            prop->nbytes = (size_t) r+1;
+            nbytes = (size_t) r+1;
             break;
         }
 
@@ -171,33 +534,20 @@ int ca_proplist_setf(ca_proplist *p, const char *key, const char *format, ...) {
         else           /* glibc 2.0 */
             size *= 2;
 
-        ca_free(prop);
-    }
-
-    prop->key = k;
+        ca_free(allocated);
 
-    ca_mutex_lock(p->mutex);
+        if (!(data = allocated = ca_malloc(size)))
+            return CA_ERROR_OOM;
 
-    if ((ret = _unset(p, key)) < 0) {
-        ca_free(prop);
-        ca_free(k);
-        goto finish;
+        count_allocation();
     }
 
-    h = calc_hash(key) % N_HASHTABLE;
-
-    prop->next_in_slot = p->prop_hashtable[h];
-    p->prop_hashtable[h] = prop;
-
-    prop->prev_item = NULL;
-    if ((prop->next_item = p->first_item))
-        prop->next_item->prev_item = prop;
-    p->first_item = prop;
-
-finish:
-
+    ca_mutex_lock(p->mutex);
+    ret = set_unlocked(p, key, data, nbytes);
     ca_mutex_unlock(p->mutex);
 
+    ca_free(allocated);
+
     return ret;
 }
 
@@ -215,46 +565,14 @@ finish:
 
 int ca_proplist_set(ca_proplist *p, const char *key, const void *data, size_t nbytes) {
     int ret;
-    char *k;
-    ca_prop *prop;
-    unsigned h;
 
     ca_return_val_if_fail(p, CA_ERROR_INVALID);
+    ca_return_val_if_fail(!p->frozen, CA_ERROR_STATE);
     ca_return_val_if_fail(key, CA_ERROR_INVALID);
     ca_return_val_if_fail(!nbytes || data, CA_ERROR_INVALID);
 
-    if (!(k = ca_strdup(key)))
-        return CA_ERROR_OOM;
-
-    if (!(prop = ca_malloc(CA_ALIGN(sizeof(ca_prop)) + nbytes))) {
-        ca_free(k);
-        return CA_ERROR_OOM;
-    }
-
-    prop->key = k;
-    prop->nbytes = nbytes;
-    memcpy(CA_PROP_DATA(prop), data, nbytes);
-
     ca_mutex_lock(p->mutex);
-
-    if ((ret = _unset(p, key)) < 0) {
-        ca_free(prop);
-        ca_free(k);
-        goto finish;
-    }
-
-    h = calc_hash(key) % N_HASHTABLE;
-
-    prop->next_in_slot = p->prop_hashtable[h];
-    p->prop_hashtable[h] = prop;
-
-    prop->prev_item = NULL;
-    if ((prop->next_item = p->first_item))
-        prop->next_item->prev_item = prop;
-    p->first_item = prop;
-
-finish:
-
+    ret = set_unlocked(p, key, data, nbytes);
     ca_mutex_unlock(p->mutex);
 
     return ret;
@@ -263,15 +581,19 @@ finish:
 /* Not exported, not self-locking */
 ca_prop* ca_proplist_get_unlocked(ca_proplist *p, const char *key) {
     ca_prop *prop;
-    unsigned i;
+    unsigned hash;
+    ca_prop_key_t id;
 
     ca_return_val_if_fail(p, NULL);
     ca_return_val_if_fail(key, NULL);
 
-    i = calc_hash(key) % N_HASHTABLE;
+    hash = calc_hash(key);
+
+    if ((id = key_lookup(key, hash)) != CA_PROP_KEY_INVALID)
+        return p->well_known[id];
 
-    for (prop = p->prop_hashtable[i]; prop; prop = prop->next_in_slot)
-        if (strcmp(prop->key, key) == 0)
+    for (prop = p->prop_hashtable[hash & (p->n_hashtable - 1)]; prop; prop = prop->next_in_slot)
+        if (prop->hash == hash && strcmp(prop->key, key) == 0)
             return prop;
 
     return NULL;
@@ -293,6 +615,30 @@ const char* ca_proplist_gets_unlocked(ca_proplist *p, const char *key) {
     return CA_PROP_DATA(prop);
 }
 
+/* Not exported, not self-locking */
+ca_prop* ca_proplist_get_key_unlocked(ca_proplist *p, ca_prop_key_t k) {
+    ca_return_val_if_fail(p, NULL);
+    ca_return_val_if_fail(k >= 0 && k < _CA_PROP_KEY_MAX, NULL);
+
+    return p->well_known[k];
+}
+
+/* Not exported, not self-locking */
+const char* ca_proplist_gets_key_unlocked(ca_proplist *p, ca_prop_key_t k) {
+    ca_prop *prop;
+
+    ca_return_val_if_fail(p, NULL);
+    ca_return_val_if_fail(k >= 0 && k < _CA_PROP_KEY_MAX, NULL);
+
+    if (!(prop = p->well_known[k]))
+        return NULL;
+
+    if (!memchr(CA_PROP_DATA(prop), 0, prop->nbytes))
+        return NULL;
+
+    return CA_PROP_DATA(prop);
+}
+
 /**
  * ca_proplist_destroy:
  * @p: The property list to destroy
@@ -303,16 +649,30 @@ const char* ca_proplist_gets_unlocked(ca_proplist *p, const char *key) {
  */
 
 int ca_proplist_destroy(ca_proplist *p) {
-    ca_prop *prop, *nprop;
+    struct ca_proplist_chunk *c, *n;
 
     ca_return_val_if_fail(p, CA_ERROR_INVALID);
 
-    for (prop = p->first_item; prop; prop = nprop) {
-        nprop = prop->next_item;
-        ca_free(prop->key);
-        ca_free(prop);
+    /* Frozen lists are allocated in one go, including their keys */
+    if (p->frozen) {
+        ca_return_val_if_fail(p->ref >= 1, CA_ERROR_INVALID);
+
+        if (__sync_sub_and_fetch(&p->ref, 1) == 0)
+            ca_free(p);
+
+        return CA_SUCCESS;
+    }
+
+    for (c = p->chunks; c; c = n) {
+        n = c->next;
+
+        if (c != FIRST_CHUNK(p))
+            ca_free(c);
     }
 
+    if (p->prop_hashtable != p->prop_hashtable_static)
+        ca_free(p->prop_hashtable);
+
     ca_mutex_free(p->mutex);
 
     ca_free(p);
@@ -320,20 +680,20 @@ int ca_proplist_destroy(ca_proplist *p) {
     return CA_SUCCESS;
 }
 
-static int merge_into(ca_proplist *a, ca_proplist *b) {
+int ca_proplist_merge_into(ca_proplist *a, ca_proplist *b) {
     int ret = CA_SUCCESS;
     ca_prop *prop;
 
     ca_return_val_if_fail(a, CA_ERROR_INVALID);
     ca_return_val_if_fail(b, CA_ERROR_INVALID);
 
-    ca_mutex_lock(b->mutex);
+    ca_proplist_lock(b);
 
     for (prop = b->first_item; prop; prop = prop->next_item)
         if ((ret = ca_proplist_set(a, prop->key, CA_PROP_DATA(prop), prop->nbytes)) < 0)
             break;
 
-    ca_mutex_unlock(b->mutex);
+    ca_proplist_unlock(b);
 
     return ret;
 }
@@ -349,8 +709,8 @@ int ca_proplist_merge(ca_proplist **_a, ca_proplist *b, ca_proplist *c) {
     if ((ret = ca_proplist_create(&a)) < 0)
         return ret;
 
-    if ((ret = merge_into(a, b)) < 0 ||
-        (ret = merge_into(a, c)) < 0) {
+    if ((ret = ca_proplist_merge_into(a, b)) < 0 ||
+        (ret = ca_proplist_merge_into(a, c)) < 0) {
         ca_proplist_destroy(a);
         return ret;
     }
@@ -359,19 +719,234 @@ int ca_proplist_merge(ca_proplist **_a, ca_proplist *b, ca_proplist *c) {
     return CA_SUCCESS;
 }
 
+static ca_bool_t overridden(ca_proplist *c, ca_prop *prop) {
+
+    if (!c)
+        return FALSE;
+
+    if (prop->id != CA_PROP_KEY_INVALID)
+        return !!c->well_known[prop->id];
+
+    return !!ca_proplist_get_unlocked(c, prop->key);
+}
+
+static size_t frozen_prop_size(ca_prop *prop) {
+    return CA_ALIGN(CA_ALIGN(sizeof(ca_prop)) + CA_ALIGN(prop->nbytes) + strlen(prop->key) + 1);
+}
+
+static void frozen_append(ca_proplist *a, ca_prop **last, uint8_t **d, ca_prop *prop) {
+    ca_prop *n;
+    unsigned i;
+
+    n = (ca_prop*) *d;
+    n->nbytes = prop->nbytes;
+    n->hash = prop->hash;
+    n->id = prop->id;
+    memcpy(CA_PROP_DATA(n), CA_PROP_DATA(prop), prop->nbytes);
+
+    n->key = (char*) CA_PROP_DATA(n) + CA_ALIGN(prop->nbytes);
+    memcpy(n->key, prop->key, strlen(prop->key) + 1);
+
+    if (n->id != CA_PROP_KEY_INVALID) {
+        n->next_in_slot = NULL;
+        a->well_known[n->id] = n;
+    } else {
+        i = n->hash & (a->n_hashtable - 1);
+        n->next_in_slot = a->prop_hashtable[i];
+        a->prop_hashtable[i] = n;
+    }
+
+    n->next_item = NULL;
+    if ((n->prev_item = *last))
+        (*last)->next_item = n;
+    else
+        a->first_item = n;
+    *last = n;
+
+    *d += frozen_prop_size(prop);
+}
+
+int ca_proplist_merge_frozen(ca_proplist **_a, ca_proplist *b, ca_proplist *c) {
+    ca_proplist *a;
+    ca_prop *prop, *last = NULL;
+    size_t size;
+    unsigned n, n_hashtable;
+    uint8_t *d;
+
+    ca_return_val_if_fail(_a, CA_ERROR_INVALID);
+    ca_return_val_if_fail(b, CA_ERROR_INVALID);
+
+    if (c == b)
+        c = NULL;
+
+    /* Nothing to do if the list is frozen already */
+    if (b->frozen && !c) {
+        *_a = ca_proplist_ref(b);
+        return CA_SUCCESS;
+    }
+
+    ca_proplist_lock(b);
+    if (c)
+        ca_proplist_lock(c);
+
+    /* Everything in c, plus whatever in b isn't overridden by c */
+    size = 0;
+    n = 0;
+
+    if (c)
+        for (prop = c->first_item; prop; prop = prop->next_item) {
+            size += frozen_prop_size(prop);
+
+            if (prop->id == CA_PROP_KEY_INVALID)
+                n++;
+        }
+
+    for (prop = b->first_item; prop; prop = prop->next_item)
+        if (!overridden(c, prop)) {
+            size += frozen_prop_size(prop);
+
+            if (prop->id == CA_PROP_KEY_INVALID)
+                n++;
+        }
+
+    /* Large lists get a larger table, right after the header */
+    for (n_hashtable = N_HASHTABLE_MIN; n_hashtable < n; n_hashtable *= 2)
+        ;
+
+    if (n_hashtable > N_HASHTABLE_MIN)
+        size += CA_ALIGN(n_hashtable * sizeof(ca_prop*));
+
+    size += CA_ALIGN(sizeof(ca_proplist));
+
+    if (!(a = ca_malloc0(size))) {
+        if (c)
+            ca_proplist_unlock(c);
+        ca_proplist_unlock(b);
+        return CA_ERROR_OOM;
+    }
+
+    count_allocation();
+
+    d = (uint8_t*) a + CA_ALIGN(sizeof(ca_proplist));
+
+    if (n_hashtable > N_HASHTABLE_MIN) {
+        a->prop_hashtable = (ca_prop**) d;
+        d += CA_ALIGN(n_hashtable * sizeof(ca_prop*));
+    } else
+        a->prop_hashtable = a->prop_hashtable_static;
+
+    a->n_hashtable = n_hashtable;
+    a->n_hashed = n;
+
+    for (prop = b->first_item; prop; prop = prop->next_item)
+        if (!overridden(c, prop))
+            frozen_append(a, &last, &d, prop);
+
+    if (c)
+        for (prop = c->first_item; prop; prop = prop->next_item)
+            frozen_append(a, &last, &d, prop);
+
+    if (c)
+        ca_proplist_unlock(c);
+    ca_proplist_unlock(b);
+
+    ca_assert(d == (uint8_t*) a + size);
+
+    a->frozen = TRUE;
+    a->ref = 1;
+
+    *_a = a;
+    return CA_SUCCESS;
+}
+
+int ca_proplist_freeze(ca_proplist **_a, ca_proplist *b) {
+    return ca_proplist_merge_frozen(_a, b, NULL);
+}
+
+ca_proplist* ca_proplist_ref(ca_proplist *p) {
+    ca_return_val_if_fail(p, NULL);
+    ca_return_val_if_fail(p->frozen, NULL);
+    ca_return_val_if_fail(p->ref >= 1, NULL);
+
+    __sync_add_and_fetch(&p->ref, 1);
+
+    return p;
+}
+
+void ca_proplist_lock(ca_proplist *p) {
+    ca_assert(p);
+
+    if (p->mutex)
+        ca_mutex_lock(p->mutex);
+}
+
+void ca_proplist_unlock(ca_proplist *p) {
+    ca_assert(p);
+
+    if (p->mutex)
+        ca_mutex_unlock(p->mutex);
+}
+
 ca_bool_t ca_proplist_contains(ca_proplist *p, const char *key) {
     ca_bool_t b;
 
     ca_return_val_if_fail(p, FALSE);
     ca_return_val_if_fail(key, FALSE);
 
-    ca_mutex_lock(p->mutex);
+    ca_proplist_lock(p);
     b = !!ca_proplist_get_unlocked(p, key);
-    ca_mutex_unlock(p->mutex);
+    ca_proplist_unlock(p);
 
     return b;
 }
 
+ca_bool_t ca_proplist_contains_key(ca_proplist *p, ca_prop_key_t k) {
+    ca_bool_t b;
+
+    ca_return_val_if_fail(p, FALSE);
+    ca_return_val_if_fail(k >= 0 && k < _CA_PROP_KEY_MAX, FALSE);
+
+    ca_proplist_lock(p);
+    b = !!p->well_known[k];
+    ca_proplist_unlock(p);
+
+    return b;
+}
+
+int ca_proplist_get_unsigned(ca_proplist *p, const char *key, unsigned *u) {
+    const char *t;
+    char *e = NULL;
+    unsigned long l;
+    int ret;
+
+    ca_return_val_if_fail(p, CA_ERROR_INVALID);
+    ca_return_val_if_fail(key, CA_ERROR_INVALID);
+    ca_return_val_if_fail(u, CA_ERROR_INVALID);
+
+    ca_proplist_lock(p);
+
+    if (!(t = ca_proplist_gets_unlocked(p, key))) {
+        ret = CA_ERROR_NOTFOUND;
+        goto finish;
+    }
+
+    errno = 0;
+    l = strtoul(t, &e, 10);
+
+    if (errno != 0 || !e || *e || e == t || l > UINT_MAX) {
+        ret = CA_ERROR_INVALID;
+        goto finish;
+    }
+
+    *u = (unsigned) l;
+    ret = CA_SUCCESS;
+
+finish:
+    ca_proplist_unlock(p);
+
+    return ret;
+}
+
 int ca_proplist_merge_ap(ca_proplist *p, va_list ap) {
     int ret;
 
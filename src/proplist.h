@@ -26,30 +26,148 @@
 #include "canberra.h"
 #include "mutex.h"
 
-#define N_HASHTABLE 31
+/* The hash table starts out with this many slots and doubles in size
+ * whenever there are more items than slots */
+#define N_HASHTABLE_MIN 16U
+
+/* The well-known properties from canberra.h are interned: they are
+ * identified by these ids and kept in an array indexed by them, while
+ * only the remaining free-form properties go into the hash table */
+typedef enum ca_prop_key {
+    CA_PROP_KEY_VISUAL_EFFECT,
+    CA_PROP_KEY_COLOR,
+    CA_PROP_KEY_MEDIA_IMAGE_PATH,
+    CA_PROP_KEY_MEDIA_NAME,
+    CA_PROP_KEY_MEDIA_TITLE,
+    CA_PROP_KEY_MEDIA_ARTIST,
+    CA_PROP_KEY_MEDIA_LANGUAGE,
+    CA_PROP_KEY_MEDIA_FILENAME,
+    CA_PROP_KEY_MEDIA_ICON,
+    CA_PROP_KEY_MEDIA_ICON_NAME,
+    CA_PROP_KEY_MEDIA_ROLE,
+    CA_PROP_KEY_EVENT_ID,
+    CA_PROP_KEY_EVENT_DESCRIPTION,
+    CA_PROP_KEY_EVENT_MOUSE_X,
+    CA_PROP_KEY_EVENT_MOUSE_Y,
+    CA_PROP_KEY_EVENT_MOUSE_HPOS,
+    CA_PROP_KEY_EVENT_MOUSE_VPOS,
+    CA_PROP_KEY_EVENT_MOUSE_BUTTON,
+    CA_PROP_KEY_WINDOW_NAME,
+    CA_PROP_KEY_WINDOW_ID,
+    CA_PROP_KEY_WINDOW_ICON,
+    CA_PROP_KEY_WINDOW_ICON_NAME,
+    CA_PROP_KEY_WINDOW_X11_DISPLAY,
+    CA_PROP_KEY_WINDOW_X11_SCREEN,
+    CA_PROP_KEY_WINDOW_X11_MONITOR,
+    CA_PROP_KEY_WINDOW_X11_XID,
+    CA_PROP_KEY_APPLICATION_NAME,
+    CA_PROP_KEY_APPLICATION_ID,
+    CA_PROP_KEY_APPLICATION_VERSION,
+    CA_PROP_KEY_APPLICATION_ICON,
+    CA_PROP_KEY_APPLICATION_ICON_NAME,
+    CA_PROP_KEY_APPLICATION_LANGUAGE,
+    CA_PROP_KEY_APPLICATION_PROCESS_ID,
+    CA_PROP_KEY_APPLICATION_PROCESS_BINARY,
+    CA_PROP_KEY_APPLICATION_PROCESS_USER,
+    CA_PROP_KEY_APPLICATION_PROCESS_HOST,
+    CA_PROP_KEY_CANBERRA_CACHE_CONTROL,
+    CA_PROP_KEY_CANBERRA_VOLUME,
+    CA_PROP_KEY_CANBERRA_XDG_THEME_NAME,
+    CA_PROP_KEY_CANBERRA_XDG_THEME_OUTPUT_PROFILE,
+    CA_PROP_KEY_CANBERRA_ENABLE,
+    CA_PROP_KEY_CANBERRA_FORCE_CHANNEL,
+    CA_PROP_KEY_CANBERRA_PLAYER_THREADS,
+    CA_PROP_KEY_CANBERRA_DEVICE_IDLE_TIMEOUT,
+    CA_PROP_KEY_CANBERRA_SOFTWARE_MIXER,
+    CA_PROP_KEY_CANBERRA_ASYNC_PLAY,
+    CA_PROP_KEY_CANBERRA_ASYNC_OPEN,
+    CA_PROP_KEY_CANBERRA_VOICE_LIMIT,
+    CA_PROP_KEY_CANBERRA_VOICE_POLICY,
+    CA_PROP_KEY_CANBERRA_PRIORITY,
+    CA_PROP_KEY_CANBERRA_LOOP_COUNT,
+    CA_PROP_KEY_CANBERRA_SEQUENCE,
+    CA_PROP_KEY_CANBERRA_VISUAL_RATE,
+    CA_PROP_KEY_CANBERRA_LATENCY,
+    CA_PROP_KEY_CANBERRA_REALTIME,
+    CA_PROP_KEY_CANBERRA_MMAP,
+    CA_PROP_KEY_CANBERRA_SHARED_CACHE,
+    CA_PROP_KEY_CANBERRA_NATIVE_FORMAT,
+    _CA_PROP_KEY_MAX,
+    CA_PROP_KEY_INVALID = -1
+} ca_prop_key_t;
 
 typedef struct ca_prop {
     char *key;
     size_t nbytes;
+    unsigned hash;
+    ca_prop_key_t id;
     struct ca_prop *next_in_slot, *next_item, *prev_item;
 } ca_prop;
 
 #define CA_PROP_DATA(p) ((void*) ((char*) (p) + CA_ALIGN(sizeof(ca_prop))))
 
 struct ca_proplist {
+    /* NULL for frozen property lists, which are immutable and hence
+     * may be read without locking */
     ca_mutex *mutex;
 
-    ca_prop *prop_hashtable[N_HASHTABLE];
+    ca_prop *well_known[_CA_PROP_KEY_MAX];
+
+    /* Power of two many slots, for the free-form properties only */
+    ca_prop **prop_hashtable;
+    unsigned n_hashtable, n_hashed;
     ca_prop *first_item;
+
+    /* Where the properties are allocated from, how much of that is
+     * used, and how much of it by properties that have been replaced */
+    struct ca_proplist_chunk *chunks;
+    size_t allocated, wasted;
+
+    /* Frozen property lists are a single allocation and reference
+     * counted, so they can be shared instead of copied */
+    ca_bool_t frozen;
+    volatile unsigned ref;
+
+    ca_prop *prop_hashtable_static[N_HASHTABLE_MIN];
 };
 
 int ca_proplist_merge(ca_proplist **_a, ca_proplist *b, ca_proplist *c);
+
+/* Sets all properties of b in a, overwriting what is already there */
+int ca_proplist_merge_into(ca_proplist *a, ca_proplist *b);
+
+/* Like ca_proplist_merge(), but returns a frozen property list. c may
+ * be NULL, in which case this returns a frozen copy of b. */
+int ca_proplist_merge_frozen(ca_proplist **_a, ca_proplist *b, ca_proplist *c);
+int ca_proplist_freeze(ca_proplist **_a, ca_proplist *b);
+
+/* Only for frozen property lists, drop the reference again with
+ * ca_proplist_destroy() */
+ca_proplist* ca_proplist_ref(ca_proplist *p);
+
+/* Locks a property list unless it is frozen */
+void ca_proplist_lock(ca_proplist *p);
+void ca_proplist_unlock(ca_proplist *p);
+
 ca_bool_t ca_proplist_contains(ca_proplist *p, const char *key);
+int ca_proplist_get_unsigned(ca_proplist *p, const char *key, unsigned *u);
 
 /* Both of the following two functions are not locked! Need manual locking! */
 ca_prop* ca_proplist_get_unlocked(ca_proplist *p, const char *key);
 const char* ca_proplist_gets_unlocked(ca_proplist *p, const char *key);
 
+/* The same for well-known properties, which doesn't involve any
+ * hashing or string comparisons. Not locked either. */
+ca_prop* ca_proplist_get_key_unlocked(ca_proplist *p, ca_prop_key_t k);
+const char* ca_proplist_gets_key_unlocked(ca_proplist *p, ca_prop_key_t k);
+ca_bool_t ca_proplist_contains_key(ca_proplist *p, ca_prop_key_t k);
+
+/* Returns CA_PROP_KEY_INVALID for free-form keys */
+ca_prop_key_t ca_prop_key_from_string(const char *key);
+
+/* Returns how many allocations the property list code did so far */
+unsigned ca_proplist_get_n_allocations(void);
+
 int ca_proplist_merge_ap(ca_proplist *p, va_list ap);
 int ca_proplist_from_ap(ca_proplist **_p, va_list ap);
 
@@ -35,6 +35,8 @@
 #include <pulse/scache.h>
 #include <pulse/subscribe.h>
 #include <pulse/introspect.h>
+#include <pulse/version.h>
+#include <pulse/timeval.h>
 
 #include "canberra.h"
 #include "common.h"
@@ -42,7 +44,11 @@
 #include "llist.h"
 #include "read-sound-file.h"
 #include "sound-theme-spec.h"
+#include "sample-cache.h"
+#include "sequence.h"
+#include "thread-pool.h"
 #include "malloc.h"
+#include "trace.h"
 
 enum outstanding_type {
     OUTSTANDING_SAMPLE,
@@ -60,16 +66,68 @@ struct outstanding {
     ca_finish_callback_t callback;
     void *userdata;
     ca_sound_file *file;
+    ca_sequence *sequence;
     int error;
     ca_bool_t clean_up;
+
+    /* For ca_trace_stage() */
+    ca_usec_t started, connecting;
+    ca_bool_t written;
+    ca_bool_t playing;
+
+    /* Only set for asynchronous play requests the server hasn't
+     * answered yet */
+    pa_operation *operation;
+    struct fallback *fallback;
+};
+
+/* What we need to stream a sound from the mainloop thread if an
+ * asynchronous play request finds it missing in the cache */
+struct fallback {
+    ca_proplist *context_props, *props;
+    pa_proplist *l;
+    char *name;
+    ca_bool_t volume_set;
+    pa_volume_t volume;
+};
+
+/* With canberra.async-open, a sound event played while we are still
+ * connecting, see driver_play() */
+struct pending {
+    CA_LLIST_FIELDS(struct pending);
+    uint32_t id;
+    ca_proplist *props, *context_props;
+    ca_finish_callback_t callback;
+    void *userdata;
+    pa_usec_t deadline;
 };
 
+/* Beyond that we'd rather have the multi driver try somebody else */
+#define PENDING_MAX 16U
+#define PENDING_TIMEOUT_USEC (5 * PA_USEC_PER_SEC)
+
 struct private {
     pa_threaded_mainloop *mainloop;
     pa_context *context;
     ca_theme_data *theme;
     ca_bool_t subscribed;
     ca_bool_t reconnect;
+    ca_bool_t async_play;
+    ca_bool_t async_open;
+
+    /* Protected by the mainloop lock. Oldest first. */
+    CA_LLIST_HEAD(struct pending, pending);
+    struct pending *pending_tail;
+    unsigned n_pending;
+    pa_time_event *pending_timer;
+    ca_bool_t flushing;
+
+    /* Plays the pending sound events once we are connected, since
+     * that cannot be done from the mainloop thread */
+    ca_thread_pool *flush_pool;
+
+    /* Only touched from the mainloop thread */
+    ca_theme_data *async_theme;
 
     ca_mutex *outstanding_mutex;
     CA_LLIST_HEAD(struct outstanding, outstanding);
@@ -77,12 +135,240 @@ struct private {
 
 #define PRIVATE(c) ((struct private *) ((c)->private))
 
+/* Older libraries have no way to let us write into their buffers */
+#ifdef PA_CHECK_VERSION
+#if PA_CHECK_VERSION(0,9,16)
+#define HAVE_PA_STREAM_BEGIN_WRITE 1
+#endif
+#endif
+
 static void context_state_cb(pa_context *pc, void *userdata);
 static void context_subscribe_cb(pa_context *pc, pa_subscription_event_type_t t, uint32_t idx, void *userdata);
+static int play_now(ca_context *c, uint32_t id, ca_proplist *proplist, ca_proplist *cp, ca_finish_callback_t cb, void *userdata);
+
+static void pending_free(struct pending *q) {
+    ca_assert(q);
+
+    if (q->props)
+        ca_proplist_destroy(q->props);
+
+    if (q->context_props)
+        ca_proplist_destroy(q->context_props);
+
+    ca_free(q);
+}
+
+static void pending_remove_unlocked(struct private *p, struct pending *q) {
+
+    if (p->pending_tail == q)
+        p->pending_tail = q->prev;
+
+    CA_LLIST_REMOVE(struct pending, p->pending, q);
+    p->n_pending--;
+}
+
+static void pending_stop_timer_unlocked(struct private *p) {
+
+    if (!p->pending_timer)
+        return;
+
+    pa_threaded_mainloop_get_api(p->mainloop)->time_free(p->pending_timer);
+    p->pending_timer = NULL;
+}
+
+/* Takes them all, the callbacks are to be called without holding the
+ * mainloop lock, unless we are in the mainloop thread */
+static struct pending *pending_steal_unlocked(struct private *p) {
+    struct pending *l;
+
+    l = p->pending;
+    p->pending = p->pending_tail = NULL;
+    p->n_pending = 0;
+
+    pending_stop_timer_unlocked(p);
+
+    return l;
+}
+
+static void pending_fail(ca_context *c, struct pending *l, int error) {
+
+    while (l) {
+        struct pending *q = l;
+
+        CA_LLIST_REMOVE(struct pending, l, q);
+
+        if (q->callback)
+            q->callback(c, q->id, error, q->userdata);
+
+        pending_free(q);
+    }
+}
+
+static pa_usec_t now_usec(void) {
+    struct timeval tv;
+
+    return pa_timeval_load(pa_gettimeofday(&tv));
+}
+
+static void pending_timeout_cb(pa_mainloop_api *a, pa_time_event *e, const struct timeval *tv, void *userdata) {
+    ca_context *c = userdata;
+    struct private *p;
+    struct pending *q;
+    pa_usec_t now;
+    struct timeval next;
+
+    p = PRIVATE(c);
+    now = now_usec();
+
+    /* The oldest expire first */
+    while ((q = p->pending) && q->deadline <= now) {
+        pending_remove_unlocked(p, q);
+
+        if (q->callback)
+            q->callback(c, q->id, CA_ERROR_NOTAVAILABLE, q->userdata);
+
+        pending_free(q);
+    }
+
+    if (!p->pending) {
+        pending_stop_timer_unlocked(p);
+        return;
+    }
+
+    a->time_restart(e, pa_timeval_store(&next, p->pending->deadline));
+}
+
+static int pending_add_unlocked(ca_context *c, uint32_t id, ca_proplist *proplist, ca_proplist *cp, ca_finish_callback_t cb, void *userdata) {
+    struct private *p;
+    struct pending *q;
+    struct timeval tv;
+    int ret;
+
+    p = PRIVATE(c);
+
+    if (p->n_pending >= PENDING_MAX)
+        return CA_ERROR_NOTAVAILABLE;
+
+    if (!(q = ca_new0(struct pending, 1)))
+        return CA_ERROR_OOM;
+
+    if ((ret = ca_proplist_freeze(&q->props, proplist)) < 0) {
+        ca_free(q);
+        return ret;
+    }
+
+    q->context_props = ca_proplist_ref(cp);
+    q->id = id;
+    q->callback = cb;
+    q->userdata = userdata;
+    q->deadline = now_usec() + PENDING_TIMEOUT_USEC;
+
+    /* Everything queued before expires before this one, hence the
+     * timer only ever needs to be set for the oldest */
+    if (!p->pending_timer)
+        if (!(p->pending_timer = pa_threaded_mainloop_get_api(p->mainloop)->time_new(
+                      pa_threaded_mainloop_get_api(p->mainloop),
+                      pa_timeval_store(&tv, q->deadline),
+                      pending_timeout_cb, c))) {
+            pending_free(q);
+            return CA_ERROR_OOM;
+        }
+
+    CA_LLIST_INSERT_AFTER(struct pending, p->pending, p->pending_tail, q);
+    p->pending_tail = q;
+    p->n_pending++;
+
+    return CA_SUCCESS;
+}
+
+static void flush_func(void *job, void *userdata) {
+    ca_context *c = userdata;
+    struct private *p;
+
+    p = PRIVATE(c);
+
+    for (;;) {
+        struct pending *q;
+        int ret;
+
+        pa_threaded_mainloop_lock(p->mainloop);
+
+        if ((q = p->pending))
+            pending_remove_unlocked(p, q);
+        else {
+            p->flushing = FALSE;
+            pending_stop_timer_unlocked(p);
+        }
+
+        pa_threaded_mainloop_unlock(p->mainloop);
+
+        if (!q)
+            break;
+
+        /* Sounds are played with the context properties they were
+         * queued with */
+        ret = play_now(c, q->id, q->props, q->context_props, q->callback, q->userdata);
+
+        if (ret < 0 && q->callback)
+            q->callback(c, q->id, ret, q->userdata);
+
+        pending_free(q);
+    }
+}
+
+/* Whether we are still connecting, or reconnecting, in which case
+ * sounds are queued with canberra.async-open */
+static ca_bool_t connecting_unlocked(struct private *p) {
+
+    if (!p->async_open || !p->context)
+        return FALSE;
+
+    switch (pa_context_get_state(p->context)) {
+
+        case PA_CONTEXT_UNCONNECTED:
+        case PA_CONTEXT_CONNECTING:
+        case PA_CONTEXT_AUTHORIZING:
+        case PA_CONTEXT_SETTING_NAME:
+            return TRUE;
+
+        default:
+            return FALSE;
+    }
+}
+
+static void fallback_free(struct fallback *f) {
+    ca_assert(f);
+
+    if (f->context_props)
+        ca_proplist_destroy(f->context_props);
+
+    if (f->props)
+        ca_proplist_destroy(f->props);
+
+    if (f->l)
+        pa_proplist_free(f->l);
+
+    ca_free(f->name);
+    ca_free(f);
+}
 
 static void outstanding_free(struct outstanding *o) {
     ca_assert(o);
 
+    if (o->operation) {
+        pa_operation_cancel(o->operation);
+        pa_operation_unref(o->operation);
+    }
+
+    if (o->fallback)
+        fallback_free(o->fallback);
+
+    /* The file is one of those of the sequence then */
+    if (o->sequence) {
+        ca_sequence_free(o->sequence);
+        o->file = NULL;
+    }
+
     if (o->file)
         ca_sound_file_close(o->file);
 
@@ -93,9 +379,17 @@ static void outstanding_free(struct outstanding *o) {
         pa_stream_unref(o->stream);
     }
 
+    if (o->playing)
+        ca_trace_stream_end();
+
     ca_free(o);
 }
 
+static void start_playing(struct outstanding *o) {
+    o->playing = TRUE;
+    ca_trace_stream_begin();
+}
+
 static int convert_proplist(pa_proplist **_l, ca_proplist *c) {
     pa_proplist *l;
     ca_prop *i;
@@ -106,16 +400,16 @@ static int convert_proplist(pa_proplist **_l, ca_proplist *c) {
     if (!(l = pa_proplist_new()))
         return CA_ERROR_OOM;
 
-    ca_mutex_lock(c->mutex);
+    ca_proplist_lock(c);
 
     for (i = c->first_item; i; i = i->next_item)
         if (pa_proplist_set(l, i->key, CA_PROP_DATA(i), i->nbytes) < 0) {
-            ca_mutex_unlock(c->mutex);
+            ca_proplist_unlock(c);
             pa_proplist_free(l);
             return CA_ERROR_INVALID;
         }
 
-    ca_mutex_unlock(c->mutex);
+    ca_proplist_unlock(c);
 
     *_l = l;
 
@@ -199,6 +493,7 @@ static int translate_error(int error) {
 static int context_connect(ca_context *c, ca_bool_t nofail) {
     pa_proplist *l;
     struct private *p;
+    ca_proplist *cp;
     int ret;
 
     ca_return_val_if_fail(c, CA_ERROR_INVALID);
@@ -206,7 +501,13 @@ static int context_connect(ca_context *c, ca_bool_t nofail) {
     ca_return_val_if_fail(p->mainloop, CA_ERROR_STATE);
     ca_return_val_if_fail(!p->context, CA_ERROR_STATE);
 
-    if ((ret = convert_proplist(&l, c->props)) < 0)
+    /* When reconnecting we are called from the mainloop thread, which
+     * doesn't hold the context lock */
+    cp = ca_context_ref_props(c);
+    ret = convert_proplist(&l, cp);
+    ca_proplist_destroy(cp);
+
+    if (ret < 0)
         return ret;
 
     strip_prefix(l, "canberra.");
@@ -246,6 +547,20 @@ static void context_state_cb(pa_context *pc, void *userdata) {
 
     state = pa_context_get_state(pc);
 
+    if (state == PA_CONTEXT_READY && p->async_open) {
+
+        /* With canberra.async-open driver_open() didn't wait for
+         * this */
+        p->reconnect = TRUE;
+
+        if (p->pending && !p->flushing) {
+            if (ca_thread_pool_push(p->flush_pool, p) < 0)
+                pending_fail(c, pending_steal_unlocked(p), CA_ERROR_OOM);
+            else
+                p->flushing = TRUE;
+        }
+    }
+
     if (state == PA_CONTEXT_FAILED || state == PA_CONTEXT_TERMINATED) {
         struct outstanding *out;
         int ret;
@@ -255,6 +570,10 @@ static void context_state_cb(pa_context *pc, void *userdata) {
         else
             ret = translate_error(pa_context_errno(pc));
 
+        /* Unless we try again below, they'd wait in vain */
+        if (!(state == PA_CONTEXT_FAILED && p->reconnect))
+            pending_fail(c, pending_steal_unlocked(p), ret);
+
         ca_mutex_lock(p->outstanding_mutex);
 
         while ((out = p->outstanding)) {
@@ -326,6 +645,8 @@ static void context_subscribe_cb(pa_context *pc, pa_subscription_event_type_t t,
 
         CA_LLIST_REMOVE(struct outstanding, l, out);
 
+        ca_trace_stage(CA_TRACE_FINISH, out->started);
+
         if (out->callback)
             out->callback(c, out->id, CA_SUCCESS, out->userdata);
 
@@ -333,6 +654,24 @@ static void context_subscribe_cb(pa_context *pc, pa_subscription_event_type_t t,
     }
 }
 
+static ca_bool_t get_async_play(ca_proplist *l) {
+    unsigned n;
+
+    if (ca_proplist_get_unsigned(l, CA_PROP_CANBERRA_ASYNC_PLAY, &n) < 0)
+        return FALSE;
+
+    return n > 0;
+}
+
+static ca_bool_t get_async_open(ca_proplist *l) {
+    unsigned n;
+
+    if (ca_proplist_get_unsigned(l, CA_PROP_CANBERRA_ASYNC_OPEN, &n) < 0)
+        return FALSE;
+
+    return n > 0;
+}
+
 int driver_open(ca_context *c) {
     struct private *p;
     int ret;
@@ -349,14 +688,25 @@ int driver_open(ca_context *c) {
         return CA_ERROR_OOM;
     }
 
+    p->async_play = get_async_play(c->props);
+    p->async_open = get_async_open(c->props);
+
     if (!(p->mainloop = pa_threaded_mainloop_new())) {
         driver_destroy(c);
         return CA_ERROR_OOM;
     }
 
+    if (p->async_open)
+        if ((ret = ca_thread_pool_new(&p->flush_pool, 0, flush_func, c)) < 0) {
+            driver_destroy(c);
+            return ret;
+        }
+
     /* The initial connection is without NOFAIL, since we want to have
-     * this call fail cleanly if we cannot connect. */
-    if ((ret = context_connect(c, FALSE)) != CA_SUCCESS) {
+     * this call fail cleanly if we cannot connect. Unless we don't
+     * wait for it anyway, in which case we wait for the server to
+     * show up. */
+    if ((ret = context_connect(c, p->async_open)) != CA_SUCCESS) {
         driver_destroy(c);
         return ret;
     }
@@ -369,6 +719,13 @@ int driver_open(ca_context *c) {
         return CA_ERROR_OOM;
     }
 
+    /* Sound events are queued until we are connected, see
+     * driver_play() */
+    if (p->async_open) {
+        pa_threaded_mainloop_unlock(p->mainloop);
+        return CA_SUCCESS;
+    }
+
     for (;;) {
         pa_context_state_t state;
 
@@ -406,6 +763,20 @@ int driver_destroy(ca_context *c) {
 
     p = PRIVATE(c);
 
+    /* The flusher needs the mainloop to finish what it is doing */
+    if (p->mainloop && p->async_open) {
+        struct pending *l;
+
+        pa_threaded_mainloop_lock(p->mainloop);
+        l = pending_steal_unlocked(p);
+        pa_threaded_mainloop_unlock(p->mainloop);
+
+        pending_fail(c, l, CA_ERROR_DESTROYED);
+    }
+
+    if (p->flush_pool)
+        ca_thread_pool_free(p->flush_pool);
+
     if (p->mainloop)
         pa_threaded_mainloop_stop(p->mainloop);
 
@@ -428,7 +799,10 @@ int driver_destroy(ca_context *c) {
         pa_threaded_mainloop_free(p->mainloop);
 
     if (p->theme)
-        ca_theme_data_free(p->theme);
+        ca_theme_data_unref(p->theme);
+
+    if (p->async_theme)
+        ca_theme_data_unref(p->async_theme);
 
     if (p->outstanding_mutex)
         ca_mutex_free(p->outstanding_mutex);
@@ -466,9 +840,13 @@ int driver_change_props(ca_context *c, ca_proplist *changed, ca_proplist *merged
 
     ca_return_val_if_fail(p->mainloop, CA_ERROR_STATE);
 
+    if (ca_proplist_contains_key(changed, CA_PROP_KEY_CANBERRA_ASYNC_PLAY))
+        p->async_play = get_async_play(merged);
+
     pa_threaded_mainloop_lock(p->mainloop);
 
-    if (!p->context) {
+    /* The server won't take updates before we are connected */
+    if (!p->context || connecting_unlocked(p)) {
         pa_threaded_mainloop_unlock(p->mainloop);
         return CA_ERROR_STATE; /* can be silently ignored */
     }
@@ -561,6 +939,18 @@ static void stream_state_cb(pa_stream *s, void *userdata) {
 
         state = pa_stream_get_state(s);
 
+        /* Streams started from the mainloop thread are on the list
+         * before they are ready, so driver_cancel() needs to learn
+         * about the sink input here */
+        if (state == PA_STREAM_READY) {
+            ca_mutex_lock(p->outstanding_mutex);
+            out->sink_input = pa_stream_get_index(s);
+            ca_mutex_unlock(p->outstanding_mutex);
+
+            if (out->type == OUTSTANDING_STREAM)
+                ca_trace_stage(CA_TRACE_DEVICE_OPEN, out->connecting);
+        }
+
         if (state == PA_STREAM_FAILED || state == PA_STREAM_TERMINATED) {
             int err;
 
@@ -596,6 +986,9 @@ static void stream_drain_cb(pa_stream *s, int success, void *userdata) {
     CA_LLIST_REMOVE(struct outstanding, p->outstanding, out);
     ca_mutex_unlock(p->outstanding_mutex);
 
+    if (success)
+        ca_trace_stage(CA_TRACE_FINISH, out->started);
+
     if (out->callback) {
         int err;
 
@@ -606,12 +999,36 @@ static void stream_drain_cb(pa_stream *s, int success, void *userdata) {
     outstanding_free(out);
 }
 
+static void free_write_buffer(pa_stream *s, void *data, ca_bool_t in_place) {
+
+    if (!data)
+        return;
+
+#ifdef HAVE_PA_STREAM_BEGIN_WRITE
+    if (in_place) {
+        pa_stream_cancel_write(s);
+        return;
+    }
+#endif
+
+    ca_free(data);
+}
+
+static void trace_written(struct outstanding *out) {
+
+    if (out->written || out->type != OUTSTANDING_STREAM)
+        return;
+
+    out->written = TRUE;
+    ca_trace_stage(CA_TRACE_FIRST_WRITE, out->started);
+}
+
 static void stream_write_cb(pa_stream *s, size_t bytes, void *userdata) {
     struct outstanding *out = userdata;
     struct private *p;
-    void *data;
+    void *data = NULL;
     int ret;
-    ca_bool_t eof = FALSE;
+    ca_bool_t eof = FALSE, in_place = FALSE;
 
     ca_assert(s);
     ca_assert(bytes > 0);
@@ -622,32 +1039,89 @@ static void stream_write_cb(pa_stream *s, size_t bytes, void *userdata) {
     while (bytes > 0) {
         size_t rbytes = bytes;
 
-        if (!(data = ca_malloc(rbytes))) {
-            ret = CA_ERROR_OOM;
-            goto finish;
+        /* Mapped files need neither an allocation nor a read, the
+         * library copies the data straight out of the map */
+        if (ca_sound_file_is_mapped(out->file)) {
+            const void *d;
+
+            if ((ret = ca_sound_file_read_mapped(out->file, &d, &rbytes)) < 0)
+                goto finish;
+
+            if (rbytes <= 0) {
+
+                /* Continue with the next file of the sequence, if any */
+                if ((ret = ca_sequence_next(out->sequence, &out->file)) == CA_SUCCESS)
+                    continue;
+
+                if (ret != CA_ERROR_NOTFOUND)
+                    goto finish;
+
+                eof = TRUE;
+                break;
+            }
+
+            if ((ret = pa_stream_write(s, d, rbytes, NULL, 0, PA_SEEK_RELATIVE)) < 0) {
+                ret = translate_error(ret);
+                goto finish;
+            }
+
+            trace_written(out);
+            bytes -= rbytes;
+            continue;
+        }
+
+        in_place = FALSE;
+
+#ifdef HAVE_PA_STREAM_BEGIN_WRITE
+        /* Decode straight into the buffer of the library, if it
+         * gives us one */
+        if (pa_stream_begin_write(s, &data, &rbytes) >= 0 && data && rbytes > 0) {
+            in_place = TRUE;
+            rbytes = CA_MIN(rbytes, bytes);
+        } else {
+            data = NULL;
+            rbytes = bytes;
         }
+#endif
+
+        if (!in_place)
+            if (!(data = ca_malloc(rbytes))) {
+                ret = CA_ERROR_OOM;
+                goto finish;
+            }
 
         if ((ret = ca_sound_file_read_arbitrary(out->file, data, &rbytes)) < 0)
             goto finish;
 
         if (rbytes <= 0) {
+
+            if ((ret = ca_sequence_next(out->sequence, &out->file)) == CA_SUCCESS) {
+                free_write_buffer(s, data, in_place);
+                data = NULL;
+                continue;
+            }
+
+            if (ret != CA_ERROR_NOTFOUND)
+                goto finish;
+
             eof = TRUE;
             break;
         }
 
         ca_assert(rbytes <= bytes);
 
-        if ((ret = pa_stream_write(s, data, rbytes, ca_free, 0, PA_SEEK_RELATIVE)) < 0) {
+        if ((ret = pa_stream_write(s, data, rbytes, in_place ? NULL : ca_free, 0, PA_SEEK_RELATIVE)) < 0) {
             ret = translate_error(ret);
             goto finish;
         }
 
         data = NULL;
 
+        trace_written(out);
         bytes -= rbytes;
     }
 
-    if (eof || ca_sound_file_get_size(out->file) <= 0) {
+    if (eof || (!out->sequence && ca_sound_file_get_size(out->file) <= 0)) {
 
         /* We reached EOF */
 
@@ -676,13 +1150,13 @@ static void stream_write_cb(pa_stream *s, size_t bytes, void *userdata) {
         pa_stream_set_write_callback(s, NULL, NULL);
     }
 
-    ca_free(data);
+    free_write_buffer(s, data, in_place);
 
     return;
 
 finish:
 
-    ca_free(data);
+    free_write_buffer(s, data, in_place);
 
     if (out->clean_up) {
         ca_mutex_lock(p->outstanding_mutex);
@@ -745,7 +1219,176 @@ static ca_bool_t convert_channel_map(ca_sound_file *f, pa_channel_map *cm) {
     return TRUE;
 }
 
-int driver_play(ca_context *c, uint32_t id, ca_proplist *proplist, ca_finish_callback_t cb, void *userdata) {
+static int fallback_new(struct fallback **_f, ca_proplist *cp, ca_proplist *proplist, pa_proplist *l, const char *name, ca_bool_t volume_set, pa_volume_t volume) {
+    struct fallback *f;
+    int ret;
+
+    if (!(f = ca_new0(struct fallback, 1)))
+        return CA_ERROR_OOM;
+
+    /* The context properties might be replaced under the mainloop
+     * thread's feet, but since they are frozen we can simply keep a
+     * reference to them. The event properties belong to the caller,
+     * hence we need a copy of them. */
+    f->context_props = ca_proplist_ref(cp);
+
+    if ((ret = ca_proplist_freeze(&f->props, proplist)) < 0)
+        goto fail;
+
+    if (!(f->l = pa_proplist_copy(l)) ||
+        !(f->name = ca_strdup(name))) {
+        ret = CA_ERROR_OOM;
+        goto fail;
+    }
+
+    f->volume_set = volume_set;
+    f->volume = volume;
+
+    *_f = f;
+
+    return CA_SUCCESS;
+
+fail:
+    fallback_free(f);
+
+    return ret;
+}
+
+/* Called from the mainloop thread */
+static int fallback_start(struct outstanding *out) {
+    struct private *p;
+    struct fallback *f = out->fallback;
+    pa_sample_spec ss;
+    pa_channel_map cm;
+    pa_cvolume cvol;
+    ca_bool_t cm_good;
+    char *sp;
+    int ret;
+
+    ca_assert(f);
+
+    p = PRIVATE(out->context);
+
+    if ((ret = ca_sample_cache_lookup_file(&out->file, &sp, &p->async_theme, f->context_props, f->props)) < 0)
+        return ret;
+
+    if (sp)
+        if (!pa_proplist_contains(f->l, CA_PROP_MEDIA_FILENAME))
+            pa_proplist_sets(f->l, CA_PROP_MEDIA_FILENAME, sp);
+
+    ca_free(sp);
+
+    ss.format = sample_type_table[ca_sound_file_get_sample_type(out->file)];
+    ss.channels = (uint8_t) ca_sound_file_get_nchannels(out->file);
+    ss.rate = ca_sound_file_get_rate(out->file);
+
+    cm_good = convert_channel_map(out->file, &cm);
+
+    ca_mutex_lock(p->outstanding_mutex);
+    out->type = OUTSTANDING_STREAM;
+    ca_mutex_unlock(p->outstanding_mutex);
+
+    if (!(out->stream = pa_stream_new_with_proplist(p->context, f->name, &ss, cm_good ? &cm : NULL, f->l)))
+        return translate_error(pa_context_errno(p->context));
+
+    pa_stream_set_state_callback(out->stream, stream_state_cb, out);
+    pa_stream_set_write_callback(out->stream, stream_write_cb, out);
+
+    if (f->volume_set)
+        pa_cvolume_set(&cvol, ss.channels, f->volume);
+
+    out->connecting = ca_trace_now();
+
+    if (pa_stream_connect_playback(out->stream, NULL, NULL,
+#ifdef PA_STREAM_FAIL_ON_SUSPEND
+                                   PA_STREAM_FAIL_ON_SUSPEND
+#else
+                                   0
+#endif
+                                   , f->volume_set ? &cvol : NULL, NULL) < 0)
+        return translate_error(pa_context_errno(p->context));
+
+    return CA_SUCCESS;
+}
+
+static void play_sample_async_cb(pa_context *c, uint32_t idx, void *userdata) {
+    struct private *p;
+    struct outstanding *out = userdata;
+    int ret;
+
+    ca_assert(c);
+    ca_assert(out);
+    ca_assert(out->operation);
+
+    p = PRIVATE(out->context);
+
+    pa_operation_unref(out->operation);
+    out->operation = NULL;
+
+    if (idx != PA_INVALID_INDEX) {
+        ca_mutex_lock(p->outstanding_mutex);
+        out->sink_input = idx;
+        ca_mutex_unlock(p->outstanding_mutex);
+
+        fallback_free(out->fallback);
+        out->fallback = NULL;
+        return;
+    }
+
+    /* Hmm, we need to play it directly */
+    if ((ret = translate_error(pa_context_errno(c))) == CA_ERROR_NOTFOUND)
+        if ((ret = fallback_start(out)) == CA_SUCCESS)
+            return;
+
+    ca_mutex_lock(p->outstanding_mutex);
+    CA_LLIST_REMOVE(struct outstanding, p->outstanding, out);
+    ca_mutex_unlock(p->outstanding_mutex);
+
+    if (out->callback)
+        out->callback(out->context, out->id, ret, out->userdata);
+
+    outstanding_free(out);
+}
+
+/* Queues the play request and returns right away. Everything that
+ * happens from then on is reported via the callback only. */
+static int play_sample_async(ca_context *c, struct outstanding *out, ca_proplist *proplist, ca_proplist *cp, pa_proplist *l, const char *name, ca_bool_t volume_set, pa_volume_t v) {
+    struct private *p;
+    int ret;
+
+    p = PRIVATE(c);
+
+    if ((ret = fallback_new(&out->fallback, cp, proplist, l, name, volume_set, v)) < 0)
+        return ret;
+
+    pa_threaded_mainloop_lock(p->mainloop);
+
+    if (!p->context) {
+        pa_threaded_mainloop_unlock(p->mainloop);
+        return CA_ERROR_STATE;
+    }
+
+    if (!(out->operation = pa_context_play_sample_with_proplist(p->context, name, c->device, v, l, play_sample_async_cb, out))) {
+        ret = translate_error(pa_context_errno(p->context));
+        pa_threaded_mainloop_unlock(p->mainloop);
+        return ret;
+    }
+
+    /* The callback cannot run before we unlock the mainloop, so it
+     * is fine to put this on the list only now */
+    out->clean_up = TRUE;
+    start_playing(out);
+
+    ca_mutex_lock(p->outstanding_mutex);
+    CA_LLIST_PREPEND(struct outstanding, p->outstanding, out);
+    ca_mutex_unlock(p->outstanding_mutex);
+
+    pa_threaded_mainloop_unlock(p->mainloop);
+
+    return CA_SUCCESS;
+}
+
+static int play_now(ca_context *c, uint32_t id, ca_proplist *proplist, ca_proplist *cp, ca_finish_callback_t cb, void *userdata) {
     struct private *p;
     pa_proplist *l = NULL;
     const char *n, *vol, *ct, *channel;
@@ -762,11 +1405,13 @@ int driver_play(ca_context *c, uint32_t id, ca_proplist *proplist, ca_finish_cal
     pa_channel_position_t position = PA_CHANNEL_POSITION_INVALID;
     ca_bool_t cm_good;
     ca_cache_control_t cache_control = CA_CACHE_CONTROL_NEVER;
+    ca_bool_t async;
     struct outstanding *out = NULL;
     int try = 3;
     int ret;
     pa_operation *o;
     char *sp;
+    ca_sample *sample = NULL;
 
     ca_return_val_if_fail(c, CA_ERROR_INVALID);
     ca_return_val_if_fail(proplist, CA_ERROR_INVALID);
@@ -777,6 +1422,12 @@ int driver_play(ca_context *c, uint32_t id, ca_proplist *proplist, ca_finish_cal
 
     ca_return_val_if_fail(p->mainloop, CA_ERROR_STATE);
 
+    /* The per-event property overrides the one of the context */
+    if (ca_proplist_contains_key(proplist, CA_PROP_KEY_CANBERRA_ASYNC_PLAY))
+        async = get_async_play(proplist);
+    else
+        async = p->async_play;
+
     if (!(out = ca_new0(struct outstanding, 1))) {
         ret = CA_ERROR_OOM;
         goto finish;
@@ -785,6 +1436,7 @@ int driver_play(ca_context *c, uint32_t id, ca_proplist *proplist, ca_finish_cal
     out->type = OUTSTANDING_SAMPLE;
     out->context = c;
     out->sink_input = PA_INVALID_INDEX;
+    out->started = ca_trace_now();
     out->id = id;
     out->callback = cb;
     out->userdata = userdata;
@@ -844,10 +1496,20 @@ int driver_play(ca_context *c, uint32_t id, ca_proplist *proplist, ca_finish_cal
     if ((ret = subscribe(c)) < 0)
         goto finish;
 
-    if (name && cache_control != CA_CACHE_CONTROL_NEVER) {
+    /* Sequences are always streamed, the server cannot play them */
+    if (name && cache_control != CA_CACHE_CONTROL_NEVER && !ca_sequence_wanted(proplist)) {
 
         /* Ok, this sample has an event id, let's try to play it from the cache */
 
+        if (async) {
+            /* From now on the outstanding struct belongs to the
+             * mainloop thread */
+            if ((ret = play_sample_async(c, out, proplist, cp, l, name, volume_set, v)) == CA_SUCCESS)
+                out = NULL;
+
+            goto finish;
+        }
+
         for (;;) {
             ca_bool_t canceled;
 
@@ -904,8 +1566,13 @@ int driver_play(ca_context *c, uint32_t id, ca_proplist *proplist, ca_finish_cal
             if (--try <= 0)
                 break;
 
-            /* Let's upload the sample and retry playing */
-            if ((ret = driver_cache(c, proplist)) < 0)
+            /* Let's upload the sample and retry playing. Uploads
+             * otherwise only happen under the context lock. */
+            ca_mutex_lock(c->mutex);
+            ret = driver_cache(c, proplist);
+            ca_mutex_unlock(c->mutex);
+
+            if (ret < 0)
                 goto finish;
         }
     }
@@ -913,7 +1580,7 @@ int driver_play(ca_context *c, uint32_t id, ca_proplist *proplist, ca_finish_cal
     out->type = OUTSTANDING_STREAM;
 
     /* Let's stream the sample directly */
-    if ((ret = ca_lookup_sound(&out->file, &sp, &p->theme, c->props, proplist)) < 0)
+    if ((ret = ca_sample_cache_lookup_file(&out->file, &sp, &p->theme, cp, proplist)) < 0)
         goto finish;
 
     if (sp)
@@ -922,6 +1589,9 @@ int driver_play(ca_context *c, uint32_t id, ca_proplist *proplist, ca_finish_cal
 
     ca_free(sp);
 
+    if ((ret = ca_sequence_new(&out->sequence, &sample, &out->file, &p->theme, cp, proplist, NULL)) < 0)
+        goto finish;
+
     ss.format = sample_type_table[ca_sound_file_get_sample_type(out->file)];
     ss.channels = (uint8_t) ca_sound_file_get_nchannels(out->file);
     ss.rate = ca_sound_file_get_rate(out->file);
@@ -966,6 +1636,8 @@ int driver_play(ca_context *c, uint32_t id, ca_proplist *proplist, ca_finish_cal
     if (volume_set)
         pa_cvolume_set(&cvol, ss.channels, v);
 
+    out->connecting = ca_trace_now();
+
     if (pa_stream_connect_playback(out->stream, NULL, NULL,
 #ifdef PA_STREAM_FAIL_ON_SUSPEND
                                    PA_STREAM_FAIL_ON_SUSPEND
@@ -989,8 +1661,10 @@ int driver_play(ca_context *c, uint32_t id, ca_proplist *proplist, ca_finish_cal
         }
 
         /* Stream sucessfully created */
-        if (state == PA_STREAM_READY)
+        if (state == PA_STREAM_READY) {
+            ca_trace_stage(CA_TRACE_DEVICE_OPEN, out->connecting);
             break;
+        }
 
         /* Check for failure */
         if (state == PA_STREAM_FAILED) {
@@ -1021,8 +1695,11 @@ int driver_play(ca_context *c, uint32_t id, ca_proplist *proplist, ca_finish_cal
 finish:
 
     /* We keep the outstanding struct around if we need clean up later to */
-    if (ret == CA_SUCCESS) {
+    if (!out)
+        ;
+    else if (ret == CA_SUCCESS) {
         out->clean_up = TRUE;
+        start_playing(out);
 
         ca_mutex_lock(p->outstanding_mutex);
         CA_LLIST_PREPEND(struct outstanding, p->outstanding, out);
@@ -1038,11 +1715,45 @@ finish:
     return ret;
 }
 
+int driver_play(ca_context *c, uint32_t id, ca_proplist *proplist, ca_proplist *cp, ca_finish_callback_t cb, void *userdata) {
+    struct private *p;
+    int ret;
+
+    ca_return_val_if_fail(c, CA_ERROR_INVALID);
+    ca_return_val_if_fail(proplist, CA_ERROR_INVALID);
+    ca_return_val_if_fail(cp, CA_ERROR_INVALID);
+    ca_return_val_if_fail(!userdata || cb, CA_ERROR_INVALID);
+    ca_return_val_if_fail(c->private, CA_ERROR_STATE);
+
+    p = PRIVATE(c);
+
+    ca_return_val_if_fail(p->mainloop, CA_ERROR_STATE);
+
+    if (!p->async_open)
+        return play_now(c, id, proplist, cp, cb, userdata);
+
+    pa_threaded_mainloop_lock(p->mainloop);
+
+    /* Sounds queued earlier go first, hence we queue this one too as
+     * long as the flusher is still busy */
+    if (!connecting_unlocked(p) && !p->pending && !p->flushing) {
+        pa_threaded_mainloop_unlock(p->mainloop);
+        return play_now(c, id, proplist, cp, cb, userdata);
+    }
+
+    ret = pending_add_unlocked(c, id, proplist, cp, cb, userdata);
+
+    pa_threaded_mainloop_unlock(p->mainloop);
+
+    return ret;
+}
+
 int driver_cancel(ca_context *c, uint32_t id) {
     struct private *p;
     pa_operation *o;
     int ret = CA_SUCCESS;
     struct outstanding *out, *n;
+    struct pending *q, *qn;
 
     ca_return_val_if_fail(c, CA_ERROR_INVALID);
     ca_return_val_if_fail(c->private, CA_ERROR_STATE);
@@ -1058,6 +1769,23 @@ int driver_cancel(ca_context *c, uint32_t id) {
         return CA_ERROR_STATE;
     }
 
+    for (q = p->pending; q; q = qn) {
+        qn = q->next;
+
+        if (q->id != id)
+            continue;
+
+        pending_remove_unlocked(p, q);
+
+        if (q->callback)
+            q->callback(c, q->id, CA_ERROR_CANCELED, q->userdata);
+
+        pending_free(q);
+    }
+
+    if (!p->pending)
+        pending_stop_timer_unlocked(p);
+
     ca_mutex_lock(p->outstanding_mutex);
 
     /* We start these asynchronously and don't care about the return
@@ -1068,11 +1796,15 @@ int driver_cancel(ca_context *c, uint32_t id) {
         n = out->next;
 
         if (out->type == OUTSTANDING_UPLOAD ||
-            out->id != id ||
-            out->sink_input == PA_INVALID_INDEX)
+            out->id != id)
             continue;
 
-        if (!(o = pa_context_kill_sink_input(p->context, out->sink_input, NULL, NULL)))
+        /* Asynchronous requests might not have a sink input yet,
+         * freeing them below cancels whatever is still pending */
+        if (out->sink_input == PA_INVALID_INDEX) {
+            if (!out->operation && !out->stream)
+                continue;
+        } else if (!(o = pa_context_kill_sink_input(p->context, out->sink_input, NULL, NULL)))
             ret2 = translate_error(pa_context_errno(p->context));
         else
             pa_operation_unref(o);
@@ -1098,145 +1830,212 @@ int driver_cancel(ca_context *c, uint32_t id) {
     return ret;
 }
 
-int driver_cache(ca_context *c, ca_proplist *proplist) {
-    struct private *p;
-    pa_proplist *l = NULL;
-    const char *n, *ct;
-    char *name = NULL;
+struct upload {
+    struct outstanding *out;
+    pa_proplist *l;
+    char *name;
     pa_sample_spec ss;
     pa_channel_map cm;
     ca_bool_t cm_good;
+    ca_bool_t done;
+};
+
+static int upload_prepare(ca_context *c, struct upload *u, ca_proplist *proplist) {
+    struct private *p;
+    const char *n, *ct;
     ca_cache_control_t cache_control = CA_CACHE_CONTROL_PERMANENT;
-    struct outstanding *out;
-    int ret;
     char *sp;
+    int ret;
 
-    ca_return_val_if_fail(c, CA_ERROR_INVALID);
-    ca_return_val_if_fail(proplist, CA_ERROR_INVALID);
-    ca_return_val_if_fail(c->private, CA_ERROR_STATE);
+    /* Everything that can be done without talking to the server */
 
     p = PRIVATE(c);
 
-    ca_return_val_if_fail(p->mainloop, CA_ERROR_STATE);
-
-    if (!(out = ca_new0(struct outstanding, 1))) {
-        ret = CA_ERROR_OOM;
-        goto finish;
-    }
+    if (!(u->out = ca_new0(struct outstanding, 1)))
+        return CA_ERROR_OOM;
 
-    out->type = OUTSTANDING_UPLOAD;
-    out->context = c;
-    out->sink_input = PA_INVALID_INDEX;
+    u->out->type = OUTSTANDING_UPLOAD;
+    u->out->context = c;
+    u->out->sink_input = PA_INVALID_INDEX;
 
-    if ((ret = convert_proplist(&l, proplist)) < 0)
-        goto finish;
+    if ((ret = convert_proplist(&u->l, proplist)) < 0)
+        return ret;
 
-    if (!(n = pa_proplist_gets(l, CA_PROP_EVENT_ID))) {
-        ret = CA_ERROR_INVALID;
-        goto finish;
-    }
+    if (!(n = pa_proplist_gets(u->l, CA_PROP_EVENT_ID)))
+        return CA_ERROR_INVALID;
 
-    if (!(name = ca_strdup(n))) {
-        ret = CA_ERROR_OOM;
-        goto finish;
-    }
+    if (!(u->name = ca_strdup(n)))
+        return CA_ERROR_OOM;
 
-    if ((ct = pa_proplist_gets(l, CA_PROP_CANBERRA_CACHE_CONTROL)))
-        if ((ret = ca_parse_cache_control(&cache_control, ct)) < 0) {
-            ret = CA_ERROR_INVALID;
-            goto finish;
-        }
+    if ((ct = pa_proplist_gets(u->l, CA_PROP_CANBERRA_CACHE_CONTROL)))
+        if ((ret = ca_parse_cache_control(&cache_control, ct)) < 0)
+            return CA_ERROR_INVALID;
 
-    if (cache_control != CA_CACHE_CONTROL_PERMANENT) {
-        ret = CA_ERROR_INVALID;
-        goto finish;
-    }
+    if (cache_control != CA_CACHE_CONTROL_PERMANENT)
+        return CA_ERROR_INVALID;
 
-    if ((ct = pa_proplist_gets(l, CA_PROP_CANBERRA_FORCE_CHANNEL))) {
-        ret = CA_ERROR_NOTSUPPORTED;
-        goto finish;
-    }
+    if ((ct = pa_proplist_gets(u->l, CA_PROP_CANBERRA_FORCE_CHANNEL)))
+        return CA_ERROR_NOTSUPPORTED;
 
-    strip_prefix(l, "canberra.");
-    strip_prefix(l, "event.mouse.");
-    strip_prefix(l, "window.");
-    add_common(l);
+    strip_prefix(u->l, "canberra.");
+    strip_prefix(u->l, "event.mouse.");
+    strip_prefix(u->l, "window.");
+    add_common(u->l);
 
     /* Let's stream the sample directly */
-    if ((ret = ca_lookup_sound(&out->file, &sp, &p->theme, c->props, proplist)) < 0)
-        goto finish;
+    if ((ret = ca_sample_cache_lookup_file(&u->out->file, &sp, &p->theme, c->props, proplist)) < 0)
+        return ret;
 
     if (sp)
-        if (!pa_proplist_contains(l, CA_PROP_MEDIA_FILENAME))
-            pa_proplist_sets(l, CA_PROP_MEDIA_FILENAME, sp);
+        if (!pa_proplist_contains(u->l, CA_PROP_MEDIA_FILENAME))
+            pa_proplist_sets(u->l, CA_PROP_MEDIA_FILENAME, sp);
 
     ca_free(sp);
 
-    ss.format = sample_type_table[ca_sound_file_get_sample_type(out->file)];
-    ss.channels = (uint8_t) ca_sound_file_get_nchannels(out->file);
-    ss.rate = ca_sound_file_get_rate(out->file);
+    u->ss.format = sample_type_table[ca_sound_file_get_sample_type(u->out->file)];
+    u->ss.channels = (uint8_t) ca_sound_file_get_nchannels(u->out->file);
+    u->ss.rate = ca_sound_file_get_rate(u->out->file);
 
-    cm_good = convert_channel_map(out->file, &cm);
+    u->cm_good = convert_channel_map(u->out->file, &u->cm);
+
+    return CA_SUCCESS;
+}
+
+static int upload_start(struct private *p, struct upload *u) {
+
+    if (!(u->out->stream = pa_stream_new_with_proplist(p->context, u->name, &u->ss, u->cm_good ? &u->cm : NULL, u->l)))
+        return translate_error(pa_context_errno(p->context));
+
+    pa_stream_set_state_callback(u->out->stream, stream_state_cb, u->out);
+    pa_stream_set_write_callback(u->out->stream, stream_write_cb, u->out);
+
+    if (pa_stream_connect_upload(u->out->stream, (size_t) ca_sound_file_get_size(u->out->file)) < 0)
+        return translate_error(pa_context_errno(p->context));
+
+    return CA_SUCCESS;
+}
+
+static void upload_free(struct upload *u) {
+
+    if (u->out)
+        outstanding_free(u->out);
+
+    if (u->l)
+        pa_proplist_free(u->l);
+
+    ca_free(u->name);
+}
+
+int driver_cache(ca_context *c, ca_proplist *proplist) {
+    int result = CA_SUCCESS;
+
+    ca_return_val_if_fail(c, CA_ERROR_INVALID);
+    ca_return_val_if_fail(proplist, CA_ERROR_INVALID);
+    ca_return_val_if_fail(c->private, CA_ERROR_STATE);
+
+    return driver_cache_many(c, &proplist, 1, &result);
+}
 
+int driver_cache_many(ca_context *c, ca_proplist **proplists, unsigned n, int *results) {
+    struct private *p;
+    struct upload *u;
+    unsigned i;
+    int ret = CA_SUCCESS;
+
+    ca_return_val_if_fail(c, CA_ERROR_INVALID);
+    ca_return_val_if_fail(proplists || n <= 0, CA_ERROR_INVALID);
+    ca_return_val_if_fail(results || n <= 0, CA_ERROR_INVALID);
+    ca_return_val_if_fail(c->private, CA_ERROR_STATE);
+
+    p = PRIVATE(c);
+
+    ca_return_val_if_fail(p->mainloop, CA_ERROR_STATE);
+
+    /* Not worth queuing, the caller may simply try again later */
     pa_threaded_mainloop_lock(p->mainloop);
+    ret = connecting_unlocked(p) ? CA_ERROR_NOTAVAILABLE : CA_SUCCESS;
+    pa_threaded_mainloop_unlock(p->mainloop);
 
-    if (!p->context) {
-        pa_threaded_mainloop_unlock(p->mainloop);
-        ret = CA_ERROR_STATE;
-        goto finish;
-    }
+    if (ret < 0)
+        return ret;
 
-    if (!(out->stream = pa_stream_new_with_proplist(p->context, name, &ss, cm_good ? &cm : NULL, l))) {
-        ret = translate_error(pa_context_errno(p->context));
+    if (!(u = ca_new0(struct upload, n)))
+        return CA_ERROR_OOM;
 
-        pa_threaded_mainloop_unlock(p->mainloop);
-        goto finish;
+    /* First look up all the sounds, so that we don't have to do
+     * disk accesses between server round trips */
+    for (i = 0; i < n; i++) {
+
+        if (results[i] >= 0)
+            results[i] = upload_prepare(c, &u[i], proplists[i]);
+
+        u[i].done = results[i] < 0;
     }
 
-    pa_stream_set_state_callback(out->stream, stream_state_cb, out);
-    pa_stream_set_write_callback(out->stream, stream_write_cb, out);
+    pa_threaded_mainloop_lock(p->mainloop);
 
-    if (pa_stream_connect_upload(out->stream, (size_t) ca_sound_file_get_size(out->file)) < 0) {
-        ret = translate_error(pa_context_errno(p->context));
-        pa_threaded_mainloop_unlock(p->mainloop);
-        goto finish;
+    /* Then start all uploads at once, and let them run in parallel */
+    for (i = 0; i < n; i++) {
+
+        if (u[i].done)
+            continue;
+
+        if (!p->context)
+            results[i] = CA_ERROR_STATE;
+        else
+            results[i] = upload_start(p, &u[i]);
+
+        u[i].done = results[i] < 0;
     }
 
     for (;;) {
-        pa_stream_state_t state = pa_stream_get_state(out->stream);
+        ca_bool_t pending = FALSE;
 
-        if (!p->context) {
-            ret = CA_ERROR_STATE;
-            pa_threaded_mainloop_unlock(p->mainloop);
-            goto finish;
-        }
+        for (i = 0; i < n; i++) {
+            pa_stream_state_t state;
 
-        /* Stream sucessfully created and uploaded */
-        if (state == PA_STREAM_TERMINATED)
-            break;
+            if (u[i].done)
+                continue;
 
-        /* Check for failure */
-        if (state == PA_STREAM_FAILED) {
-            ret = translate_error(pa_context_errno(p->context));
-            pa_threaded_mainloop_unlock(p->mainloop);
-            goto finish;
+            if (!p->context) {
+                results[i] = CA_ERROR_STATE;
+                u[i].done = TRUE;
+                continue;
+            }
+
+            state = pa_stream_get_state(u[i].out->stream);
+
+            /* Stream sucessfully created and uploaded, unless the
+             * write callback had to give up on it */
+            if (state == PA_STREAM_TERMINATED) {
+                results[i] = u[i].out->error;
+                u[i].done = TRUE;
+
+            /* Check for failure */
+            } else if (state == PA_STREAM_FAILED) {
+                results[i] = translate_error(pa_context_errno(p->context));
+                u[i].done = TRUE;
+
+            } else
+                pending = TRUE;
         }
 
+        if (!pending)
+            break;
+
         pa_threaded_mainloop_wait(p->mainloop);
     }
 
     pa_threaded_mainloop_unlock(p->mainloop);
 
-    ret = CA_SUCCESS;
-
-finish:
-
-    outstanding_free(out);
+    for (i = 0; i < n; i++) {
+        upload_free(&u[i]);
 
-    if (l)
-        pa_proplist_free(l);
+        if (results[i] < 0 && ret == CA_SUCCESS)
+            ret = results[i];
+    }
 
-    ca_free(name);
+    ca_free(u);
 
     return ret;
 }
@@ -23,32 +23,82 @@
 #endif
 
 #include <errno.h>
+#include <pthread.h>
 
 #include "read-sound-file.h"
 #include "read-wav.h"
 #include "read-vorbis.h"
 #include "macro.h"
 #include "malloc.h"
+#include "mutex.h"
+#include "thread-pool.h"
+#include "trace.h"
 #include "canberra.h"
 
+/* How much to decode in one go, so that the reader doesn't wait for
+ * more than it needs */
+#define READ_AHEAD_CHUNK (4U*1024U)
+
+/* Decoded data the decoder thread is ahead of the reader */
+struct read_ahead {
+    /* Everything below protected by the mutex */
+    ca_mutex *mutex;
+    ca_cond *cond;
+
+    uint8_t *buffer;
+    size_t size, index, fill;
+    off_t size_left;
+
+    ca_bool_t running;
+    ca_bool_t dead;
+    ca_bool_t eof;
+    int error;
+
+    /* The value of n_forks when the decoder was started */
+    unsigned forks;
+};
+
+/* Bumped in forked children, where the decoder threads of the parent
+ * don't exist */
+static volatile unsigned n_forks = 0;
+
+static ca_bool_t read_ahead_running_unlocked(struct read_ahead *r) {
+
+    if (r->running && r->forks != n_forks)
+        r->running = FALSE;
+
+    return r->running;
+}
+
 struct ca_sound_file {
     ca_wav *wav;
     ca_vorbis *vorbis;
+    struct read_ahead *read_ahead;
     char *filename;
 
     unsigned nchannels;
     unsigned rate;
     ca_sample_type_t type;
+
+    /* For files that are already decoded in memory */
+    const uint8_t *data;
+    size_t nbytes, offset;
+    const ca_channel_position_t *channel_map;
+    void (*free_cb)(void *userdata);
+    void *userdata;
 };
 
 int ca_sound_file_open(ca_sound_file **_f, const char *fn) {
     FILE *file;
     ca_sound_file *f;
+    ca_usec_t start;
     int ret;
 
     ca_return_val_if_fail(_f, CA_ERROR_INVALID);
     ca_return_val_if_fail(fn, CA_ERROR_INVALID);
 
+    start = ca_trace_now();
+
     if (!(f = ca_new0(ca_sound_file, 1)))
         return CA_ERROR_OOM;
 
@@ -67,6 +117,7 @@ int ca_sound_file_open(ca_sound_file **_f, const char *fn) {
         f->rate = ca_wav_get_rate(f->wav);
         f->type = ca_wav_get_sample_type(f->wav);
         *_f = f;
+        ca_trace_stage(CA_TRACE_FILE_OPEN, start);
         return CA_SUCCESS;
     }
 
@@ -82,6 +133,7 @@ int ca_sound_file_open(ca_sound_file **_f, const char *fn) {
             f->rate = ca_vorbis_get_rate(f->vorbis);
             f->type = CA_SAMPLE_S16NE;
             *_f = f;
+            ca_trace_stage(CA_TRACE_FILE_OPEN, start);
             return CA_SUCCESS;
         }
     }
@@ -94,13 +146,88 @@ fail:
     return ret;
 }
 
+int ca_sound_file_open_memory(
+        ca_sound_file **_f,
+        const void *data,
+        size_t nbytes,
+        ca_sample_type_t type,
+        unsigned nchannels,
+        unsigned rate,
+        const ca_channel_position_t *channel_map,
+        void (*free_cb)(void *userdata),
+        void *userdata) {
+
+    ca_sound_file *f;
+
+    ca_return_val_if_fail(_f, CA_ERROR_INVALID);
+    ca_return_val_if_fail(data, CA_ERROR_INVALID);
+    ca_return_val_if_fail(nbytes > 0, CA_ERROR_INVALID);
+    ca_return_val_if_fail(nchannels > 0, CA_ERROR_INVALID);
+
+    if (!(f = ca_new0(ca_sound_file, 1)))
+        return CA_ERROR_OOM;
+
+    f->data = data;
+    f->nbytes = nbytes;
+    f->type = type;
+    f->nchannels = nchannels;
+    f->rate = rate;
+    f->channel_map = channel_map;
+    f->free_cb = free_cb;
+    f->userdata = userdata;
+
+    *_f = f;
+
+    return CA_SUCCESS;
+}
+
+static void read_memory(ca_sound_file *f, void *d, size_t *n) {
+    size_t k;
+
+    k = f->nbytes - f->offset;
+
+    if (*n > k)
+        *n = k;
+
+    memcpy(d, f->data + f->offset, *n);
+    f->offset += *n;
+}
+
+/* Waits until the decoder lets go */
+static void read_ahead_stop_unlocked(struct read_ahead *r) {
+    ca_assert(r);
+
+    r->dead = TRUE;
+    ca_cond_signal(r->cond, TRUE);
+
+    while (read_ahead_running_unlocked(r))
+        ca_cond_wait(r->cond, r->mutex);
+}
+
+static void read_ahead_free(struct read_ahead *r) {
+    ca_assert(r);
+
+    ca_mutex_lock(r->mutex);
+    read_ahead_stop_unlocked(r);
+    ca_mutex_unlock(r->mutex);
+
+    ca_cond_free(r->cond);
+    ca_mutex_free(r->mutex);
+    ca_free(r->buffer);
+    ca_free(r);
+}
+
 void ca_sound_file_close(ca_sound_file *f) {
     ca_assert(f);
 
+    if (f->read_ahead)
+        read_ahead_free(f->read_ahead);
     if (f->wav)
         ca_wav_close(f->wav);
     if (f->vorbis)
         ca_vorbis_close(f->vorbis);
+    if (f->free_cb)
+        f->free_cb(f->userdata);
 
     ca_free(f->filename);
     ca_free(f);
@@ -124,38 +251,319 @@ ca_sample_type_t ca_sound_file_get_sample_type(ca_sound_file *f) {
 const ca_channel_position_t* ca_sound_file_get_channel_map(ca_sound_file *f) {
     ca_assert(f);
 
-    if (f->wav)
+    if (f->data)
+        return f->channel_map;
+    else if (f->wav)
         return ca_wav_get_channel_map(f->wav);
     else
         return ca_vorbis_get_channel_map(f->vorbis);
 }
 
+/* Decodes one chunk into the free space of the ring, with the mutex
+ * held by the caller. Only one thread may call this at a time. */
+static void read_ahead_decode_unlocked(ca_sound_file *f) {
+    struct read_ahead *r = f->read_ahead;
+    size_t fs, k, j;
+    int ret;
+
+    fs = ca_sound_file_frame_size(f);
+    j = (r->index + r->fill) % r->size;
+
+    /* The decoder only ever writes complete frames */
+    k = CA_MIN(r->size - r->fill, r->size - j);
+    k = CA_MIN(k, READ_AHEAD_CHUNK);
+    k = (k / fs) * fs;
+
+    if (k <= 0)
+        return;
+
+    /* The reader doesn't touch the free space, so we can decode
+     * without holding the lock */
+    ca_mutex_unlock(r->mutex);
+
+    k /= sizeof(int16_t);
+    if ((ret = ca_vorbis_read_s16ne(f->vorbis, (int16_t*) (r->buffer + j), &k)) == CA_SUCCESS)
+        ca_trace_bytes_decoded(k * sizeof(int16_t));
+
+    ca_mutex_lock(r->mutex);
+
+    if (ret < 0) {
+        r->error = ret;
+        r->eof = TRUE;
+    } else if (k <= 0)
+        r->eof = TRUE;
+    else
+        r->fill += k * sizeof(int16_t);
+}
+
+/* How many decoder jobs are running right now */
+static volatile unsigned n_jobs = 0;
+
+static void read_ahead_func(void *job, void *userdata) {
+    ca_sound_file *f = job;
+    struct read_ahead *r = f->read_ahead;
+
+    ca_mutex_lock(r->mutex);
+
+    while (!r->dead && !r->eof) {
+
+        if (r->size - r->fill < ca_sound_file_frame_size(f)) {
+            /* Full, wait for the reader */
+            ca_cond_wait(r->cond, r->mutex);
+            continue;
+        }
+
+        read_ahead_decode_unlocked(f);
+        ca_cond_signal(r->cond, TRUE);
+    }
+
+    r->running = FALSE;
+    ca_cond_signal(r->cond, TRUE);
+
+    ca_mutex_unlock(r->mutex);
+
+    __sync_sub_and_fetch(&n_jobs, 1);
+}
+
+/* Shared by all files, the decoder jobs usually don't take long */
+static ca_thread_pool *read_ahead_pool = NULL;
+static int read_ahead_pool_result = CA_ERROR_OOM;
+static pthread_once_t read_ahead_pool_once = PTHREAD_ONCE_INIT;
+
+static void read_ahead_atfork_child(void) {
+
+    /* The workers didn't make it into the child, hence files decode
+     * synchronously there. The pool itself is simply leaked. */
+    read_ahead_pool = NULL;
+    read_ahead_pool_result = CA_ERROR_FORKED;
+    n_jobs = 0;
+    n_forks++;
+}
+
+static void read_ahead_pool_new(void) {
+
+    if (pthread_atfork(NULL, NULL, read_ahead_atfork_child) != 0)
+        return;
+
+    read_ahead_pool_result = ca_thread_pool_new(&read_ahead_pool, 2, read_ahead_func, NULL);
+}
+
+#ifdef CA_GCC_DESTRUCTOR
+
+static void read_ahead_pool_free(void) CA_GCC_DESTRUCTOR;
+
+static void read_ahead_pool_free(void) {
+
+    /* The workers must be gone before our code is unmapped. A file
+     * that is still open at exit would keep ca_thread_pool_free()
+     * waiting forever though, in which case we leave them be. */
+    if (!read_ahead_pool || n_jobs > 0)
+        return;
+
+    ca_thread_pool_free(read_ahead_pool);
+    read_ahead_pool = NULL;
+    read_ahead_pool_result = CA_ERROR_STATE;
+}
+
+#endif
+
+static void read_ahead_start_unlocked(ca_sound_file *f, size_t prefill) {
+    struct read_ahead *r = f->read_ahead;
+    size_t fs;
+
+    fs = ca_sound_file_frame_size(f);
+
+    /* Whatever is needed to get going is decoded right away, so that
+     * the first write doesn't need to wait for the decoder thread */
+    while (!r->eof && r->fill < prefill && r->size - r->fill >= fs)
+        read_ahead_decode_unlocked(f);
+
+    if (r->eof)
+        return;
+
+    r->running = TRUE;
+    r->forks = n_forks;
+
+    /* If we cannot start the decoder thread, the reader decodes
+     * synchronously again */
+    if (pthread_once(&read_ahead_pool_once, read_ahead_pool_new) != 0 ||
+        read_ahead_pool_result < 0)
+        r->running = FALSE;
+    else {
+        __sync_add_and_fetch(&n_jobs, 1);
+
+        if (ca_thread_pool_push(read_ahead_pool, f) < 0) {
+            __sync_sub_and_fetch(&n_jobs, 1);
+            r->running = FALSE;
+        }
+    }
+}
+
+int ca_sound_file_read_ahead(ca_sound_file *f, size_t ring_size, size_t prefill) {
+    struct read_ahead *r;
+    size_t fs;
+
+    ca_return_val_if_fail(f, CA_ERROR_INVALID);
+    ca_return_val_if_fail(!f->read_ahead, CA_ERROR_STATE);
+    ca_return_val_if_fail(prefill <= ring_size, CA_ERROR_INVALID);
+
+    /* Everything else is cheap to read */
+    if (!f->vorbis)
+        return CA_SUCCESS;
+
+    fs = ca_sound_file_frame_size(f);
+    ca_return_val_if_fail(ring_size >= fs, CA_ERROR_INVALID);
+
+    if (!(r = ca_new0(struct read_ahead, 1)))
+        return CA_ERROR_OOM;
+
+    r->size = (ring_size / fs) * fs;
+    r->size_left = ca_vorbis_get_size(f->vorbis);
+
+    if (!(r->mutex = ca_mutex_new()) ||
+        !(r->cond = ca_cond_new()) ||
+        !(r->buffer = ca_new(uint8_t, r->size))) {
+
+        if (r->cond)
+            ca_cond_free(r->cond);
+        if (r->mutex)
+            ca_mutex_free(r->mutex);
+
+        ca_free(r);
+        return CA_ERROR_OOM;
+    }
+
+    f->read_ahead = r;
+
+    ca_mutex_lock(r->mutex);
+    read_ahead_start_unlocked(f, prefill);
+    ca_mutex_unlock(r->mutex);
+
+    return CA_SUCCESS;
+}
+
+static int read_ahead_rewind(ca_sound_file *f) {
+    struct read_ahead *r = f->read_ahead;
+    int ret;
+
+    ca_mutex_lock(r->mutex);
+
+    read_ahead_stop_unlocked(r);
+
+    /* Nobody else touches the decoder now */
+    if ((ret = ca_vorbis_rewind(f->vorbis)) < 0) {
+        r->error = ret;
+        r->eof = TRUE;
+        ca_mutex_unlock(r->mutex);
+        return ret;
+    }
+
+    r->index = r->fill = 0;
+    r->size_left = ca_vorbis_get_size(f->vorbis);
+    r->eof = r->dead = FALSE;
+    r->error = CA_SUCCESS;
+
+    read_ahead_start_unlocked(f, 0);
+
+    ca_mutex_unlock(r->mutex);
+
+    return CA_SUCCESS;
+}
+
+static int read_ahead_read(ca_sound_file *f, int16_t *d, size_t *n) {
+    struct read_ahead *r = f->read_ahead;
+    size_t k, nbytes = 0;
+    int ret = CA_SUCCESS;
+
+    ca_mutex_lock(r->mutex);
+
+    while (r->fill <= 0 && !r->eof) {
+
+        if (read_ahead_running_unlocked(r))
+            ca_cond_wait(r->cond, r->mutex);
+        else
+            read_ahead_decode_unlocked(f);
+    }
+
+    if (r->fill <= 0)
+        ret = r->error;
+
+    /* Copy what we have, in up to two pieces if it wraps around */
+    while (r->fill > 0 && nbytes < *n * sizeof(int16_t)) {
+        k = CA_MIN(r->fill, r->size - r->index);
+        k = CA_MIN(k, *n * sizeof(int16_t) - nbytes);
+
+        memcpy((uint8_t*) d + nbytes, r->buffer + r->index, k);
+
+        nbytes += k;
+        r->index = (r->index + k) % r->size;
+        r->fill -= k;
+    }
+
+    r->size_left -= (off_t) nbytes;
+    ca_cond_signal(r->cond, TRUE);
+
+    ca_mutex_unlock(r->mutex);
+
+    *n = nbytes / sizeof(int16_t);
+
+    return ret;
+}
+
 int ca_sound_file_read_int16(ca_sound_file *f, int16_t *d, size_t *n) {
+    int ret;
+
     ca_return_val_if_fail(f, CA_ERROR_INVALID);
     ca_return_val_if_fail(d, CA_ERROR_INVALID);
     ca_return_val_if_fail(n, CA_ERROR_INVALID);
     ca_return_val_if_fail(*n > 0, CA_ERROR_INVALID);
-    ca_return_val_if_fail(f->wav || f->vorbis, CA_ERROR_STATE);
+    ca_return_val_if_fail(f->wav || f->vorbis || f->data, CA_ERROR_STATE);
     ca_return_val_if_fail(f->type == CA_SAMPLE_S16NE || f->type == CA_SAMPLE_S16RE, CA_ERROR_STATE);
 
+    if (f->data) {
+        size_t k = *n * sizeof(int16_t);
+
+        read_memory(f, d, &k);
+        *n = k / sizeof(int16_t);
+        return CA_SUCCESS;
+    }
+
+    if (f->read_ahead)
+        return read_ahead_read(f, d, n);
+
     if (f->wav)
-        return ca_wav_read_s16le(f->wav, d, n);
+        ret = ca_wav_read_s16le(f->wav, d, n);
     else
-        return ca_vorbis_read_s16ne(f->vorbis, d, n);
+        ret = ca_vorbis_read_s16ne(f->vorbis, d, n);
+
+    if (ret == CA_SUCCESS)
+        ca_trace_bytes_decoded(*n * sizeof(int16_t));
+
+    return ret;
 }
 
 int ca_sound_file_read_uint8(ca_sound_file *f, uint8_t *d, size_t *n) {
+    int ret;
+
     ca_return_val_if_fail(f, CA_ERROR_INVALID);
     ca_return_val_if_fail(d, CA_ERROR_INVALID);
     ca_return_val_if_fail(n, CA_ERROR_INVALID);
     ca_return_val_if_fail(*n > 0, CA_ERROR_INVALID);
-    ca_return_val_if_fail(f->wav && !f->vorbis, CA_ERROR_STATE);
+    ca_return_val_if_fail((f->wav && !f->vorbis) || f->data, CA_ERROR_STATE);
     ca_return_val_if_fail(f->type == CA_SAMPLE_U8, CA_ERROR_STATE);
 
-    if (f->wav)
-        return ca_wav_read_u8(f->wav, d, n);
+    if (f->data) {
+        read_memory(f, d, n);
+        return CA_SUCCESS;
+    }
+
+    if (!f->wav)
+        return CA_ERROR_STATE;
+
+    if ((ret = ca_wav_read_u8(f->wav, d, n)) == CA_SUCCESS)
+        ca_trace_bytes_decoded(*n);
 
-    return CA_ERROR_STATE;
+    return ret;
 }
 
 int ca_sound_file_read_arbitrary(ca_sound_file *f, void *d, size_t *n) {
@@ -195,10 +603,71 @@ int ca_sound_file_read_arbitrary(ca_sound_file *f, void *d, size_t *n) {
     return ret;
 }
 
+int ca_sound_file_read_mapped(ca_sound_file *f, const void **d, size_t *n) {
+    ca_return_val_if_fail(f, CA_ERROR_INVALID);
+    ca_return_val_if_fail(d, CA_ERROR_INVALID);
+    ca_return_val_if_fail(n, CA_ERROR_INVALID);
+    ca_return_val_if_fail(*n > 0, CA_ERROR_INVALID);
+
+    if (f->data) {
+        size_t k, fs;
+
+        fs = ca_sound_file_frame_size(f);
+        k = f->nbytes - f->offset;
+
+        if (*n > k)
+            *n = k;
+
+        *n = (*n / fs) * fs;
+        *d = f->data + f->offset;
+        f->offset += *n;
+
+        return CA_SUCCESS;
+    }
+
+    if (!f->wav)
+        return CA_ERROR_NOTSUPPORTED;
+
+    return ca_wav_read_mapped(f->wav, d, n);
+}
+
+int ca_sound_file_rewind(ca_sound_file *f) {
+    ca_return_val_if_fail(f, CA_ERROR_INVALID);
+
+    if (f->data) {
+        f->offset = 0;
+        return CA_SUCCESS;
+    }
+
+    if (f->read_ahead)
+        return read_ahead_rewind(f);
+
+    if (f->wav)
+        return ca_wav_rewind(f->wav);
+
+    return ca_vorbis_rewind(f->vorbis);
+}
+
+ca_bool_t ca_sound_file_is_mapped(ca_sound_file *f) {
+    ca_assert(f);
+
+    return f->data || (f->wav && ca_wav_is_mapped(f->wav));
+}
+
 off_t ca_sound_file_get_size(ca_sound_file *f) {
     ca_return_val_if_fail(f, (off_t) -1);
 
-    if (f->wav)
+    if (f->data)
+        return (off_t) f->nbytes;
+    else if (f->read_ahead) {
+        off_t size;
+
+        ca_mutex_lock(f->read_ahead->mutex);
+        size = f->read_ahead->size_left;
+        ca_mutex_unlock(f->read_ahead->mutex);
+
+        return size;
+    } else if (f->wav)
         return ca_wav_get_size(f->wav);
     else
         return ca_vorbis_get_size(f->vorbis);
@@ -24,6 +24,8 @@
 #include <sys/types.h>
 #include <inttypes.h>
 
+#include "macro.h"
+
 typedef enum ca_sample_type {
     CA_SAMPLE_S16NE,
     CA_SAMPLE_S16RE,
@@ -56,6 +58,19 @@ typedef enum ca_channel_position {
 typedef struct ca_sound_file ca_sound_file;
 
 int ca_sound_file_open(ca_sound_file **f, const char *fn);
+
+/* Wraps PCM data that is already decoded in memory. The data and the
+ * channel map need to stay around until free_cb is called on close. */
+int ca_sound_file_open_memory(
+        ca_sound_file **f,
+        const void *data,
+        size_t nbytes,
+        ca_sample_type_t type,
+        unsigned nchannels,
+        unsigned rate,
+        const ca_channel_position_t *channel_map,
+        void (*free_cb)(void *userdata),
+        void *userdata);
 void ca_sound_file_close(ca_sound_file *f);
 
 unsigned ca_sound_file_get_nchannels(ca_sound_file *f);
@@ -70,6 +85,21 @@ int ca_sound_file_read_uint8(ca_sound_file *f, uint8_t *d, size_t *n);
 
 int ca_sound_file_read_arbitrary(ca_sound_file *f, void *d, size_t *n);
 
+/* Zero-copy access to the sample data, for files that could be
+ * mapped into memory. *n is in bytes and will be a multiple of the
+ * frame size. */
+int ca_sound_file_read_mapped(ca_sound_file *f, const void **d, size_t *n);
+ca_bool_t ca_sound_file_is_mapped(ca_sound_file *f);
+
+/* Starts reading from the beginning again */
+int ca_sound_file_rewind(ca_sound_file *f);
+
+/* Keeps decoding compressed files from a background thread, up to
+ * ring_size bytes ahead of the reader, so that the reader doesn't
+ * stall on the decoder. The first prefill bytes are decoded before
+ * this returns. Does nothing for files that don't need decoding. */
+int ca_sound_file_read_ahead(ca_sound_file *f, size_t ring_size, size_t prefill);
+
 size_t ca_sound_file_frame_size(ca_sound_file *f);
 
 #endif
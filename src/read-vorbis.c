@@ -34,7 +34,7 @@
 
 struct ca_vorbis {
     OggVorbis_File ovf;
-    off_t size;
+    off_t size, size_total;
     ca_channel_position_t channel_map[6];
 };
 
@@ -94,7 +94,7 @@ int ca_vorbis_open(ca_vorbis **_v, FILE *f)  {
         goto fail;
     }
 
-    v->size = (off_t) n * (off_t) sizeof(int16_t) * ca_vorbis_get_nchannels(v);
+    v->size = v->size_total = (off_t) n * (off_t) sizeof(int16_t) * ca_vorbis_get_nchannels(v);
 
     *_v = v;
 
@@ -214,6 +214,19 @@ int ca_vorbis_read_s16ne(ca_vorbis *v, int16_t *d, size_t *n){
     return CA_SUCCESS;
 }
 
+int ca_vorbis_rewind(ca_vorbis *v) {
+    int or;
+
+    ca_return_val_if_fail(v, CA_ERROR_INVALID);
+
+    if ((or = ov_pcm_seek(&v->ovf, 0)) < 0)
+        return convert_error(or);
+
+    v->size = v->size_total;
+
+    return CA_SUCCESS;
+}
+
 off_t ca_vorbis_get_size(ca_vorbis *v) {
     ca_return_val_if_fail(v, (off_t) -1);
 
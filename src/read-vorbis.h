@@ -37,6 +37,9 @@ const ca_channel_position_t* ca_vorbis_get_channel_map(ca_vorbis *v);
 
 int ca_vorbis_read_s16ne(ca_vorbis *v, int16_t *d, size_t *n);
 
+/* Starts decoding from the beginning of the first section again */
+int ca_vorbis_rewind(ca_vorbis *v);
+
 off_t ca_vorbis_get_size(ca_vorbis *f);
 
 #endif
@@ -22,6 +22,10 @@
 #include <config.h>
 #endif
 
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
 #include "canberra.h"
 #include "read-wav.h"
 #include "macro.h"
@@ -76,6 +80,16 @@ static const ca_channel_position_t channel_table[_BIT_MAX] = {
 struct ca_wav {
     FILE *file;
 
+    /* If the file could be mapped, data points to the next unread
+     * byte of the data chunk within the map */
+    void *map;
+    size_t map_size;
+    const uint8_t *data;
+
+    /* Where the data chunk starts, for rewinding */
+    off_t data_offset;
+    off_t data_size_total;
+
     off_t data_size;
     unsigned nchannels;
     unsigned rate;
@@ -131,6 +145,33 @@ fail_io:
     ca_assert_not_reached();
 }
 
+static void map_data(ca_wav *w) {
+    struct stat st;
+    off_t offset;
+    void *m;
+
+    /* If this fails we just read through the FILE* instead */
+
+    if ((offset = ftello(w->file)) < 0)
+        return;
+
+    if (fstat(fileno(w->file), &st) < 0 || !S_ISREG(st.st_mode))
+        return;
+
+    /* Truncated files are handled by the FILE* path, and so are
+     * oddly placed data chunks, so that readers of the map may rely
+     * on samples being aligned */
+    if (st.st_size <= 0 || offset + w->data_size > st.st_size || (offset % (off_t) sizeof(int16_t)) != 0)
+        return;
+
+    if ((m = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fileno(w->file), 0)) == MAP_FAILED)
+        return;
+
+    w->map = m;
+    w->map_size = (size_t) st.st_size;
+    w->data = (const uint8_t*) m + offset;
+}
+
 int ca_wav_open(ca_wav **_w, FILE *f)  {
     uint32_t header[3], fmt_chunk[10];
     int ret;
@@ -142,7 +183,7 @@ int ca_wav_open(ca_wav **_w, FILE *f)  {
     ca_return_val_if_fail(_w, CA_ERROR_INVALID);
     ca_return_val_if_fail(f, CA_ERROR_INVALID);
 
-    if (!(w = ca_new(ca_wav, 1)))
+    if (!(w = ca_new0(ca_wav, 1)))
         return CA_ERROR_OOM;
 
     w->file = f;
@@ -229,6 +270,15 @@ int ca_wav_open(ca_wav **_w, FILE *f)  {
         goto fail;
     }
 
+    if ((w->data_offset = ftello(f)) < 0) {
+        ret = CA_ERROR_SYSTEM;
+        goto fail;
+    }
+
+    w->data_size_total = w->data_size;
+
+    map_data(w);
+
     *_w = w;
 
     return CA_SUCCESS;
@@ -252,6 +302,9 @@ fail:
 void ca_wav_close(ca_wav *w) {
     ca_assert(w);
 
+    if (w->map)
+        munmap(w->map, w->map_size);
+
     fclose(w->file);
     ca_free(w);
 }
@@ -318,10 +371,16 @@ int ca_wav_read_s16le(ca_wav *w, int16_t *d, size_t *n) {
         *n = (size_t) remaining;
 
     if (*n > 0) {
-        *n = fread(d, sizeof(int16_t), *n, w->file);
 
-        if (*n <= 0 && ferror(w->file))
-            return CA_ERROR_SYSTEM;
+        if (w->data) {
+            memcpy(d, w->data, *n * sizeof(int16_t));
+            w->data += *n * sizeof(int16_t);
+        } else {
+            *n = fread(d, sizeof(int16_t), *n, w->file);
+
+            if (*n <= 0 && ferror(w->file))
+                return CA_ERROR_SYSTEM;
+        }
 
         ca_assert(w->data_size >= (off_t) *n * (off_t) sizeof(int16_t));
         w->data_size -= (off_t) *n * (off_t) sizeof(int16_t);
@@ -345,10 +404,16 @@ int ca_wav_read_u8(ca_wav *w, uint8_t *d, size_t *n) {
         *n = (size_t) remaining;
 
     if (*n > 0) {
-        *n = fread(d, sizeof(uint8_t), *n, w->file);
 
-        if (*n <= 0 && ferror(w->file))
-            return CA_ERROR_SYSTEM;
+        if (w->data) {
+            memcpy(d, w->data, *n * sizeof(uint8_t));
+            w->data += *n * sizeof(uint8_t);
+        } else {
+            *n = fread(d, sizeof(uint8_t), *n, w->file);
+
+            if (*n <= 0 && ferror(w->file))
+                return CA_ERROR_SYSTEM;
+        }
 
         ca_assert(w->data_size >= (off_t) *n * (off_t) sizeof(uint8_t));
         w->data_size -= (off_t) *n * (off_t) sizeof(uint8_t);
@@ -357,6 +422,52 @@ int ca_wav_read_u8(ca_wav *w, uint8_t *d, size_t *n) {
     return CA_SUCCESS;
 }
 
+int ca_wav_read_mapped(ca_wav *w, const void **d, size_t *n) {
+    size_t fs;
+
+    ca_return_val_if_fail(w, CA_ERROR_INVALID);
+    ca_return_val_if_fail(d, CA_ERROR_INVALID);
+    ca_return_val_if_fail(n, CA_ERROR_INVALID);
+    ca_return_val_if_fail(*n > 0, CA_ERROR_INVALID);
+
+    if (!w->data)
+        return CA_ERROR_NOTSUPPORTED;
+
+    /* Only hand out complete frames, a trailing partial frame is
+     * treated as EOF */
+    fs = w->nchannels * (w->depth/8);
+
+    if ((off_t) *n > w->data_size)
+        *n = (size_t) w->data_size;
+
+    *n = (*n / fs) * fs;
+    *d = w->data;
+
+    w->data += *n;
+    w->data_size -= (off_t) *n;
+
+    return CA_SUCCESS;
+}
+
+int ca_wav_rewind(ca_wav *w) {
+    ca_return_val_if_fail(w, CA_ERROR_INVALID);
+
+    if (w->map)
+        w->data = (const uint8_t*) w->map + w->data_offset;
+    else if (fseeko(w->file, w->data_offset, SEEK_SET) < 0)
+        return CA_ERROR_SYSTEM;
+
+    w->data_size = w->data_size_total;
+
+    return CA_SUCCESS;
+}
+
+ca_bool_t ca_wav_is_mapped(ca_wav *w) {
+    ca_assert(w);
+
+    return !!w->data;
+}
+
 off_t ca_wav_get_size(ca_wav *v) {
     ca_return_val_if_fail(v, (off_t) -1);
 
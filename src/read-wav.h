@@ -38,6 +38,14 @@ const ca_channel_position_t* ca_wav_get_channel_map(ca_wav *f);
 int ca_wav_read_u8(ca_wav *f, uint8_t *d, size_t *n);
 int ca_wav_read_s16le(ca_wav *f, int16_t *d, size_t *n);
 
+/* Returns a pointer to the next *n bytes of the data chunk, without
+ * copying. Only available if the file could be mapped into memory. */
+int ca_wav_read_mapped(ca_wav *f, const void **d, size_t *n);
+ca_bool_t ca_wav_is_mapped(ca_wav *f);
+
+/* Starts reading from the beginning of the data chunk again */
+int ca_wav_rewind(ca_wav *f);
+
 off_t ca_wav_get_size(ca_wav *f);
 
 #endif
@@ -0,0 +1,790 @@
+/***
+  This file is part of libcanberra.
+
+  Copyright 2008 Lennart Poettering
+
+  libcanberra is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 2.1 of the
+  License, or (at your option) any later version.
+
+  libcanberra is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with libcanberra. If not, see
+  <http://www.gnu.org/licenses/>.
+***/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <sys/mman.h>
+#include <pthread.h>
+
+#include "canberra.h"
+#include "malloc.h"
+#include "macro.h"
+#include "mix.h"
+#include "mutex.h"
+#include "proplist.h"
+#include "sample-cache.h"
+#include "sample-shm.h"
+#include "trace.h"
+
+#define N_SLOTS 31
+
+/* Upper bounds for the total amount of decoded data we keep around,
+ * and for a single sound to be considered for caching at all. Event
+ * sounds are short, anything bigger than this is streamed from the
+ * file as before. */
+#define CACHE_SIZE_MAX ((size_t) (8U*1024U*1024U))
+#define SAMPLE_SIZE_MAX ((off_t) (1U*1024U*1024U))
+
+/* This part is not portable due to pthread_once usage, should be abstracted
+ * when we port this to platforms that do not have POSIX threading */
+
+static ca_mutex *mutex = NULL;
+
+/* Everything below is protected by the mutex */
+static ca_sample *sample_hashtable[N_SLOTS];
+static CA_LLIST_HEAD(ca_sample, lru);
+static ca_sample *lru_tail = NULL;
+static size_t cache_size = 0;
+
+/* How many entries are only in the cache while they are shared by
+ * somebody, see ca_sample_cache_share_sound(). Read without locking
+ * as a hint whether looking for them is worth the effort. */
+static volatile unsigned n_shared = 0;
+
+static void allocate_mutex_once(void) {
+    mutex = ca_mutex_new();
+}
+
+static int allocate_mutex(void) {
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+    if (pthread_once(&once, allocate_mutex_once) != 0)
+        return CA_ERROR_OOM;
+
+    if (!mutex)
+        return CA_ERROR_OOM;
+
+    return 0;
+}
+
+static unsigned calc_hash(const char *key, size_t klen) {
+    unsigned hash = 0;
+
+    /* The key contains embedded NUL bytes, hence we cannot stop at
+     * the first one */
+    for (; klen > 0; key++, klen--)
+        hash = 31 * hash + (unsigned) *key;
+
+    return hash;
+}
+
+static void sample_free(ca_sample *s) {
+    ca_assert(s);
+
+    ca_free(s->key);
+    ca_free(s->path);
+    ca_free(s->channel_map);
+
+    if (s->map)
+        munmap(s->map, s->map_size);
+    else
+        ca_free(s->data);
+
+    ca_free(s);
+}
+
+static ca_sample* find_unlocked(const char *key, size_t klen, unsigned hash) {
+    ca_sample *s;
+
+    for (s = sample_hashtable[hash % N_SLOTS]; s; s = s->next_in_slot)
+        if (s->hash == hash && s->klen == klen && memcmp(s->key, key, klen) == 0)
+            return s;
+
+    return NULL;
+}
+
+static void lru_remove_unlocked(ca_sample *s) {
+
+    if (lru_tail == s)
+        lru_tail = s->prev;
+
+    CA_LLIST_REMOVE(ca_sample, lru, s);
+}
+
+static void lru_prepend_unlocked(ca_sample *s) {
+
+    CA_LLIST_PREPEND(ca_sample, lru, s);
+
+    if (!lru_tail)
+        lru_tail = s;
+}
+
+static void unlink_unlocked(ca_sample *s) {
+    ca_sample **i;
+
+    ca_assert(s->cached);
+
+    for (i = &sample_hashtable[s->hash % N_SLOTS]; *i; i = &(*i)->next_in_slot)
+        if (*i == s) {
+            *i = s->next_in_slot;
+            break;
+        }
+
+    s->next_in_slot = NULL;
+    lru_remove_unlocked(s);
+
+    ca_assert(cache_size >= s->nbytes);
+    cache_size -= s->nbytes;
+
+    if (s->cache_control == CA_CACHE_CONTROL_NEVER) {
+        ca_assert(n_shared > 0);
+        n_shared--;
+    }
+
+    s->cached = FALSE;
+}
+
+static void set_cache_control_unlocked(ca_sample *s, ca_cache_control_t control) {
+
+    /* Entries may only be upgraded, from shared to volatile to
+     * permanent */
+    if (control == CA_CACHE_CONTROL_NEVER ||
+        s->cache_control == CA_CACHE_CONTROL_PERMANENT ||
+        s->cache_control == control)
+        return;
+
+    if (s->cached && s->cache_control == CA_CACHE_CONTROL_NEVER) {
+        ca_assert(n_shared > 0);
+        n_shared--;
+    }
+
+    s->cache_control = control;
+}
+
+static void make_room_unlocked(size_t nbytes) {
+    ca_sample *s, *prev;
+    unsigned pass;
+
+    /* Volatile entries go first, permanent ones only if that wasn't
+     * enough. Within each class we drop the least recently used
+     * first. Samples that are still being played are merely removed
+     * from the table and freed by the last ca_sample_unref(). */
+
+    for (pass = 0; pass < 2; pass++) {
+        ca_cache_control_t victim = pass == 0 ? CA_CACHE_CONTROL_VOLATILE : CA_CACHE_CONTROL_PERMANENT;
+
+        for (s = lru_tail; s && cache_size + nbytes > CACHE_SIZE_MAX; s = prev) {
+            prev = s->prev;
+
+            if (s->cache_control != victim)
+                continue;
+
+            unlink_unlocked(s);
+
+            if (s->ref <= 0)
+                sample_free(s);
+        }
+    }
+}
+
+ca_sample* ca_sample_ref(ca_sample *s) {
+    ca_assert(s);
+    ca_assert(mutex);
+
+    ca_mutex_lock(mutex);
+    ca_assert(s->ref >= 1);
+    s->ref++;
+    ca_mutex_unlock(mutex);
+
+    return s;
+}
+
+void ca_sample_unref(ca_sample *s) {
+    ca_bool_t dispose;
+
+    ca_assert(s);
+    ca_assert(mutex);
+
+    ca_mutex_lock(mutex);
+    ca_assert(s->ref >= 1);
+    s->ref--;
+
+    /* Shared entries go away with their last user */
+    if (s->ref <= 0 && s->cached && s->cache_control == CA_CACHE_CONTROL_NEVER)
+        unlink_unlocked(s);
+
+    dispose = s->ref <= 0 && !s->cached;
+    ca_mutex_unlock(mutex);
+
+    if (dispose)
+        sample_free(s);
+}
+
+size_t ca_sample_frame_size(ca_sample *s) {
+    ca_assert(s);
+
+    return s->nchannels * (s->type == CA_SAMPLE_U8 ? 1U : 2U);
+}
+
+static int decode_sample(ca_sample **_s, ca_sound_file *f) {
+    ca_sample *s;
+    const ca_channel_position_t *m;
+    off_t size;
+    size_t n, k, fs;
+    ca_usec_t start;
+    int ret;
+
+    ca_assert(_s);
+    ca_assert(f);
+
+    start = ca_trace_now();
+
+    size = ca_sound_file_get_size(f);
+
+    if (size <= 0 || size > SAMPLE_SIZE_MAX)
+        return CA_ERROR_TOOBIG;
+
+    if (!(s = ca_new0(ca_sample, 1)))
+        return CA_ERROR_OOM;
+
+    s->type = ca_sound_file_get_sample_type(f);
+    s->nchannels = ca_sound_file_get_nchannels(f);
+    s->rate = ca_sound_file_get_rate(f);
+
+    if ((m = ca_sound_file_get_channel_map(f)))
+        if (!(s->channel_map = ca_newdup(ca_channel_position_t, m, s->nchannels))) {
+            ret = CA_ERROR_OOM;
+            goto fail;
+        }
+
+    if (!(s->data = ca_malloc((size_t) size))) {
+        ret = CA_ERROR_OOM;
+        goto fail;
+    }
+
+    for (n = 0; n < (size_t) size; n += k) {
+        k = (size_t) size - n;
+
+        if ((ret = ca_sound_file_read_arbitrary(f, (uint8_t*) s->data + n, &k)) < 0)
+            goto fail;
+
+        if (k <= 0)
+            break;
+    }
+
+    /* Our size estimate is not necessarily exact for compressed
+     * files, so let's make sure we only keep complete frames */
+    fs = ca_sample_frame_size(s);
+    s->nbytes = (n / fs) * fs;
+
+    if (s->nbytes <= 0) {
+        ret = CA_ERROR_CORRUPT;
+        goto fail;
+    }
+
+    *_s = s;
+
+    ca_trace_stage(CA_TRACE_DECODE, start);
+
+    return CA_SUCCESS;
+
+fail:
+
+    sample_free(s);
+
+    return ret;
+}
+
+static ca_bool_t is_native(const ca_sample *s, const ca_sample_format *native) {
+    return
+        s->type == CA_SAMPLE_S16NE &&
+        s->rate == native->rate &&
+        s->nchannels == native->nchannels &&
+        !s->channel_map;
+}
+
+static int convert_sample(ca_sample *s, const ca_sample_format *native) {
+    void *data;
+    size_t nbytes;
+    int ret;
+
+    ca_assert(s);
+    ca_assert(native);
+    ca_assert(!s->map);
+
+    if (is_native(s, native))
+        return CA_SUCCESS;
+
+    if ((ret = ca_mix_convert(&data, &nbytes, native->rate, native->nchannels,
+                              s->data, s->nbytes, s->type, s->rate, s->nchannels, s->channel_map)) < 0)
+        return ret;
+
+    ca_free(s->data);
+    ca_free(s->channel_map);
+
+    s->data = data;
+    s->nbytes = nbytes;
+    s->type = CA_SAMPLE_S16NE;
+    s->rate = native->rate;
+    s->nchannels = native->nchannels;
+    s->channel_map = NULL;
+
+    return CA_SUCCESS;
+}
+
+/* Makes a converted copy of a sound that is cached unconverted */
+static int copy_sample(ca_sample **_s, const ca_sample *o, const ca_sample_format *native) {
+    ca_sample *s;
+    int ret;
+
+    ca_assert(_s);
+    ca_assert(o);
+    ca_assert(native);
+
+    if (!(s = ca_new0(ca_sample, 1)))
+        return CA_ERROR_OOM;
+
+    if ((ret = ca_mix_convert(&s->data, &s->nbytes, native->rate, native->nchannels,
+                              o->data, o->nbytes, o->type, o->rate, o->nchannels, o->channel_map)) < 0) {
+        ca_free(s);
+        return ret;
+    }
+
+    if (o->path && !(s->path = ca_strdup(o->path))) {
+        sample_free(s);
+        return CA_ERROR_OOM;
+    }
+
+    s->type = CA_SAMPLE_S16NE;
+    s->rate = native->rate;
+    s->nchannels = native->nchannels;
+
+    *_s = s;
+
+    return CA_SUCCESS;
+}
+
+/* Converted sounds are cached under the key of the sound followed by
+ * the format, so that contexts on different devices don't get in each
+ * other's way */
+static int append_format(char **key, size_t *klen, const ca_sample_format *native) {
+    char suffix[32], *k;
+    size_t l;
+
+    snprintf(suffix, sizeof(suffix), "%u/%u", native->rate, native->nchannels);
+    l = strlen(suffix) + 1;
+
+    if (!(k = ca_new(char, *klen + l)))
+        return CA_ERROR_OOM;
+
+    memcpy(k, *key, *klen);
+    memcpy(k + *klen, suffix, l);
+
+    ca_free(*key);
+    *key = k;
+    *klen += l;
+
+    return CA_SUCCESS;
+}
+
+static int get_cache_control(ca_cache_control_t *control, ca_proplist *sp) {
+    const char *ct;
+    int ret = CA_SUCCESS;
+
+    ca_proplist_lock(sp);
+
+    if ((ct = ca_proplist_gets_key_unlocked(sp, CA_PROP_KEY_CANBERRA_CACHE_CONTROL)))
+        if (ca_parse_cache_control(control, ct) < 0)
+            ret = CA_ERROR_INVALID;
+
+    ca_proplist_unlock(sp);
+
+    return ret;
+}
+
+static ca_bool_t get_shm(ca_proplist *cp) {
+    unsigned n;
+
+    if (ca_proplist_get_unsigned(cp, CA_PROP_CANBERRA_SHARED_CACHE, &n) < 0)
+        return FALSE;
+
+    return n > 0;
+}
+
+static int get_sample(
+        ca_sample **_s,
+        ca_sound_file **_f,
+        ca_theme_data **t,
+        ca_proplist *cp,
+        ca_proplist *sp,
+        ca_cache_control_t control,
+        const ca_sample_format *native) {
+
+    ca_sample *s = NULL, *o = NULL, *e;
+    ca_sound_file *f = NULL;
+    char *key = NULL, *path = NULL;
+    size_t klen, plain_klen;
+    unsigned hash;
+    ca_bool_t shm;
+    int ret;
+
+    if ((ret = allocate_mutex()) < 0)
+        return ret;
+
+    if ((ret = ca_lookup_sound_key(&key, &klen, cp, sp)) < 0)
+        return ret;
+
+    plain_klen = klen;
+
+    if (native && (ret = append_format(&key, &klen, native)) < 0)
+        goto finish;
+
+    hash = calc_hash(key, klen);
+
+    ca_mutex_lock(mutex);
+
+    if ((s = find_unlocked(key, klen, hash)) ||
+
+        /* Sounds shared by the context are cached without a format,
+         * since it doesn't know about the driver's. If one of those
+         * happens to be in our format already we take it as it is. */
+        (native &&
+         (o = find_unlocked(key, plain_klen, calc_hash(key, plain_klen))) &&
+         is_native(o, native))) {
+
+        if (!s) {
+            s = o;
+            o = NULL;
+        }
+
+        s->ref++;
+        set_cache_control_unlocked(s, control);
+
+        lru_remove_unlocked(s);
+        lru_prepend_unlocked(s);
+
+    } else if (o)
+        o->ref++;
+
+    ca_mutex_unlock(mutex);
+
+    if (s) {
+        *_s = s;
+        ret = CA_SUCCESS;
+        goto finish;
+    }
+
+    shm = get_shm(cp);
+
+    /* Otherwise we convert our own copy of it, rather than decoding
+     * the same sound another time */
+    if (o) {
+        ret = copy_sample(&s, o, native);
+
+        if (ret == CA_ERROR_NOTSUPPORTED) {
+            *_s = o;
+            o = NULL;
+            ret = CA_SUCCESS;
+            goto finish;
+        }
+
+        if (ret < 0)
+            goto finish;
+
+    /* Maybe another process decoded it for us already */
+    } else if (!shm || ca_sample_shm_lookup(&s, key, klen) < 0) {
+        ca_sample *m;
+
+        if ((ret = ca_lookup_sound(&f, &path, t, cp, sp)) < 0)
+            goto finish;
+
+        if ((ret = decode_sample(&s, f)) < 0) {
+
+            /* Too big for the cache, let the caller stream it instead */
+            if (ret == CA_ERROR_TOOBIG && _f) {
+                *_f = f;
+                f = NULL;
+                ret = CA_SUCCESS;
+            }
+
+            goto finish;
+        }
+
+        s->path = path;
+        path = NULL;
+
+        /* Paid once here rather than on every play. If we cannot
+         * convert it the driver has to cope with it as it is. */
+        if (native && (ret = convert_sample(s, native)) < 0) {
+
+            if (ret != CA_ERROR_NOTSUPPORTED) {
+                sample_free(s);
+                goto finish;
+            }
+
+            ret = CA_SUCCESS;
+        }
+
+        /* If we can share it we use the mapping ourselves, too, so
+         * that there's only one copy of the data. Failing to share it
+         * is fine, we play our own copy then. */
+        if (shm &&
+            ca_sample_shm_store(s, key, klen) >= 0 &&
+            ca_sample_shm_lookup(&m, key, klen) >= 0) {
+            sample_free(s);
+            s = m;
+        }
+    }
+
+    s->key = key;
+    s->klen = klen;
+    s->hash = hash;
+    s->cache_control = control;
+    s->ref = 1;
+    key = NULL;
+
+    ca_mutex_lock(mutex);
+
+    /* Somebody else might have decoded the same sound in the
+     * meantime, in which case we drop ours and use theirs */
+    if ((e = find_unlocked(s->key, s->klen, s->hash))) {
+        e->ref++;
+        set_cache_control_unlocked(e, control);
+
+        ca_mutex_unlock(mutex);
+
+        sample_free(s);
+        s = e;
+
+    } else {
+        make_room_unlocked(s->nbytes);
+
+        s->next_in_slot = sample_hashtable[hash % N_SLOTS];
+        sample_hashtable[hash % N_SLOTS] = s;
+        lru_prepend_unlocked(s);
+        cache_size += s->nbytes;
+        s->cached = TRUE;
+
+        if (control == CA_CACHE_CONTROL_NEVER)
+            n_shared++;
+
+        ca_mutex_unlock(mutex);
+    }
+
+    *_s = s;
+
+finish:
+
+    if (o)
+        ca_sample_unref(o);
+
+    if (f)
+        ca_sound_file_close(f);
+
+    ca_free(key);
+    ca_free(path);
+
+    return ret;
+}
+
+/* Only returns entries that are already in the cache */
+static int find_sample(ca_sample **_s, ca_proplist *cp, ca_proplist *sp) {
+    ca_sample *s;
+    char *key;
+    size_t klen;
+    int ret;
+
+    if ((ret = allocate_mutex()) < 0)
+        return ret;
+
+    if ((ret = ca_lookup_sound_key(&key, &klen, cp, sp)) < 0)
+        return ret;
+
+    ca_mutex_lock(mutex);
+
+    if ((s = find_unlocked(key, klen, calc_hash(key, klen)))) {
+        s->ref++;
+        ret = CA_SUCCESS;
+    } else
+        ret = CA_ERROR_NOTFOUND;
+
+    ca_mutex_unlock(mutex);
+
+    ca_free(key);
+
+    if (ret == CA_SUCCESS)
+        *_s = s;
+
+    return ret;
+}
+
+int ca_sample_cache_lookup_sound(
+        ca_sample **s,
+        ca_sound_file **f,
+        ca_theme_data **t,
+        ca_proplist *cp,
+        ca_proplist *sp,
+        const ca_sample_format *native) {
+
+    ca_cache_control_t control = CA_CACHE_CONTROL_NEVER;
+    int ret;
+
+    ca_return_val_if_fail(s, CA_ERROR_INVALID);
+    ca_return_val_if_fail(f, CA_ERROR_INVALID);
+    ca_return_val_if_fail(t, CA_ERROR_INVALID);
+    ca_return_val_if_fail(cp, CA_ERROR_INVALID);
+    ca_return_val_if_fail(sp, CA_ERROR_INVALID);
+
+    *s = NULL;
+    *f = NULL;
+
+    if ((ret = get_cache_control(&control, sp)) < 0)
+        return ret;
+
+    /* Same semantics as the PulseAudio sample cache: without a cache
+     * control property we don't touch the cache at all, unless
+     * somebody shared this very sound with us. */
+    if (control == CA_CACHE_CONTROL_NEVER) {
+        if (n_shared > 0 && find_sample(s, cp, sp) == CA_SUCCESS)
+            return CA_SUCCESS;
+
+        return ca_lookup_sound(f, NULL, t, cp, sp);
+    }
+
+    return get_sample(s, f, t, cp, sp, control, native);
+}
+
+int ca_sample_cache_store_sound(
+        ca_theme_data **t,
+        ca_proplist *cp,
+        ca_proplist *sp,
+        const ca_sample_format *native) {
+
+    ca_cache_control_t control = CA_CACHE_CONTROL_PERMANENT;
+    ca_sample *s;
+    int ret;
+
+    ca_return_val_if_fail(t, CA_ERROR_INVALID);
+    ca_return_val_if_fail(cp, CA_ERROR_INVALID);
+    ca_return_val_if_fail(sp, CA_ERROR_INVALID);
+
+    if ((ret = get_cache_control(&control, sp)) < 0)
+        return ret;
+
+    if (control != CA_CACHE_CONTROL_PERMANENT)
+        return CA_ERROR_INVALID;
+
+    if ((ret = get_sample(&s, NULL, t, cp, sp, control, native)) < 0)
+        return ret;
+
+    ca_sample_unref(s);
+
+    return CA_SUCCESS;
+}
+
+int ca_sample_cache_share_sound(
+        ca_sample **s,
+        ca_theme_data **t,
+        ca_proplist *cp,
+        ca_proplist *sp) {
+
+    ca_cache_control_t control = CA_CACHE_CONTROL_NEVER;
+    int ret;
+
+    ca_return_val_if_fail(s, CA_ERROR_INVALID);
+    ca_return_val_if_fail(t, CA_ERROR_INVALID);
+    ca_return_val_if_fail(cp, CA_ERROR_INVALID);
+    ca_return_val_if_fail(sp, CA_ERROR_INVALID);
+
+    *s = NULL;
+
+    if ((ret = get_cache_control(&control, sp)) < 0)
+        return ret;
+
+    /* Without a cache control property this creates a shared entry,
+     * which is dropped again with its last reference. Sounds too big
+     * for the cache are left to the drivers to stream themselves. */
+    return get_sample(s, NULL, t, cp, sp, control, NULL);
+}
+
+static void sample_file_free(void *userdata) {
+    ca_sample_unref(userdata);
+}
+
+int ca_sample_cache_open_file(ca_sound_file **f, ca_sample *s) {
+    int ret;
+
+    ca_return_val_if_fail(f, CA_ERROR_INVALID);
+    ca_return_val_if_fail(s, CA_ERROR_INVALID);
+
+    if ((ret = ca_sound_file_open_memory(f, s->data, s->nbytes, s->type, s->nchannels, s->rate, s->channel_map, sample_file_free, s)) < 0)
+        ca_sample_unref(s);
+
+    return ret;
+}
+
+int ca_sample_cache_lookup_file(
+        ca_sound_file **f,
+        char **sound_path,
+        ca_theme_data **t,
+        ca_proplist *cp,
+        ca_proplist *sp) {
+
+    ca_sample *s;
+    int ret;
+
+    ca_return_val_if_fail(f, CA_ERROR_INVALID);
+    ca_return_val_if_fail(t, CA_ERROR_INVALID);
+    ca_return_val_if_fail(cp, CA_ERROR_INVALID);
+    ca_return_val_if_fail(sp, CA_ERROR_INVALID);
+
+    if (n_shared <= 0 || find_sample(&s, cp, sp) < 0)
+        return ca_lookup_sound(f, sound_path, t, cp, sp);
+
+    if (sound_path && s->path)
+        if (!(*sound_path = ca_strdup(s->path))) {
+            ca_sample_unref(s);
+            return CA_ERROR_OOM;
+        }
+
+    if ((ret = ca_sample_cache_open_file(f, s)) < 0)
+        if (sound_path) {
+            ca_free(*sound_path);
+            *sound_path = NULL;
+        }
+
+    return ret;
+}
+
+#ifdef CA_GCC_DESTRUCTOR
+
+static void sample_cache_free(void) CA_GCC_DESTRUCTOR;
+
+static void sample_cache_free(void) {
+    ca_sample *s;
+
+    /* Only here to make this valgrind clean */
+    if (!mutex)
+        return;
+
+    while ((s = lru)) {
+        unlink_unlocked(s);
+
+        if (s->ref <= 0)
+            sample_free(s);
+    }
+
+    ca_mutex_free(mutex);
+    mutex = NULL;
+}
+
+#endif
@@ -0,0 +1,94 @@
+#ifndef foocanberrasamplecachehfoo
+#define foocanberrasamplecachehfoo
+
+/***
+  This file is part of libcanberra.
+
+  Copyright 2008 Lennart Poettering
+
+  libcanberra is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 2.1 of the
+  License, or (at your option) any later version.
+
+  libcanberra is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with libcanberra. If not, see
+  <http://www.gnu.org/licenses/>.
+***/
+
+#include "common.h"
+#include "llist.h"
+#include "read-sound-file.h"
+#include "sound-theme-spec.h"
+
+/* An in-process cache of fully decoded PCM data, for those drivers
+ * which have no server side sample cache of their own. */
+
+typedef struct ca_sample ca_sample;
+
+struct ca_sample {
+    /* Everything in this first block is protected by the cache mutex */
+    unsigned ref;
+    ca_bool_t cached;
+    char *key;
+    size_t klen;
+    unsigned hash;
+    /* CA_CACHE_CONTROL_NEVER for entries that are only shared */
+    ca_cache_control_t cache_control;
+    ca_sample *next_in_slot;
+    CA_LLIST_FIELDS(ca_sample);
+
+    /* Everything below is immutable after creation */
+    ca_sample_type_t type;
+    unsigned nchannels;
+    unsigned rate;
+    ca_channel_position_t *channel_map;
+    char *path;
+
+    void *data;
+    size_t nbytes;
+
+    /* If set, data points into this read only mapping of a file that
+     * is shared with other processes, see sample-shm.h */
+    void *map;
+    size_t map_size;
+};
+
+/* What a driver wants cached sounds converted to when they are
+ * decoded, so that it can keep the device in one configuration. The
+ * sample type is always CA_SAMPLE_S16NE. */
+typedef struct ca_sample_format {
+    unsigned rate;
+    unsigned nchannels;
+} ca_sample_format;
+
+/* If native is not NULL, sounds are converted when they enter the
+ * cache, and cached separately from the unconverted ones. Sounds that
+ * are streamed from the file are left alone. */
+int ca_sample_cache_lookup_sound(ca_sample **s, ca_sound_file **f, ca_theme_data **t, ca_proplist *cp, ca_proplist *sp, const ca_sample_format *native);
+int ca_sample_cache_store_sound(ca_theme_data **t, ca_proplist *cp, ca_proplist *sp, const ca_sample_format *native);
+
+/* Looks up and decodes a sound once so that others can use it too.
+ * Without a cache control property the cache only keeps the sound
+ * for as long as somebody holds a reference to it. */
+int ca_sample_cache_share_sound(ca_sample **s, ca_theme_data **t, ca_proplist *cp, ca_proplist *sp);
+
+/* Like ca_lookup_sound(), but returns a shared decoded sound as an in
+ * memory sound file if there is one */
+int ca_sample_cache_lookup_file(ca_sound_file **f, char **sound_path, ca_theme_data **t, ca_proplist *cp, ca_proplist *sp);
+
+/* Turns a decoded sound into an in memory sound file. Takes over the
+ * reference passed in, even on failure. */
+int ca_sample_cache_open_file(ca_sound_file **f, ca_sample *s);
+
+ca_sample* ca_sample_ref(ca_sample *s);
+void ca_sample_unref(ca_sample *s);
+
+size_t ca_sample_frame_size(ca_sample *s);
+
+#endif
@@ -0,0 +1,543 @@
+/***
+  This file is part of libcanberra.
+
+  Copyright 2008 Lennart Poettering
+
+  libcanberra is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 2.1 of the
+  License, or (at your option) any later version.
+
+  libcanberra is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with libcanberra. If not, see
+  <http://www.gnu.org/licenses/>.
+***/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "canberra.h"
+#include "malloc.h"
+#include "macro.h"
+#include "sample-shm.h"
+#include "sound-theme-spec.h"
+
+#define MAGIC "CASAMPL1"
+#define DIRNAME "libcanberra-samples"
+
+/* Decoded sounds are at most 1 MiB, see sample-cache.c, but they
+ * may grow quite a bit when converted to the native format of the
+ * device. Anything bigger than this is not one of our files. */
+#define SEGMENT_SIZE_MAX ((off_t) (16U*1024U*1024U))
+
+/* Once the files take more than this much space the least recently
+ * used ones are removed. Files nobody used for a day are removed in
+ * any case, and so are temporary files somebody failed to finish. */
+#define SEGMENTS_SIZE_MAX ((uint64_t) (32U*1024U*1024U))
+#define SEGMENT_AGE_MAX (24*60*60)
+#define TMP_AGE_MAX 60
+
+struct header {
+    char magic[8];
+    uint32_t timestamp; /* compared with the last change to the sound theme dirs */
+    uint32_t klen;
+    uint32_t plen; /* including the trailing NUL, 0 without path */
+    uint32_t type;
+    uint32_t nchannels;
+    uint32_t has_channel_map;
+    uint32_t rate;
+    uint32_t data_offset;
+    uint64_t nbytes;
+    int64_t source_mtime;
+    uint64_t source_size;
+    /* Followed by the key, the channel map as 32bit values, the path
+     * and then the PCM data, padded to 16 bytes */
+};
+
+#define DATA_OFFSET(klen, nchannels, plen) ((sizeof(struct header) + (klen) + (nchannels) * sizeof(uint32_t) + (plen) + 15) & ~((size_t) 15))
+
+struct segment {
+    char *name;
+    time_t used;
+    off_t size;
+};
+
+static int get_dir(char **dir) {
+    const char *e;
+
+    /* Without a runtime dir we have no place that is private to
+     * this user and doesn't outlive the session */
+    if (!(e = getenv("XDG_RUNTIME_DIR")) || *e != '/')
+        return CA_ERROR_NOTSUPPORTED;
+
+    if (!(*dir = ca_sprintf_malloc("%s/" DIRNAME, e)))
+        return CA_ERROR_OOM;
+
+    return CA_SUCCESS;
+}
+
+static int get_path(char **path, const char *dir, const char *key, size_t klen) {
+    uint64_t hash = UINT64_C(14695981039346656037);
+
+    /* FNV-1a, the key contains embedded NUL bytes. Collisions are
+     * caught by comparing the key stored in the file. */
+    for (; klen > 0; key++, klen--) {
+        hash ^= (uint8_t) *key;
+        hash *= UINT64_C(1099511628211);
+    }
+
+    if (!(*path = ca_sprintf_malloc("%s/%016" PRIx64, dir, hash)))
+        return CA_ERROR_OOM;
+
+    return CA_SUCCESS;
+}
+
+static ca_bool_t segment_valid(const uint8_t *d, size_t size, const char *key, size_t klen) {
+    const struct header *h = (const struct header*) d;
+    size_t channel_map_size;
+
+    if (size < sizeof(struct header) ||
+        memcmp(h->magic, MAGIC, sizeof(h->magic)) != 0)
+        return FALSE;
+
+    if (h->type != CA_SAMPLE_S16NE &&
+        h->type != CA_SAMPLE_S16RE &&
+        h->type != CA_SAMPLE_U8)
+        return FALSE;
+
+    if (h->nchannels <= 0 || h->nchannels > _CA_CHANNEL_POSITION_MAX)
+        return FALSE;
+
+    channel_map_size = h->has_channel_map ? h->nchannels * sizeof(uint32_t) : 0;
+
+    if (h->klen != klen ||
+        h->data_offset != DATA_OFFSET(h->klen, h->has_channel_map ? h->nchannels : 0, h->plen) ||
+        h->data_offset > size ||
+        h->nbytes != size - h->data_offset ||
+        h->nbytes <= 0 ||
+        h->nbytes % (h->nchannels * (h->type == CA_SAMPLE_U8 ? 1U : 2U)) != 0)
+        return FALSE;
+
+    if (memcmp(d + sizeof(struct header), key, klen) != 0)
+        return FALSE;
+
+    if (h->plen > 0 && d[sizeof(struct header) + klen + channel_map_size + h->plen - 1] != 0)
+        return FALSE;
+
+    return TRUE;
+}
+
+static ca_bool_t segment_outdated(const uint8_t *d, const char **path) {
+    const struct header *h = (const struct header*) d;
+    time_t last_change, now;
+    struct stat st;
+
+    if (ca_get_last_change(&last_change) < 0)
+        return TRUE;
+
+    ca_assert_se(time(&now) != (time_t) -1);
+
+    /* Same rules as for the lookup cache in cache.c. Also, check for
+     * clock skews */
+    if ((time_t) h->timestamp < last_change || (time_t) h->timestamp > now)
+        return TRUE;
+
+    *path = NULL;
+
+    if (h->plen <= 0)
+        return FALSE;
+
+    *path = (const char*) d + sizeof(struct header) + h->klen + (h->has_channel_map ? h->nchannels * sizeof(uint32_t) : 0);
+
+    /* Sounds played by file name are not covered by the theme dirs,
+     * hence let's make sure the file is still the same */
+    if (stat(*path, &st) < 0 ||
+        (int64_t) st.st_mtime != h->source_mtime ||
+        (uint64_t) st.st_size != h->source_size)
+        return TRUE;
+
+    return FALSE;
+}
+
+int ca_sample_shm_lookup(ca_sample **_s, const char *key, size_t klen) {
+    char *dir = NULL, *fn = NULL;
+    const struct header *h;
+    const char *path;
+    ca_sample *s = NULL;
+    uint8_t *d = NULL;
+    size_t size = 0;
+    struct stat st;
+    int fd = -1, ret;
+
+    ca_return_val_if_fail(_s, CA_ERROR_INVALID);
+    ca_return_val_if_fail(key, CA_ERROR_INVALID);
+
+    if ((ret = get_dir(&dir)) < 0)
+        return ret;
+
+    if ((ret = get_path(&fn, dir, key, klen)) < 0)
+        goto finish;
+
+    if ((fd = open(fn, O_RDONLY|O_NOCTTY
+#ifdef O_CLOEXEC
+                   | O_CLOEXEC
+#endif
+             )) < 0) {
+        ret = errno == ENOENT ? CA_ERROR_NOTFOUND : CA_ERROR_SYSTEM;
+        goto finish;
+    }
+
+    if (fstat(fd, &st) < 0) {
+        ret = CA_ERROR_SYSTEM;
+        goto finish;
+    }
+
+    if (!S_ISREG(st.st_mode) || st.st_size <= 0 || st.st_size > SEGMENT_SIZE_MAX)
+        goto outdated;
+
+    size = (size_t) st.st_size;
+
+    if ((d = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        d = NULL;
+        ret = CA_ERROR_SYSTEM;
+        goto finish;
+    }
+
+    if (!segment_valid(d, size, key, klen)) {
+
+        /* Most likely one for a different key with the same hash,
+         * which we have to leave alone */
+        ret = CA_ERROR_NOTFOUND;
+        goto finish;
+    }
+
+    if (segment_outdated(d, &path))
+        goto outdated;
+
+    h = (const struct header*) d;
+
+    if (!(s = ca_new0(ca_sample, 1))) {
+        ret = CA_ERROR_OOM;
+        goto finish;
+    }
+
+    s->type = (ca_sample_type_t) h->type;
+    s->nchannels = h->nchannels;
+    s->rate = h->rate;
+
+    if (h->has_channel_map) {
+        const uint32_t *m = (const uint32_t*) (d + sizeof(struct header) + h->klen);
+        unsigned c;
+
+        if (!(s->channel_map = ca_new(ca_channel_position_t, s->nchannels))) {
+            ret = CA_ERROR_OOM;
+            goto finish;
+        }
+
+        for (c = 0; c < s->nchannels; c++) {
+            uint32_t p;
+
+            /* Not necessarily aligned */
+            memcpy(&p, m + c, sizeof(p));
+            s->channel_map[c] = p < _CA_CHANNEL_POSITION_MAX ? (ca_channel_position_t) p : CA_CHANNEL_MONO;
+        }
+    }
+
+    if (path)
+        if (!(s->path = ca_strdup(path))) {
+            ret = CA_ERROR_OOM;
+            goto finish;
+        }
+
+    s->data = d + h->data_offset;
+    s->nbytes = (size_t) h->nbytes;
+    s->map = d;
+    s->map_size = size;
+
+    /* The modification time tells collect_garbage() when this was
+     * used last. Failing is fine, then it goes a bit earlier. */
+    futimens(fd, NULL);
+
+    *_s = s;
+    s = NULL;
+    d = NULL;
+    ret = CA_SUCCESS;
+    goto finish;
+
+outdated:
+
+    /* Whoever has mapped it can keep using it */
+    unlink(fn);
+    ret = CA_ERROR_NOTFOUND;
+
+finish:
+
+    if (s) {
+        ca_free(s->channel_map);
+        ca_free(s->path);
+        ca_free(s);
+    }
+
+    if (d)
+        munmap(d, size);
+
+    if (fd >= 0)
+        close(fd);
+
+    ca_free(fn);
+    ca_free(dir);
+
+    return ret;
+}
+
+static int write_all(int fd, const void *d, size_t l) {
+    const uint8_t *p = d;
+
+    while (l > 0) {
+        ssize_t r;
+
+        if ((r = write(fd, p, l)) < 0) {
+            if (errno == EINTR)
+                continue;
+
+            return CA_ERROR_SYSTEM;
+        }
+
+        p += r;
+        l -= (size_t) r;
+    }
+
+    return CA_SUCCESS;
+}
+
+static int compare_used(const void *a, const void *b) {
+    const struct segment *x = a, *y = b;
+
+    return x->used < y->used ? -1 : (x->used > y->used ? 1 : 0);
+}
+
+static void collect_garbage(const char *dir, size_t nbytes) {
+    struct segment *segments = NULL;
+    unsigned n = 0, n_allocated = 0, i;
+    uint64_t total = nbytes;
+    struct dirent *de;
+    time_t now;
+    DIR *d;
+
+    if (!(d = opendir(dir)))
+        return;
+
+    ca_assert_se(time(&now) != (time_t) -1);
+
+    while ((de = readdir(d))) {
+        struct stat st;
+
+        if (de->d_name[0] == '.')
+            continue;
+
+        if (fstatat(dirfd(d), de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0 ||
+            !S_ISREG(st.st_mode))
+            continue;
+
+        /* Temporary files have a suffix, they are left alone while
+         * somebody might still be writing them */
+        if (strchr(de->d_name, '.')) {
+            if (st.st_mtime + TMP_AGE_MAX < now)
+                unlinkat(dirfd(d), de->d_name, 0);
+
+            continue;
+        }
+
+        if (st.st_mtime + SEGMENT_AGE_MAX < now) {
+            unlinkat(dirfd(d), de->d_name, 0);
+            continue;
+        }
+
+        total += (uint64_t) st.st_size;
+
+        if (n >= n_allocated) {
+            struct segment *k;
+
+            n_allocated = n_allocated > 0 ? n_allocated * 2 : 16;
+
+            if (!(k = ca_realloc(segments, sizeof(struct segment) * n_allocated)))
+                goto finish;
+
+            segments = k;
+        }
+
+        if (!(segments[n].name = ca_strdup(de->d_name)))
+            goto finish;
+
+        segments[n].used = st.st_mtime;
+        segments[n].size = st.st_size;
+        n++;
+    }
+
+    if (total <= SEGMENTS_SIZE_MAX)
+        goto finish;
+
+    qsort(segments, n, sizeof(struct segment), compare_used);
+
+    for (i = 0; i < n && total > SEGMENTS_SIZE_MAX; i++)
+        if (unlinkat(dirfd(d), segments[i].name, 0) >= 0)
+            total -= (uint64_t) segments[i].size;
+
+finish:
+
+    for (i = 0; i < n; i++)
+        ca_free(segments[i].name);
+
+    ca_free(segments);
+    closedir(d);
+}
+
+int ca_sample_shm_store(ca_sample *s, const char *key, size_t klen) {
+    char *dir = NULL, *fn = NULL, *tmp = NULL;
+    struct header *h;
+    uint8_t *b = NULL, *p;
+    size_t offset, plen;
+    struct stat st;
+    time_t now;
+    int fd = -1, ret;
+
+    ca_return_val_if_fail(s, CA_ERROR_INVALID);
+    ca_return_val_if_fail(key, CA_ERROR_INVALID);
+    ca_return_val_if_fail(s->data, CA_ERROR_INVALID);
+
+    if ((ret = get_dir(&dir)) < 0)
+        return ret;
+
+    /* Not recursively, the runtime dir is there already */
+    if (mkdir(dir, 0700) < 0 && errno != EEXIST) {
+        ret = CA_ERROR_SYSTEM;
+        goto finish;
+    }
+
+    if ((ret = get_path(&fn, dir, key, klen)) < 0)
+        goto finish;
+
+    plen = s->path ? strlen(s->path) + 1 : 0;
+    offset = DATA_OFFSET(klen, s->channel_map ? s->nchannels : 0, plen);
+
+    if (!(b = ca_new0(uint8_t, offset))) {
+        ret = CA_ERROR_OOM;
+        goto finish;
+    }
+
+    h = (struct header*) b;
+    memcpy(h->magic, MAGIC, sizeof(h->magic));
+    h->klen = (uint32_t) klen;
+    h->plen = (uint32_t) plen;
+    h->type = (uint32_t) s->type;
+    h->nchannels = s->nchannels;
+    h->has_channel_map = !!s->channel_map;
+    h->rate = s->rate;
+    h->data_offset = (uint32_t) offset;
+    h->nbytes = (uint64_t) s->nbytes;
+
+    if (s->path) {
+
+        /* If we cannot tell whether the file changes later on we
+         * rather don't share it at all */
+        if (stat(s->path, &st) < 0) {
+            ret = CA_ERROR_NOTFOUND;
+            goto finish;
+        }
+
+        h->source_mtime = (int64_t) st.st_mtime;
+        h->source_size = (uint64_t) st.st_size;
+    }
+
+    p = b + sizeof(struct header);
+    memcpy(p, key, klen);
+    p += klen;
+
+    if (s->channel_map) {
+        unsigned c;
+
+        for (c = 0; c < s->nchannels; c++) {
+            uint32_t m = (uint32_t) s->channel_map[c];
+
+            memcpy(p, &m, sizeof(m));
+            p += sizeof(m);
+        }
+    }
+
+    if (s->path)
+        memcpy(p, s->path, plen);
+
+    ca_assert_se(time(&now) != (time_t) -1);
+    h->timestamp = (uint32_t) now;
+
+    /* Make room first, so that we don't remove our own file right
+     * away */
+    collect_garbage(dir, offset + s->nbytes);
+
+    if (!(tmp = ca_sprintf_malloc("%s.XXXXXX", fn))) {
+        ret = CA_ERROR_OOM;
+        goto finish;
+    }
+
+    if ((fd = mkstemp(tmp)) < 0) {
+        ret = CA_ERROR_SYSTEM;
+        goto finish;
+    }
+
+    if ((ret = write_all(fd, b, offset)) >= 0 &&
+        (ret = write_all(fd, s->data, s->nbytes)) >= 0 &&
+        fchmod(fd, 0400) < 0)
+        ret = CA_ERROR_SYSTEM;
+
+    /* Closed in any case, so that a full runtime dir doesn't make us
+     * leak a descriptor on every store */
+    if (close(fd) < 0 && ret >= 0)
+        ret = CA_ERROR_SYSTEM;
+
+    fd = -1;
+
+    if (ret < 0) {
+        unlink(tmp);
+        goto finish;
+    }
+
+    /* Whoever mapped the file we replace can keep using it */
+    if (rename(tmp, fn) < 0) {
+        ret = CA_ERROR_SYSTEM;
+        unlink(tmp);
+        goto finish;
+    }
+
+    ret = CA_SUCCESS;
+
+finish:
+
+    if (fd >= 0)
+        close(fd);
+
+    ca_free(b);
+    ca_free(tmp);
+    ca_free(fn);
+    ca_free(dir);
+
+    return ret;
+}
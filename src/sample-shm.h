@@ -0,0 +1,41 @@
+#ifndef foocanberrasampleshmhfoo
+#define foocanberrasampleshmhfoo
+
+/***
+  This file is part of libcanberra.
+
+  Copyright 2008 Lennart Poettering
+
+  libcanberra is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 2.1 of the
+  License, or (at your option) any later version.
+
+  libcanberra is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with libcanberra. If not, see
+  <http://www.gnu.org/licenses/>.
+***/
+
+#include "sample-cache.h"
+
+/* Decoded sounds shared between the processes of a session, in files
+ * below $XDG_RUNTIME_DIR that are mapped read only. The files are
+ * named after the same keys the in-process sample cache uses. Unlinking
+ * a file doesn't affect those who have mapped it already, hence
+ * outdated or unused files are simply removed by whoever stores the
+ * next one. */
+
+/* On success *s is a new sample with a reference count of 0 whose
+ * data points into the mapping, the caller has to fill in the key. */
+int ca_sample_shm_lookup(ca_sample **s, const char *key, size_t klen);
+
+/* Writes a decoded sample out so that others can map it. Fails with
+ * CA_ERROR_NOTSUPPORTED if there is no runtime dir. */
+int ca_sample_shm_store(ca_sample *s, const char *key, size_t klen);
+
+#endif
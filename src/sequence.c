@@ -0,0 +1,315 @@
+/***
+  This file is part of libcanberra.
+
+  Copyright 2008 Lennart Poettering
+
+  libcanberra is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 2.1 of the
+  License, or (at your option) any later version.
+
+  libcanberra is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with libcanberra. If not, see
+  <http://www.gnu.org/licenses/>.
+***/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+
+#include "canberra.h"
+#include "malloc.h"
+#include "macro.h"
+#include "proplist.h"
+#include "sequence.h"
+
+struct ca_sequence {
+    ca_sound_file **files;
+    unsigned n_files;
+    unsigned current;
+
+    /* 0 means forever */
+    unsigned loop_count;
+    unsigned loop;
+};
+
+/* The properties of the event sound that also apply to the lookup of
+ * the rest of the sequence */
+static const char * const inherited_keys[] = {
+    CA_PROP_MEDIA_LANGUAGE,
+    CA_PROP_APPLICATION_LANGUAGE,
+    CA_PROP_CANBERRA_XDG_THEME_NAME,
+    CA_PROP_CANBERRA_XDG_THEME_OUTPUT_PROFILE,
+    CA_PROP_CANBERRA_CACHE_CONTROL
+};
+
+ca_bool_t ca_sequence_wanted(ca_proplist *sp) {
+    ca_return_val_if_fail(sp, FALSE);
+
+    return
+        ca_proplist_contains_key(sp, CA_PROP_KEY_CANBERRA_LOOP_COUNT) ||
+        ca_proplist_contains_key(sp, CA_PROP_KEY_CANBERRA_SEQUENCE);
+}
+
+static int segment_proplist(ca_proplist **_p, ca_proplist *sp, const char *id) {
+    ca_proplist *p;
+    unsigned i;
+    int ret;
+
+    if ((ret = ca_proplist_create(&p)) < 0)
+        return ret;
+
+    if ((ret = ca_proplist_sets(p, CA_PROP_EVENT_ID, id)) < 0)
+        goto fail;
+
+    ca_proplist_lock(sp);
+
+    for (i = 0; i < CA_ELEMENTSOF(inherited_keys); i++) {
+        const char *v;
+
+        if (!(v = ca_proplist_gets_unlocked(sp, inherited_keys[i])))
+            continue;
+
+        if ((ret = ca_proplist_sets(p, inherited_keys[i], v)) < 0)
+            break;
+    }
+
+    ca_proplist_unlock(sp);
+
+    if (ret < 0)
+        goto fail;
+
+    *_p = p;
+    return CA_SUCCESS;
+
+fail:
+    ca_proplist_destroy(p);
+    return ret;
+}
+
+static int lookup_segment(ca_sound_file **_f, ca_theme_data **t, ca_proplist *cp, ca_proplist *sp, const ca_sample_format *native, const char *id) {
+    ca_proplist *p;
+    ca_sample *s = NULL;
+    ca_sound_file *f = NULL;
+    int ret;
+
+    if ((ret = segment_proplist(&p, sp, id)) < 0)
+        return ret;
+
+    ret = ca_sample_cache_lookup_sound(&s, &f, t, cp, p, native);
+    ca_proplist_destroy(p);
+
+    if (ret < 0)
+        return ret;
+
+    if (s && (ret = ca_sample_cache_open_file(&f, s)) < 0)
+        return ret;
+
+    *_f = f;
+    return CA_SUCCESS;
+}
+
+static ca_bool_t same_format(ca_sound_file *a, ca_sound_file *b) {
+    return
+        ca_sound_file_get_sample_type(a) == ca_sound_file_get_sample_type(b) &&
+        ca_sound_file_get_rate(a) == ca_sound_file_get_rate(b) &&
+        ca_sound_file_get_nchannels(a) == ca_sound_file_get_nchannels(b);
+}
+
+static int add_file(ca_sequence *q, ca_sound_file *f) {
+    ca_sound_file **n;
+
+    /* Empty sounds would make us loop forever without playing
+     * anything */
+    if (ca_sound_file_get_size(f) <= 0)
+        return CA_ERROR_CORRUPT;
+
+    if (q->n_files > 0 && !same_format(q->files[0], f))
+        return CA_ERROR_NOTSUPPORTED;
+
+    if (!(n = ca_new(ca_sound_file*, q->n_files + 1)))
+        return CA_ERROR_OOM;
+
+    if (q->n_files > 0)
+        memcpy(n, q->files, sizeof(ca_sound_file*) * q->n_files);
+
+    ca_free(q->files);
+    q->files = n;
+    q->files[q->n_files++] = f;
+
+    return CA_SUCCESS;
+}
+
+static int add_segments(ca_sequence *q, ca_theme_data **t, ca_proplist *cp, ca_proplist *sp, const ca_sample_format *native) {
+    const char *e;
+    char *list;
+    int ret = CA_SUCCESS;
+
+    ca_proplist_lock(sp);
+
+    if ((e = ca_proplist_gets_key_unlocked(sp, CA_PROP_KEY_CANBERRA_SEQUENCE)))
+        list = ca_strdup(e);
+    else
+        list = NULL;
+
+    ca_proplist_unlock(sp);
+
+    if (!e)
+        return CA_SUCCESS;
+
+    if (!list)
+        return CA_ERROR_OOM;
+
+    for (e = list; *e;) {
+        ca_sound_file *f = NULL;
+        size_t k;
+        char *id;
+
+        e += strspn(e, ", \t");
+        k = strcspn(e, ", \t");
+
+        if (k <= 0)
+            continue;
+
+        if (!(id = ca_strndup(e, k))) {
+            ret = CA_ERROR_OOM;
+            break;
+        }
+
+        e += k;
+
+        ret = lookup_segment(&f, t, cp, sp, native, id);
+        ca_free(id);
+
+        if (ret < 0)
+            break;
+
+        if ((ret = add_file(q, f)) < 0) {
+            ca_sound_file_close(f);
+            break;
+        }
+    }
+
+    ca_free(list);
+
+    return ret;
+}
+
+int ca_sequence_new(
+        ca_sequence **_q,
+        ca_sample **s,
+        ca_sound_file **f,
+        ca_theme_data **t,
+        ca_proplist *cp,
+        ca_proplist *sp,
+        const ca_sample_format *native) {
+
+    ca_sequence *q;
+    ca_sound_file *first = NULL;
+    int ret;
+
+    ca_return_val_if_fail(_q, CA_ERROR_INVALID);
+    ca_return_val_if_fail(s, CA_ERROR_INVALID);
+    ca_return_val_if_fail(f, CA_ERROR_INVALID);
+    ca_return_val_if_fail(*s || *f, CA_ERROR_INVALID);
+    ca_return_val_if_fail(t, CA_ERROR_INVALID);
+    ca_return_val_if_fail(cp, CA_ERROR_INVALID);
+    ca_return_val_if_fail(sp, CA_ERROR_INVALID);
+
+    *_q = NULL;
+
+    if (!ca_sequence_wanted(sp))
+        return CA_SUCCESS;
+
+    if (!(q = ca_new0(ca_sequence, 1)))
+        return CA_ERROR_OOM;
+
+    q->loop_count = 1;
+
+    if ((ret = ca_proplist_get_unsigned(sp, CA_PROP_CANBERRA_LOOP_COUNT, &q->loop_count)) < 0 &&
+        ret != CA_ERROR_NOTFOUND)
+        goto fail;
+
+    /* Decoded sounds are played from memory like any other file */
+    if (*s) {
+        ret = ca_sample_cache_open_file(&first, *s);
+        *s = NULL;
+
+        if (ret < 0)
+            goto fail;
+    } else
+        first = *f;
+
+    if ((ret = add_file(q, first)) < 0) {
+        if (first != *f)
+            ca_sound_file_close(first);
+        goto fail;
+    }
+
+    /* The sequence owns the file from here on */
+    *f = first;
+
+    if ((ret = add_segments(q, t, cp, sp, native)) < 0) {
+        unsigned i;
+
+        /* Leave the first file to the caller again */
+        for (i = 1; i < q->n_files; i++)
+            ca_sound_file_close(q->files[i]);
+
+        q->n_files = 0;
+        goto fail;
+    }
+
+    *_q = q;
+
+    return CA_SUCCESS;
+
+fail:
+    ca_sequence_free(q);
+    return ret;
+}
+
+void ca_sequence_free(ca_sequence *q) {
+    unsigned i;
+
+    ca_return_if_fail(q);
+
+    for (i = 0; i < q->n_files; i++)
+        ca_sound_file_close(q->files[i]);
+
+    ca_free(q->files);
+    ca_free(q);
+}
+
+int ca_sequence_next(ca_sequence *q, ca_sound_file **f) {
+    int ret;
+
+    ca_return_val_if_fail(f, CA_ERROR_INVALID);
+
+    if (!q)
+        return CA_ERROR_NOTFOUND;
+
+    if (q->current + 1 >= q->n_files) {
+
+        if (q->loop_count > 0 && q->loop + 1 >= q->loop_count)
+            return CA_ERROR_NOTFOUND;
+
+        q->loop++;
+        q->current = 0;
+    } else
+        q->current++;
+
+    if ((ret = ca_sound_file_rewind(q->files[q->current])) < 0)
+        return ret;
+
+    *f = q->files[q->current];
+
+    return CA_SUCCESS;
+}
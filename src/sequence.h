@@ -0,0 +1,53 @@
+#ifndef foocanberrasequencehfoo
+#define foocanberrasequencehfoo
+
+/***
+  This file is part of libcanberra.
+
+  Copyright 2008 Lennart Poettering
+
+  libcanberra is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 2.1 of the
+  License, or (at your option) any later version.
+
+  libcanberra is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with libcanberra. If not, see
+  <http://www.gnu.org/licenses/>.
+***/
+
+#include "canberra.h"
+#include "read-sound-file.h"
+#include "sample-cache.h"
+#include "sound-theme-spec.h"
+
+/* Implements canberra.loop-count and canberra.sequence for the
+ * drivers that stream sounds themselves. A sequence is the list of
+ * sound files to play one after the other, the drivers just ask it
+ * for the next one whenever they hit the end of the current one. */
+
+typedef struct ca_sequence ca_sequence;
+
+/* Returns TRUE if the sound is to be played as a sequence */
+ca_bool_t ca_sequence_wanted(ca_proplist *sp);
+
+/* Takes the sound just looked up for sp, either decoded in *s or as
+ * file in *f, and looks up the rest of the sequence. If sp doesn't
+ * ask for a sequence this does nothing and sets *q to NULL.
+ * Otherwise the sequence takes over the sound, *s is set to NULL and
+ * *f to the first file of the sequence, which is freed with it. The
+ * segments need to be looked up with the same native format as the
+ * first sound, see ca_sample_cache_lookup_sound(). */
+int ca_sequence_new(ca_sequence **q, ca_sample **s, ca_sound_file **f, ca_theme_data **t, ca_proplist *cp, ca_proplist *sp, const ca_sample_format *native);
+void ca_sequence_free(ca_sequence *q);
+
+/* Rewinds and returns the file to play next. Returns
+ * CA_ERROR_NOTFOUND when the sequence is over, or if q is NULL. */
+int ca_sequence_next(ca_sequence *q, ca_sound_file **f);
+
+#endif
@@ -22,7 +22,12 @@
 #include <config.h>
 #endif
 
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <dirent.h>
 #include <errno.h>
+#include <pthread.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <locale.h>
@@ -31,13 +36,19 @@
 #include "malloc.h"
 #include "llist.h"
 #include "cache.h"
+#include "theme-watch.h"
+#include "trace.h"
 
 #define DEFAULT_THEME "freedesktop"
 #define FALLBACK_THEME "freedesktop"
 #define DEFAULT_OUTPUT_PROFILE "stereo"
 #define N_THEME_DIR_MAX 8
+#define N_DIR_INDEX 31
+#define UPDATE_INTERVAL 10
 
 typedef struct ca_data_dir ca_data_dir;
+typedef struct ca_dir_entry ca_dir_entry;
+typedef struct ca_dir_index ca_dir_index;
 
 struct ca_data_dir {
     CA_LLIST_FIELDS(ca_data_dir);
@@ -47,7 +58,43 @@ struct ca_data_dir {
     char *output_profile;
 };
 
+struct ca_dir_entry {
+    ca_dir_entry *next_in_slot;
+    unsigned hash;
+    char *name;
+};
+
+/* The names of all files in one directory we looked for sounds in, so
+ * that we can tell a miss without trying to open the file. */
+struct ca_dir_index {
+    ca_dir_index *next_in_slot;
+    char *path;
+    unsigned hash;
+
+    ca_bool_t loaded;
+    time_t mtime; /* 0 if the directory doesn't exist */
+    time_t checked;
+
+    ca_dir_entry **entries;
+    unsigned n_entries;
+};
+
+/* What the sound dirs looked like when a theme was loaded */
+typedef struct ca_theme_stamp {
+    ca_bool_t watched;
+    unsigned generation;
+    time_t last_change;
+} ca_theme_stamp;
+
+/* Parsed themes are shared between all contexts of the process, and
+ * apart from the directory index never change after loading. If the
+ * sound dirs changed, the next lookup loads a fresh copy, and the old
+ * one goes away once no context uses it anymore. */
 struct ca_theme_data {
+    CA_LLIST_FIELDS(ca_theme_data);
+    unsigned ref;
+    ca_theme_stamp stamp;
+
     char *name;
 
     CA_LLIST_HEAD(ca_data_dir, data_dirs);
@@ -55,8 +102,59 @@ struct ca_theme_data {
 
     unsigned n_theme_dir;
     ca_bool_t loaded_fallback_theme;
+
+    /* Protects the directory index */
+    ca_mutex *mutex;
+    ca_dir_index *dir_index[N_DIR_INDEX];
+    time_t dir_index_last_change;
+    unsigned dir_index_generation;
 };
 
+/* This part is not portable due to pthread_once usage, should be abstracted
+ * when we port this to platforms that do not have POSIX threading */
+
+static ca_mutex *last_change_mutex = NULL;
+
+/* Protects the list of loaded themes and their reference counters */
+static ca_mutex *theme_mutex = NULL;
+static CA_LLIST_HEAD(ca_theme_data, themes) = NULL;
+
+static void allocate_mutex_once(void) {
+    last_change_mutex = ca_mutex_new();
+    theme_mutex = ca_mutex_new();
+}
+
+static int allocate_mutex(void) {
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+    if (pthread_once(&once, allocate_mutex_once) != 0)
+        return CA_ERROR_OOM;
+
+    if (!last_change_mutex || !theme_mutex)
+        return CA_ERROR_OOM;
+
+    return 0;
+}
+
+#ifdef CA_GCC_DESTRUCTOR
+
+static void free_mutex(void) CA_GCC_DESTRUCTOR;
+
+static void free_mutex(void) {
+    /* Only here to make this valgrind clean */
+    if (last_change_mutex) {
+        ca_mutex_free(last_change_mutex);
+        last_change_mutex = NULL;
+    }
+
+    if (theme_mutex) {
+        ca_mutex_free(theme_mutex);
+        theme_mutex = NULL;
+    }
+}
+
+#endif
+
 int ca_get_data_home(char **e) {
     const char *env, *subdir;
     char *r;
@@ -324,6 +422,345 @@ const char *ca_get_data_dirs(void) {
     return g;
 }
 
+int ca_scan_last_change(time_t *t) {
+    char *e, *k;
+    struct stat st;
+    const char *g;
+    int ret;
+
+    ca_return_val_if_fail(t, CA_ERROR_INVALID);
+
+    if ((ret = ca_get_data_home(&e)) < 0)
+        return ret;
+
+    *t = 0;
+
+    if (e) {
+        if (!(k = ca_new(char, strlen(e) + sizeof("/sounds")))) {
+            ca_free(e);
+            return CA_ERROR_OOM;
+        }
+
+        sprintf(k, "%s/sounds", e);
+        ca_free(e);
+
+        if (stat(k, &st) >= 0)
+            *t = st.st_mtime;
+
+        ca_free(k);
+    }
+
+    g = ca_get_data_dirs();
+
+    for (;;) {
+        size_t j = strcspn(g, ":");
+
+        if (g[0] == '/' && j > 0) {
+
+            if (!(k = ca_new(char, j + sizeof("/sounds"))))
+                return CA_ERROR_OOM;
+
+            memcpy(k, g, j);
+            strcpy(k+j, "/sounds");
+
+            if (stat(k, &st) >= 0)
+                if (st.st_mtime >= *t)
+                    *t = st.st_mtime;
+
+            ca_free(k);
+        }
+
+        if (g[j] == 0)
+            break;
+
+        g += j+1;
+    }
+
+    return CA_SUCCESS;
+}
+
+int ca_get_last_change(time_t *t) {
+    int ret;
+    static time_t last_check = 0, last_change = 0;
+    static ca_bool_t watch_started = FALSE;
+    time_t now;
+
+    ca_return_val_if_fail(t, CA_ERROR_INVALID);
+
+    /* If the sound dirs are being watched we don't have to look
+     * ourselves */
+    if (ca_theme_watch_get(NULL, t))
+        return CA_SUCCESS;
+
+    if ((ret = allocate_mutex()) < 0)
+        return ret;
+
+    ca_mutex_lock(last_change_mutex);
+
+    if (!watch_started) {
+        watch_started = TRUE;
+
+        if (ca_theme_watch_start() >= 0 && ca_theme_watch_get(NULL, t)) {
+            ret = CA_SUCCESS;
+            goto finish;
+        }
+    }
+
+    ca_assert_se(time(&now) != (time_t) -1);
+
+    if (now < last_check + UPDATE_INTERVAL) {
+        *t = last_change;
+        ret = CA_SUCCESS;
+        goto finish;
+    }
+
+    if ((ret = ca_scan_last_change(t)) < 0)
+        goto finish;
+
+    last_change = *t;
+    last_check = now;
+
+finish:
+
+    ca_mutex_unlock(last_change_mutex);
+
+    return ret;
+}
+
+static unsigned calc_hash(const char *c) {
+    unsigned hash = 0;
+
+    for (; *c; c++)
+        hash = 31 * hash + (unsigned) *c;
+
+    return hash;
+}
+
+static void dir_index_flush(ca_dir_index *d) {
+    unsigned i;
+
+    ca_assert(d);
+
+    for (i = 0; i < d->n_entries; i++)
+        while (d->entries[i]) {
+            ca_dir_entry *e = d->entries[i];
+
+            d->entries[i] = e->next_in_slot;
+            ca_free(e);
+        }
+
+    ca_free(d->entries);
+    d->entries = NULL;
+    d->n_entries = 0;
+    d->loaded = FALSE;
+}
+
+static void dir_index_free(ca_theme_data *t) {
+    unsigned i;
+
+    ca_assert(t);
+
+    for (i = 0; i < N_DIR_INDEX; i++)
+        while (t->dir_index[i]) {
+            ca_dir_index *d = t->dir_index[i];
+
+            t->dir_index[i] = d->next_in_slot;
+
+            dir_index_flush(d);
+            ca_free(d->path);
+            ca_free(d);
+        }
+}
+
+static int dir_index_load(ca_dir_index *d) {
+    DIR *dir;
+    struct dirent *de;
+    ca_dir_entry *e, *l = NULL;
+    unsigned n = 0;
+
+    ca_assert(d);
+
+    dir_index_flush(d);
+
+    if (!(dir = opendir(d->path))) {
+
+        /* A directory that isn't there simply has no files */
+        if (errno != ENOENT && errno != ENOTDIR)
+            return CA_ERROR_SYSTEM;
+
+        d->loaded = TRUE;
+        return CA_SUCCESS;
+    }
+
+    while ((de = readdir(dir))) {
+        size_t k;
+
+        if (de->d_name[0] == '.')
+            continue;
+
+        k = strlen(de->d_name);
+
+        if (!(e = ca_malloc(CA_ALIGN(sizeof(ca_dir_entry)) + k + 1)))
+            break;
+
+        e->name = (char*) e + CA_ALIGN(sizeof(ca_dir_entry));
+        memcpy(e->name, de->d_name, k + 1);
+        e->hash = calc_hash(e->name);
+
+        e->next_in_slot = l;
+        l = e;
+        n++;
+    }
+
+    closedir(dir);
+
+    if (de || (n > 0 && !(d->entries = ca_new0(ca_dir_entry*, n)))) {
+
+        while ((e = l)) {
+            l = e->next_in_slot;
+            ca_free(e);
+        }
+
+        return CA_ERROR_OOM;
+    }
+
+    d->n_entries = n;
+
+    while ((e = l)) {
+        l = e->next_in_slot;
+
+        e->next_in_slot = d->entries[e->hash % n];
+        d->entries[e->hash % n] = e;
+    }
+
+    d->loaded = TRUE;
+
+    return CA_SUCCESS;
+}
+
+static ca_dir_index* dir_index_get(ca_theme_data *t, const char *path) {
+    ca_dir_index *d;
+    unsigned hash;
+
+    ca_assert(t);
+    ca_assert(path);
+
+    hash = calc_hash(path);
+
+    for (d = t->dir_index[hash % N_DIR_INDEX]; d; d = d->next_in_slot)
+        if (d->hash == hash && ca_streq(d->path, path))
+            return d;
+
+    if (!(d = ca_new0(ca_dir_index, 1)))
+        return NULL;
+
+    if (!(d->path = ca_strdup(path))) {
+        ca_free(d);
+        return NULL;
+    }
+
+    d->hash = hash;
+
+    d->next_in_slot = t->dir_index[hash % N_DIR_INDEX];
+    t->dir_index[hash % N_DIR_INDEX] = d;
+
+    return d;
+}
+
+static int dir_index_lookup_unlocked(ca_theme_data *t, const char *path, const char *name) {
+    ca_dir_index *d;
+    ca_dir_entry *e;
+    time_t last_change, now;
+    unsigned hash, generation;
+    ca_bool_t watched;
+    int ret;
+
+    ca_assert(t);
+    ca_assert(path);
+    ca_assert(name);
+
+    /* If any of the sound dirs changed, start from scratch. The
+     * watcher also tells us about changes within them. */
+    if ((watched = ca_theme_watch_get(&generation, NULL))) {
+
+        if (generation != t->dir_index_generation) {
+            dir_index_free(t);
+            t->dir_index_generation = generation;
+        }
+
+    } else {
+
+        if ((ret = ca_get_last_change(&last_change)) < 0)
+            return ret;
+
+        if (last_change != t->dir_index_last_change) {
+            dir_index_free(t);
+            t->dir_index_last_change = last_change;
+        }
+    }
+
+    if (!(d = dir_index_get(t, path)))
+        return CA_ERROR_OOM;
+
+    ca_assert_se(time(&now) != (time_t) -1);
+
+    /* The sound dirs don't change when a file is dropped into one of
+     * their subdirectories, so unless they are watched we need to
+     * check on each directory we indexed, too. But not more often
+     * than the cache does. */
+    if (!d->loaded || (!watched && (now >= d->checked + UPDATE_INTERVAL || now < d->checked))) {
+        struct stat st;
+        time_t mtime;
+
+        if (stat(path, &st) >= 0)
+            mtime = st.st_mtime;
+        else if (errno == ENOENT || errno == ENOTDIR)
+            mtime = 0;
+        else
+            return CA_ERROR_SYSTEM;
+
+        if (!d->loaded || mtime != d->mtime)
+            if ((ret = dir_index_load(d)) < 0)
+                return ret;
+
+        /* If the directory changed within this very second, it
+         * might change again without its mtime changing, so don't
+         * trust the index beyond this lookup */
+        if (mtime >= now) {
+            d->mtime = (time_t) -1;
+            d->checked = 0;
+        } else {
+            d->mtime = mtime;
+            d->checked = now;
+        }
+    }
+
+    if (d->n_entries <= 0)
+        return CA_ERROR_NOTFOUND;
+
+    hash = calc_hash(name);
+
+    for (e = d->entries[hash % d->n_entries]; e; e = e->next_in_slot)
+        if (e->hash == hash && ca_streq(e->name, name))
+            return CA_SUCCESS;
+
+    return CA_ERROR_NOTFOUND;
+}
+
+/* Returns CA_SUCCESS if the file might be there, CA_ERROR_NOTFOUND
+ * if it certainly isn't, and some other error if we cannot tell. */
+static int dir_index_lookup(ca_theme_data *t, const char *path, const char *name) {
+    int ret;
+
+    ca_assert(t);
+
+    ca_mutex_lock(t->mutex);
+    ret = dir_index_lookup_unlocked(t, path, name);
+    ca_mutex_unlock(t->mutex);
+
+    return ret;
+}
+
 static int load_theme_dir(ca_theme_data *t, const char *name) {
     int ret;
     char *e;
@@ -376,19 +813,108 @@ static int load_theme_dir(ca_theme_data *t, const char *name) {
     return CA_ERROR_NOTFOUND;
 }
 
+static void theme_data_free(ca_theme_data *t) {
+    ca_assert(t);
+
+    while (t->data_dirs) {
+        ca_data_dir *d = t->data_dirs;
+
+        CA_LLIST_REMOVE(ca_data_dir, t->data_dirs, d);
+
+        ca_free(d->theme_name);
+        ca_free(d->dir_name);
+        ca_free(d->output_profile);
+        ca_free(d);
+    }
+
+    dir_index_free(t);
+
+    if (t->mutex)
+        ca_mutex_free(t->mutex);
+
+    ca_free(t->name);
+    ca_free(t);
+}
+
+static int get_theme_stamp(ca_theme_stamp *s) {
+    int ret;
+
+    ca_assert(s);
+
+    memset(s, 0, sizeof(*s));
+
+    if ((s->watched = ca_theme_watch_get(&s->generation, NULL)))
+        return CA_SUCCESS;
+
+    if ((ret = ca_get_last_change(&s->last_change)) < 0)
+        return ret;
+
+    /* That might just have started the watcher */
+    if ((s->watched = ca_theme_watch_get(&s->generation, NULL)))
+        s->last_change = 0;
+
+    return CA_SUCCESS;
+}
+
+static ca_bool_t theme_stamp_equal(const ca_theme_stamp *a, const ca_theme_stamp *b) {
+    ca_assert(a);
+    ca_assert(b);
+
+    if (a->watched != b->watched)
+        return FALSE;
+
+    if (a->watched)
+        return a->generation == b->generation;
+
+    return a->last_change == b->last_change;
+}
+
 static int load_theme_data(ca_theme_data **_t, const char *name) {
     ca_theme_data *t;
+    ca_theme_stamp stamp;
     int ret;
 
     ca_return_val_if_fail(_t, CA_ERROR_INVALID);
     ca_return_val_if_fail(name, CA_ERROR_INVALID);
 
+    if ((ret = allocate_mutex()) < 0)
+        return ret;
+
+    if ((ret = get_theme_stamp(&stamp)) < 0)
+        return ret;
+
     if (*_t)
-        if (ca_streq((*_t)->name, name))
+        if (ca_streq((*_t)->name, name) && theme_stamp_equal(&(*_t)->stamp, &stamp))
             return CA_SUCCESS;
 
-    if (!(t = ca_new0(ca_theme_data, 1)))
-        return CA_ERROR_OOM;
+    ca_mutex_lock(theme_mutex);
+
+    /* Maybe another context already loaded this theme */
+    for (t = themes; t; t = t->next)
+        if (ca_streq(t->name, name) && theme_stamp_equal(&t->stamp, &stamp))
+            break;
+
+    if (t) {
+        t->ref++;
+        ca_mutex_unlock(theme_mutex);
+        goto finish;
+    }
+
+    /* We keep the lock while parsing, so that contexts asking for the
+     * same theme at the same time don't all parse it */
+
+    if (!(t = ca_new0(ca_theme_data, 1))) {
+        ret = CA_ERROR_OOM;
+        goto fail;
+    }
+
+    t->ref = 1;
+    t->stamp = stamp;
+
+    if (!(t->mutex = ca_mutex_new())) {
+        ret = CA_ERROR_OOM;
+        goto fail;
+    }
 
     if (!(t->name = ca_strdup(name))) {
         ret = CA_ERROR_OOM;
@@ -402,8 +928,14 @@ static int load_theme_data(ca_theme_data **_t, const char *name) {
     if (!t->loaded_fallback_theme)
         load_theme_dir(t, FALLBACK_THEME);
 
+    CA_LLIST_PREPEND(ca_theme_data, themes, t);
+
+    ca_mutex_unlock(theme_mutex);
+
+finish:
+
     if (*_t)
-        ca_theme_data_free(*_t);
+        ca_theme_data_unref(*_t);
 
     *_t = t;
 
@@ -411,8 +943,10 @@ static int load_theme_data(ca_theme_data **_t, const char *name) {
 
 fail:
 
+    ca_mutex_unlock(theme_mutex);
+
     if (t)
-        ca_theme_data_free(t);
+        theme_data_free(t);
 
     return ret;
 }
@@ -421,6 +955,7 @@ static int find_sound_for_suffix(
         ca_sound_file **f,
         ca_sound_file_open_callback_t sfopen,
         char **sound_path,
+        ca_theme_data *idx,
         const char *theme_name,
         const char *name,
         const char *path,
@@ -429,6 +964,7 @@ static int find_sound_for_suffix(
         const char *subdir) {
 
     char *fn;
+    size_t dl;
     int ret;
 
     ca_return_val_if_fail(f, CA_ERROR_INVALID);
@@ -448,6 +984,21 @@ static int find_sound_for_suffix(
                                  name, suffix)))
         return CA_ERROR_OOM;
 
+    dl = strlen(fn) - strlen(name) - strlen(suffix) - 1;
+
+    /* Don't bother the file system if we already know the file isn't
+     * there */
+    if (idx && !strchr(name, '/')) {
+        fn[dl] = 0;
+        ret = dir_index_lookup(idx, fn, fn + dl + 1);
+        fn[dl] = '/';
+
+        if (ret == CA_ERROR_NOTFOUND) {
+            ca_free(fn);
+            return ret;
+        }
+    }
+
     if (ca_streq(suffix, ".disabled")) {
 
         if (access(fn, F_OK) == 0)
@@ -470,6 +1021,7 @@ static int find_sound_in_locale(
         ca_sound_file **f,
         ca_sound_file_open_callback_t sfopen,
         char **sound_path,
+        ca_theme_data *idx,
         const char *theme_name,
         const char *name,
         const char *path,
@@ -490,10 +1042,10 @@ static int find_sound_in_locale(
 
     sprintf(p, "%s/sounds", path);
 
-    if ((ret = find_sound_for_suffix(f, sfopen, sound_path, theme_name, name, p, ".disabled", locale, subdir)) == CA_ERROR_NOTFOUND)
-        if ((ret = find_sound_for_suffix(f, sfopen, sound_path,theme_name, name, p, ".oga", locale, subdir)) == CA_ERROR_NOTFOUND)
-            if ((ret = find_sound_for_suffix(f, sfopen, sound_path,theme_name, name, p, ".ogg", locale, subdir)) == CA_ERROR_NOTFOUND)
-                ret = find_sound_for_suffix(f, sfopen, sound_path,theme_name, name, p, ".wav", locale, subdir);
+    if ((ret = find_sound_for_suffix(f, sfopen, sound_path, idx, theme_name, name, p, ".disabled", locale, subdir)) == CA_ERROR_NOTFOUND)
+        if ((ret = find_sound_for_suffix(f, sfopen, sound_path, idx, theme_name, name, p, ".oga", locale, subdir)) == CA_ERROR_NOTFOUND)
+            if ((ret = find_sound_for_suffix(f, sfopen, sound_path, idx, theme_name, name, p, ".ogg", locale, subdir)) == CA_ERROR_NOTFOUND)
+                ret = find_sound_for_suffix(f, sfopen, sound_path, idx, theme_name, name, p, ".wav", locale, subdir);
 
     ca_free(p);
 
@@ -504,6 +1056,7 @@ static int find_sound_for_locale(
         ca_sound_file **f,
         ca_sound_file_open_callback_t sfopen,
         char **sound_path,
+        ca_theme_data *idx,
         const char *theme_name,
         const char *name,
         const char *path,
@@ -520,7 +1073,7 @@ static int find_sound_for_locale(
     ca_return_val_if_fail(locale, CA_ERROR_INVALID);
 
     /* First, try the locale def itself */
-    if ((ret = find_sound_in_locale(f, sfopen, sound_path, theme_name, name, path, locale, subdir)) != CA_ERROR_NOTFOUND)
+    if ((ret = find_sound_in_locale(f, sfopen, sound_path, idx, theme_name, name, path, locale, subdir)) != CA_ERROR_NOTFOUND)
         return ret;
 
     /* Then, try to truncate at the @ */
@@ -530,7 +1083,7 @@ static int find_sound_for_locale(
         if (!(t = ca_strndup(locale, (size_t) (e - locale))))
             return CA_ERROR_OOM;
 
-        ret = find_sound_in_locale(f, sfopen, sound_path, theme_name, name, path, t, subdir);
+        ret = find_sound_in_locale(f, sfopen, sound_path, idx, theme_name, name, path, t, subdir);
         ca_free(t);
 
         if (ret != CA_ERROR_NOTFOUND)
@@ -544,7 +1097,7 @@ static int find_sound_for_locale(
         if (!(t = ca_strndup(locale, (size_t) (e - locale))))
             return CA_ERROR_OOM;
 
-        ret = find_sound_in_locale(f, sfopen, sound_path, theme_name, name, path, t, subdir);
+        ret = find_sound_in_locale(f, sfopen, sound_path, idx, theme_name, name, path, t, subdir);
         ca_free(t);
 
         if (ret != CA_ERROR_NOTFOUND)
@@ -553,17 +1106,18 @@ static int find_sound_for_locale(
 
     /* Then, try "C" as fallback locale */
     if (strcmp(locale, "C"))
-        if ((ret = find_sound_in_locale(f, sfopen, sound_path, theme_name, name, path, "C", subdir)) != CA_ERROR_NOTFOUND)
+        if ((ret = find_sound_in_locale(f, sfopen, sound_path, idx, theme_name, name, path, "C", subdir)) != CA_ERROR_NOTFOUND)
             return ret;
 
     /* Try without locale */
-    return find_sound_in_locale(f, sfopen, sound_path, theme_name, name, path, NULL, subdir);
+    return find_sound_in_locale(f, sfopen, sound_path, idx, theme_name, name, path, NULL, subdir);
 }
 
 static int find_sound_for_name(
         ca_sound_file **f,
         ca_sound_file_open_callback_t sfopen,
         char **sound_path,
+        ca_theme_data *idx,
         const char *theme_name,
         const char *name,
         const char *path,
@@ -577,7 +1131,7 @@ static int find_sound_for_name(
     ca_return_val_if_fail(sfopen, CA_ERROR_INVALID);
     ca_return_val_if_fail(name && *name, CA_ERROR_INVALID);
 
-    if ((ret = find_sound_for_locale(f, sfopen, sound_path, theme_name, name, path, locale, subdir)) != CA_ERROR_NOTFOUND)
+    if ((ret = find_sound_for_locale(f, sfopen, sound_path, idx, theme_name, name, path, locale, subdir)) != CA_ERROR_NOTFOUND)
         return ret;
 
     k = strchr(name, 0);
@@ -595,7 +1149,7 @@ static int find_sound_for_name(
         if (!(n = ca_strndup(name, (size_t) (k-name))))
             return CA_ERROR_OOM;
 
-        if ((ret = find_sound_for_locale(f, sfopen, sound_path, theme_name, n, path, locale, subdir)) != CA_ERROR_NOTFOUND) {
+        if ((ret = find_sound_for_locale(f, sfopen, sound_path, idx, theme_name, n, path, locale, subdir)) != CA_ERROR_NOTFOUND) {
             ca_free(n);
             return ret;
         }
@@ -608,6 +1162,7 @@ static int find_sound_in_subdir(
         ca_sound_file **f,
         ca_sound_file_open_callback_t sfopen,
         char **sound_path,
+        ca_theme_data *idx,
         const char *theme_name,
         const char *name,
         const char *locale,
@@ -625,7 +1180,7 @@ static int find_sound_in_subdir(
         return ret;
 
     if (e) {
-        ret = find_sound_for_name(f, sfopen, sound_path, theme_name, name, e, locale, subdir);
+        ret = find_sound_for_name(f, sfopen, sound_path, idx, theme_name, name, e, locale, subdir);
         ca_free(e);
 
         if (ret != CA_ERROR_NOTFOUND)
@@ -645,7 +1200,7 @@ static int find_sound_in_subdir(
             if (!(p = ca_strndup(g, k)))
                 return CA_ERROR_OOM;
 
-            ret = find_sound_for_name(f, sfopen, sound_path, theme_name, name, p, locale, subdir);
+            ret = find_sound_for_name(f, sfopen, sound_path, idx, theme_name, name, p, locale, subdir);
             ca_free(p);
 
             if (ret != CA_ERROR_NOTFOUND)
@@ -681,7 +1236,7 @@ static int find_sound_in_profile(
         if (data_dir_matches(d, profile)) {
             int ret;
 
-            if ((ret = find_sound_in_subdir(f, sfopen, sound_path, d->theme_name, name, locale, d->dir_name)) != CA_ERROR_NOTFOUND)
+            if ((ret = find_sound_in_subdir(f, sfopen, sound_path, t, d->theme_name, name, locale, d->dir_name)) != CA_ERROR_NOTFOUND)
                 return ret;
         }
 
@@ -692,6 +1247,7 @@ static int find_sound_in_theme(
         ca_sound_file **f,
         ca_sound_file_open_callback_t sfopen,
         char **sound_path,
+        ca_theme_data *idx,
         ca_theme_data *t,
         const char *name,
         const char *locale,
@@ -716,7 +1272,42 @@ static int find_sound_in_theme(
     }
 
     /* And fall back to no profile */
-    return find_sound_in_subdir(f, sfopen, sound_path, t ? t->name : NULL, name, locale, NULL);
+    return find_sound_in_subdir(f, sfopen, sound_path, idx, t ? t->name : NULL, name, locale, NULL);
+}
+
+/* The theme slot of a context is shared by all sound events played on
+ * it at the same time, hence lookups only ever work on a reference of
+ * their own, and put the theme they loaded back when done */
+static ca_theme_data* theme_slot_get(ca_theme_data **slot) {
+    ca_theme_data *t;
+
+    ca_mutex_lock(theme_mutex);
+
+    if ((t = *slot))
+        t->ref++;
+
+    ca_mutex_unlock(theme_mutex);
+
+    return t;
+}
+
+static void theme_slot_set(ca_theme_data **slot, ca_theme_data *t) {
+    ca_theme_data *old;
+
+    ca_mutex_lock(theme_mutex);
+
+    if ((old = *slot) == t) {
+        ca_mutex_unlock(theme_mutex);
+        return;
+    }
+
+    t->ref++;
+    *slot = t;
+
+    ca_mutex_unlock(theme_mutex);
+
+    if (old)
+        ca_theme_data_unref(old);
 }
 
 static int find_sound_for_theme(
@@ -729,6 +1320,7 @@ static int find_sound_for_theme(
         const char *locale,
         const char *profile) {
 
+    ca_theme_data *local;
     int ret;
 
     ca_return_val_if_fail(f, CA_ERROR_INVALID);
@@ -739,17 +1331,124 @@ static int find_sound_for_theme(
     ca_return_val_if_fail(locale, CA_ERROR_INVALID);
     ca_return_val_if_fail(profile, CA_ERROR_INVALID);
 
+    if ((ret = allocate_mutex()) < 0)
+        return ret;
+
+    local = theme_slot_get(t);
+
     /* First, try in the theme itself, and if that fails the fallback theme */
-    if ((ret = load_theme_data(t, theme)) == CA_ERROR_NOTFOUND)
+    if ((ret = load_theme_data(&local, theme)) == CA_ERROR_NOTFOUND)
         if (!ca_streq(theme, FALLBACK_THEME))
-            ret = load_theme_data(t, FALLBACK_THEME);
+            ret = load_theme_data(&local, FALLBACK_THEME);
 
-    if (ret == CA_SUCCESS)
-        if ((ret = find_sound_in_theme(f, sfopen, sound_path, *t, name, locale, profile)) != CA_ERROR_NOTFOUND)
-            return ret;
+    if (ret == CA_SUCCESS) {
+        theme_slot_set(t, local);
+
+        if ((ret = find_sound_in_theme(f, sfopen, sound_path, local, local, name, locale, profile)) != CA_ERROR_NOTFOUND)
+            goto finish;
+    }
 
     /* Then, fall back to "unthemed" files */
-    return find_sound_in_theme(f, sfopen, sound_path, NULL, name, locale, profile);
+    ret = find_sound_in_theme(f, sfopen, sound_path, local, NULL, name, locale, profile);
+
+finish:
+
+    if (local)
+        ca_theme_data_unref(local);
+
+    return ret;
+}
+
+static void resolve_event(
+        ca_proplist *cp,
+        ca_proplist *sp,
+        const char **theme,
+        const char **locale,
+        const char **profile) {
+
+    /* Both proplists need to be locked by the caller */
+
+    if (!(*theme = ca_proplist_gets_key_unlocked(sp, CA_PROP_KEY_CANBERRA_XDG_THEME_NAME)))
+        if (!(*theme = ca_proplist_gets_key_unlocked(cp, CA_PROP_KEY_CANBERRA_XDG_THEME_NAME)))
+            *theme = DEFAULT_THEME;
+
+    if (!(*locale = ca_proplist_gets_key_unlocked(sp, CA_PROP_KEY_MEDIA_LANGUAGE)))
+        if (!(*locale = ca_proplist_gets_key_unlocked(sp, CA_PROP_KEY_APPLICATION_LANGUAGE)))
+            if (!(*locale = ca_proplist_gets_key_unlocked(cp, CA_PROP_KEY_MEDIA_LANGUAGE)))
+                if (!(*locale = ca_proplist_gets_key_unlocked(cp, CA_PROP_KEY_APPLICATION_LANGUAGE)))
+                    if (!(*locale = setlocale(LC_MESSAGES, NULL)))
+                        *locale = "C";
+
+    if (!(*profile = ca_proplist_gets_key_unlocked(sp, CA_PROP_KEY_CANBERRA_XDG_THEME_OUTPUT_PROFILE)))
+        if (!(*profile = ca_proplist_gets_key_unlocked(cp, CA_PROP_KEY_CANBERRA_XDG_THEME_OUTPUT_PROFILE)))
+            *profile = DEFAULT_OUTPUT_PROFILE;
+}
+
+int ca_lookup_sound_key(
+        char **_key,
+        size_t *_klen,
+        ca_proplist *cp,
+        ca_proplist *sp) {
+
+    const char *theme = "", *name, *locale = "", *profile = "", *fname;
+    const char *fields[5];
+    char *key, *k;
+    size_t klen, l;
+    unsigned i;
+    int ret;
+
+    ca_return_val_if_fail(_key, CA_ERROR_INVALID);
+    ca_return_val_if_fail(_klen, CA_ERROR_INVALID);
+    ca_return_val_if_fail(cp, CA_ERROR_INVALID);
+    ca_return_val_if_fail(sp, CA_ERROR_INVALID);
+
+    ca_proplist_lock(cp);
+    ca_proplist_lock(sp);
+
+    /* The key is made of the same theme/name/locale/profile tuple
+     * build_key() in cache.c uses, followed by the file name we'd
+     * fall back to if the event sound cannot be found. */
+
+    if ((name = ca_proplist_gets_key_unlocked(sp, CA_PROP_KEY_EVENT_ID)))
+        resolve_event(cp, sp, &theme, &locale, &profile);
+
+    fname = ca_proplist_gets_key_unlocked(sp, CA_PROP_KEY_MEDIA_FILENAME);
+
+    if (!name && !fname) {
+        ret = CA_ERROR_INVALID;
+        goto finish;
+    }
+
+    fields[0] = theme;
+    fields[1] = name ? name : "";
+    fields[2] = locale;
+    fields[3] = profile;
+    fields[4] = fname ? fname : "";
+
+    for (klen = 0, i = 0; i < CA_ELEMENTSOF(fields); i++)
+        klen += strlen(fields[i]) + 1;
+
+    if (!(k = key = ca_new(char, klen))) {
+        ret = CA_ERROR_OOM;
+        goto finish;
+    }
+
+    for (i = 0; i < CA_ELEMENTSOF(fields); i++) {
+        l = strlen(fields[i]) + 1;
+        memcpy(k, fields[i], l);
+        k += l;
+    }
+
+    *_key = key;
+    *_klen = klen;
+    ret = CA_SUCCESS;
+
+finish:
+
+    ca_proplist_unlock(cp);
+    ca_proplist_unlock(sp);
+
+    return ret;
 }
 
 int ca_lookup_sound_with_callback(
@@ -761,6 +1460,7 @@ int ca_lookup_sound_with_callback(
         ca_proplist *sp) {
     int ret = CA_ERROR_INVALID;
     const char *name, *fname;
+    ca_usec_t start;
 
     ca_return_val_if_fail(f, CA_ERROR_INVALID);
     ca_return_val_if_fail(t, CA_ERROR_INVALID);
@@ -768,34 +1468,26 @@ int ca_lookup_sound_with_callback(
     ca_return_val_if_fail(sp, CA_ERROR_INVALID);
     ca_return_val_if_fail(sfopen, CA_ERROR_INVALID);
 
+    start = ca_trace_now();
+
     *f = NULL;
 
     if (sound_path)
         *sound_path = NULL;
 
-    ca_mutex_lock(cp->mutex);
-    ca_mutex_lock(sp->mutex);
+    ca_proplist_lock(cp);
+    ca_proplist_lock(sp);
 
-    if ((name = ca_proplist_gets_unlocked(sp, CA_PROP_EVENT_ID))) {
+    if ((name = ca_proplist_gets_key_unlocked(sp, CA_PROP_KEY_EVENT_ID))) {
         const char *theme, *locale, *profile;
 
-        if (!(theme = ca_proplist_gets_unlocked(sp, CA_PROP_CANBERRA_XDG_THEME_NAME)))
-            if (!(theme = ca_proplist_gets_unlocked(cp, CA_PROP_CANBERRA_XDG_THEME_NAME)))
-                theme = DEFAULT_THEME;
-
-        if (!(locale = ca_proplist_gets_unlocked(sp, CA_PROP_MEDIA_LANGUAGE)))
-            if (!(locale = ca_proplist_gets_unlocked(sp, CA_PROP_APPLICATION_LANGUAGE)))
-                if (!(locale = ca_proplist_gets_unlocked(cp, CA_PROP_MEDIA_LANGUAGE)))
-                    if (!(locale = ca_proplist_gets_unlocked(cp, CA_PROP_APPLICATION_LANGUAGE)))
-                        if (!(locale = setlocale(LC_MESSAGES, NULL)))
-                            locale = "C";
-
-        if (!(profile = ca_proplist_gets_unlocked(sp, CA_PROP_CANBERRA_XDG_THEME_OUTPUT_PROFILE)))
-            if (!(profile = ca_proplist_gets_unlocked(cp, CA_PROP_CANBERRA_XDG_THEME_OUTPUT_PROFILE)))
-                profile = DEFAULT_OUTPUT_PROFILE;
+        resolve_event(cp, sp, &theme, &locale, &profile);
 
 #ifdef HAVE_CACHE
-        if ((ret = ca_cache_lookup_sound(f, sfopen, sound_path, theme, name, locale, profile)) >= 0) {
+        ret = ca_cache_lookup_sound(f, sfopen, sound_path, theme, name, locale, profile);
+        ca_trace_stage(ret >= 0 ? CA_TRACE_CACHE_HIT : CA_TRACE_CACHE_MISS, start);
+
+        if (ret >= 0) {
 
             /* This entry is available in the cache, let's transform
              * negative cache entries to CA_ERROR_NOTFOUND */
@@ -827,12 +1519,14 @@ int ca_lookup_sound_with_callback(
     }
 
     if (ret == CA_ERROR_NOTFOUND || !name) {
-        if ((fname = ca_proplist_gets_unlocked(sp, CA_PROP_MEDIA_FILENAME)))
+        if ((fname = ca_proplist_gets_key_unlocked(sp, CA_PROP_KEY_MEDIA_FILENAME)))
             ret = sfopen(f, fname);
     }
 
-    ca_mutex_unlock(cp->mutex);
-    ca_mutex_unlock(sp->mutex);
+    ca_proplist_unlock(cp);
+    ca_proplist_unlock(sp);
+
+    ca_trace_stage(CA_TRACE_LOOKUP, start);
 
     return ret;
 }
@@ -847,20 +1541,20 @@ int ca_lookup_sound(
     return ca_lookup_sound_with_callback(f, ca_sound_file_open, sound_path, t, cp, sp);
 }
 
-void ca_theme_data_free(ca_theme_data *t) {
+void ca_theme_data_unref(ca_theme_data *t) {
     ca_assert(t);
+    ca_assert(t->ref >= 1);
 
-    while (t->data_dirs) {
-        ca_data_dir *d = t->data_dirs;
+    ca_mutex_lock(theme_mutex);
 
-        CA_LLIST_REMOVE(ca_data_dir, t->data_dirs, d);
-
-        ca_free(d->theme_name);
-        ca_free(d->dir_name);
-        ca_free(d->output_profile);
-        ca_free(d);
+    if (--t->ref > 0) {
+        ca_mutex_unlock(theme_mutex);
+        return;
     }
 
-    ca_free(t->name);
-    ca_free(t);
+    CA_LLIST_REMOVE(ca_theme_data, themes, t);
+
+    ca_mutex_unlock(theme_mutex);
+
+    theme_data_free(t);
 }
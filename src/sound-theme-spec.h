@@ -21,6 +21,8 @@
   <http://www.gnu.org/licenses/>.
 ***/
 
+#include <time.h>
+
 #include "read-sound-file.h"
 #include "proplist.h"
 
@@ -30,9 +32,22 @@ typedef int (*ca_sound_file_open_callback_t)(ca_sound_file **f, const char *fn);
 
 int ca_lookup_sound(ca_sound_file **f, char **sound_path, ca_theme_data **t, ca_proplist *cp, ca_proplist *sp);
 int ca_lookup_sound_with_callback(ca_sound_file **f, ca_sound_file_open_callback_t sfopen, char **sound_path, ca_theme_data **t, ca_proplist *cp, ca_proplist *sp);
-void ca_theme_data_free(ca_theme_data *t);
+
+/* The theme data a lookup stores in *t is shared with other contexts
+ * that use the same theme. Drop it with ca_theme_data_unref(). */
+void ca_theme_data_unref(ca_theme_data *t);
+
+int ca_lookup_sound_key(char **key, size_t *klen, ca_proplist *cp, ca_proplist *sp);
 
 int ca_get_data_home(char **e);
 const char *ca_get_data_dirs(void);
 
+/* The most recent modification time of any of the sound directories,
+ * checked at most every few seconds, unless they are watched for
+ * changes anyway */
+int ca_get_last_change(time_t *t);
+
+/* The same, but always checks the file system */
+int ca_scan_last_change(time_t *t);
+
 #endif
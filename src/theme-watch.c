@@ -0,0 +1,430 @@
+/***
+  This file is part of libcanberra.
+
+  Copyright 2008 Lennart Poettering
+
+  libcanberra is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 2.1 of the
+  License, or (at your option) any later version.
+
+  libcanberra is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with libcanberra. If not, see
+  <http://www.gnu.org/licenses/>.
+***/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifdef HAVE_INOTIFY
+#include <sys/inotify.h>
+#include <sys/types.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#include "canberra.h"
+#include "malloc.h"
+#include "sound-theme-spec.h"
+#include "theme-watch.h"
+
+#ifdef HAVE_INOTIFY
+
+/* Sounds are at most in sounds/<theme>/<output profile>/<locale> */
+#define SOUND_DIR_DEPTH_MAX 3
+
+#define SOUND_DIR_MASK (IN_CREATE|IN_DELETE|IN_MOVED_FROM|IN_MOVED_TO|IN_CLOSE_WRITE|IN_ATTRIB|IN_DELETE_SELF|IN_MOVE_SELF|IN_ONLYDIR)
+#define DATA_DIR_MASK (IN_CREATE|IN_DELETE|IN_MOVED_FROM|IN_MOVED_TO|IN_ONLYDIR)
+
+/* This part is not portable due to pthread_once usage, should be abstracted
+ * when we port this to platforms that do not have POSIX threading */
+
+static int fd = -1;
+static int start_result = CA_ERROR_NOTSUPPORTED;
+
+/* Closing the write end tells the thread to finish */
+static int quit_fd[2] = { -1, -1 };
+static pthread_t thread;
+static ca_bool_t thread_running = FALSE;
+
+/* Only touched by whoever starts the watcher, and the watcher thread
+ * after that */
+static int *data_dir_wd = NULL;
+static unsigned n_data_dir_wd = 0;
+
+/* We don't have atomic loads and stores, hence these are volatile
+ * and ordered with memory barriers */
+static volatile ca_bool_t watching = FALSE;
+static volatile unsigned generation = 0;
+static volatile unsigned last_change = 0;
+
+static void watch_sound_dir(const char *path, unsigned depth) {
+    DIR *d;
+    struct dirent *de;
+
+    if (inotify_add_watch(fd, path, SOUND_DIR_MASK) < 0)
+        return;
+
+    if (depth >= SOUND_DIR_DEPTH_MAX)
+        return;
+
+    if (!(d = opendir(path)))
+        return;
+
+    while ((de = readdir(d))) {
+        char *p;
+
+        if (de->d_name[0] == '.')
+            continue;
+
+        if (de->d_type != DT_DIR &&
+            de->d_type != DT_LNK &&
+            de->d_type != DT_UNKNOWN)
+            continue;
+
+        if (!(p = ca_sprintf_malloc("%s/%s", path, de->d_name)))
+            break;
+
+        watch_sound_dir(p, depth + 1);
+        ca_free(p);
+    }
+
+    closedir(d);
+}
+
+static void watch_data_dir(const char *path) {
+    char *p;
+    int wd;
+
+    /* The data dir itself is only watched so that we notice if a
+     * sounds dir is created or removed in it */
+    if ((wd = inotify_add_watch(fd, path, DATA_DIR_MASK)) >= 0)
+        data_dir_wd[n_data_dir_wd++] = wd;
+
+    if (!(p = ca_sprintf_malloc("%s/sounds", path)))
+        return;
+
+    watch_sound_dir(p, 0);
+    ca_free(p);
+}
+
+static void add_watches(void) {
+    const char *g;
+    char *e;
+    unsigned n;
+
+    /* Watches for directories that are already watched are simply
+     * updated, hence it's fine to call this again and again. */
+
+    for (n = 2, g = ca_get_data_dirs(); *g; g++)
+        if (*g == ':')
+            n++;
+
+    ca_free(data_dir_wd);
+    n_data_dir_wd = 0;
+
+    if (!(data_dir_wd = ca_new(int, n)))
+        return;
+
+    if (ca_get_data_home(&e) >= 0 && e) {
+        watch_data_dir(e);
+        ca_free(e);
+    }
+
+    g = ca_get_data_dirs();
+
+    for (;;) {
+        size_t k;
+
+        k = strcspn(g, ":");
+
+        if (g[0] == '/' && k > 0) {
+            char *p;
+
+            if (!(p = ca_strndup(g, k)))
+                return;
+
+            watch_data_dir(p);
+            ca_free(p);
+        }
+
+        if (g[k] == 0)
+            break;
+
+        g += k+1;
+    }
+}
+
+static ca_bool_t is_data_dir_wd(int wd) {
+    unsigned i;
+
+    for (i = 0; i < n_data_dir_wd; i++)
+        if (data_dir_wd[i] == wd)
+            return TRUE;
+
+    return FALSE;
+}
+
+static void notify_change(void) {
+    time_t now;
+    unsigned t;
+
+    ca_assert_se(time(&now) != (time_t) -1);
+
+    /* Cache entries stored within this second might predate the
+     * change, so make sure they are considered out of date, too */
+    t = (unsigned) now + 1;
+
+    if (t > last_change)
+        last_change = t;
+
+    __sync_synchronize();
+    __sync_add_and_fetch(&generation, 1);
+}
+
+static void* watch_func(void *userdata) {
+    union {
+        struct inotify_event event;
+        char buf[4096];
+    } u;
+
+    for (;;) {
+        struct pollfd pfd[2];
+        ssize_t l, i;
+        ca_bool_t changed = FALSE, rescan = FALSE;
+
+        pfd[0].fd = fd;
+        pfd[0].events = POLLIN;
+        pfd[1].fd = quit_fd[0];
+        pfd[1].events = POLLIN;
+
+        if (poll(pfd, 2, -1) < 0) {
+
+            if (errno == EINTR)
+                continue;
+
+            break;
+        }
+
+        if (pfd[1].revents)
+            break;
+
+        if ((l = read(fd, &u, sizeof(u))) < 0) {
+
+            if (errno == EINTR)
+                continue;
+
+            break;
+        }
+
+        if (l == 0)
+            break;
+
+        for (i = 0; i + (ssize_t) sizeof(struct inotify_event) <= l; ) {
+            struct inotify_event *e = (struct inotify_event*) (u.buf + i);
+
+            i += (ssize_t) (sizeof(struct inotify_event) + e->len);
+
+            /* We lost events, so let's assume everything changed */
+            if (e->mask & IN_Q_OVERFLOW) {
+                changed = rescan = TRUE;
+                continue;
+            }
+
+            /* All kinds of things happen in the data dirs, we only
+             * care about the sounds dirs in them */
+            if (is_data_dir_wd(e->wd)) {
+                if (e->len > 0 && ca_streq(e->name, "sounds"))
+                    changed = rescan = TRUE;
+
+                continue;
+            }
+
+            if (e->mask & IN_IGNORED)
+                continue;
+
+            changed = TRUE;
+
+            /* New directories need to be watched, too */
+            if ((e->mask & IN_ISDIR) && (e->mask & (IN_CREATE|IN_MOVED_TO)))
+                rescan = TRUE;
+        }
+
+        if (rescan)
+            add_watches();
+
+        if (changed)
+            notify_change();
+    }
+
+    /* We were stopped or something went wrong, the lookups need to
+     * check the file system again themselves */
+    watching = FALSE;
+    __sync_synchronize();
+
+    return NULL;
+}
+
+static void close_fds(void) {
+
+    if (fd >= 0) {
+        close(fd);
+        fd = -1;
+    }
+
+    if (quit_fd[0] >= 0) {
+        close(quit_fd[0]);
+        quit_fd[0] = -1;
+    }
+
+    if (quit_fd[1] >= 0) {
+        close(quit_fd[1]);
+        quit_fd[1] = -1;
+    }
+
+    ca_free(data_dir_wd);
+    data_dir_wd = NULL;
+    n_data_dir_wd = 0;
+}
+
+static void atfork_child(void) {
+
+    /* The thread didn't make it into the child, and its descriptors
+     * shouldn't stay around there */
+    if (!thread_running)
+        return;
+
+    thread_running = FALSE;
+    watching = FALSE;
+    __sync_synchronize();
+
+    close_fds();
+}
+
+static void start_once(void) {
+    time_t t;
+    int ret;
+
+#ifdef IN_CLOEXEC
+    fd = inotify_init1(IN_CLOEXEC);
+#else
+    fd = inotify_init();
+#endif
+
+    if (fd < 0) {
+        start_result = errno == ENOSYS ? CA_ERROR_NOTSUPPORTED : CA_ERROR_SYSTEM;
+        return;
+    }
+
+    if (pipe(quit_fd) < 0) {
+        ret = CA_ERROR_SYSTEM;
+        goto fail;
+    }
+
+    fcntl(quit_fd[0], F_SETFD, FD_CLOEXEC);
+    fcntl(quit_fd[1], F_SETFD, FD_CLOEXEC);
+
+    if (pthread_atfork(NULL, NULL, atfork_child) != 0) {
+        ret = CA_ERROR_OOM;
+        goto fail;
+    }
+
+    add_watches();
+
+    /* Whatever changed before we started watching we need to find
+     * out the hard way */
+    if ((ret = ca_scan_last_change(&t)) < 0)
+        goto fail;
+
+    last_change = (unsigned) t;
+    generation = 1;
+    watching = TRUE;
+    __sync_synchronize();
+
+    if (pthread_create(&thread, NULL, watch_func, NULL) != 0) {
+        watching = FALSE;
+        __sync_synchronize();
+
+        ret = CA_ERROR_OOM;
+        goto fail;
+    }
+
+    thread_running = TRUE;
+    start_result = CA_SUCCESS;
+    return;
+
+fail:
+    close_fds();
+
+    start_result = ret;
+}
+
+int ca_theme_watch_start(void) {
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+    if (pthread_once(&once, start_once) != 0)
+        return CA_ERROR_OOM;
+
+    return start_result;
+}
+
+#ifdef CA_GCC_DESTRUCTOR
+
+static void stop(void) CA_GCC_DESTRUCTOR;
+
+static void stop(void) {
+
+    /* The thread must be gone before our code is unmapped */
+    if (!thread_running)
+        return;
+
+    close(quit_fd[1]);
+    quit_fd[1] = -1;
+
+    pthread_join(thread, NULL);
+    thread_running = FALSE;
+
+    close_fds();
+}
+
+#endif
+
+ca_bool_t ca_theme_watch_get(unsigned *g, time_t *t) {
+
+    if (!watching)
+        return FALSE;
+
+    __sync_synchronize();
+
+    if (g)
+        *g = generation;
+
+    __sync_synchronize();
+
+    if (t)
+        *t = (time_t) last_change;
+
+    return TRUE;
+}
+
+#else
+
+int ca_theme_watch_start(void) {
+    return CA_ERROR_NOTSUPPORTED;
+}
+
+ca_bool_t ca_theme_watch_get(unsigned *g, time_t *t) {
+    return FALSE;
+}
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef foocanberrathemewatchhfoo
+#define foocanberrathemewatchhfoo
+
+/***
+  This file is part of libcanberra.
+
+  Copyright 2008 Lennart Poettering
+
+  libcanberra is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 2.1 of the
+  License, or (at your option) any later version.
+
+  libcanberra is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with libcanberra. If not, see
+  <http://www.gnu.org/licenses/>.
+***/
+
+#include <time.h>
+
+#include "macro.h"
+
+/* Watches the sound theme directories from a background thread, so
+ * that sound lookups can learn about changes to them without looking
+ * at the file system themselves. The generation counter is bumped
+ * every time something changed, the last change time is the one to
+ * compare cache entries against. The watcher is stopped when the
+ * library is unloaded, and doesn't carry over into forked children,
+ * which have to check the file system themselves. */
+
+/* Starts the watcher, if it isn't running yet. Fails with
+ * CA_ERROR_NOTSUPPORTED if we weren't built with inotify support. */
+int ca_theme_watch_start(void);
+
+/* Returns FALSE if the watcher isn't running, in which case the
+ * caller has to check the file system itself. Doesn't take any
+ * locks. */
+ca_bool_t ca_theme_watch_get(unsigned *generation, time_t *last_change);
+
+#endif
@@ -0,0 +1,239 @@
+/***
+  This file is part of libcanberra.
+
+  Copyright 2008 Lennart Poettering
+
+  libcanberra is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 2.1 of the
+  License, or (at your option) any later version.
+
+  libcanberra is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with libcanberra. If not, see
+  <http://www.gnu.org/licenses/>.
+***/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "canberra.h"
+#include "malloc.h"
+#include "mutex.h"
+#include "thread-pool.h"
+
+struct job {
+    void *data;
+    struct job *next;
+};
+
+struct ca_thread_pool {
+    ca_thread_pool_func_t func;
+    void *userdata;
+
+    /* Posted once for every job pushed, and once for every idle
+     * worker that shall exit */
+    sem_t semaphore;
+    sem_t exit_semaphore;
+
+    /* Everything below protected by the mutex */
+    ca_mutex *mutex;
+    ca_bool_t shutdown;
+    ca_bool_t signal_exit;
+    unsigned n_workers;
+    unsigned n_idle;
+    unsigned n_idle_max;
+    struct job *queue_head, *queue_tail;
+};
+
+static void* worker_func(void *userdata) {
+    ca_thread_pool *t = userdata;
+    struct job *j;
+
+    pthread_detach(pthread_self());
+
+    ca_mutex_lock(t->mutex);
+
+    for (;;) {
+        ca_mutex_unlock(t->mutex);
+
+        while (sem_wait(&t->semaphore) < 0 && errno == EINTR)
+            ;
+
+        ca_mutex_lock(t->mutex);
+
+        /* Nothing queued? Then we have been asked to exit */
+        if (!(j = t->queue_head))
+            break;
+
+        if (!(t->queue_head = j->next))
+            t->queue_tail = NULL;
+
+        ca_mutex_unlock(t->mutex);
+
+        t->func(j->data, t->userdata);
+        ca_free(j);
+
+        ca_mutex_lock(t->mutex);
+
+        if (t->shutdown || t->n_idle >= t->n_idle_max)
+            break;
+
+        t->n_idle++;
+    }
+
+    ca_assert(t->n_workers > 0);
+    t->n_workers--;
+
+    if (t->signal_exit)
+        sem_post(&t->exit_semaphore);
+
+    ca_mutex_unlock(t->mutex);
+
+    return NULL;
+}
+
+int ca_thread_pool_new(ca_thread_pool **_t, unsigned n_idle_max, ca_thread_pool_func_t func, void *userdata) {
+    ca_thread_pool *t;
+
+    ca_return_val_if_fail(_t, CA_ERROR_INVALID);
+    ca_return_val_if_fail(func, CA_ERROR_INVALID);
+
+    if (!(t = ca_new0(ca_thread_pool, 1)))
+        return CA_ERROR_OOM;
+
+    t->func = func;
+    t->userdata = userdata;
+    t->n_idle_max = n_idle_max;
+
+    if (!(t->mutex = ca_mutex_new()))
+        goto fail;
+
+    if (sem_init(&t->semaphore, 0, 0) < 0)
+        goto fail;
+
+    if (sem_init(&t->exit_semaphore, 0, 0) < 0) {
+        sem_destroy(&t->semaphore);
+        goto fail;
+    }
+
+    *_t = t;
+
+    return CA_SUCCESS;
+
+fail:
+
+    if (t->mutex)
+        ca_mutex_free(t->mutex);
+
+    ca_free(t);
+
+    return CA_ERROR_OOM;
+}
+
+void ca_thread_pool_free(ca_thread_pool *t) {
+    unsigned i;
+
+    ca_assert(t);
+
+    ca_mutex_lock(t->mutex);
+
+    t->shutdown = TRUE;
+    t->signal_exit = TRUE;
+
+    /* Wake up the idle workers so that they notice */
+    for (i = 0; i < t->n_idle; i++)
+        sem_post(&t->semaphore);
+    t->n_idle = 0;
+
+    while (t->n_workers > 0) {
+        ca_mutex_unlock(t->mutex);
+        sem_wait(&t->exit_semaphore);
+        ca_mutex_lock(t->mutex);
+    }
+
+    ca_mutex_unlock(t->mutex);
+
+    ca_assert(!t->queue_head);
+
+    sem_destroy(&t->semaphore);
+    sem_destroy(&t->exit_semaphore);
+    ca_mutex_free(t->mutex);
+    ca_free(t);
+}
+
+int ca_thread_pool_push(ca_thread_pool *t, void *data) {
+    struct job *j;
+    pthread_t thread;
+    int ret;
+
+    ca_return_val_if_fail(t, CA_ERROR_INVALID);
+
+    if (!(j = ca_new(struct job, 1)))
+        return CA_ERROR_OOM;
+
+    j->data = data;
+    j->next = NULL;
+
+    ca_mutex_lock(t->mutex);
+
+    if (t->shutdown) {
+        ret = CA_ERROR_STATE;
+        goto fail;
+    }
+
+    /* Either hand this job to an idle worker or start a new one. We
+     * never let jobs wait for a busy worker, since that would delay
+     * overlapping event sounds. */
+    if (t->n_idle > 0)
+        t->n_idle--;
+    else {
+        if (pthread_create(&thread, NULL, worker_func, t) != 0) {
+            ret = CA_ERROR_OOM;
+            goto fail;
+        }
+
+        t->n_workers++;
+    }
+
+    if (t->queue_tail)
+        t->queue_tail->next = j;
+    else
+        t->queue_head = j;
+    t->queue_tail = j;
+
+    sem_post(&t->semaphore);
+
+    ca_mutex_unlock(t->mutex);
+
+    return CA_SUCCESS;
+
+fail:
+    ca_mutex_unlock(t->mutex);
+    ca_free(j);
+
+    return ret;
+}
+
+void ca_thread_pool_set_idle_max(ca_thread_pool *t, unsigned n_idle_max) {
+    ca_assert(t);
+
+    ca_mutex_lock(t->mutex);
+
+    t->n_idle_max = n_idle_max;
+
+    /* Let superfluous idle workers go */
+    for (; t->n_idle > t->n_idle_max; t->n_idle--)
+        sem_post(&t->semaphore);
+
+    ca_mutex_unlock(t->mutex);
+}
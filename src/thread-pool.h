@@ -0,0 +1,44 @@
+#ifndef foocanberrathreadpoolhfoo
+#define foocanberrathreadpoolhfoo
+
+/***
+  This file is part of libcanberra.
+
+  Copyright 2008 Lennart Poettering
+
+  libcanberra is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 2.1 of the
+  License, or (at your option) any later version.
+
+  libcanberra is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with libcanberra. If not, see
+  <http://www.gnu.org/licenses/>.
+***/
+
+/* A small pool of long-lived worker threads. Every job pushed is
+ * picked up right away: if no worker is idle a new one is
+ * spawned. Once a job is done its worker stays around waiting for
+ * the next one, as long as there are fewer than n_idle_max idle
+ * workers already. */
+
+typedef struct ca_thread_pool ca_thread_pool;
+
+typedef void (*ca_thread_pool_func_t)(void *job, void *userdata);
+
+int ca_thread_pool_new(ca_thread_pool **t, unsigned n_idle_max, ca_thread_pool_func_t func, void *userdata);
+
+/* Waits until all workers have exited. Jobs already pushed are still
+ * executed. */
+void ca_thread_pool_free(ca_thread_pool *t);
+
+int ca_thread_pool_push(ca_thread_pool *t, void *job);
+
+void ca_thread_pool_set_idle_max(ca_thread_pool *t, unsigned n_idle_max);
+
+#endif
@@ -0,0 +1,239 @@
+/***
+  This file is part of libcanberra.
+
+  Copyright 2008 Lennart Poettering
+
+  libcanberra is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 2.1 of the
+  License, or (at your option) any later version.
+
+  libcanberra is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with libcanberra. If not, see
+  <http://www.gnu.org/licenses/>.
+***/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include "canberra.h"
+#include "trace.h"
+#include "proplist.h"
+#include "macro.h"
+
+struct stage {
+    volatile uint64_t count;
+    volatile uint64_t total;
+    volatile uint64_t max;
+};
+
+static const char * const stage_names[_CA_TRACE_STAGE_MAX] = {
+    [CA_TRACE_LOOKUP] = "lookup",
+    [CA_TRACE_CACHE_HIT] = "cache-hit",
+    [CA_TRACE_CACHE_MISS] = "cache-miss",
+    [CA_TRACE_FILE_OPEN] = "file-open",
+    [CA_TRACE_DECODE] = "decode",
+    [CA_TRACE_DEVICE_OPEN] = "device-open",
+    [CA_TRACE_FIRST_WRITE] = "first-write",
+    [CA_TRACE_FINISH] = "finish"
+};
+
+/* We don't have atomic loads and stores, hence these are volatile
+ * and only modified with the GCC atomic builtins */
+static struct stage stages[_CA_TRACE_STAGE_MAX];
+static volatile uint64_t bytes_decoded = 0;
+static volatile unsigned streams = 0;
+static volatile unsigned streams_max = 0;
+static volatile uint64_t device_latency = 0;
+static volatile uint64_t device_latency_min = 0;
+static volatile uint64_t device_latency_max = 0;
+
+/* -1 if not checked yet. Checking twice is harmless, so no locking */
+static int logging = -1;
+
+static ca_bool_t log_enabled(void) {
+
+    if (logging < 0) {
+        const char *e;
+
+        logging = (e = getenv("CANBERRA_TRACE")) && *e;
+    }
+
+    return !!logging;
+}
+
+ca_usec_t ca_trace_now(void) {
+#ifdef HAVE_CLOCK_GETTIME
+    struct timespec ts;
+
+#ifdef CLOCK_MONOTONIC
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+        return (ca_usec_t) ts.tv_sec * 1000000ULL + (ca_usec_t) ts.tv_nsec / 1000ULL;
+#endif
+
+    if (clock_gettime(CLOCK_REALTIME, &ts) == 0)
+        return (ca_usec_t) ts.tv_sec * 1000000ULL + (ca_usec_t) ts.tv_nsec / 1000ULL;
+#endif
+
+    {
+        struct timeval tv;
+
+        ca_assert_se(gettimeofday(&tv, NULL) == 0);
+
+        return (ca_usec_t) tv.tv_sec * 1000000ULL + (ca_usec_t) tv.tv_usec;
+    }
+}
+
+static void update_max64(volatile uint64_t *m, uint64_t v) {
+    uint64_t old;
+
+    while ((old = *m) < v)
+        if (__sync_bool_compare_and_swap(m, old, v))
+            break;
+}
+
+void ca_trace_stage(ca_trace_stage_t stage, ca_usec_t start) {
+    ca_usec_t now, d;
+
+    ca_assert(stage < _CA_TRACE_STAGE_MAX);
+
+    now = ca_trace_now();
+    d = now > start ? now - start : 0;
+
+    __sync_add_and_fetch(&stages[stage].count, 1);
+    __sync_add_and_fetch(&stages[stage].total, d);
+    update_max64(&stages[stage].max, d);
+
+    if (log_enabled())
+        fprintf(stderr, "canberra-trace: %s %llu usec\n", stage_names[stage], (unsigned long long) d);
+}
+
+void ca_trace_bytes_decoded(size_t nbytes) {
+    __sync_add_and_fetch(&bytes_decoded, (uint64_t) nbytes);
+}
+
+static void update_min64(volatile uint64_t *m, uint64_t v) {
+    uint64_t old;
+
+    /* 0 means unset */
+    while ((old = *m) == 0 || old > v)
+        if (__sync_bool_compare_and_swap(m, old, v))
+            break;
+}
+
+void ca_trace_device_latency(ca_usec_t usec) {
+
+    /* There is no atomic store, hence the loop */
+    for (;;) {
+        uint64_t old = device_latency;
+
+        if (__sync_bool_compare_and_swap(&device_latency, old, usec))
+            break;
+    }
+
+    update_min64(&device_latency_min, usec);
+    update_max64(&device_latency_max, usec);
+
+    if (log_enabled())
+        fprintf(stderr, "canberra-trace: device-latency %llu usec\n", (unsigned long long) usec);
+}
+
+void ca_trace_stream_begin(void) {
+    unsigned n, old;
+
+    n = __sync_add_and_fetch(&streams, 1);
+
+    while ((old = streams_max) < n)
+        if (__sync_bool_compare_and_swap(&streams_max, old, n))
+            break;
+}
+
+void ca_trace_stream_end(void) {
+    ca_assert(streams > 0);
+
+    __sync_sub_and_fetch(&streams, 1);
+}
+
+int ca_trace_get_stats(ca_proplist **_p) {
+    ca_proplist *p;
+    unsigned i;
+    int ret;
+
+    ca_return_val_if_fail(_p, CA_ERROR_INVALID);
+
+    if ((ret = ca_proplist_create(&p)) < 0)
+        return ret;
+
+    __sync_synchronize();
+
+    if ((ret = ca_proplist_setf(p, "canberra.stats.bytes-decoded", "%llu", (unsigned long long) bytes_decoded)) < 0 ||
+        (ret = ca_proplist_setf(p, "canberra.stats.streams", "%u", streams)) < 0 ||
+        (ret = ca_proplist_setf(p, "canberra.stats.streams-max", "%u", streams_max)) < 0 ||
+        (ret = ca_proplist_setf(p, "canberra.stats.device-latency.usec", "%llu", (unsigned long long) device_latency)) < 0 ||
+        (ret = ca_proplist_setf(p, "canberra.stats.device-latency.usec-min", "%llu", (unsigned long long) device_latency_min)) < 0 ||
+        (ret = ca_proplist_setf(p, "canberra.stats.device-latency.usec-max", "%llu", (unsigned long long) device_latency_max)) < 0)
+        goto fail;
+
+    for (i = 0; i < _CA_TRACE_STAGE_MAX; i++) {
+        char k[64];
+
+        snprintf(k, sizeof(k), "canberra.stats.%s.count", stage_names[i]);
+        if ((ret = ca_proplist_setf(p, k, "%llu", (unsigned long long) stages[i].count)) < 0)
+            goto fail;
+
+        snprintf(k, sizeof(k), "canberra.stats.%s.usec", stage_names[i]);
+        if ((ret = ca_proplist_setf(p, k, "%llu", (unsigned long long) stages[i].total)) < 0)
+            goto fail;
+
+        snprintf(k, sizeof(k), "canberra.stats.%s.usec-max", stage_names[i]);
+        if ((ret = ca_proplist_setf(p, k, "%llu", (unsigned long long) stages[i].max)) < 0)
+            goto fail;
+    }
+
+    *_p = p;
+
+    return CA_SUCCESS;
+
+fail:
+    ca_proplist_destroy(p);
+
+    return ret;
+}
+
+#ifdef CA_GCC_DESTRUCTOR
+
+static void trace_summary(void) CA_GCC_DESTRUCTOR;
+
+static void trace_summary(void) {
+    unsigned i;
+
+    if (!log_enabled())
+        return;
+
+    for (i = 0; i < _CA_TRACE_STAGE_MAX; i++) {
+        if (stages[i].count <= 0)
+            continue;
+
+        fprintf(stderr, "canberra-trace: summary %s count=%llu avg=%llu usec max=%llu usec\n",
+                stage_names[i],
+                (unsigned long long) stages[i].count,
+                (unsigned long long) (stages[i].total / stages[i].count),
+                (unsigned long long) stages[i].max);
+    }
+
+    fprintf(stderr, "canberra-trace: summary bytes-decoded=%llu streams-max=%u\n",
+            (unsigned long long) bytes_decoded, streams_max);
+}
+
+#endif
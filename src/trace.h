@@ -0,0 +1,69 @@
+#ifndef foocanberratracehfoo
+#define foocanberratracehfoo
+
+/***
+  This file is part of libcanberra.
+
+  Copyright 2008 Lennart Poettering
+
+  libcanberra is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 2.1 of the
+  License, or (at your option) any later version.
+
+  libcanberra is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with libcanberra. If not, see
+  <http://www.gnu.org/licenses/>.
+***/
+
+#include <inttypes.h>
+
+#include "canberra.h"
+#include "macro.h"
+
+/* Instrumentation of the stages a sound event goes through on its
+ * way to the device. Every stage keeps a count, the total and the
+ * maximum time it took. The counters are always kept, since taking a
+ * timestamp is cheap. If $CANBERRA_TRACE is set, every stage is
+ * logged to stderr as well, together with a summary at exit. All of
+ * this is process wide, since the caches it measures are, too. */
+
+typedef uint64_t ca_usec_t;
+
+typedef enum ca_trace_stage {
+    CA_TRACE_LOOKUP,          /* Finding the sound in the theme, ca_lookup_sound_with_callback() */
+    CA_TRACE_CACHE_HIT,       /* The lookup cache knew the sound, ca_cache_lookup_sound() */
+    CA_TRACE_CACHE_MISS,      /* ... or it didn't */
+    CA_TRACE_FILE_OPEN,       /* Opening the sound file, ca_sound_file_open() */
+    CA_TRACE_DECODE,          /* Decoding a sound into the sample cache */
+    CA_TRACE_DEVICE_OPEN,     /* Opening the device or connecting the stream */
+    CA_TRACE_FIRST_WRITE,     /* From the driver getting the event to the first write */
+    CA_TRACE_FINISH,          /* From the driver getting the event to the finish callback */
+    _CA_TRACE_STAGE_MAX
+} ca_trace_stage_t;
+
+/* A monotonic timestamp */
+ca_usec_t ca_trace_now(void);
+
+/* Accounts the time since start to the stage */
+void ca_trace_stage(ca_trace_stage_t stage, ca_usec_t start);
+
+void ca_trace_bytes_decoded(size_t nbytes);
+
+/* Call this with the buffer latency a device was configured with */
+void ca_trace_device_latency(ca_usec_t usec);
+
+/* Call these when a driver starts and stops playing a stream */
+void ca_trace_stream_begin(void);
+void ca_trace_stream_end(void);
+
+/* Returns all counters as a newly allocated property list, see
+ * ca_context_get_stats() */
+int ca_trace_get_stats(ca_proplist **p);
+
+#endif
@@ -24,94 +24,474 @@
 #endif
 
 #include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
 
 #include "canberra.h"
 #include "common.h"
 #include "driver.h"
 #include "vizaudio.h"
 #include "proplist.h"
+#include "llist.h"
+#include "malloc.h"
+#include "mutex.h"
+#include "thread-pool.h"
+#include "trace.h"
+
+/* The VizAudio library renders its effects synchronously, hence we do
+ * that from our own render thread and tell the caller via the
+ * callback once an effect is done. Effects that queue up in the
+ * meantime are merged: a burst of events should not end up as a burst
+ * of flashes. */
+
+typedef enum effect_type {
+    EFFECT_NONE,
+    EFFECT_COLOR,
+    EFFECT_IMAGE,
+    EFFECT_TEXT,
+    _EFFECT_MAX
+} effect_type_t;
+
+/* Describes one of the effects CA_PROP_VISUAL_EFFECT can name */
+struct effect_info {
+    const char *name;
+    effect_type_t type;
+
+    /* The property the effect is rendered from, if any */
+    ca_prop_key_t argument;
+
+    /* Further properties the effect requires */
+    ca_prop_key_t required[2];
+};
+
+/* Sorted by name, for bsearch() */
+static const struct effect_info effects[] = {
+    { "COLOR_ALERT", EFFECT_COLOR, CA_PROP_KEY_COLOR, { CA_PROP_KEY_INVALID, CA_PROP_KEY_INVALID } },
+    { "FLYING_DESCRIPTION_TEXT_ALERT", EFFECT_TEXT, CA_PROP_KEY_EVENT_DESCRIPTION, { CA_PROP_KEY_INVALID, CA_PROP_KEY_INVALID } },
+    { "IMAGE_ALERT", EFFECT_IMAGE, CA_PROP_KEY_MEDIA_IMAGE_PATH, { CA_PROP_KEY_INVALID, CA_PROP_KEY_INVALID } },
+    /* TODO: Make sure song_popup() isn't causing GTK errors, until
+     * then this is only checked */
+    { "SONG_INFO_POPUP", EFFECT_NONE, CA_PROP_KEY_INVALID, { CA_PROP_KEY_MEDIA_TITLE, CA_PROP_KEY_MEDIA_ARTIST } }
+};
+
+/* Effects arriving within one display frame of each other are always
+ * merged, on top of the rate limit */
+#define FRAME_USEC 16667ULL
+
+/* No more than three flashes a second, following the usual guidelines
+ * for photosensitive users */
+#define VISUAL_RATE_DEFAULT 3U
+
+/* Texts of merged effects are shown together, up to this many */
+#define TEXTS_MAX 8U
+
+struct outstanding {
+    CA_LLIST_FIELDS(struct outstanding);
+    uint32_t id;
+    ca_finish_callback_t callback;
+    void *userdata;
+    effect_type_t type;
+    char *argument;
+};
+
+/* An effect resource that has been checked already, see
+ * driver_cache() */
+struct resource {
+    CA_LLIST_FIELDS(struct resource);
+    effect_type_t type;
+    char *argument;
+};
+
+/* Least recently used ones are dropped beyond that */
+#define RESOURCES_MAX 32U
+
+struct private {
+    ca_mutex *outstanding_mutex;
+    ca_thread_pool *pool;
+
+    /* Everything below protected by the outstanding_mutex too */
+
+    /* Queued effects, oldest first */
+    CA_LLIST_HEAD(struct outstanding, outstanding);
+    struct outstanding *outstanding_tail;
+
+    /* The effects currently being rendered, merged into one */
+    CA_LLIST_HEAD(struct outstanding, rendering);
+    ca_bool_t render_running;
+
+    /* Minimum time between two renderings, 0 for none */
+    ca_usec_t render_interval;
+    ca_usec_t last_render;
+
+    /* Most recently used first */
+    CA_LLIST_HEAD(struct resource, resources);
+    struct resource *resources_tail;
+    unsigned n_resources;
+};
+
+#define PRIVATE(c) ((struct private *) ((c)->private))
+
+static void outstanding_free(struct outstanding *out) {
+    ca_assert(out);
+
+    ca_free(out->argument);
+    ca_free(out);
+}
 
+static void outstanding_remove_unlocked(struct private *p, struct outstanding *out) {
 
-/* Plays a visual effect from the VizAudio library */
-int driver_play(ca_context *c, uint32_t id, ca_proplist *proplist, ca_finish_callback_t cb, void *userdata) {
-    ca_return_val_if_fail(c, CA_ERROR_INVALID);
-    ca_return_val_if_fail(proplist, CA_ERROR_INVALID);
-    ca_return_val_if_fail(!userdata || cb, CA_ERROR_INVALID);
+    if (p->outstanding_tail == out)
+        p->outstanding_tail = out->prev;
+
+    CA_LLIST_REMOVE(struct outstanding, p->outstanding, out);
+}
+
+/* Calls back and frees the effects that have been taken off the
+ * lists. Must be called without holding the outstanding_mutex, since
+ * the callbacks may call into us again. */
+static void outstanding_finish(ca_context *c, struct outstanding *done, int error) {
+    struct outstanding *out;
+
+    while ((out = done)) {
+        CA_LLIST_REMOVE(struct outstanding, done, out);
+
+        if (out->callback)
+            out->callback(c, out->id, error, out->userdata);
+
+        outstanding_free(out);
+    }
+}
+
+static void resource_free(struct resource *r) {
+    ca_assert(r);
+
+    ca_free(r->argument);
+    ca_free(r);
+}
+
+static void resource_remove_unlocked(struct private *p, struct resource *r) {
+
+    if (p->resources_tail == r)
+        p->resources_tail = r->prev;
+
+    CA_LLIST_REMOVE(struct resource, p->resources, r);
+    p->n_resources--;
+}
+
+static void resource_prepend_unlocked(struct private *p, struct resource *r) {
+
+    CA_LLIST_PREPEND(struct resource, p->resources, r);
+
+    if (!p->resources_tail)
+        p->resources_tail = r;
+
+    p->n_resources++;
+}
+
+/* Moves the resource to the front if it is found */
+static ca_bool_t resource_lookup_unlocked(struct private *p, effect_type_t type, const char *argument) {
+    struct resource *r;
+
+    for (r = p->resources; r; r = r->next)
+        if (r->type == type && ca_streq(r->argument, argument))
+            break;
+
+    if (!r)
+        return FALSE;
+
+    if (r != p->resources) {
+        resource_remove_unlocked(p, r);
+        resource_prepend_unlocked(p, r);
+    }
+
+    return TRUE;
+}
+
+static int resource_add_unlocked(struct private *p, effect_type_t type, const char *argument) {
+    struct resource *r;
+
+    if (resource_lookup_unlocked(p, type, argument))
+        return CA_SUCCESS;
+
+    if (!(r = ca_new0(struct resource, 1)))
+        return CA_ERROR_OOM;
+
+    if (!(r->argument = ca_strdup(argument))) {
+        ca_free(r);
+        return CA_ERROR_OOM;
+    }
+
+    r->type = type;
+
+    resource_prepend_unlocked(p, r);
+
+    if (p->n_resources > RESOURCES_MAX) {
+        struct resource *last = p->resources_tail;
+
+        resource_remove_unlocked(p, last);
+        resource_free(last);
+    }
+
+    return CA_SUCCESS;
+}
 
-	if(!isVAEnabled()){
-		 return CA_ERROR_DISABLED;
-	}
-	
-	char* effect;
-	// Get the visual effect
-    effect = (char*) ca_proplist_gets_unlocked(proplist, CA_PROP_VISUAL_EFFECT);
-    // Return if its not found
+static int effect_compare(const void *a, const void *b) {
+    return strcmp(a, ((const struct effect_info*) b)->name);
+}
+
+/* Figures out which effect the property list asks for and the single
+ * argument it takes, if any */
+static int get_effect(ca_proplist *proplist, effect_type_t *type, const char **argument) {
+    const char *effect;
+    const struct effect_info *e;
+    unsigned i;
+
+    *type = EFFECT_NONE;
+    *argument = NULL;
+
+    /* Get the visual effect, and return if it is not found */
+    effect = ca_proplist_gets_key_unlocked(proplist, CA_PROP_KEY_VISUAL_EFFECT);
     ca_return_val_if_fail(effect, CA_ERROR_INVALID);
 
-	if(!strcmp(effect, "SONG_INFO_POPUP")){
-		// Grab additional info and goto finish if any are found
-		char* artist;
-		char* title;
-
-		artist = (char*) ca_proplist_gets_unlocked(proplist, CA_PROP_MEDIA_ARTIST);
-		title = (char*) ca_proplist_gets_unlocked(proplist, CA_PROP_MEDIA_TITLE);
-    
-        ca_return_val_if_fail(title, CA_ERROR_INVALID);
-        ca_return_val_if_fail(artist, CA_ERROR_INVALID);
-
-		// TODO: Make sure this isn't causing GTK errors
-		//song_popup(artist, title);
-	}
-	else if (!strcmp(effect, "COLOR_ALERT")){
-        char* color;
-        color = (char*)ca_proplist_gets_unlocked(proplist, CA_PROP_COLOR);
-        
-        ca_return_val_if_fail(color, CA_ERROR_INVALID);
-        
-		flash_color(color);
-		return CA_SUCCESS;
-	}
-	else if (!strcmp(effect, "IMAGE_ALERT")){
-		char* filePath = (char*) ca_proplist_gets_unlocked(proplist, CA_PROP_MEDIA_IMAGE_PATH);
-		
-		// Determine if the file actually exists
-		FILE* file = fopen(filePath, "r");
-        ca_return_val_if_fail(file, CA_ERROR_NOTFOUND);
-
-		flash_image(filePath);
-
-        fclose(file);
-	}
-	else if(!strcmp(effect, "FLYING_DESCRIPTION_TEXT_ALERT")){
-		char* text = (char*) ca_proplist_gets_unlocked(proplist, CA_PROP_EVENT_DESCRIPTION);
-		
-		// Check for errors
-        ca_return_val_if_fail(text, CA_ERROR_INVALID);
-
-		flash_text(text);
-	}
-
-    
-    if (cb){
-        cb(c, id, CA_SUCCESS, userdata);
-	}
+    /* Effects we don't know are silently ignored */
+    if (!(e = bsearch(effect, effects, CA_ELEMENTSOF(effects), sizeof(effects[0]), effect_compare)))
+        return CA_SUCCESS;
+
+    for (i = 0; i < CA_ELEMENTSOF(e->required); i++)
+        if (e->required[i] != CA_PROP_KEY_INVALID)
+            ca_return_val_if_fail(ca_proplist_contains_key(proplist, e->required[i]), CA_ERROR_INVALID);
+
+    if (e->argument != CA_PROP_KEY_INVALID) {
+        *argument = ca_proplist_gets_key_unlocked(proplist, e->argument);
+        ca_return_val_if_fail(*argument, CA_ERROR_INVALID);
+    }
+
+    *type = e->type;
+
+    return CA_SUCCESS;
+}
+
+static unsigned get_visual_rate(ca_proplist *l) {
+    unsigned n;
+
+    if (ca_proplist_get_unsigned(l, CA_PROP_CANBERRA_VISUAL_RATE, &n) < 0)
+        return VISUAL_RATE_DEFAULT;
+
+    return n;
+}
+
+static ca_usec_t get_render_interval(ca_proplist *l) {
+    unsigned n;
 
+    if ((n = get_visual_rate(l)) <= 0)
+        return 0;
 
+    return 1000000ULL / n;
+}
+
+static int check_image(const char *path) {
+    FILE *file;
 
+    /* Determine if the file actually exists */
+    file = fopen(path, "r");
+    ca_return_val_if_fail(file, CA_ERROR_NOTFOUND);
+    fclose(file);
 
     return CA_SUCCESS;
 }
 
-/* These methods are not currently relelvant to VizAudio*/
+/* Renders all effects currently in p->rendering as one. Of colors and
+ * images only the latest is shown, texts are put together. */
+static void render_unlocked(struct private *p) {
+    struct outstanding *out, *latest[_EFFECT_MAX];
+    const char *texts[TEXTS_MAX];
+    unsigned n_texts = 0, i;
+    char *color = NULL, *image = NULL, *text = NULL;
+
+    memset(latest, 0, sizeof(latest));
+
+    for (out = p->rendering; out; out = out->next) {
+        latest[out->type] = out;
+
+        if (out->type == EFFECT_TEXT && n_texts < TEXTS_MAX)
+            texts[n_texts++] = out->argument;
+    }
+
+    /* The effects may be canceled while we render them, hence we need
+     * our own copies */
+    if (latest[EFFECT_COLOR])
+        color = ca_strdup(latest[EFFECT_COLOR]->argument);
+
+    if (latest[EFFECT_IMAGE])
+        image = ca_strdup(latest[EFFECT_IMAGE]->argument);
+
+    if (n_texts > 0) {
+        size_t l = 0;
+
+        for (i = 0; i < n_texts; i++)
+            l += strlen(texts[i]) + 1;
+
+        if ((text = ca_new(char, l))) {
+            char *e = text;
+
+            for (i = 0; i < n_texts; i++) {
+                size_t k = strlen(texts[i]);
+
+                if (i > 0)
+                    *(e++) = '\n';
+
+                memcpy(e, texts[i], k);
+                e += k;
+            }
+
+            *e = 0;
+        }
+    }
+
+    ca_mutex_unlock(p->outstanding_mutex);
+
+    if (color)
+        flash_color(color);
+
+    if (image)
+        flash_image(image);
+
+    if (text)
+        flash_text(text);
+
+    ca_free(color);
+    ca_free(image);
+    ca_free(text);
+
+    ca_mutex_lock(p->outstanding_mutex);
+}
+
+static void render_func(void *job, void *userdata) {
+    ca_context *c = userdata;
+    struct private *p;
+
+    p = PRIVATE(c);
+
+    ca_mutex_lock(p->outstanding_mutex);
+
+    for (;;) {
+        struct outstanding *done;
+        ca_usec_t now, next;
+
+        if (!p->outstanding) {
+            p->render_running = FALSE;
+            break;
+        }
+
+        /* Give the burst a frame to complete, and stay within the
+         * rate limit */
+        now = ca_trace_now();
+        next = now + FRAME_USEC;
+
+        if (p->last_render > 0 && p->last_render + p->render_interval > next)
+            next = p->last_render + p->render_interval;
+
+        ca_mutex_unlock(p->outstanding_mutex);
+        usleep((useconds_t) (next - now));
+        ca_mutex_lock(p->outstanding_mutex);
+
+        /* Everything queued by now is merged into one */
+        p->rendering = p->outstanding;
+        p->outstanding = p->outstanding_tail = NULL;
+
+        p->last_render = ca_trace_now();
+
+        render_unlocked(p);
+
+        /* Those that were canceled in the meantime have been taken
+         * off the list and called back already */
+        done = p->rendering;
+        p->rendering = NULL;
+
+        ca_mutex_unlock(p->outstanding_mutex);
+        outstanding_finish(c, done, CA_SUCCESS);
+        ca_mutex_lock(p->outstanding_mutex);
+    }
+
+    ca_mutex_unlock(p->outstanding_mutex);
+}
+
 int driver_open(ca_context *c) {
+    struct private *p;
+    int ret;
+
     ca_return_val_if_fail(c, CA_ERROR_INVALID);
     ca_return_val_if_fail(!c->driver || ca_streq(c->driver, "vizaudio"), CA_ERROR_NODRIVER);
+    ca_return_val_if_fail(!PRIVATE(c), CA_ERROR_STATE);
+
+    if (!(c->private = p = ca_new0(struct private, 1)))
+        return CA_ERROR_OOM;
+
+    if (!(p->outstanding_mutex = ca_mutex_new())) {
+        driver_destroy(c);
+        return CA_ERROR_OOM;
+    }
+
+    p->render_interval = get_render_interval(c->props);
+
+    /* A single render thread that is kept around while idle */
+    if ((ret = ca_thread_pool_new(&p->pool, 1, render_func, c)) < 0) {
+        driver_destroy(c);
+        return ret;
+    }
 
     return CA_SUCCESS;
 }
 
 int driver_destroy(ca_context *c) {
+    struct private *p;
+
     ca_return_val_if_fail(c, CA_ERROR_INVALID);
+    ca_return_val_if_fail(c->private, CA_ERROR_STATE);
+
+    p = PRIVATE(c);
+
+    if (p->outstanding_mutex) {
+        struct outstanding *out, *done = NULL;
+        struct resource *r;
+
+        ca_mutex_lock(p->outstanding_mutex);
+
+        while ((r = p->resources)) {
+            resource_remove_unlocked(p, r);
+            resource_free(r);
+        }
+
+        /* Whatever hasn't been rendered yet never will be */
+        while ((out = p->outstanding)) {
+            outstanding_remove_unlocked(p, out);
+            CA_LLIST_PREPEND(struct outstanding, done, out);
+        }
+
+        /* We cannot interrupt the library, but we don't need to wait
+         * for the callback of the effect that is currently shown. The
+         * renderer works on its own copies, so we can take them. */
+        while ((out = p->rendering)) {
+            CA_LLIST_REMOVE(struct outstanding, p->rendering, out);
+            CA_LLIST_PREPEND(struct outstanding, done, out);
+        }
+
+        ca_mutex_unlock(p->outstanding_mutex);
+
+        outstanding_finish(c, done, CA_ERROR_DESTROYED);
+    }
+
+    /* Waits for the render thread to finish */
+    if (p->pool)
+        ca_thread_pool_free(p->pool);
+
+    if (p->outstanding_mutex)
+        ca_mutex_free(p->outstanding_mutex);
+
+    ca_free(p);
+
+    c->private = NULL;
 
     return CA_SUCCESS;
 }
@@ -123,22 +503,179 @@ int driver_change_device(ca_context *c, const char *device) {
 }
 
 int driver_change_props(ca_context *c, ca_proplist *changed, ca_proplist *merged) {
+    struct private *p;
+
     ca_return_val_if_fail(c, CA_ERROR_INVALID);
     ca_return_val_if_fail(changed, CA_ERROR_INVALID);
     ca_return_val_if_fail(merged, CA_ERROR_INVALID);
+    ca_return_val_if_fail(c->private, CA_ERROR_STATE);
+
+    p = PRIVATE(c);
+
+    if (ca_proplist_contains_key(changed, CA_PROP_KEY_CANBERRA_VISUAL_RATE)) {
+        ca_mutex_lock(p->outstanding_mutex);
+        p->render_interval = get_render_interval(merged);
+        ca_mutex_unlock(p->outstanding_mutex);
+    }
+
+    return CA_SUCCESS;
+}
+
+/* Plays a visual effect from the VizAudio library */
+int driver_play(ca_context *c, uint32_t id, ca_proplist *proplist, ca_proplist *cp, ca_finish_callback_t cb, void *userdata) {
+    struct private *p;
+    struct outstanding *out;
+    effect_type_t type;
+    const char *argument;
+    int ret;
+
+    ca_return_val_if_fail(c, CA_ERROR_INVALID);
+    ca_return_val_if_fail(proplist, CA_ERROR_INVALID);
+    ca_return_val_if_fail(cp, CA_ERROR_INVALID);
+    ca_return_val_if_fail(!userdata || cb, CA_ERROR_INVALID);
+    ca_return_val_if_fail(c->private, CA_ERROR_STATE);
+
+    p = PRIVATE(c);
+
+    if (!isVAEnabled())
+        return CA_ERROR_DISABLED;
+
+    /* Everything the effect needs is checked here, so that errors
+     * are still reported synchronously */
+    if ((ret = get_effect(proplist, &type, &argument)) < 0)
+        return ret;
+
+    /* Images that have been cached don't need to be looked at again */
+    if (type == EFFECT_IMAGE) {
+        ca_bool_t cached;
+
+        ca_mutex_lock(p->outstanding_mutex);
+        cached = resource_lookup_unlocked(p, type, argument);
+        ca_mutex_unlock(p->outstanding_mutex);
+
+        if (!cached && (ret = check_image(argument)) < 0)
+            return ret;
+    }
+
+    /* Nothing to render */
+    if (type == EFFECT_NONE) {
+        if (cb)
+            cb(c, id, CA_SUCCESS, userdata);
+
+        return CA_SUCCESS;
+    }
+
+    if (!(out = ca_new0(struct outstanding, 1)))
+        return CA_ERROR_OOM;
+
+    if (!(out->argument = ca_strdup(argument))) {
+        ca_free(out);
+        return CA_ERROR_OOM;
+    }
+
+    out->id = id;
+    out->callback = cb;
+    out->userdata = userdata;
+    out->type = type;
+
+    ca_mutex_lock(p->outstanding_mutex);
+
+    /* The render thread picks up everything queued while it keeps
+     * running, so it is only started if it isn't running yet */
+    if (!p->render_running) {
+
+        if ((ret = ca_thread_pool_push(p->pool, p)) < 0) {
+            ca_mutex_unlock(p->outstanding_mutex);
+            outstanding_free(out);
+            return ret;
+        }
+
+        p->render_running = TRUE;
+    }
+
+    CA_LLIST_INSERT_AFTER(struct outstanding, p->outstanding, p->outstanding_tail, out);
+    p->outstanding_tail = out;
+
+    ca_mutex_unlock(p->outstanding_mutex);
 
     return CA_SUCCESS;
 }
 
 int driver_cancel(ca_context *c, uint32_t id) {
+    struct private *p;
+    struct outstanding *out, *n, *done = NULL;
+
     ca_return_val_if_fail(c, CA_ERROR_INVALID);
+    ca_return_val_if_fail(c->private, CA_ERROR_STATE);
+
+    p = PRIVATE(c);
+
+    ca_mutex_lock(p->outstanding_mutex);
+
+    for (out = p->outstanding; out; out = n) {
+        n = out->next;
+
+        if (out->id != id)
+            continue;
+
+        outstanding_remove_unlocked(p, out);
+        CA_LLIST_PREPEND(struct outstanding, done, out);
+    }
+
+    /* The library doesn't allow us to take an effect off the screen
+     * once it is shown, but the caller doesn't need to wait for it */
+    for (out = p->rendering; out; out = n) {
+        n = out->next;
+
+        if (out->id != id)
+            continue;
+
+        CA_LLIST_REMOVE(struct outstanding, p->rendering, out);
+        CA_LLIST_PREPEND(struct outstanding, done, out);
+    }
+
+    ca_mutex_unlock(p->outstanding_mutex);
+
+    outstanding_finish(c, done, CA_ERROR_CANCELED);
 
     return CA_SUCCESS;
 }
 
+/* Remembers images, so that playing them later on doesn't involve
+ * checking them again. Colors are handed to the library as they are,
+ * there is nothing to check or keep for them. */
 int driver_cache(ca_context *c, ca_proplist *proplist) {
+    struct private *p;
+    effect_type_t type;
+    const char *argument;
+    int ret;
+
     ca_return_val_if_fail(c, CA_ERROR_INVALID);
     ca_return_val_if_fail(proplist, CA_ERROR_INVALID);
+    ca_return_val_if_fail(c->private, CA_ERROR_STATE);
+
+    p = PRIVATE(c);
+
+    if ((ret = get_effect(proplist, &type, &argument)) < 0)
+        return ret;
+
+    if (type != EFFECT_IMAGE)
+        return CA_ERROR_NOTSUPPORTED;
+
+    if ((ret = check_image(argument)) < 0)
+        return ret;
+
+    ca_mutex_lock(p->outstanding_mutex);
+    ret = resource_add_unlocked(p, type, argument);
+    ca_mutex_unlock(p->outstanding_mutex);
+
+    return ret;
+}
+
+int driver_cache_many(ca_context *c, ca_proplist **proplists, unsigned n, int *results) {
+    ca_return_val_if_fail(c, CA_ERROR_INVALID);
+    ca_return_val_if_fail(proplists || n <= 0, CA_ERROR_INVALID);
+    ca_return_val_if_fail(results || n <= 0, CA_ERROR_INVALID);
 
-    return CA_ERROR_NOTSUPPORTED;
+    return ca_cache_many_sequentially(c, proplists, n, results, driver_cache);
 }